@@ -7,6 +7,10 @@
 
 /*
     Intel 8253/8254 Programmable Interval Timer (PIT) driver
+
+    Channel 0 is run in one-shot mode (interrupt on terminal count) and programmed by the timer
+    system to fire at the next timed event. The time since boot is kept by accumulating the ticks
+    of each one-shot, reading the progress of the current one through the read-back command.
 */
 #include <arch/i686/io.h>
 #include <arch/interrupts.h>
@@ -15,9 +19,6 @@
 #include <stdint.h>
 #include <utils.h>
 
-/* Macro for rounded integer division */
-#define ROUND_IDIV(a, b) (((a) + ((b) / 2)) / (b))
-
 /*
     IO-ports
 */
@@ -26,53 +27,101 @@
 #define CHANNEL_2    0x42
 #define CMD_REGISTER 0x43
 
-#define SELECT_CHANNEL_0  0x00
-#define MODE_SQUARED_WAVE 0x06
-#define HI_LO_ACCESS_MODE 0x30
+#define SELECT_CHANNEL_0    0x00
+#define MODE_TERMINAL_COUNT 0x00
+#define HI_LO_ACCESS_MODE   0x30
+
+/* Read-back command latching both the count and status of channel 0 */
+#define READ_BACK_CHANNEL_0 0xC2
+
+#define STATUS_OUT        0x80  // Output pin state, goes high when the one-shot reaches 0
+#define STATUS_NULL_COUNT 0x40  // The new count has not yet been loaded into the counter
 
 #define BASE_FREQUENCY 1193182  // Is technically 1193182.66.666....., or (3579545 / 3)
 
-#define DEFAULT_FREQUENCY 1000  // 1 kHz, i.e. 1 ms period
-#define MAX_FREQUENCY     (BASE_FREQUENCY)
-#define MIN_FREQUENCY     ((BASE_FREQUENCY / 0x10000) + 1)
+/* The 16-bit counter gives a maximum one-shot of 0x10000 ticks, about 55 ms */
+#define MAX_TICKS 0x10000u
+
+/* Shortest one-shot, prevents an interrupt storm when events are due right away */
+#define MIN_TICKS 12u  // ~10 us
 
-static uint32_t pit_frequency;
-static uint32_t period_ms;
+static uint64_t elapsed_ticks    = 0;  // Ticks of all one-shots before the current one
+static uint32_t programmed_ticks = 0;  // Length of the current one-shot
+static uint64_t last_read_ns     = 0;  // Keeps the clock monotonic across re-programming
 
-bool pit_set_frequency(uint32_t freq)
+static uint64_t ticks_to_ns(uint64_t ticks)
 {
-    uint32_t reload_value;
+    // Split in seconds and fraction, preventing overflow of the multiplication
+    return (ticks / BASE_FREQUENCY) * 1000000000ull +
+           (ticks % BASE_FREQUENCY) * 1000000000ull / BASE_FREQUENCY;
+}
 
-    // bound check
-    if (freq > MAX_FREQUENCY || freq < MIN_FREQUENCY) {
-        return false;  // failed to set freq
-    }
+/* Ticks since the current one-shot was programmed, must be called with interrupts disabled */
+static uint32_t read_progress()
+{
+    uint8_t  status;
+    uint32_t count;
 
-    pit_frequency = freq;
-    period_ms     = (1000 / freq);
-    reload_value  = ROUND_IDIV(BASE_FREQUENCY, freq);
+    outb(CMD_REGISTER, READ_BACK_CHANNEL_0);
+    status = inb(CHANNEL_0);
+    count  = inb(CHANNEL_0);
+    count |= (uint32_t)inb(CHANNEL_0) << 8;
 
-    // Handle special case, 0x10000 == 0 since PIT only can receive 16 bytes
-    if (reload_value == 0x10000) {
-        reload_value = 0x00;
+    if (status & STATUS_NULL_COUNT) {
+        return 0;
     }
 
-    outb(CHANNEL_0, reload_value & 0xff);
-    outb(CHANNEL_0, (reload_value >> 8) & 0xff);
+    // Past the terminal count, the counter keeps counting down from 0xffff
+    if (status & STATUS_OUT) {
+        return programmed_ticks + ((0x10000 - count) & 0xffff);
+    }
 
-    return true;  // success
+    // A count of 0 represents 0x10000 before the terminal count is reached
+    return count == 0 ? 0 : programmed_ticks - count;
 }
 
-void pit_set_default_frequency()
+static uint64_t pit_read_ns()
 {
-    bool success = pit_set_frequency(DEFAULT_FREQUENCY);
-    kassert(success);
+    uint64_t ns;
+    uint32_t flags = get_register_and_disable_interrupts();
+
+    ns           = MAX(ticks_to_ns(elapsed_ticks + read_progress()), last_read_ns);
+    last_read_ns = ns;
+
+    restore_interrupt_register(flags);
+    return ns;
 }
 
+static void pit_set_next_event(uint64_t delta_ns)
+{
+    uint32_t ticks;
+    uint32_t flags = get_register_and_disable_interrupts();
+
+    ticks = (uint32_t)(MIN(delta_ns, SECONDS_TO_NS(1)) * BASE_FREQUENCY / 1000000000ull);
+    ticks = MAX(MIN(ticks, MAX_TICKS), MIN_TICKS);
+
+    // Account for the current one-shot before replacing it
+    elapsed_ticks += read_progress();
+    programmed_ticks = ticks;
+
+    // A reload value of 0 gives 0x10000 ticks
+    outb(CMD_REGISTER, SELECT_CHANNEL_0 | HI_LO_ACCESS_MODE | MODE_TERMINAL_COUNT);
+    outb(CHANNEL_0, ticks & 0xff);
+    outb(CHANNEL_0, (ticks >> 8) & 0xff);
+
+    restore_interrupt_register(flags);
+}
+
+static struct clock_event_device pit_clock_event = {
+    .name           = "pit",
+    .max_delta_ns   = (uint64_t)MAX_TICKS * 1000000000ull / BASE_FREQUENCY,
+    .read_ns        = pit_read_ns,
+    .set_next_event = pit_set_next_event,
+};
+
 void pit_init()
 {
-    outb(CMD_REGISTER, SELECT_CHANNEL_0 | HI_LO_ACCESS_MODE | MODE_SQUARED_WAVE);
-    pit_set_default_frequency();
+    timer_register_clock_event_device(&pit_clock_event);
 }
 
 void pit_interrupt_handler(struct interrupt_stack_state *state, uint32_t interrupt_number)
@@ -80,5 +129,5 @@ void pit_interrupt_handler(struct interrupt_stack_state *state, uint32_t interru
     (void)state;
     (void)interrupt_number;
 
-    timer_report_clock_pulse(period_ms * 1000000);
+    timer_report_clock_event();
 }
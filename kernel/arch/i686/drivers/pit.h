@@ -13,8 +13,6 @@
 
 #define PIT_INTERRUPT_NUM 0  // relative to pic
 
-bool pit_set_frequency(uint32_t freq);
-void pit_set_default_frequency();
 void pit_init();
 void pit_interrupt_handler();
 
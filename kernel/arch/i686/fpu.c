@@ -0,0 +1,213 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#include <arch/fpu.h>
+#include <stdint.h>
+#include <utils.h>
+
+/* CPUID.1 feature bits */
+#define CPUID_EDX_FPU   (1 << 0)
+#define CPUID_EDX_FXSR  (1 << 24)
+#define CPUID_EDX_SSE   (1 << 25)
+#define CPUID_ECX_XSAVE (1 << 26)
+
+/* CPUID.(0xd,1) feature bits */
+#define CPUID_XSAVEOPT (1 << 0)
+
+#define CR0_MP (1 << 1)  // Monitor co-processor, makes wait/fwait honour TS
+#define CR0_EM (1 << 2)  // Emulation, fpu instructions raise #UD
+#define CR0_TS (1 << 3)  // Task switched, fpu instructions raise #NM
+#define CR0_NE (1 << 5)  // Native fpu error reporting
+
+#define CR4_OSFXSR     (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+#define CR4_OSXSAVE    (1 << 18)
+
+/* XCR0 state components, only the ones the kernel knows how to enable */
+#define XCR0_X87 (1 << 0)
+#define XCR0_SSE (1 << 1)
+#define XCR0_AVX (1 << 2)
+
+/* MXCSR with all SIMD exceptions masked */
+#define MXCSR_DEFAULT 0x1f80
+
+#define FNSAVE_STATE_SIZE 108
+#define FXSAVE_STATE_SIZE 512
+
+typedef enum {
+    FPU_SAVE_FNSAVE,
+    FPU_SAVE_FXSAVE,
+    FPU_SAVE_XSAVE,
+    FPU_SAVE_XSAVEOPT,
+} fpu_save_t;
+
+static const char *const save_method_names[] = {
+    [FPU_SAVE_FNSAVE]   = "fnsave",
+    [FPU_SAVE_FXSAVE]   = "fxsave",
+    [FPU_SAVE_XSAVE]    = "xsave",
+    [FPU_SAVE_XSAVEOPT] = "xsaveopt",
+};
+
+static fpu_save_t save_method;
+static bool       has_sse;
+
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx,
+                  uint32_t *edx)
+{
+    asm volatile("cpuid"
+                 : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                 : "a"(leaf), "c"(subleaf));
+}
+
+static uint32_t read_cr0()
+{
+    uint32_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+static void write_cr0(uint32_t cr0)
+{
+    asm volatile("mov %0, %%cr0" ::"r"(cr0));
+}
+
+static uint32_t read_cr4()
+{
+    uint32_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static void write_cr4(uint32_t cr4)
+{
+    asm volatile("mov %0, %%cr4" ::"r"(cr4));
+}
+
+static void xsetbv(uint32_t xcr, uint64_t value)
+{
+    asm volatile("xsetbv" ::"c"(xcr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+/* Detects and enables the fpu of the executing cpu, returns the size of its saved state in bytes or
+ * 0 if there's no usable fpu */
+size_t arch_fpu_init()
+{
+    uint32_t eax, ebx, ecx, edx;
+    size_t   size;
+
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (!(edx & CPUID_EDX_FPU)) {
+        return 0;
+    }
+
+    write_cr0((read_cr0() & ~(uint32_t)(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE);
+
+    save_method = FPU_SAVE_FNSAVE;
+    size        = FNSAVE_STATE_SIZE;
+    has_sse     = (edx & CPUID_EDX_FXSR) && (edx & CPUID_EDX_SSE);
+
+    if (edx & CPUID_EDX_FXSR) {
+        write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+        save_method = FPU_SAVE_FXSAVE;
+        size        = FXSAVE_STATE_SIZE;
+    }
+
+    if (ecx & CPUID_ECX_XSAVE) {
+        uint32_t supported;
+
+        cpuid(0xd, 0, &supported, &ebx, &ecx, &edx);
+        write_cr4(read_cr4() | CR4_OSXSAVE);
+        xsetbv(0, supported & (XCR0_X87 | XCR0_SSE | XCR0_AVX));
+
+        // The size reported depends on the components just enabled
+        cpuid(0xd, 0, &eax, &ebx, &ecx, &edx);
+        size = ebx;
+
+        cpuid(0xd, 1, &eax, &ebx, &ecx, &edx);
+        save_method = (eax & CPUID_XSAVEOPT) ? FPU_SAVE_XSAVEOPT : FPU_SAVE_XSAVE;
+    }
+
+    arch_fpu_reset();
+    return size;
+}
+
+/* True if saving the state is cheap enough to be done eagerly on every context switch */
+bool arch_fpu_eager_save()
+{
+    // Only saves the components modified since they were last restored
+    return save_method == FPU_SAVE_XSAVEOPT;
+}
+
+/* Name of the instruction set used to save and restore the state, for kinfo */
+const char *arch_fpu_save_method()
+{
+    return save_method_names[save_method];
+}
+
+/* Saves the fpu registers to state, which must be aligned by ARCH_FPU_STATE_ALIGN */
+void arch_fpu_save(void *state)
+{
+    switch (save_method) {
+        case FPU_SAVE_XSAVEOPT:
+            asm volatile("xsaveopt (%0)" ::"r"(state), "a"(-1), "d"(-1) : "memory");
+            break;
+
+        case FPU_SAVE_XSAVE:
+            asm volatile("xsave (%0)" ::"r"(state), "a"(-1), "d"(-1) : "memory");
+            break;
+
+        case FPU_SAVE_FXSAVE:
+            asm volatile("fxsave (%0)" ::"r"(state) : "memory");
+            break;
+
+        case FPU_SAVE_FNSAVE:
+            // Re-initialises the fpu as a side effect, which is fine since the state is saved
+            asm volatile("fnsave (%0)" ::"r"(state) : "memory");
+            break;
+    }
+}
+
+/* Loads the fpu registers from a state saved by arch_fpu_save() */
+void arch_fpu_restore(const void *state)
+{
+    switch (save_method) {
+        case FPU_SAVE_XSAVEOPT:
+        case FPU_SAVE_XSAVE:
+            asm volatile("xrstor (%0)" ::"r"(state), "a"(-1), "d"(-1) : "memory");
+            break;
+
+        case FPU_SAVE_FXSAVE:
+            asm volatile("fxrstor (%0)" ::"r"(state) : "memory");
+            break;
+
+        case FPU_SAVE_FNSAVE:
+            asm volatile("frstor (%0)" ::"r"(state) : "memory");
+            break;
+    }
+}
+
+/* Puts the fpu registers in their initial state */
+void arch_fpu_reset()
+{
+    uint32_t mxcsr = MXCSR_DEFAULT;
+
+    asm volatile("fninit");
+    if (has_sse) {
+        asm volatile("ldmxcsr %0" ::"m"(mxcsr));
+    }
+}
+
+/* Makes the next use of the fpu trap into fpu_trap() */
+void arch_fpu_trap_enable()
+{
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+/* Allows the fpu to be used without trapping */
+void arch_fpu_trap_disable()
+{
+    asm volatile("clts");
+}
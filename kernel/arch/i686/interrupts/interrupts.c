@@ -4,9 +4,13 @@
 
    Copyright (C) 2024 Isak Evaldsson
 */
+#include <arch/fpu.h>
 #include <arch/interrupts.h>
+#include <arch/percpu.h>
 #include <atomics.h>
 #include <stdint.h>
+#include <tasks/fpu.h>
+#include <tasks/latency_tracer.h>
 #include <tasks/scheduler.h>
 #include <uapi/errno.h>
 #include <utils.h>
@@ -91,6 +95,7 @@ void interrupt_handler_44();
 void interrupt_handler_45();
 void interrupt_handler_46();
 void interrupt_handler_47();
+void interrupt_handler_251();
 void interrupt_handler_252();
 void interrupt_handler_253();
 void interrupt_handler_254();
@@ -124,6 +129,10 @@ void exception_handler(struct interrupt_stack_state *state, uint32_t interrupt_n
             kpanic("Debug exception at %x with dr6=%x\n", state->eip, dr6 & 0xffff);
             break;
 
+        case ARCH_FPU_TRAP_VECTOR:
+            fpu_trap();
+            break;
+
         case 14:
             kpanic("Page fault at (0x%x) when accessing address 0x%x error code %x\n", state->eip,
                    get_cr2(), state->error_code);
@@ -135,6 +144,17 @@ void exception_handler(struct interrupt_stack_state *state, uint32_t interrupt_n
     }
 }
 
+/*
+    Nothing to do here, the task raising the interrupt has already marked itself for rescheduling,
+    the switch itself is done by scheduler_end_of_interrupt() on the way out of the interrupt.
+*/
+static void reschedule_interrupt_handler(struct interrupt_stack_state *state,
+                                         uint32_t                      interrupt_number)
+{
+    (void)state;
+    (void)interrupt_number;
+}
+
 int verify_valid_interrupt(unsigned int index)
 {
     interrupt_descriptor_t *entry = idt + index;
@@ -198,6 +218,7 @@ void init_interrupts()
     set_interrupt_descriptor(45, (uint32_t)interrupt_handler_45);
     set_interrupt_descriptor(46, (uint32_t)interrupt_handler_46);
     set_interrupt_descriptor(47, (uint32_t)interrupt_handler_47);
+    set_interrupt_descriptor(ARCH_RESCHEDULE_INTERRUPT, (uint32_t)interrupt_handler_251);
 
     // For testing purposes
     set_interrupt_descriptor(252, (uint32_t)interrupt_handler_252);
@@ -216,7 +237,9 @@ void init_interrupts()
     pic_remap(PIC1_START_INTERRUPT, PIC2_START_INTERRUPT);
 
     ps2_init();
-    ret = pic_register_interrupt(PS2_KEYBOARD_INTERRUPT, ps2_top_irq, ps2_bottom_irq);
+    // The keyboard bottom half registers devices and may be slow, keep it off the interrupt path
+    ret = pic_register_threaded_interrupt(PS2_KEYBOARD_INTERRUPT, ps2_top_irq, ps2_bottom_irq,
+                                          INTERRUPT_THREAD_PRIORITY);
     if (ret < 0) {
         kpanic("x86: Failed to register ps2 controller, error: %i", ret);
     }
@@ -228,6 +251,11 @@ void init_interrupts()
         kpanic("x86: Failed to register pit, error: %i", ret);
     }
 
+    ret = register_interrupt_handler(ARCH_RESCHEDULE_INTERRUPT, reschedule_interrupt_handler, NULL);
+    if (ret < 0) {
+        kpanic("x86: Failed to register reschedule interrupt, error: %i", ret);
+    }
+
     // Register exception handlers
     for (size_t i = 0; i < N_EXCEPTIONS; i++) {
         ret = register_interrupt_handler(i, exception_handler, NULL);
@@ -245,9 +273,23 @@ void wait_for_interrupt()
     asm volatile("hlt");
 }
 
+void enable_interrupts_and_wait()
+{
+    // sti only takes effect after the following instruction, so no irq can fire before the hlt
+    trace_irqs_on(TRACE_CALLER());
+    mem_barrier_full();
+    asm volatile("sti; hlt");
+}
+
+void raise_reschedule_interrupt()
+{
+    asm volatile("int %0" ::"i"(ARCH_RESCHEDULE_INTERRUPT) : "memory");
+}
+
 void enable_interrupts()
 {
     // Stop the compiler from possible re-ordering the call to sti
+    trace_irqs_on(TRACE_CALLER());
     mem_barrier_full();
     asm volatile("sti");
 }
@@ -257,19 +299,22 @@ void disable_interrupts()
     // Stop the compiler from possible re-ordering the call to cli
     mem_barrier_full();
     asm volatile("cli");
+    trace_irqs_off(TRACE_CALLER());
 }
 
-/* To catch errors with nested enabled/disable calls */
-static unsigned int irq_disable_counter;
+/* To catch errors with nested enabled/disable calls, only touched with interrupts disabled */
+static DEFINE_PER_CPU(unsigned int, irq_disable_counter);
 
 uint32_t get_register_and_disable_interrupts()
 {
     unsigned int flags, prev;
 
     mem_barrier_full();
-    prev = irq_disable_counter++;
-    kassert(prev < irq_disable_counter);  // Too many nested calls
     asm volatile("pushfl; cli; popl %0" : "=r"(flags)::"memory");
+    prev = this_cpu_read(irq_disable_counter);
+    this_cpu_inc(irq_disable_counter);
+    kassert(prev < this_cpu_read(irq_disable_counter));  // Too many nested calls
+    trace_irqs_off(TRACE_CALLER());
     return flags;
 }
 
@@ -277,8 +322,12 @@ void restore_interrupt_register(uint32_t flags)
 {
     unsigned int prev;
 
-    prev = irq_disable_counter--;
-    kassert(prev > irq_disable_counter);  // Bug on more calls to restore than disable
+    prev = this_cpu_read(irq_disable_counter);
+    this_cpu_dec(irq_disable_counter);
+    kassert(prev > this_cpu_read(irq_disable_counter));  // More restores than disables
+    if (flags & (1 << 9)) {
+        trace_irqs_on(TRACE_CALLER());
+    }
     mem_barrier_full();
     asm("pushl %0; popfl" ::"r"(flags) : "memory", "cc");
 }
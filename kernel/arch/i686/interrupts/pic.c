@@ -125,12 +125,8 @@ static void pic_top_half_isr(struct interrupt_stack_state *state, uint32_t inter
     pic_acknowledge(irq);
 }
 
-/*
-    Register interrupts for the pic irq number, wraps the regular interrupt registration api with
-    some additional logic to make sure that the PIC is correctly configured
-*/
-int pic_register_interrupt(uint32_t irq_num, top_half_handler_t top_half,
-                           bottom_half_handler_t bottom_half)
+/* Routes the top half through the generic pic top half isr and unmasks the irq */
+static int pic_setup_irq(uint32_t irq_num, top_half_handler_t top_half)
 {
     if (irq_num > N_PIC_INTERRUPTS) {
         return -EINVAL;
@@ -144,7 +140,34 @@ int pic_register_interrupt(uint32_t irq_num, top_half_handler_t top_half,
     // indirect call through the generic pic top half isr
     handlers[irq_num] = top_half;
     pic_irq_enable(irq_num);
+    return 0;
+}
+
+/*
+    Register interrupts for the pic irq number, wraps the regular interrupt registration api with
+    some additional logic to make sure that the PIC is correctly configured
+*/
+int pic_register_interrupt(uint32_t irq_num, top_half_handler_t top_half,
+                           bottom_half_handler_t bottom_half)
+{
+    int ret = pic_setup_irq(irq_num, top_half);
+    if (ret < 0) {
+        return ret;
+    }
 
     return register_interrupt_handler(PIC1_START_INTERRUPT + irq_num, pic_top_half_isr,
                                       bottom_half);
 }
+
+/* Like pic_register_interrupt(), but runs the bottom half in a thread with the supplied priority */
+int pic_register_threaded_interrupt(uint32_t irq_num, top_half_handler_t top_half,
+                                    bottom_half_handler_t thread_fn, unsigned int priority)
+{
+    int ret = pic_setup_irq(irq_num, top_half);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return register_threaded_interrupt_handler(PIC1_START_INTERRUPT + irq_num, pic_top_half_isr,
+                                               thread_fn, priority);
+}
@@ -78,4 +78,8 @@ uint16_t pic_get_isr();
 int pic_register_interrupt(uint32_t irq_num, top_half_handler_t top_half,
                            bottom_half_handler_t bottom_half);
 
+/* Like pic_register_interrupt(), but runs the bottom half in a thread with the supplied priority */
+int pic_register_threaded_interrupt(uint32_t irq_num, top_half_handler_t top_half,
+                                    bottom_half_handler_t thread_fn, unsigned int priority);
+
 #endif /* ARCH_i686_PIC_H */
@@ -4,6 +4,9 @@
 
    Copyright (C) 2024 Isak Evaldsson
 */
+#include <arch/cpu.h>
+#include <arch/percpu.h>
+
 #include "processor.h"
 
 uint32_t get_esp()
@@ -26,3 +29,20 @@ uint32_t get_cr3()
     asm volatile("mov %%cr3, %0" : "r="(cr3));
     return cr3;
 }
+
+/* The logical id of the cpu owning the per-cpu area */
+static DEFINE_PER_CPU(unsigned int, cpu_number) = 0;
+
+/*
+    Only the boot cpu is brought online, starting the application processors requires the local
+    APIC which in turn requires the ACPI tables to be mapped
+*/
+unsigned int arch_cpu_id()
+{
+    return this_cpu_read(cpu_number);
+}
+
+unsigned int arch_cpus_online()
+{
+    return 1;
+}
@@ -4,6 +4,7 @@
 
    Copyright (C) 2024 Isak Evaldsson
 */
+#include <arch/cpu.h>
 #include <stdint.h>
 #include <utils.h>
 
@@ -65,8 +66,8 @@
 #define GDT_TSS SEG_PRES(1) | SEG_PRIV(0) | SEG_DESCTYPE(0) | SEG_TSS_AVAIL
 
 /* The global descriptor table, hardcode size since it will only be filled with the bare minimum
- * required for flat mode  */
-uint64_t gdt[6];
+ * required for flat mode, followed by the per-cpu data segments */
+uint64_t gdt[GDT_PERCPU_ENTRY + MAX_CPUS];
 
 /*
     Creates a segment descriptor according the following layout:
@@ -138,5 +139,21 @@ void init_gdt()
     ptr.address = (uint32_t)&gdt;
     load_gdt(&ptr);
     init_kernel_tss();
+
+    // The boot cpu uses the per-cpu section itself as its per-cpu area
+    gdt_load_percpu_segment(0, 0);
     kprintf("Successfully initiated GDT\n");
 }
+
+/*
+    Installs the data segment of the cpu's per-cpu area, located offset bytes from the per-cpu
+    section, and loads it into %gs. Must be called by the cpu itself.
+*/
+void gdt_load_percpu_segment(unsigned int cpu, uint32_t offset)
+{
+    uint16_t selector = (uint16_t)((GDT_PERCPU_ENTRY + cpu) * sizeof(uint64_t));
+
+    kassert(cpu < MAX_CPUS);
+    gdt[GDT_PERCPU_ENTRY + cpu] = create_descriptor(offset, 0x000FFFFF, (GDT_DATA_PL0));
+    asm volatile("mov %0, %%gs" : : "r"(selector) : "memory");
+}
@@ -17,6 +17,15 @@ typedef struct gdt_ptr_t {
     uint32_t address;  // The address of the first gdt_entry_t struct.
 } __attribute__((packed)) gdt_ptr_t;
 
+/* Index of the first per-cpu data segment, one for each cpu, following the flat mode segments */
+#define GDT_PERCPU_ENTRY 6
+
+/*
+    Installs the data segment of the cpu's per-cpu area, located offset bytes from the per-cpu
+    section, and loads it into %gs. Must be called by the cpu itself.
+*/
+void gdt_load_percpu_segment(unsigned int cpu, uint32_t offset);
+
 /*
     Assembly routine for properly loading the GDT registers (see load_gdt.S),
 */
@@ -16,9 +16,6 @@
 #include <stdint.h>
 #include <utils.h>
 
-#define INIT_SECTION_START  GET_LINKER_SYMBOL(_initobjs_start)
-#define INIT_SECTION_END    GET_LINKER_SYMBOL(_initobjs_end)
-
 /* The kernel main function */
 extern void kernel_main(struct boot_data *boot_data);
 
@@ -26,21 +23,18 @@ extern void kernel_main(struct boot_data *boot_data);
 
 static struct boot_data boot_data;
 
-void initrd_relocation(physaddr_t old, physaddr_t new, size_t size)
+/*
+    Maps the initrd read-only into the higher half, leaving it where the bootloader placed it. The
+    page frame manager reserves its frames based on the boot data, so no copy is required.
+*/
+static void initrd_map(physaddr_t start, size_t size)
 {
-    // Check that the address ranges do not overlap by comparing the distances between them
-    kassert((old > new ? old - new : new - old) > size);
+    // Modules are page aligned, requested through MULTIBOOT_PAGE_ALIGN
+    kassert(start % PAGE_SIZE == 0);
 
     size_t page_count = ALIGN_BY_PAGE_SIZE(size) / PAGE_SIZE;
     for (size_t i = 0; i < page_count; i++) {
-        map_page(new + i, P2L(new + i), PAGE_OPTION_WRITABLE);
-        map_page(old + i, P2L(old + i), PAGE_OPTION_WRITABLE);
-    }
-
-    memcpy((void *)P2L(new), (void *)P2L(old), size);
-    for (size_t i = 0; i < page_count; i++) {
-        unmap_page(P2L(old + i));
-        map_page(new + i, P2L(new + i), 0);  // Re-map page to read-only
+        map_page(start + i * PAGE_SIZE, P2L(start + i * PAGE_SIZE), 0);
     }
 }
 
@@ -95,13 +89,12 @@ void kernel_init(multiboot_info_t *mbd, uint32_t magic)
     parse_init_section((struct init_object **)INIT_SECTION_START,
             (struct init_object **)INIT_SECTION_END);  
     /*
-     * Unmap init section since it's no longer needed, will be overwritten by initrd allocation.
-     * If initrd size < init section size, there will be pages from the init section that is still
-     * mapped. To avoid this, just umap all pages before initrd rellocation.
+     * Unmap init section since it's no longer needed, the page frame manager hands out its frames
+     * as regular memory.
      */
     size_t init_page_count =  ALIGN_BY_PAGE_SIZE(INIT_SECTION_END - INIT_SECTION_START) / PAGE_SIZE;
     for (size_t i = 0; i < init_page_count; i++) {
-        unmap_page(INIT_SECTION_START + i);
+        unmap_page(INIT_SECTION_START + i * PAGE_SIZE);
     }
 
     if (mbd->mods_count < 1) {
@@ -110,10 +103,10 @@ void kernel_init(multiboot_info_t *mbd, uint32_t magic)
 
     multiboot_module_t *initrd_mod = (multiboot_module_t *)mbd->mods_addr;
 
-    // Relocate initrd to the first available page after the kernel bss, i.e start of init section
+    // Use the initrd in place, boot time and memory usage are independent of the initrd size
     size_t     initrd_size  = initrd_mod->mod_end - initrd_mod->mod_start;
-    physaddr_t initrd_start = ALIGN_BY_PAGE_SIZE(INIT_SECTION_START - HIGHER_HALF_ADDR);
-    initrd_relocation(initrd_mod->mod_start, initrd_start, initrd_size);
+    physaddr_t initrd_start = initrd_mod->mod_start;
+    initrd_map(initrd_start, initrd_size);
 
     boot_data.initrd_size  = initrd_size;
     boot_data.initrd_start = initrd_start;
@@ -7,14 +7,19 @@
 #include <arch/interrupts.h>
 #include <devices/input_manager.h>
 #include <ring_buffer.h>
+#include <tasks/rcu.h>
+#include <tasks/spinlock.h>
 #include <uapi/errno.h>
 #include <utils.h>
 
 #define LOG(fmt, ...) __LOG(1, "[INPUT_MANAGER]", fmt, ##__VA_ARGS__)
 
-// Stores all currently registered input event subscribers
+// Stores all currently registered input event subscribers, read under rcu
 static DEFINE_LIST(subscriber_queue);
 
+// Serialises updates of the subscriber queue
+static SPINLOCK_DEFINE(subscriber_lock);
+
 void input_manager_init()
 {
     static bool initiated = false;
@@ -38,23 +43,34 @@ void input_manager_send_event(input_event_t event)
     }
 
     // TODO: fix clang format, curly bracket should be on the same line
-    LIST_ITER_STRUCT(&subscriber_queue, subscriber, struct input_subscriber, list)
+    rcu_read_lock();
+    LIST_ITER_STRUCT_RCU(&subscriber_queue, subscriber, struct input_subscriber, list)
     {
         // How to handle errors?
         subscriber->on_events_received(event);
     }
+    rcu_read_unlock();
 }
 
 int input_manger_subscribe(struct input_subscriber* subscriber)
 {
+    uint32_t flags;
+
     if (!subscriber->on_events_received) {
         return -EINVAL;
     }
 
-    list_add_last(&subscriber_queue, &subscriber->list);
+    spinlock_lock(&subscriber_lock, &flags);
+    list_add_last_rcu(&subscriber_queue, &subscriber->list);
+    spinlock_unlock(&subscriber_lock, flags);
+    return 0;
 }
 
 void input_manger_unsubscribe(struct input_subscriber* subscriber)
 {
-    list_entry_remove(&subscriber->list);
+    uint32_t flags;
+
+    spinlock_lock(&subscriber_lock, &flags);
+    list_entry_remove_rcu(&subscriber->list);
+    spinlock_unlock(&subscriber_lock, flags);
 }
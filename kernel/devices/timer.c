@@ -4,11 +4,17 @@
 
    Copyright (C) 2024 Isak Evaldsson
 */
+#include <arch/interrupts.h>
 #include <devices/timer.h>
+#include <memory/mempool.h>
+#include <tasks/locking.h>
 #include <utils.h>
 
-// The initial priority queue size
-#define INITIAL_QUEUE_SIZE (10)
+// The events are stored in fixed size chunks, allocated from a mempool so interrupt handlers can
+// register events even when the heap can't grow
+#define EVENT_CHUNK_SIZE   32
+#define MAX_EVENT_CHUNKS   64
+#define EVENT_POOL_RESERVE 2
 
 // Enables verification of the min-heap data structure
 #define DEBUG_TIMER_HEAP 1
@@ -33,6 +39,19 @@
 static uint64_t time_since_boot_ns;  // Time since the device was booted in ns allows about 584
                                      // years of uptime before overflow, should proably be enough :)
 
+// The one-shot device driving the timer system, NULL while relying on periodic clock pulses
+static struct clock_event_device* clock_event = NULL;
+
+// The time since boot when the one-shot device was registered
+static uint64_t clock_event_offset_ns = 0;
+
+// Lets the time be read without torn 64-bit reads, written from the timer interrupt only, apart
+// from registering the device which is done with interrupts disabled
+static SEQCOUNT_DEFINE(time_seq);
+
+// Set while the expired events are executed, the device is programmed once they are done
+static bool dispatching_events = false;
+
 /*
     Struct for each element in the internal timed event priority queue
  */
@@ -42,35 +61,64 @@ typedef struct timed_event {
 } timed_event_t;
 
 /*
-    The internal timed event min-heap priority queue
+    The internal timed event min-heap priority queue, entry i lives in chunk i / EVENT_CHUNK_SIZE
  */
 static struct {
-    timed_event_t* array;
+    timed_event_t* chunks[MAX_EVENT_CHUNKS];
+    size_t         nr_chunks;
     size_t         size;
-    size_t         max_size;
-} event_queue = {.array = NULL, .size = 0, .max_size = 0};
+} event_queue = {.nr_chunks = 0, .size = 0};
+
+// The number of clock pulses and clock events since boot, only updated by the timer interrupt
+static uint32_t nr_interrupts = 0;
+
+// Reserves the chunks needed to register events in atomic context, see timer_init()
+static struct mempool event_pool;
+static bool           event_pool_ready = false;
 
 /*
     Helper functions returning pointers to entries in queue based on supplied indicies
 */
+static timed_event_t* get_entry(size_t index)
+{
+    return &event_queue.chunks[index / EVENT_CHUNK_SIZE][index % EVENT_CHUNK_SIZE];
+}
+
 static timed_event_t* get_parent(size_t child_index)
 {
-    return event_queue.array + GET_PARENT(child_index);
+    return get_entry(GET_PARENT(child_index));
 }
 
 static timed_event_t* get_left(size_t parent_index)
 {
-    return event_queue.array + GET_LEFT_CHILD(parent_index);
+    return get_entry(GET_LEFT_CHILD(parent_index));
 }
 
 static timed_event_t* get_right(size_t parent_index)
 {
-    return event_queue.array + GET_RIGHT_CHILD(parent_index);
+    return get_entry(GET_RIGHT_CHILD(parent_index));
 }
 
-static timed_event_t* get_entry(size_t index)
+static bool queue_full()
 {
-    return event_queue.array + index;
+    return event_queue.size == event_queue.nr_chunks * EVENT_CHUNK_SIZE;
+}
+
+static timed_event_t* alloc_chunk(unsigned int flags)
+{
+    if (!event_pool_ready) {
+        return kalloc_flags(sizeof(timed_event_t) * EVENT_CHUNK_SIZE, flags);
+    }
+    return mempool_alloc(&event_pool, flags);
+}
+
+static void free_chunk(timed_event_t* chunk)
+{
+    if (!event_pool_ready) {
+        kfree(chunk);
+        return;
+    }
+    mempool_free(&event_pool, chunk);
 }
 
 /*
@@ -79,12 +127,14 @@ static timed_event_t* get_entry(size_t index)
 #if DEBUG_TIMER_HEAP
 void print_heap_element(size_t index, size_t indent)
 {
-    timed_event_t* event = event_queue.array + index;
+    timed_event_t* event;
 
     // Ensure termination
     if (index >= event_queue.size)
         return;
 
+    event = get_entry(index);
+
     // Insert proper indent
     for (size_t i = 0; i < indent; i++)
         kprintf("  ");
@@ -170,15 +220,50 @@ static void heapify(size_t index)
 static void extract_min_element(timed_event_t* event)
 {
     // copy min element
-    *event = event_queue.array[0];
+    *event = *get_entry(0);
 
     //  replace first with last element
-    event_queue.array[0] = event_queue.array[--event_queue.size];
+    *get_entry(0) = *get_entry(--event_queue.size);
 
     // maintain heap property by applying the heapify operation
     heapify(0);
 
     VERIFY_HEAP();
+
+    // Give back the last chunk once the queue fits in the others with half a chunk to spare
+    if (event_queue.nr_chunks > 1 &&
+        event_queue.size + EVENT_CHUNK_SIZE / 2 <= (event_queue.nr_chunks - 1) * EVENT_CHUNK_SIZE) {
+        free_chunk(event_queue.chunks[--event_queue.nr_chunks]);
+    }
+}
+
+/*
+    Programs the one-shot device to fire at the earliest timed event. The device is programmed even
+    when there are no events, the longest delay bounds the time between interrupts which is needed
+    for the device to keep track of time.
+*/
+static void program_next_event()
+{
+    uint64_t now   = timer_get_time_since_boot();
+    uint64_t delta = clock_event->max_delta_ns;
+
+    if (event_queue.size > 0) {
+        delta = get_entry(0)->timestamp_ns > now ? MIN(get_entry(0)->timestamp_ns - now, delta) : 0;
+    }
+    clock_event->set_next_event(delta);
+}
+
+/*
+    Reserves the memory needed to register timed events in atomic context, must be called from a
+    sleepable context before the interrupt handlers start registering events
+*/
+void timer_init()
+{
+    if (mempool_init(&event_pool, EVENT_POOL_RESERVE,
+                     sizeof(timed_event_t) * EVENT_CHUNK_SIZE) < 0) {
+        kpanic("Failed to reserve memory for timed events");
+    }
+    event_pool_ready = true;
 }
 
 /*
@@ -188,39 +273,54 @@ static void extract_min_element(timed_event_t* event)
  */
 bool timer_register_timed_event(uint64_t timestamp_ns, timed_event_callback callback)
 {
+    uint32_t       flags;
+    size_t         i;
+    timed_event_t* spare = NULL;
+
     LOG("Register timed event to %x at %u", callback, timestamp_ns);
 
-    // (re-)allocate array if necessary
-    if (event_queue.size == event_queue.max_size) {
-        void*  new_array;
-        size_t new_max_size;
-        size_t old_max_size = event_queue.max_size;
-
-        // Set initial size if array is empty, else double size
-        new_max_size = old_max_size == 0 ? INITIAL_QUEUE_SIZE : old_max_size * 2;
-
-        new_array = krealloc(event_queue.array, sizeof(timed_event_t) * new_max_size);
-        if (new_array == NULL) {
-            return false;  // Failed to expand array
-        } else {
-            // update array
-            event_queue.array    = new_array;
-            event_queue.max_size = new_max_size;
+    // Sleepable callers allocate the next chunk up front, when the heap is still allowed to grow
+    if (interrupts_enabled() && queue_full()) {
+        spare = alloc_chunk(KALLOC_SLEEP);
+    }
+
+    // The queue is modified by the timer interrupt
+    flags = get_register_and_disable_interrupts();
+    if (queue_full()) {
+        if (!spare) {
+            spare = alloc_chunk(KALLOC_ATOMIC);
+        }
+        if (!spare || event_queue.nr_chunks == MAX_EVENT_CHUNKS) {
+            restore_interrupt_register(flags);
+            free_chunk(spare);
+            return false;  // Failed to expand the queue
         }
+        event_queue.chunks[event_queue.nr_chunks++] = spare;
+        spare                                       = NULL;
     }
 
     // insert element in end of heap
-    event_queue.array[event_queue.size++] =
-        (timed_event_t){.timestamp_ns = timestamp_ns, .callback = callback};
+    i             = event_queue.size++;
+    *get_entry(i) = (timed_event_t){.timestamp_ns = timestamp_ns, .callback = callback};
 
     // move element until the heap property is satisfied
-    size_t i = event_queue.size - 1;
     while (i != 0 && get_parent(i)->timestamp_ns > timestamp_ns) {
-        swap(get_parent(i), event_queue.array + i);
+        swap(get_parent(i), get_entry(i));
         i = GET_PARENT(i);
     }
 
     VERIFY_HEAP();
+
+    // Re-program the one-shot device if the new event is the earliest one
+    if (clock_event && !dispatching_events && i == 0) {
+        program_next_event();
+    }
+    restore_interrupt_register(flags);
+
+    // The queue was grown by someone else in the meantime
+    if (spare) {
+        free_chunk(spare);
+    }
     return true;
 }
 
@@ -229,23 +329,85 @@ bool timer_register_timed_event(uint64_t timestamp_ns, timed_event_callback call
 */
 uint64_t timer_get_time_since_boot()
 {
-    return time_since_boot_ns;
+    unsigned int               seq;
+    uint64_t                   offset, time;
+    struct clock_event_device* device;
+
+    do {
+        seq    = read_seqcount_begin(&time_seq);
+        device = clock_event;
+        offset = clock_event_offset_ns;
+        time   = time_since_boot_ns;
+    } while (read_seqcount_retry(&time_seq, seq));
+
+    return device ? offset + device->read_ns() : time;
 }
 
-/*
-    Used for drivers to report the increase in time every clock pulse
-*/
-void timer_report_clock_pulse(uint64_t period_ns)
+static void run_expired_events()
 {
     timed_event_t event;
 
-    time_since_boot_ns += period_ns;
-
-    // Check the event queue for timed event
-    while (event_queue.size > 0 && event_queue.array[0].timestamp_ns <= time_since_boot_ns) {
+    dispatching_events = true;
+    while (event_queue.size > 0 && get_entry(0)->timestamp_ns <= time_since_boot_ns) {
         extract_min_element(&event);
 
         LOG("Executing callback %x with timestamp %u", event.callback, event.timestamp_ns);
         event.callback(time_since_boot_ns, event.timestamp_ns);
     }
+    dispatching_events = false;
+}
+
+/*
+    The number of timer interrupts since boot, the one-shot mode keeps it low while idling
+*/
+uint32_t timer_get_nr_interrupts()
+{
+    return READ_ONCE(nr_interrupts);
+}
+
+/*
+    Used for drivers to report the increase in time every clock pulse
+*/
+void timer_report_clock_pulse(uint64_t period_ns)
+{
+    nr_interrupts++;
+    write_seqcount_begin(&time_seq);
+    time_since_boot_ns += period_ns;
+    write_seqcount_end(&time_seq);
+    run_expired_events();
+}
+
+/*
+    Switches the timer system to the one-shot device, clock pulses are no longer expected. The
+    device must call timer_report_clock_event() upon each interrupt.
+*/
+void timer_register_clock_event_device(struct clock_event_device* device)
+{
+    uint32_t flags;
+
+    kassert(device->read_ns && device->set_next_event && device->max_delta_ns);
+
+    flags = get_register_and_disable_interrupts();
+    write_seqcount_begin(&time_seq);
+    clock_event_offset_ns = time_since_boot_ns;
+    clock_event           = device;
+    write_seqcount_end(&time_seq);
+    program_next_event();
+    restore_interrupt_register(flags);
+    log("Using %s as clock event device", device->name);
+}
+
+/*
+    Used for one-shot devices to report that the programmed event has fired
+*/
+void timer_report_clock_event()
+{
+    uint64_t now = timer_get_time_since_boot();
+
+    nr_interrupts++;
+    write_seqcount_begin(&time_seq);
+    time_since_boot_ns = now;
+    write_seqcount_end(&time_seq);
+    run_expired_events();
+    program_next_event();
 }
@@ -11,6 +11,7 @@
 #include <devices/input_manager.h>
 #include <memory/vmem_manager.h>
 #include <tasks/scheduler.h>
+#include <tasks/wait_queue.h>
 #include <uapi/errno.h>
 
 #include "keyboard/keyboard.h"
@@ -25,10 +26,7 @@ struct tty {
     struct input_subscriber  subscriber;
     unsigned char            mode;
 
-    // TODO: Replace with a task id so when so we are force to get the
-    // pointer on every interacting, otherwise we might get problems if
-    // it points to a dead process
-    struct task*      waiting_proc;
+    struct wait_queue read_wait;  // Readers waiting for a line to be committed
     struct open_file* opened;
 
     // Escape codes spans multiple bytes, so this serves as an intermidiate buffer until they are
@@ -159,10 +157,7 @@ static int on_events_received(input_event_t event)
                         // Commit the current line
                         current_tty->char_buffer_commit_idx = current_tty->char_buffer_write_idx;
 
-                        if (current_tty->waiting_proc) {
-                            scheduler_unblock_task(current_tty->waiting_proc);
-                            current_tty->waiting_proc = NULL;
-                        }
+                        wake_up_all(&current_tty->read_wait);
                     }
                     return 0;
                 }
@@ -229,11 +224,6 @@ static int tty_close(struct device *dev, struct open_file *file)
     struct tty* tty = DEVICE_TO_TTY(dev);
     kassert(tty->opened == file);
 
-    if (tty->waiting_proc) {
-        // Can this ever happened?
-        scheduler_unblock_task(tty->waiting_proc);
-    }
-
     // Allow device to be opened by a new process
     tty->opened = NULL;
 
@@ -241,6 +231,9 @@ static int tty_close(struct device *dev, struct open_file *file)
     tty->char_buffer_read_idx   = 0;
     tty->char_buffer_write_idx  = 0;
     tty->char_buffer_commit_idx = 0;
+
+    // Readers wait for the file to be closed as well
+    wake_up_all(&tty->read_wait);
     return 0;
 }
 
@@ -253,10 +246,8 @@ static ssize_t tty_read(struct device *dev, char* buf, size_t size, off_t offset
 
     // Only block in canonical mode
     if (tty->mode & TTY_MODE_CANONICAL) {
-        if (tty->char_buffer_read_idx == tty->char_buffer_commit_idx) {
-            tty->waiting_proc = scheduler_get_current_task();
-            scheduler_block_task(BLOCK_REASON_IO_WAIT);
-        }
+        wait_event(&tty->read_wait, tty->char_buffer_read_idx != tty->char_buffer_commit_idx ||
+                                        tty->opened != file);
     }
 
     // Read until buffer full or empty
@@ -323,6 +314,7 @@ int tty_attach(struct builtin_device *dev)
     }
 
     tty_dev->subscriber.on_events_received = on_events_received;
+    wait_queue_init(&tty_dev->read_wait, BLOCK_REASON_IO_WAIT);
     ret = DEVICE_TYPE_BIND_AND_CREATE_FILE(tty, builtin_to_device(dev), true);
     if (ret < 0) {
         return ret;
@@ -66,6 +66,12 @@ int fs_init(struct boot_data* boot_data)
         return ret;
     }
 
+    ret = kinfo_create_static_files();
+    if (ret < 0) {
+        LOG("Failed to create kinfo files %i", ret);
+        return ret;
+    }
+
     ret = kinfo_create_file(NULL, &kinfo_fs_dir, "fs", S_IFDIR, NULL);
     if (ret < 0) {
         LOG("Failed to create kinfo/fs directory %i", ret);
@@ -119,19 +119,61 @@ int kinfo_create_file(struct kinfo_file* dir, struct kinfo_file** result_ptr, co
     return 0;
 }
 
+/* Finds the directory with the supplied name in the kinfo root, creating it if it doesn't exist */
+static int get_root_dir(const char* name, struct kinfo_file** result_ptr)
+{
+    struct pseudo_file* child;
+
+    for (child = root.file.child; child != NULL; child = child->sibling) {
+        if (S_ISDIR(child->mode) && strcmp(child->name, name) == 0) {
+            *result_ptr = GET_STRUCT(struct kinfo_file, file, child);
+            return 0;
+        }
+    }
+    return kinfo_create_file(NULL, result_ptr, name, S_IFDIR, NULL);
+}
+
+static int create_static_file(void* arg)
+{
+    int                       ret;
+    struct kinfo_file*        dir;
+    struct kinfo_file*        file;
+    struct kinfo_static_file* static_file = arg;
+
+    ret = get_root_dir(static_file->dir, &dir);
+    if (ret < 0) {
+        return ret;
+    }
+    return kinfo_create_file(dir, &file, static_file->name, S_IFREG, static_file->read);
+}
+
+/* Creates the files defined by DEFINE_KINFO_FILE, returns 0 on success, otherwise -ERRNO */
+int kinfo_create_static_files()
+{
+    return call_init_objects(INITOBJ_TYPE_KINFO, create_static_file);
+}
+
 /* Prints the data to be read when reading a kinfo file */
 void kinfo_write(struct kinfo_buffer* buff, const char* restrict format, ...)
 {
-    size_t  nbytes;
+    int     nbytes;
     char*   start = buff->buff + buff->offset;
     size_t  size  = buff->size - buff->offset;
     va_list args;
 
+    // The buffer is full, drop the rest of the output
+    if (size <= 1) {
+        return;
+    }
+
     va_start(args, format);
     nbytes = vsnprintf(start, size, format, args);
     va_end(args);
 
-    if (nbytes > 0) {
-        buff->offset += nbytes;
+    // Truncated, keep what fit and mark the buffer as full
+    if (nbytes < 0 || (size_t)nbytes >= size) {
+        buff->offset = (off_t)buff->size - 1;
+        return;
     }
+    buff->offset += nbytes;
 }
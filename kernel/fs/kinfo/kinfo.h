@@ -11,21 +11,17 @@
     kinfo - a filesystem exposing kernel information the userspace.
 */
 
+#include <kinfo.h>
+
 #include "../fs-internals.h"
 
 /*
     Kinfo API
 */
 
-/* Passed to the kinfo_write() so it knows what buffer to write to */
-struct kinfo_buffer;
-
 /* Object representing a kinfo pseudo file */
 struct kinfo_file;
 
-/* Function called when a file within kinfo is read */
-typedef void (*kinfo_read_t)(struct kinfo_buffer* buff);
-
 /*
     Creates a file within kinfo relative to the specified directory (or within fs root if NULL).
     On success it returns 0 and sets the result_ptr, otherwise it returns -ERRNO.
@@ -33,7 +29,7 @@ typedef void (*kinfo_read_t)(struct kinfo_buffer* buff);
 int kinfo_create_file(struct kinfo_file* dir, struct kinfo_file** result_ptr, const char* name,
                       mode_t mode, kinfo_read_t read);
 
-/* Prints the data to be read when reading a kinfo file */
-void kinfo_write(struct kinfo_buffer* buff, const char* restrict format, ...);
+/* Creates the files defined by DEFINE_KINFO_FILE, returns 0 on success, otherwise -ERRNO */
+int kinfo_create_static_files();
 
 #endif /* FS_KINFO_H */
@@ -5,6 +5,7 @@
    Copyright (C) 2024 Isak Evaldsson
 */
 #include <libc.h>
+#include <tasks/locking.h>
 #include <utils.h>
 
 #include "fs-internals.h"
@@ -20,21 +21,36 @@ struct inode* vfs_root;
 #define N_SUPERBLOCK 10
 static struct superblock superblocks[N_SUPERBLOCK];
 
+/* Protects the registered file systems and the mount table, taken for reading by every pathwalk
+ * crossing a mountpoint */
+static RWLOCK_DEFINE(mount_lock);
+
 /* Find the superblock which is mounted upon the supplied inode, returns NULL on failure. */
 struct superblock* find_superblock(const struct inode* mounted)
 {
     struct superblock* super;
 
+    rwlock_read_lock(&mount_lock);
     for (super = superblocks; super < END_OF_ARRAY(superblocks); super++) {
         if (super->fs != NULL && super->mounted_inode == mounted) {
-            return super;
+            break;
         }
     }
-    return NULL;
+    rwlock_read_unlock(&mount_lock);
+    return super < END_OF_ARRAY(superblocks) ? super : NULL;
+}
+
+/* Marks the superblock as free */
+static void free_superblock(struct superblock* superblk)
+{
+    rwlock_write_lock(&mount_lock);
+    superblk->fs = NULL;
+    rwlock_write_unlock(&mount_lock);
 }
 
 void kinfo_dump_vfs(struct kinfo_buffer* buff)
 {
+    rwlock_read_lock(&mount_lock);
     kinfo_write(buff, "VFS Dump\n");
     kinfo_write(buff, "Registered file systems:\n");
 
@@ -45,6 +61,7 @@ void kinfo_dump_vfs(struct kinfo_buffer* buff)
                         super->mounted_inode, super->root_inode);
         }
     }
+    rwlock_read_unlock(&mount_lock);
 }
 
 static int check_required_fs_ops(const struct fs_ops* ops, unsigned int static_flags)
@@ -59,29 +76,11 @@ static int check_required_fs_ops(const struct fs_ops* ops, unsigned int static_f
     return 0;
 }
 
-/**
- * Registers a file system for future mounting. The name of each registered file system is
- * required to be unique and at least 3 characters.
- * @param fs static file system data such as name, opts etc.
- * @param static_flags mountflags that's always applied when mounting this particular fs, see
- * mount_flags
- * @return 0 on success, -EEXIST if there's already exists a file system with the same.
- */
-int register_fs(struct fs* fs)
+/* Appends the fs to the list of registered file systems, unless the name is taken */
+static int add_fs_locked(struct fs* fs)
 {
-    size_t     len;
     struct fs *prev, *next;
 
-    if (!fs)
-        return -EFAULT;
-
-    if (!fs->ops || check_required_fs_ops(fs->ops, fs->static_flags))
-        return -EINVAL;
-
-    len = strlen(fs->name);
-    if (len < 3 || len > FS_NAME_MAXLEN)
-        return -ENAMETOOLONG;
-
     fs->next = NULL;
     if (fs_list == NULL) {
         fs_list = fs;
@@ -100,15 +99,50 @@ int register_fs(struct fs* fs)
 
     prev->next = fs;
     return 0;
+}
+
+/**
+ * Registers a file system for future mounting. The name of each registered file system is
+ * required to be unique and at least 3 characters.
+ * @param fs static file system data such as name, opts etc.
+ * @param static_flags mountflags that's always applied when mounting this particular fs, see
+ * mount_flags
+ * @return 0 on success, -EEXIST if there's already exists a file system with the same.
+ */
+int register_fs(struct fs* fs)
+{
+    int    ret;
+    size_t len;
+
+    if (!fs)
+        return -EFAULT;
+
+    if (!fs->ops || check_required_fs_ops(fs->ops, fs->static_flags))
+        return -EINVAL;
+
+    len = strlen(fs->name);
+    if (len < 3 || len > FS_NAME_MAXLEN)
+        return -ENAMETOOLONG;
+
+    rwlock_write_lock(&mount_lock);
+    ret = add_fs_locked(fs);
+    rwlock_write_unlock(&mount_lock);
+    return ret;
 };
 
 bool is_registered_fs(const char *name)
 {
+    bool found = false;
+
+    rwlock_read_lock(&mount_lock);
     for (struct fs* fs = fs_list; fs != NULL; fs = fs->next) {
-        if (strncmp(fs->name, name, FS_NAME_MAXLEN) == 0)
-            return true;
+        if (strncmp(fs->name, name, FS_NAME_MAXLEN) == 0) {
+            found = true;
+            break;
+        }
     }
-    return false;
+    rwlock_read_unlock(&mount_lock);
+    return found;
 }
 
 /* Helper function for the mounting procedure that allocates a superblock for the fs specfied in by
@@ -118,12 +152,14 @@ static struct superblock* alloc_superblock(const char* fs_name, int* errno)
     struct fs*         fs = NULL;
     struct superblock* superblk;
 
+    rwlock_write_lock(&mount_lock);
     for (fs = fs_list; fs != NULL; fs = fs->next) {
         if (strncmp(fs->name, fs_name, FS_NAME_MAXLEN) == 0)
             break;
     }
 
     if (!fs) {
+        rwlock_write_unlock(&mount_lock);
         *errno = -ENOENT;
         return NULL;
     }
@@ -132,9 +168,11 @@ static struct superblock* alloc_superblock(const char* fs_name, int* errno)
     for (superblk = superblocks; superblk < END_OF_ARRAY(superblocks); superblk++) {
         if (superblk->fs == NULL) {
             superblk->fs = fs;  // Mark superblock as allocated
+            rwlock_write_unlock(&mount_lock);
             return superblk;
         }
     }
+    rwlock_write_unlock(&mount_lock);
 
     *errno = -ENOMEM;
     LOG("Out of superblocks");
@@ -165,6 +203,7 @@ static int mount_helper(void* data, struct superblock* superblk, struct inode* m
     }
 
     // 'Glue' the mounted filesystems together
+    rwlock_write_lock(&mount_lock);
     if (mnt_inode) {
         mnt_inode->mountpoint   = true;
         superblk->mounted_inode = mnt_inode;
@@ -173,6 +212,7 @@ static int mount_helper(void* data, struct superblock* superblk, struct inode* m
     // Add superblk to list the per fs mountlist
     superblk->next       = superblk->fs->mounts;
     superblk->fs->mounts = superblk;
+    rwlock_write_unlock(&mount_lock);
     return 0;
 }
 
@@ -188,7 +228,7 @@ int mount_rootfs(char* name, void* data)
 
     ret = mount_helper(data, superblk, NULL);
     if (ret < 0) {
-        superblk->fs = NULL;  // Mark superblock as free
+        free_superblock(superblk);
         return ret;
     }
 
@@ -213,20 +253,20 @@ int mount(const char* path, const char* name, unsigned int flags, void* data)
     // Find inode to mount upon, since we never call put on success, the mountpoint will in memory
     ret = pathwalk(vfs_root, path, &inode);
     if (ret < 0) {
-        superblk->fs = NULL;  // Mark superblock as free
+        free_superblock(superblk);
         return ret;
     }
 
     // TODO: Check if already mounted (and busy?)
     if (!S_ISDIR(inode->mode)) {
-        superblk->fs = NULL;  // Mark superblock as free
+        free_superblock(superblk);
         put_node(inode);
         return -ENOTDIR;
     }
 
     ret = mount_helper(data, superblk, inode);
     if (ret < 0) {
-        superblk->fs = NULL;  // Mark superblock as free
+        free_superblock(superblk);
         put_node(inode);
         return ret;
     }
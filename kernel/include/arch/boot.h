@@ -22,6 +22,10 @@ void unmap_identity_mapping();
 #define KERNEL_END       GET_LINKER_SYMBOL(_kernel_end)         /* end symbol, virtual address since higher half kernel */
 #define HIGHER_HALF_ADDR GET_LINKER_SYMBOL(_higher_half_addr)   /* indicating the start of higher half area */
 
+/* The init section is placed last within the kernel and is released once parsed during boot */
+#define INIT_SECTION_START GET_LINKER_SYMBOL(_initobjs_start)
+#define INIT_SECTION_END   GET_LINKER_SYMBOL(_initobjs_end)
+
 #define MEMMAP_SEGMENT_MAX 10
 
 /* Memory segment in memory map */
@@ -32,7 +36,7 @@ typedef struct memory_segment {
 
 /* Architecture independent boot data */
 struct boot_data {
-    // Initrd
+    // Initrd, left where the bootloader placed it and mapped read-only at P2L(initrd_start)
     physaddr_t initrd_start;
     size_t     initrd_size;
 
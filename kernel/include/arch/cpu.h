@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifndef ARCH_CPU_H
+#define ARCH_CPU_H
+#include <arch/platfrom.h>
+
+#if ARCH(i686)
+#include "i686/cpu.h"
+#endif
+
+/*
+    Multiprocessor support, cpus are identified by their logical id ranging from 0 to MAX_CPUS - 1
+    where 0 is the boot cpu.
+*/
+#ifdef SMP
+#define MAX_CPUS 8
+#else
+#define MAX_CPUS 1
+#endif
+
+/* Gives the logical id of the executing cpu */
+unsigned int arch_cpu_id();
+
+/* Gives the number of cpus brought online, the online cpus have the ids 0 to n - 1 */
+unsigned int arch_cpus_online();
+
+/* Hint to the cpu that it's executing a spin-wait loop */
+static inline void arch_cpu_relax();
+
+#endif /* ARCH_CPU_H */
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifndef ARCH_FPU_H
+#define ARCH_FPU_H
+#include <arch/platfrom.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Imports ARCH_FPU_STATE_ALIGN, the alignment required by the saved fpu state */
+#if ARCH(i686)
+#include "i686/fpu.h"
+#else
+#error "Unkown architecture"
+#endif
+
+/* Detects and enables the fpu of the executing cpu, returns the size of its saved state in bytes or
+ * 0 if there's no usable fpu */
+size_t arch_fpu_init();
+
+/* True if saving the state is cheap enough to be done eagerly on every context switch */
+bool arch_fpu_eager_save();
+
+/* Name of the instruction set used to save and restore the state, for kinfo */
+const char *arch_fpu_save_method();
+
+/* Saves the fpu registers to state, which must be aligned by ARCH_FPU_STATE_ALIGN */
+void arch_fpu_save(void *state);
+
+/* Loads the fpu registers from a state saved by arch_fpu_save() */
+void arch_fpu_restore(const void *state);
+
+/* Puts the fpu registers in their initial state */
+void arch_fpu_reset();
+
+/* Makes the next use of the fpu trap into fpu_trap() */
+void arch_fpu_trap_enable();
+
+/* Allows the fpu to be used without trapping */
+void arch_fpu_trap_disable();
+
+#endif /* ARCH_FPU_H */
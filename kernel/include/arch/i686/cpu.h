@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifndef ARCH_i686_CPU_H
+#define ARCH_i686_CPU_H
+
+static inline void arch_cpu_relax()
+{
+    // Avoids the memory order violation penalty when leaving the loop, and saves power
+    asm volatile("pause" ::: "memory");
+}
+
+#endif /* ARCH_i686_CPU_H */
@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifndef ARCH_i686_FPU_H
+#define ARCH_i686_FPU_H
+
+/* XSAVE requires 64 byte alignment, FXSAVE 16 */
+#define ARCH_FPU_STATE_ALIGN 64u
+
+/* The device not available exception, raised by fpu instructions while CR0.TS is set */
+#define ARCH_FPU_TRAP_VECTOR 7
+
+#endif /* ARCH_i686_FPU_H */
@@ -33,6 +33,18 @@ struct interrupt_stack_state {
 
 #define ARCH_N_INTERRUPTS 256
 
+/* The instruction the interrupt fired at */
+#define ARCH_GET_INTERRUPTED_IP(state) ((uintptr_t)(state)->eip)
+
+/* True if the interrupted code ran with interrupts enabled */
+#define ARCH_INTERRUPTED_WITH_IRQS_ENABLED(state) ((state)->eflags & (1 << 9))
+
+/*
+    Software interrupt raised by tasks yielding the cpu, allowing the context switch to be done
+    immediately by the regular interrupt exit path instead of waiting for the next hardware irq.
+*/
+#define ARCH_RESCHEDULE_INTERRUPT 251
+
 /* Fetches the interrupt number from the interrupt_stack_state struct */
 #define ARCH_GET_INTERRUPT_NUMBER(state)               \
     ({                                                 \
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifndef ARCH_i686_PERCPU_H
+#define ARCH_i686_PERCPU_H
+#include <stdint.h>
+
+/* The per-cpu area of the executing cpu is addressed through %gs */
+#define __PERCPU_CHECK_SIZE(var) \
+    _Static_assert(sizeof(var) == sizeof(uint32_t), "only 32-bit per-cpu variables supported")
+
+/* Reads the executing cpu's copy of var */
+#define this_cpu_read(var)                                             \
+    ({                                                                 \
+        __PERCPU_CHECK_SIZE(var);                                      \
+        typeof(var) __val;                                             \
+        asm volatile("movl %%gs:%1, %0" : "=r"(__val) : "m"(var));     \
+        __val;                                                         \
+    })
+
+/* Writes val to the executing cpu's copy of var */
+#define this_cpu_write(var, val)                                                 \
+    ({                                                                           \
+        __PERCPU_CHECK_SIZE(var);                                                \
+        asm volatile("movl %1, %%gs:%0" : "=m"(var) : "ri"((typeof(var))(val))); \
+    })
+
+/* Increments the executing cpu's copy of var */
+#define this_cpu_inc(var)                                  \
+    ({                                                     \
+        __PERCPU_CHECK_SIZE(var);                          \
+        asm volatile("incl %%gs:%0" : "+m"(var) :: "cc"); \
+    })
+
+/* Decrements the executing cpu's copy of var */
+#define this_cpu_dec(var)                                  \
+    ({                                                     \
+        __PERCPU_CHECK_SIZE(var);                          \
+        asm volatile("decl %%gs:%0" : "+m"(var) :: "cc"); \
+    })
+
+#endif /* ARCH_i686_PERCPU_H */
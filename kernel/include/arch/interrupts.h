@@ -26,6 +26,20 @@ typedef void (*top_half_handler_t)(struct interrupt_stack_state *state, uint32_t
  * to block or sleep */
 typedef void (*bottom_half_handler_t)(uint32_t interrupt_number);
 
+/*
+    Priority classes of the bottom halves run at the end of the interrupt. Pending bottom halves of
+    a more important class always run first, within a class they run in vector order.
+*/
+typedef enum {
+    BOTTOM_HALF_PRIORITY_HIGH = 0,
+    BOTTOM_HALF_PRIORITY_NORMAL,
+    BOTTOM_HALF_PRIORITY_LOW,
+    N_BOTTOM_HALF_PRIORITIES,
+} bottom_half_priority_t;
+
+/* Scheduling priority suggested for interrupt threads, see register_threaded_interrupt_handler() */
+#define INTERRUPT_THREAD_PRIORITY 1
+
 /*
     Registers an interrupt at the specified interrupt number. The caller needs to provide at least a
     top or a bottom half handler.
@@ -33,6 +47,23 @@ typedef void (*bottom_half_handler_t)(uint32_t interrupt_number);
 int register_interrupt_handler(uint32_t interrupt_number, top_half_handler_t top_half,
                                bottom_half_handler_t bottom_half);
 
+/* Like register_interrupt_handler(), but runs the bottom half in the supplied priority class */
+int register_interrupt_handler_with_priority(uint32_t interrupt_number, top_half_handler_t top_half,
+                                             bottom_half_handler_t bottom_half,
+                                             bottom_half_priority_t priority);
+
+/*
+    Registers an interrupt whose bottom half runs in a dedicated thread with the supplied
+    scheduling priority, rather than inline at the end of the interrupt. Slow bottom halves
+    therefore don't delay other interrupts. During boot, the thread is started by
+    start_interrupt_threads() once the scheduler is up.
+*/
+int register_threaded_interrupt_handler(uint32_t interrupt_number, top_half_handler_t top_half,
+                                        bottom_half_handler_t thread_fn, unsigned int priority);
+
+/* Starts the threads of the threaded interrupts registered before the scheduler was up */
+void start_interrupt_threads();
+
 /*
     Provides an architecture independet interrupt mechanism proving a atomic top half and a
     reentrant bottom half. Is supposed to be called by the arch specific low level interrupt code.
@@ -49,6 +80,12 @@ void init_interrupts();
 
 void wait_for_interrupt();
 
+/* Enables interrupts and waits for the next one, without any window for an irq to slip in between */
+void enable_interrupts_and_wait();
+
+/* Raises the software interrupt used by the scheduler to perform synchronous context switches */
+void raise_reschedule_interrupt();
+
 void enable_interrupts();
 
 void disable_interrupts();
@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifndef ARCH_PERCPU_H
+#define ARCH_PERCPU_H
+#include <arch/platfrom.h>
+
+/*
+    Per-cpu variables - data that every cpu has its own copy of
+
+    The variables are placed in the per-cpu section, which serves as the copy of the boot cpu and
+    the template for the others. Each cpu reaches its own copy through a segment register whose
+    base is set to the offset of the cpu's copy relative to the section, so the accessors below
+    compile to a single instruction, are atomic with respect to interrupts on the executing cpu
+    and never touch the cache lines of other cpus.
+
+    The variables must not be accessed directly, only through the this_cpu_* accessors, which only
+    supports 32-bit variables.
+*/
+#define PERCPU_SECTION __attribute__((section(".data.percpu")))
+
+/* Defines a per-cpu variable, may be prefixed by static */
+#define DEFINE_PER_CPU(type, name) PERCPU_SECTION type name
+
+/* Declares a per-cpu variable defined elsewhere */
+#define DECLARE_PER_CPU(type, name) extern PERCPU_SECTION type name
+
+#if ARCH(i686)
+#include "i686/percpu.h"
+#endif
+
+#endif /* ARCH_PERCPU_H */
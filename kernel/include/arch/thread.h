@@ -25,4 +25,8 @@ void init_thread_regs_with_stack(struct thread_regs* regs, void* stack_top, void
 /* Initialise the thread registers for the initial thread */
 void init_initial_thread_regs(struct thread_regs* regs);
 
+/* Saves the executing context in from and resumes the one in to, returns once from is resumed.
+ * Only switches the stack, so both must belong to the same task. */
+void arch_thread_switch(struct thread_regs* from, struct thread_regs* to);
+
 #endif /* ARCH_THREAD_H */
@@ -277,7 +277,8 @@ struct input_subscriber {
 int input_manger_subscribe(struct input_subscriber* subscriber);
 
 /* Unsubscribe from inputs events, the callback associated to the subscriber object will no longer
- * be called on new input events. */
+ * be called on new input events. Events already being delivered may still reach the callback, so
+ * the object must not be free'd or re-subscribed until after synchronize_rcu(). */
 void input_manger_unsubscribe(struct input_subscriber* subscriber);
 
 #endif /* DEVICES_INPUT_H */
@@ -21,12 +21,21 @@
 */
 #define SECONDS_TO_NS(second) ((second) * 1000000000ull)
 
+/* Same as above but for milliseconds */
+#define MS_TO_NS(ms) ((ms) * 1000000ull)
+
 /*
     Type definition for time event callbacks returns both the time since boot and the registered
     timestamp allowing the callback to compensate if they differ.
  */
 typedef void (*timed_event_callback)(uint64_t time_since_boot_ns, uint64_t timestamp_ns);
 
+/*
+    Reserves the memory needed to register timed events in atomic context, must be called from a
+    sleepable context before the interrupt handlers start registering events
+*/
+void timer_init();
+
 /*
     Allows the registration of timed events, one the supplied timestamps is reached the callback
     will be executed. The time system does not grantee the callback to be invoked at exactly the
@@ -39,9 +48,41 @@ bool timer_register_timed_event(uint64_t timestamp_ns, timed_event_callback call
 */
 uint64_t timer_get_time_since_boot();
 
+/*
+    The number of timer interrupts since boot, the one-shot mode keeps it low while idling
+*/
+uint32_t timer_get_nr_interrupts();
+
 /*
     Used for drivers to report the increase in time every clock pulse
 */
 void timer_report_clock_pulse(uint64_t period_ns);
 
+/*
+    One-shot timer device. Rather than interrupting periodically, the device is programmed to
+    interrupt at the earliest timed event, letting an idle cpu sleep through quiet periods. The
+    device also keeps the time since boot since there's no periodic pulse to count.
+*/
+struct clock_event_device {
+    const char *name;
+    uint64_t    max_delta_ns;  // The longest delay the device can be programmed with
+
+    // Gives the time in ns since the device was registered, must be monotonic
+    uint64_t (*read_ns)();
+
+    // Programs the device to interrupt delta_ns from now, replacing any previous programming
+    void (*set_next_event)(uint64_t delta_ns);
+};
+
+/*
+    Switches the timer system to the one-shot device, clock pulses are no longer expected. The
+    device must call timer_report_clock_event() upon each interrupt.
+*/
+void timer_register_clock_event_device(struct clock_event_device *device);
+
+/*
+    Used for one-shot devices to report that the programmed event has fired
+*/
+void timer_report_clock_event();
+
 #endif /* DEVICE_TIMER_H */
@@ -0,0 +1,96 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifndef IDR_H
+#define IDR_H
+
+#include <atomics.h>
+#include <stdint.h>
+#include <utils.h>
+
+/*
+    ID allocator mapping small integer ids to pointers
+
+    The ids are stored in a two-level radix table, the root splits the id space into leaves of
+    IDR_LEAF_SIZE slots which are allocated on demand. Looking up an id is a constant time operation
+    and doesn't require any locking, since leaves are never freed and slots are updated atomically,
+    but keeping the object alive is up to the caller. Allocating and removing ids must be
+    serialised by the caller.
+
+    Ids are allocated cyclically, starting after the last allocated one, delaying the re-use of an
+    id for as long as possible. Each leaf has a bitmap of the used slots, and the root a bitmap of
+    the full leaves, allowing the search for a free id to skip 32 used ids at a time.
+
+    Since allocation is often done with a spinlock held, the leaf it may need can be allocated in
+    advance with idr_preload(), e.g.
+
+    idr_preload(&idr);
+    spinlock_lock(&lock, &flags);
+    id = idr_alloc(&idr, obj);
+    spinlock_unlock(&lock, flags);
+*/
+
+#define IDR_LEAF_BITS 8
+#define IDR_ROOT_BITS 8
+#define IDR_LEAF_SIZE (1u << IDR_LEAF_BITS)
+#define IDR_LEAVES    (1u << IDR_ROOT_BITS)
+#define IDR_MAX_ID    ((int)(IDR_LEAVES * IDR_LEAF_SIZE - 1))
+
+struct idr_leaf {
+    uint32_t     used[IDR_LEAF_SIZE / 32];  // Bitmap of the used slots
+    unsigned int nr_used;
+    void        *slots[IDR_LEAF_SIZE];
+};
+
+struct idr {
+    struct idr_leaf *leaves[IDR_LEAVES];
+    uint32_t         full[IDR_LEAVES / 32];  // Bitmap of the leaves without free slots
+    int              min_id;                 // The lowest id handed out
+    int              next_id;                // Where the search for a free id starts
+    atomic_ptr_t     spare;                  // Leaf allocated by idr_preload()
+};
+
+/* Initialises an idr handing out ids from min_id and upwards */
+#define IDR_INIT(_min_id) {.min_id = (_min_id), .next_id = (_min_id), .spare = ATOMIC_INIT()}
+
+/* Initialise an allocated idr */
+static inline void idr_init(struct idr *idr, int min_id)
+{
+    *idr = (struct idr)IDR_INIT(min_id);
+}
+
+/* Gives the pointer associated with the id, NULL if the id isn't in use */
+static inline void *idr_find(const struct idr *idr, int id)
+{
+    struct idr_leaf *leaf;
+
+    if (id < 0 || id > IDR_MAX_ID) {
+        return NULL;
+    }
+
+    leaf = READ_ONCE(idr->leaves[(unsigned int)id >> IDR_LEAF_BITS]);
+    return leaf ? READ_ONCE(leaf->slots[(unsigned int)id & (IDR_LEAF_SIZE - 1)]) : NULL;
+}
+
+/* Frees the memory held by the idr, no concurrent lookups may be in progress */
+void idr_destroy(struct idr *idr);
+
+/*
+    Allocates the memory a following idr_alloc() may need, allowing it to be called in atomic
+    context. Must be called in a sleepable context. Returns 0 on success, otherwise -ERRNO.
+*/
+int idr_preload(struct idr *idr);
+
+/*
+    Associates ptr with a free id, ptr must not be NULL. Only allocates memory in atomic context, so
+    idr_preload() should be called beforehand. Returns the id on success, otherwise -ERRNO.
+*/
+int idr_alloc(struct idr *idr, void *ptr);
+
+/* Frees the id, returns the pointer it was associated with */
+void *idr_remove(struct idr *idr, int id);
+
+#endif /* IDR_H */
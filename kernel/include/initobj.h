@@ -15,7 +15,9 @@ enum {
    INITOBJ_TYPE_FS,
    INITOBJ_TYPE_BUS,
    INITOBJ_TYPE_DRIVER,
-   INITOBJ_LAST_OBJ_TYPE = INITOBJ_TYPE_DRIVER,
+   INITOBJ_TYPE_SHRINKER,
+   INITOBJ_TYPE_KINFO,
+   INITOBJ_LAST_OBJ_TYPE = INITOBJ_TYPE_KINFO,
 
    /* Functioon type, assings data->fn */
    INITOBJ_TYPE_COUNT
@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifndef KINFO_H
+#define KINFO_H
+#include <initobj.h>
+
+/*
+    kinfo - a filesystem exposing kernel information the userspace.
+
+    Subsystems outside of the fs can expose their own files using DEFINE_KINFO_FILE, the files are
+    created within /kinfo/<dir>/<name> once kinfo is mounted.
+*/
+
+/* Passed to the kinfo_write() so it knows what buffer to write to */
+struct kinfo_buffer;
+
+/* Function called when a file within kinfo is read */
+typedef void (*kinfo_read_t)(struct kinfo_buffer* buff);
+
+/* Statically defined kinfo file */
+struct kinfo_static_file {
+    const char*  dir;
+    const char*  name;
+    kinfo_read_t read;
+};
+
+/* Defines a kinfo file /kinfo/<_dir>/<_name>, created upon init */
+#define DEFINE_KINFO_FILE(_dir, _name, _read)                     \
+    static struct kinfo_static_file kinfo_file_##_dir##_##_name = { \
+        .dir  = #_dir,                                            \
+        .name = #_name,                                           \
+        .read = (_read),                                          \
+    };                                                            \
+    DEFINE_INITOBJ(INITOBJ_TYPE_KINFO, _dir##_##_name, &kinfo_file_##_dir##_##_name)
+
+/* Prints the data to be read when reading a kinfo file */
+void kinfo_write(struct kinfo_buffer* buff, const char* restrict format, ...);
+
+#endif /* KINFO_H */
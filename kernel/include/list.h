@@ -123,4 +123,34 @@ void list_entry_append(struct list_entry* entry, struct list_entry* new_entry);
  * and prev points to itself), we can save some memory lookups. */
 void list_entry_append_single_element(struct list_entry* entry, struct list_entry* new_entry);
 
+/*
+    List operations safe to use concurrently with rcu readers (see tasks/rcu.h), updates must still
+    be serialised by the caller. A removed entry is kept intact, letting readers already on it
+    continue the iteration, so it must not be re-used or free'd until a grace period has elapsed.
+*/
+
+/* Add item to end of list, the entry is initialised before it's published to readers */
+static inline void list_add_last_rcu(struct list* list, struct list_entry* entry)
+{
+    entry->next = &list->head;
+    entry->prev = list->head.prev;
+    __atomic_store_n(&list->head.prev->next, entry, __ATOMIC_RELEASE);
+    list->head.prev = entry;
+}
+
+/* Removes list_entry from its list, leaving its own links intact */
+static inline void list_entry_remove_rcu(struct list_entry* entry)
+{
+    entry->next->prev = entry->prev;
+    __atomic_store_n(&entry->prev->next, entry->next, __ATOMIC_RELAXED);
+}
+
+/* Iterates over the structs embedding the list entries within a read-side critical section */
+#define LIST_ITER_STRUCT_RCU(list_ptr, struct_ptr, type, field)                                  \
+    for (struct_ptr =                                                                           \
+             GET_STRUCT(type, field, __atomic_load_n(&(list_ptr)->head.next, __ATOMIC_CONSUME)); \
+         &struct_ptr->field != &(list_ptr)->head;                                               \
+         struct_ptr =                                                                           \
+             GET_STRUCT(type, field, __atomic_load_n(&struct_ptr->field.next, __ATOMIC_CONSUME)))
+
 #endif /* LIST_H */
@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifndef MEMORY_MEMBLOCK_H
+#define MEMORY_MEMBLOCK_H
+#include <arch/boot.h>
+#include <stddef.h>
+
+/*
+    Memblock - boot time memory allocator
+
+    Keeps track of the available memory segments reported by the bootloader together with a list of
+    reserved ranges (kernel image, initrd and early allocations). It allows code running before the
+    page frame manager and heap exist to allocate memory, and is used to size and place the page
+    frame manager's own data structures.
+
+    Once the page frame manager has taken over, see memblock_retire(), memblock allocations are no
+    longer allowed. Memory allocated through memblock is never freed.
+*/
+
+/* Iterates over all memory segments, available or reserved */
+#define MEMBLOCK_FOR_EACH(seg, type) \
+    for (seg = memblock_##type##_segments(); seg < memblock_##type##_end(); seg++)
+
+/*
+    Initialises memblock from the boot data, reserving the kernel image and initrd. Must be called
+    first thing during boot, before anything doing early allocations.
+*/
+void memblock_init(struct boot_data *boot_data);
+
+/* Marks the physical range as reserved, returns 0 on success, otherwise -ERRNO */
+int memblock_reserve(physaddr_t addr, size_t length);
+
+/*
+    Allocates size bytes (rounded up to whole pages) of cleared and mapped low memory, returns the
+    virtual address or NULL on failure.
+*/
+void *memblock_alloc(size_t size);
+
+/* Accessors used by MEMBLOCK_FOR_EACH, the segments are page aligned */
+memory_segment_t *memblock_memory_segments();
+memory_segment_t *memblock_memory_end();
+memory_segment_t *memblock_reserved_segments();
+memory_segment_t *memblock_reserved_end();
+
+/* Called once the page frame manager has taken over the memory, further allocations will panic */
+void memblock_retire();
+
+#endif /* MEMORY_MEMBLOCK_H */
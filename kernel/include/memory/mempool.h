@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifndef MEMORY_MEMPOOL_H
+#define MEMORY_MEMPOOL_H
+#include <stddef.h>
+#include <stdint.h>
+#include <tasks/spinlock.h>
+
+/*
+    Memory pool - guarantees a minimum number of fixed size objects to critical code paths
+
+    The pool pre-allocates min_nr objects that are kept in reserve. Allocations are first served by
+    the heap, only if the heap fails the reserve is used, and freed objects refills the reserve
+    before being returned to the heap. This ensures that code running in atomic context, which isn't
+    allowed to grow the heap, can make progress even under memory pressure.
+*/
+struct mempool {
+    struct spinlock lock;
+    size_t          obj_size;
+    unsigned int    min_nr;   // The number of objects to keep in reserve
+    unsigned int    curr_nr;  // The number of objects currently in reserve
+    void           *reserve;  // Singly linked list of reserved objects, linked through the objects
+};
+
+/*
+    Initialises a mempool reserving min_nr objects of size obj_size. Must be called from a sleepable
+    context. Returns 0 on success, otherwise -ERRNO.
+*/
+int mempool_init(struct mempool *pool, unsigned int min_nr, size_t obj_size);
+
+/* Frees all reserved objects, all objects allocated from the pool must be returned beforehand */
+void mempool_destroy(struct mempool *pool);
+
+/*
+    Allocates a cleared object from the pool, flags is passed to the heap (see KALLOC_*). Returns
+    NULL if both the heap and the reserve are exhausted.
+*/
+void *mempool_alloc(struct mempool *pool, unsigned int flags);
+
+/* Returns an object to the pool, refilling the reserve if necessary */
+void mempool_free(struct mempool *pool, void *obj);
+
+#endif /* MEMORY_MEMPOOL_H */
@@ -18,6 +18,7 @@
     Allocation options
 */
 #define PF_OPT_HIGH_MEM (1 << 0)  // First bit indicates request allocate high memory
+#define PF_OPT_ATOMIC   (1 << 1)  // Caller can't wait for memory to be reclaimed on failure
 
 // Struct holding memory statistics provided by the page frame manager
 typedef struct memory_stats {
@@ -32,6 +33,9 @@ void page_frame_manager_init(struct boot_data *boot_data);
 // Returns memory statistics from the page frame manager
 void page_frame_manger_memory_stats(memory_stats_t *stats);
 
+// Returns the number of frames that needs to be reclaimed to get back above the high watermark
+size_t page_frame_reclaim_target();
+
 // Returns physical address to the page that was allocated, 0 marks failure
 physaddr_t page_frame_alloc_page(uint8_t options);
 
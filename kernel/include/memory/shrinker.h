@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifndef MEMORY_SHRINKER_H
+#define MEMORY_SHRINKER_H
+#include <initobj.h>
+#include <list.h>
+#include <stddef.h>
+
+/*
+    Shrinkers - allows kernel caches to give memory back when the page frame allocator runs low
+
+    Each cache registers a shrinker exposing how many pages it could free (count) and a way of
+    freeing them (scan). Shrinkers are invoked by a background reclaim thread once the number of
+    available page frames drops below the low watermark, and directly by the page frame allocator
+    when a sleepable allocation fails.
+
+    The callbacks may be called with interrupts disabled and must therefore never block.
+*/
+struct shrinker {
+    const char *name;
+
+    // Returns the number of pages the cache could free right now
+    size_t (*count)(struct shrinker *shrinker);
+
+    // Tries to free nr_pages, returns the number of pages actually freed
+    size_t (*scan)(struct shrinker *shrinker, size_t nr_pages);
+
+    struct list_entry entry;
+};
+
+/* Defines a shrinker that is registered upon init */
+#define DEFINE_SHRINKER(_name, _count, _scan)   \
+    static struct shrinker shrinker_##_name = { \
+        .name  = #_name,                        \
+        .count = (_count),                      \
+        .scan  = (_scan),                       \
+    };                                          \
+    DEFINE_INITOBJ(INITOBJ_TYPE_SHRINKER, _name, &shrinker_##_name)
+
+/* Registers the shrinker, returns 0 on success, otherwise -ERRNO */
+int register_shrinker(struct shrinker *shrinker);
+
+/* Removes a registered shrinker */
+void unregister_shrinker(struct shrinker *shrinker);
+
+/* Asks the registered shrinkers to free nr_pages, returns the number of pages actually freed */
+size_t shrink_caches(size_t nr_pages);
+
+/* Wakes the background reclaim thread, safe to call from any context */
+void reclaim_wakeup();
+
+/* Registers the statically defined shrinkers and starts the background reclaim thread */
+void shrinker_init();
+
+#endif /* MEMORY_SHRINKER_H */
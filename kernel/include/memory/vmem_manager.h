@@ -17,6 +17,7 @@
 */
 #define FPO_HIGHMEM (1 << 0)  // If bit 0 is high, alloc high-memory
 #define FPO_CLEAR   (1 << 1)  // If bit 1 is high, clear allocated pages
+#define FPO_ATOMIC  (1 << 2)  // If bit 2 is high, fail instead of reclaiming memory
 
 // Allocates a single page and returns its virtual address
 virtaddr_t vmem_request_free_page(unsigned int fpo);
@@ -0,0 +1,86 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifndef RBTREE_H
+#define RBTREE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+    Generic red-black tree implementation
+
+    Similar to the list, the rb_node is embedded within a struct and the tree is ordered by a less
+    function comparing two nodes, eg.
+
+    struct test {
+        int            key;
+        struct rb_node node;
+    };
+
+    static bool test_less(const struct rb_node* a, const struct rb_node* b)
+    {
+        return GET_STRUCT(const struct test, node, a)->key <
+               GET_STRUCT(const struct test, node, b)->key;
+    }
+
+    struct rb_root tree = RB_ROOT_INIT;
+    rb_add(&tree, &elem->node, test_less);
+    ...
+
+    struct test* smallest = GET_STRUCT(struct test, node, rb_first(&tree));
+
+    The tree caches its leftmost node, making rb_first() a constant time operation.
+*/
+
+/* The node representing each entry within the tree */
+struct rb_node {
+    struct rb_node* parent;
+    struct rb_node* left;
+    struct rb_node* right;
+    int             color;
+};
+
+/* Object storing the state of the tree */
+struct rb_root {
+    struct rb_node* node;
+    struct rb_node* leftmost;
+};
+
+#define RB_ROOT_INIT {.node = NULL, .leftmost = NULL}
+
+/* Check if tree is empty */
+#define RB_EMPTY(root_ptr) ((root_ptr)->node == NULL)
+
+/* Orders the nodes within the tree, equal nodes are kept in insertion order */
+typedef bool (*rb_less_t)(const struct rb_node* a, const struct rb_node* b);
+
+/* Initialise an allocated tree */
+static inline void rb_init(struct rb_root* root)
+{
+    root->node = root->leftmost = NULL;
+}
+
+/* Inserts node into the tree */
+void rb_add(struct rb_root* root, struct rb_node* node, rb_less_t less);
+
+/* Removes node from the tree */
+void rb_erase(struct rb_root* root, struct rb_node* node);
+
+/* Gives the smallest node within the tree, NULL if empty */
+static inline struct rb_node* rb_first(const struct rb_root* root)
+{
+    return root->leftmost;
+}
+
+/* Gives the node following node in order, NULL if it is the last one */
+struct rb_node* rb_next(const struct rb_node* node);
+
+/* Macro to simplify in order tree iteration */
+#define RB_ITER(root_ptr, node_ptr) \
+    for (node_ptr = rb_first(root_ptr); node_ptr != NULL; node_ptr = rb_next(node_ptr))
+
+#endif /* RBTREE_H */
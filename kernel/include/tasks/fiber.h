@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifndef TASKS_FIBER_H
+#define TASKS_FIBER_H
+#include <arch/thread.h>
+#include <list.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <tasks/spinlock.h>
+#include <tasks/task.h>
+
+/*
+    Fibers - cooperatively scheduled stackful coroutines within a single task
+
+    A fiber scheduler is run by one task, its host, which switches between the fibers until all of
+    them have exited. Fibers only give up the cpu by yielding, sleeping or waiting on a wait queue,
+    wait_event() and friends block just the fiber rather than the host task. Other blocking
+    primitives, like mutexes and nano_sleep(), block the whole host.
+
+    Each fiber lives at the bottom of its own FIBER_STACK_SIZE allocation, free'd fibers are cached
+    for re-use. Interrupts run on the stack of the interrupted fiber, so the stack is sized for the
+    fiber's own calls plus the deepest interrupt path. Deep call chains within fibers don't fit.
+*/
+
+/* Size of a fiber allocation, including the fiber itself, one page */
+#define FIBER_STACK_SIZE 4096
+
+/* The number of exited fibers, together with their stacks, kept around for re-use */
+#define FIBER_CACHE_SIZE 64
+
+struct fiber_scheduler {
+    struct spinlock    lock;
+    struct list        ready;     // Fibers ready to run, in the order they became ready
+    struct list        sleeping;  // Blocked fibers with a wakeup time, sorted by the time
+    task_t            *host;      // The task running the scheduler, while fiber_run() runs
+    struct thread_regs regs;      // The host context, while a fiber runs
+    unsigned int       nr_fibers;
+    bool               host_waiting;  // The host is blocked until a fiber becomes ready
+};
+
+#define FIBER_SCHEDULER_INIT(name)                                                    \
+    {.lock = SPINLOCK_INIT(), .ready = LIST_INIT((name).ready),                       \
+     .sleeping = LIST_INIT((name).sleeping), .host = NULL, .nr_fibers = 0,            \
+     .host_waiting = false}
+
+/* Initialise a statically allocated fiber scheduler */
+#define DEFINE_FIBER_SCHEDULER(name) \
+    struct fiber_scheduler name = FIBER_SCHEDULER_INIT(name)
+
+/* Initialise an allocated fiber scheduler, a macro so the lockstat class is named after caller */
+#define fiber_scheduler_init(fs) \
+    (*(fs) = (struct fiber_scheduler)FIBER_SCHEDULER_INIT(*(fs)))
+
+/* Creates a fiber calling fn(arg), run once the scheduler gets to it. Returns 0 or -ERRNO. */
+int fiber_create(struct fiber_scheduler *fs, void (*fn)(void *), void *arg);
+
+/* Runs the fibers of the scheduler until all of them have exited, must not be called by a fiber */
+void fiber_run(struct fiber_scheduler *fs);
+
+/* The executing fiber, NULL if not called by a fiber */
+struct fiber *fiber_current();
+
+/* Lets the other ready fibers run before the calling one continues */
+void fiber_yield();
+
+/* Blocks the calling fiber for at least the supplied number of ns */
+void fiber_sleep(uint64_t ns);
+
+/*
+    Wait queue support, the fiber counterparts of scheduler_prepare_block(), scheduler_yield() and
+    scheduler_unblock_task(). Marks the fiber as blocked until woken or, if deadline is non-zero,
+    until the deadline, switches to the next fiber and makes it runnable again.
+*/
+void fiber_prepare_block(struct fiber *fiber, uint64_t deadline);
+void fiber_schedule();
+void fiber_finish_block(struct fiber *fiber);
+
+/* Makes the blocked fiber runnable, safe in any context */
+void fiber_wake(struct fiber *fiber);
+
+#endif /* TASKS_FIBER_H */
@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifndef TASKS_FPU_H
+#define TASKS_FPU_H
+#include <tasks/task.h>
+
+/*
+    FPU context switching - gives each task its own fpu/SIMD register state
+
+    The context switch itself only saves the general purpose registers. The fpu state is instead
+    switched lazily: a task switched in without its state loaded runs with fpu trapping enabled,
+    and its first fpu instruction traps into fpu_trap(), which saves the state of the previous user
+    and loads its own. Tasks never touching the fpu therefore never pay for it. The state is
+    allocated on first use.
+
+    When the cpu has a cheap save instruction (XSAVEOPT), the state of tasks using the fpu is
+    instead saved and restored eagerly on every switch, avoiding the trap. SMP kernels always save
+    eagerly, so the state of a task never lingers in the registers of another cpu.
+
+    Kernel code may use the fpu, e.g. for SIMD, between kernel_fpu_begin() and kernel_fpu_end()
+    without disturbing the state of any task. Interrupt handlers must not use the fpu.
+*/
+
+/* Detects and enables the fpu */
+void fpu_init();
+
+/* Called when a task uses the fpu while trapping is enabled, loads the state of the current task */
+void fpu_trap();
+
+/* Switches the fpu state from prev to next, called by the scheduler with interrupts disabled */
+void fpu_switch(task_t *prev, task_t *next);
+
+/* Releases the fpu state of the terminated task */
+void fpu_release_task(task_t *task);
+
+/*
+    Marks a region using the fpu within the kernel. The region runs with preemption disabled and
+    must not sleep, nor be nested. The fpu registers are in their initial state on entry.
+*/
+void kernel_fpu_begin();
+void kernel_fpu_end();
+
+#endif /* TASKS_FPU_H */
@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifndef TASKS_LATENCY_TRACER_H
+#define TASKS_LATENCY_TRACER_H
+#include <stdint.h>
+
+/*
+    Latency tracer - records the longest windows with interrupts or preemption disabled
+
+    Compiled out unless the kernel is built with LATENCY_TRACER defined. Each cpu keeps the longest
+    window seen together with the call sites that opened and closed it, published in
+    /kinfo/latency. Windows opened by an interrupt record the interrupted instruction as entry.
+
+    The hooks are idempotent, a window is only opened if none is open and only closed if one is,
+    which keeps nested and unbalanced calls from skewing the measurements.
+*/
+
+#ifdef LATENCY_TRACER
+
+/* Called right after interrupts have been disabled */
+void trace_irqs_off(uintptr_t ip);
+
+/* Called right before interrupts are re-enabled */
+void trace_irqs_on(uintptr_t ip);
+
+/* Called once the preemption counter has left zero */
+void trace_preempt_off(uintptr_t ip);
+
+/* Called before the preemption counter returns to zero */
+void trace_preempt_on(uintptr_t ip);
+
+/* Forgets the longest windows of the executing cpu, must be called with interrupts disabled */
+void latency_tracer_reset();
+
+/* Returns the longest irqs off window of the executing cpu in ns, together with its call sites */
+uint64_t latency_tracer_irqsoff_max(uintptr_t *entry_ip, uintptr_t *exit_ip);
+
+#else
+
+#define trace_irqs_off(ip)    ((void)0)
+#define trace_irqs_on(ip)     ((void)0)
+#define trace_preempt_off(ip) ((void)0)
+#define trace_preempt_on(ip)  ((void)0)
+
+#endif /* LATENCY_TRACER */
+
+/* The caller of the function expanding it, passed as call site to the hooks */
+#define TRACE_CALLER() ((uintptr_t)__builtin_return_address(0))
+
+#endif /* TASKS_LATENCY_TRACER_H */
@@ -6,14 +6,31 @@
 */
 #ifndef TASK_LOCKING_H
 #define TASK_LOCKING_H
+#include <arch/cpu.h>
 #include <atomics.h>
-#include <tasks/task_queue.h>
+#include <stdbool.h>
+#include <tasks/lockstat.h>
+#include <tasks/spinlock.h>
+#include <tasks/wait_queue.h>
 
 /* Defines an empty semaphore struct */
-#define SEMAPHORE_INIT(name, initial_count) \
-    {.count = ATOMIC_INIT_VAL(initial_count), .waiting_tasks = QUEUE_INIT((name).waiting_tasks)}
+#define SEMAPHORE_INIT(name, initial_count)                                                    \
+    {.count = (initial_count), .wait = WAIT_QUEUE_INIT((name).wait, BLOCK_REASON_LOCK_WAIT) \
+                                   LOCKSTAT_INIT()}
 
-#define MUTEX_INIT(name) {.sem = SEMAPHORE_INIT((name).sem, 1)}
+#define MUTEX_INIT(name) \
+    {.owner = NULL, .wait = WAIT_QUEUE_INIT((name).wait, BLOCK_REASON_LOCK_WAIT) LOCKSTAT_INIT()}
+
+#define CONDVAR_INIT(name) {.wait = WAIT_QUEUE_INIT((name).wait, BLOCK_REASON_LOCK_WAIT)}
+
+#define RWLOCK_INIT(name) \
+    {.readers = 0, .writer = NULL, .wait = WAIT_QUEUE_INIT((name).wait, BLOCK_REASON_LOCK_WAIT)}
+
+#define RW_SPINLOCK_INIT() {.state = 0}
+
+#define SEQCOUNT_INIT() {.sequence = 0}
+
+#define SEQLOCK_INIT() {.seq = SEQCOUNT_INIT(), .lock = SPINLOCK_INIT()}
 
 /* Initialise a staticly allocated semaphore */
 #define SEMAPHORE_DEFINE(name, count) semaphore_t name = SEMAPHORE_INIT(name, count)
@@ -21,19 +38,101 @@
 /* Initialise a staticly allocated mutex */
 #define MUTEX_DEFINE(name) mutex_t name = MUTEX_INIT(name)
 
-/* Semaphore lock */
+/* Initialise a staticly allocated condition variable */
+#define CONDVAR_DEFINE(name) condvar_t name = CONDVAR_INIT(name)
+
+/* Initialise a staticly allocated reader-writer lock */
+#define RWLOCK_DEFINE(name) rwlock_t name = RWLOCK_INIT(name)
+
+/* Initialise a staticly allocated reader-writer spinlock */
+#define RW_SPINLOCK_DEFINE(name) struct rw_spinlock name = RW_SPINLOCK_INIT()
+
+/* Initialise a staticly allocated sequence counter */
+#define SEQCOUNT_DEFINE(name) seqcount_t name = SEQCOUNT_INIT()
+
+/* Initialise a staticly allocated sequence lock */
+#define SEQLOCK_DEFINE(name) seqlock_t name = SEQLOCK_INIT()
+
+/*
+    Semaphore lock, a signal hands the unit directly to the longest waiting task rather than
+    incrementing the count, so a running task can't barge in ahead of the waiters.
+*/
 typedef struct semaphore semaphore_t;
 
 struct semaphore {
-    atomic_int_t count;
-    task_queue_t waiting_tasks;
+    int               count;
+    struct wait_queue wait;  // Protects the count
+#ifdef LOCKSTAT
+    struct lockstat_key lockstat;
+#endif
 };
 
-/* Mutex lock, like a semaphore of size 1 but with a nicer interface */
+/*
+    Mutex lock, tracks its owner and hands the ownership directly over to the longest waiting task
+    on unlock, ensuring waiters are served in FIFO order.
+*/
 typedef struct mutex mutex_t;
 
 struct mutex {
-    semaphore_t sem;  // internal implemented as a semaphore of count 1
+    task_t           *owner;
+    struct wait_queue wait;  // Protects the owner
+#ifdef LOCKSTAT
+    struct lockstat_key lockstat;
+#endif
+};
+
+/* Condition variable, always used together with a mutex protecting the condition */
+typedef struct condvar condvar_t;
+
+struct condvar {
+    struct wait_queue wait;
+};
+
+/*
+    Sleeping reader-writer lock, allowing multiple readers or a single writer. Prefers writers, new
+    readers queue up behind a waiting writer rather than starving it. On unlock the lock is handed
+    over to the first waiting writer, or to the readers at the front of the queue.
+*/
+typedef struct rwlock rwlock_t;
+
+struct rwlock {
+    int               readers;  // The number of readers holding the lock
+    task_t           *writer;
+    struct wait_queue wait;  // Protects the readers and writer fields
+};
+
+/*
+    Spinning reader-writer lock, like the spinlock it disables interrupts and works in both irq and
+    thread context. A waiting writer stops new readers from taking the lock.
+*/
+struct rw_spinlock {
+    unsigned int state;  // Reader count together with the writer bits
+};
+
+/*
+    Sequence counter, lets readers of data that is rarely written run without taking any lock.
+    Writers, which must be serialised by other means, make the counter odd while updating the data,
+    and readers retry if the counter changed during their read, e.g.
+
+    do {
+        seq  = read_seqcount_begin(&seqcount);
+        copy = data;
+    } while (read_seqcount_retry(&seqcount, seq));
+
+    Readers must not dereference pointers read within the section, since they may be torn.
+*/
+typedef struct seqcount seqcount_t;
+
+struct seqcount {
+    unsigned int sequence;
+};
+
+/* Sequence counter whose writers are serialised by a spinlock */
+typedef struct seqlock seqlock_t;
+
+struct seqlock {
+    seqcount_t      seq;
+    struct spinlock lock;
 };
 
 /* Allocate and initialise a semaphore */
@@ -54,4 +153,96 @@ void mutex_lock(mutex_t *mutex);
 /* Unlock mutex */
 void mutex_unlock(mutex_t *mutex);
 
+/* Checks if the mutex is held by the current task */
+bool mutex_is_held(mutex_t *mutex);
+
+/* Atomically unlocks the mutex and waits for the condition variable to be signaled, the mutex is
+ * locked again before returning */
+void condvar_wait(condvar_t *cond, mutex_t *mutex);
+
+/* Like condvar_wait() but gives up after timeout_ns, returns false on timeout */
+bool condvar_wait_timeout(condvar_t *cond, mutex_t *mutex, uint64_t timeout_ns);
+
+/* Wakes up one task waiting on the condition variable */
+void condvar_signal(condvar_t *cond);
+
+/* Wakes up all tasks waiting on the condition variable */
+void condvar_broadcast(condvar_t *cond);
+
+/* Allocate and initialise a reader-writer lock */
+rwlock_t *rwlock_create();
+
+/* Lock for reading, must be called in a sleepable context */
+void rwlock_read_lock(rwlock_t *rwlock);
+
+/* Unlock after reading */
+void rwlock_read_unlock(rwlock_t *rwlock);
+
+/* Lock for writing, must be called in a sleepable context */
+void rwlock_write_lock(rwlock_t *rwlock);
+
+/* Unlock after writing */
+void rwlock_write_unlock(rwlock_t *rwlock);
+
+/* Lock for reading */
+void rw_spinlock_read_lock(struct rw_spinlock *lock, uint32_t *irqflags);
+
+/* Unlock after reading */
+void rw_spinlock_read_unlock(struct rw_spinlock *lock, uint32_t irqflags);
+
+/* Lock for writing */
+void rw_spinlock_write_lock(struct rw_spinlock *lock, uint32_t *irqflags);
+
+/* Unlock after writing */
+void rw_spinlock_write_unlock(struct rw_spinlock *lock, uint32_t irqflags);
+
+/* Starts a read section, returns the sequence to pass to read_seqcount_retry() */
+static inline unsigned int read_seqcount_begin(const seqcount_t *s)
+{
+    unsigned int seq;
+
+    while ((seq = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE)) & 1) {
+        arch_cpu_relax();
+    }
+    return seq;
+}
+
+/* Ends a read section, returns true if a writer interfered and the read must be retried */
+static inline bool read_seqcount_retry(const seqcount_t *s, unsigned int seq)
+{
+    mem_barrier_acquire();
+    return __atomic_load_n(&s->sequence, __ATOMIC_RELAXED) != seq;
+}
+
+/* Starts a write section, writers must be serialised and not be interrupted by readers */
+static inline void write_seqcount_begin(seqcount_t *s)
+{
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+    mem_barrier_release();
+}
+
+/* Ends a write section */
+static inline void write_seqcount_end(seqcount_t *s)
+{
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELEASE);
+}
+
+/* Starts a read section of a sequence lock */
+static inline unsigned int read_seqbegin(const seqlock_t *sl)
+{
+    return read_seqcount_begin(&sl->seq);
+}
+
+/* Ends a read section of a sequence lock, returns true if the read must be retried */
+static inline bool read_seqretry(const seqlock_t *sl, unsigned int seq)
+{
+    return read_seqcount_retry(&sl->seq, seq);
+}
+
+/* Takes the sequence lock for writing */
+void write_seqlock(seqlock_t *sl, uint32_t *irqflags);
+
+/* Releases the sequence lock */
+void write_sequnlock(seqlock_t *sl, uint32_t irqflags);
+
 #endif /* TASK_LOCKING_H */
@@ -0,0 +1,104 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifndef TASKS_LOCKSTAT_H
+#define TASKS_LOCKSTAT_H
+#include <stdint.h>
+
+/*
+    Lock statistics - per lock class accounting of acquisitions, contentions, wait and hold times
+
+    Compiled out unless the kernel is built with LOCKSTAT defined. Locks are grouped into classes by
+    type and the source location where they are initialised, so all locks initialised by the same
+    line share statistics. The results are published in /kinfo/lockstat.
+
+    Hold times are only tracked for spinlocks and mutexes, a semaphore can have several holders at
+    once and isn't released by the holder, so there's no hold time to report for it.
+*/
+
+/* Lock types tracked by lockstat */
+enum lock_type {
+    LOCK_TYPE_SPINLOCK,
+    LOCK_TYPE_MUTEX,
+    LOCK_TYPE_SEMAPHORE,
+    N_LOCK_TYPES,
+};
+
+#ifdef LOCKSTAT
+
+#define LOCKSTAT_HIST_BUCKETS 8  // Power of 4 buckets in us, from <1 us to >=4 ms
+#define LOCKSTAT_CALL_SITES   4  // Number of top contending call sites tracked per class
+
+/* Passed as the wait start to lockstat_acquired() when the lock was free */
+#define LOCKSTAT_UNCONTENDED UINT64_MAX
+
+struct lock_call_site {
+    uintptr_t ip;
+    uint32_t  count;
+};
+
+/* Statistics shared by all locks of a class */
+struct lock_class {
+    const char    *name;
+    enum lock_type type;
+    unsigned int   busy;  // Protects the statistics
+
+    uint32_t acquisitions;
+    uint32_t contentions;
+    uint64_t wait_total_ns;
+    uint64_t wait_max_ns;
+    uint64_t hold_total_ns;
+    uint64_t hold_max_ns;
+    uint32_t wait_hist[LOCKSTAT_HIST_BUCKETS];
+    uint32_t hold_hist[LOCKSTAT_HIST_BUCKETS];
+
+    struct lock_call_site call_sites[LOCKSTAT_CALL_SITES];
+};
+
+/* Embedded into each lock, the class is looked up upon the first acquisition */
+struct lockstat_key {
+    const char        *name;
+    struct lock_class *class;
+    uint64_t           acquired_at;  // Not used by semaphores, which have no single holder
+};
+
+#define __LOCKSTAT_STR(x)  #x
+#define __LOCKSTAT_XSTR(x) __LOCKSTAT_STR(x)
+
+/* Appended to the lock initialisers, naming the class after the initialising source line */
+#define LOCKSTAT_INIT() , .lockstat = {.name = __FILE__ ":" __LOCKSTAT_XSTR(__LINE__)}
+
+/* Timestamp used for the wait start */
+uint64_t lockstat_now();
+
+/* Records an acquisition, contended unless wait_start is LOCKSTAT_UNCONTENDED */
+void __lockstat_acquired(struct lockstat_key *key, enum lock_type type, uint64_t wait_start,
+                         uintptr_t ip);
+
+/* Records the release of a lock held since its last acquisition */
+void __lockstat_released(struct lockstat_key *key);
+
+/* Must be expanded within the lock function, so the caller is recorded as call site */
+#define lockstat_acquired(lock, type, wait_start) \
+    __lockstat_acquired(&(lock)->lockstat, type, wait_start, (uintptr_t)__builtin_return_address(0))
+
+#define lockstat_released(lock) __lockstat_released(&(lock)->lockstat)
+
+#else
+
+#define LOCKSTAT_UNCONTENDED 0
+
+#define LOCKSTAT_INIT()
+
+#define lockstat_now() ((uint64_t)0)
+
+#define lockstat_acquired(lock, type, wait_start) ((void)(wait_start))
+
+#define lockstat_released(lock) ((void)0)
+
+#endif /* LOCKSTAT */
+
+#endif /* TASKS_LOCKSTAT_H */
@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifndef TASKS_RCU_H
+#define TASKS_RCU_H
+
+#include <atomics.h>
+#include <list.h>
+
+/*
+    Read-copy-update - lets readers of read-mostly data run without taking any locks
+
+    Readers mark their critical sections with rcu_read_lock()/rcu_read_unlock(), which only disables
+    preemption, and must neither block nor yield within them. Writers still serialise against each
+    other, but instead of freeing removed objects right away they wait for a grace period, after
+    which no reader can hold a reference to them anymore.
+
+    The implementation is quiescent state based: since readers can't be preempted, block or yield,
+    a cpu passing through the scheduler can't be within a read-side critical section, which the
+    scheduler asserts. A grace period has therefore elapsed once every online cpu has been through
+    the scheduler after it was started. Grace periods and callbacks are driven by the rcu thread,
+    callbacks are therefore invoked in task context.
+*/
+
+/* Embedded into objects which are free'd through call_rcu() */
+struct rcu_head {
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+};
+
+/* Marks the start of a read-side critical section, may be nested */
+void rcu_read_lock();
+
+/* Marks the end of a read-side critical section */
+void rcu_read_unlock();
+
+/* Returns true if the executing cpu is within a read-side critical section */
+bool rcu_read_lock_held();
+
+/*
+    Invokes func once a grace period has elapsed, i.e. once all read-side critical sections that
+    may hold a reference to the object has ended. Must be called in task context.
+*/
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+
+/* Blocks until a grace period has elapsed, must be called in a sleepable context */
+void synchronize_rcu();
+
+/* Starts the rcu thread */
+void rcu_init();
+
+/* Reads a pointer protected by rcu, only valid within a read-side critical section */
+#define rcu_dereference(ptr) __atomic_load_n(&(ptr), __ATOMIC_CONSUME)
+
+/* Publishes a pointer to readers, ensuring the pointed to object is initialised beforehand */
+#define rcu_assign_pointer(ptr, val) __atomic_store_n(&(ptr), (val), __ATOMIC_RELEASE)
+
+#endif /* TASKS_RCU_H */
@@ -8,8 +8,31 @@
 #define TASK_SCHEDULER_H
 #include <tasks/task.h>
 
-/* How long is the thread allowed to run before pre-emption */
-#define TIME_SLICE_NS 50000000 /* 50 ms */
+/* How long is a priority task allowed to run before pre-emption, scaled by its priority level */
+#define TIME_SLICE_BASE_NS 10000000u /* 10 ms */
+
+/* Gives the time slice of the supplied priority level */
+#define TIME_SLICE_NS(priority) (TIME_SLICE_BASE_NS * ((priority) + 1))
+
+/* The period in which every ready fair task should get to run, divided according to their weight */
+#define SCHED_LATENCY_NS 20000000u /* 20 ms */
+
+/*
+    Default of the minimum granularity knob, the shortest time slice given to a fair task, which
+    stretches the period when there's many of them. It's also the least time a fair task runs
+    before it can be preempted by a woken fair task.
+*/
+#define SCHED_MIN_GRANULARITY_NS 4000000u /* 4 ms */
+
+/* Lower limit of the minimum granularity knob */
+#define SCHED_MIN_GRANULARITY_LOWER_NS 500000u /* 0.5 ms */
+
+/* How long a cpu may go without passing through the scheduler, while other tasks are waiting for
+ * it, before the watchdog reports a soft lockup */
+#define SCHED_WATCHDOG_THRESHOLD_NS 2000000000u /* 2 s */
+
+/* How often the watchdog checks the cpus */
+#define SCHED_WATCHDOG_INTERVAL_NS 500000000u /* 500 ms */
 
 /* Initialises the scheduler by setting up the inital boot process */
 void scheduler_init();
@@ -36,4 +59,26 @@ void scheduler_yield();
 /* Terminates the currently running task */
 void scheduler_terminate_task();
 
+/* Sets the minimum granularity knob, returns 0 on success, otherwise -ERRNO */
+int scheduler_set_min_granularity(uint64_t granularity_ns);
+
+/* Sets the nice value of a fair task, returns 0 on success, otherwise -ERRNO */
+int scheduler_set_nice(task_t *task, int nice);
+
+/* Upper limit of the total cpu utilisation of deadline tasks, in percent */
+#define SCHED_DEADLINE_MAX_UTIL 90
+
+/*
+    Turns the current task into a deadline task, guaranteed runtime_ns of cpu time within
+    deadline_ns of the start of each period. Requires runtime <= deadline <= period. Returns 0 on
+    success, -EBUSY if admitting the task would exceed SCHED_DEADLINE_MAX_UTIL, otherwise -ERRNO.
+*/
+int scheduler_set_deadline(uint64_t runtime_ns, uint64_t deadline_ns, uint64_t period_ns);
+
+/* Turns the current deadline task back into a fair task, releasing its reserved utilisation */
+void scheduler_clear_deadline();
+
+/* Lets the current deadline task give up the rest of its runtime, blocking until the next period */
+void scheduler_wait_next_period();
+
 #endif /* TASK_SCHEDULER_H */
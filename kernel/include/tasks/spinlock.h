@@ -6,8 +6,9 @@
 */
 #ifndef TASK_SPINLOCK_H
 #define TASK_SPINLOCK_H
+#include <tasks/lockstat.h>
 
-#define SPINLOCK_INIT()       {.flag = 0}
+#define SPINLOCK_INIT()       {.flag = 0 LOCKSTAT_INIT()}
 #define SPINLOCK_DEFINE(name) struct spinlock name = SPINLOCK_INIT()
 
 /*
@@ -18,13 +19,13 @@
  */
 struct spinlock {
     unsigned int flag;
+#ifdef LOCKSTAT
+    struct lockstat_key lockstat;
+#endif
 };
 
-/* Initialise spinlock */
-static inline void spinlock_init(struct spinlock *spinlock)
-{
-	*spinlock = (struct spinlock)SPINLOCK_INIT();
-}
+/* Initialise spinlock, a macro so the lockstat class is named after the caller */
+#define spinlock_init(lock) (*(lock) = (struct spinlock)SPINLOCK_INIT())
 
 /* Lock spinlock */
 void spinlock_lock(struct spinlock *spinlock, uint32_t *irqflags);
@@ -10,6 +10,8 @@
 #include <atomics.h>
 #include <fs.h>
 #include <list.h>
+#include <rbtree.h>
+#include <tasks/rcu.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <utils.h>
@@ -20,6 +22,26 @@
 /* If set to 1, indicates that the task is currently running an ISR */
 #define TASK_STATUS_INTERRUPT (1 << 1)
 
+/* If set, the task is re-scheduled because it was preempted rather than giving up the cpu */
+#define TASK_STATUS_PREEMPTED (1 << 2)
+
+/* The scheduling classes, deciding how the scheduler picks between ready tasks */
+typedef enum {
+    SCHED_CLASS_FAIR,      // Shares the cpu in proportion to the weight given by the nice value
+    SCHED_CLASS_PRIORITY,  // Strict priority levels, always scheduled before fair tasks
+    SCHED_CLASS_DEADLINE,  // Earliest deadline first, scheduled before all other tasks
+} sched_class_t;
+
+/* Number of scheduling priority levels, level 0 being the most important */
+#define SCHED_PRIORITY_LEVELS 8
+
+/* Range of nice values for fair tasks, a lower nice value gives a larger share of the cpu */
+#define NICE_MIN -20
+#define NICE_MAX 19
+
+/* The weight of a fair task with nice value 0 */
+#define SCHED_NICE_0_WEIGHT 1024
+
 /* The possible state a task can be in */
 typedef enum {
     READY_TO_RUN,
@@ -35,15 +57,41 @@ typedef enum {
     BLOCK_REASON_LOCK_WAIT,
     BLOCK_REASON_IO_WAIT,
     BLOCK_REASON_TERMINATED,
+    BLOCK_REASON_DEADLINE_WAIT,
     BLOCK_REASON_MAX,
 } block_reason_t;
 
 // Temporary solution? I see two options 1: Merge headers, 2: Forward reference
 typedef struct task_queue task_queue_t;
 
+struct fiber;
+
 /* Number identify an existing task */
 typedef unsigned int tid_t;
 
+/*
+    Parameters of deadline tasks. Each period the task is guaranteed runtime ns of cpu time before
+    the relative deadline, but it is throttled once the runtime is used up.
+*/
+struct sched_deadline {
+    uint64_t runtime;
+    uint64_t deadline;
+    uint64_t period;
+
+    uint64_t abs_deadline;  // Deadline of the current instance, orders the deadline runqueue
+    uint64_t remaining;     // Runtime left of the current instance
+    uint64_t next_period;   // When the next instance starts
+};
+
+/* Scheduling statistics of a task, exposed through /kinfo/sched/tasks */
+struct sched_stats {
+    uint64_t last_change;                     // When the task last changed state
+    uint64_t wait_time;                       // Time spent ready to run in a runqueue
+    uint64_t blocked_time[BLOCK_REASON_MAX];  // Time spent blocked, per reason
+    uint32_t nr_voluntary_switches;           // Times the task blocked or yielded the cpu
+    uint32_t nr_involuntary_switches;         // Times the task was preempted
+};
+
 /*
     The task control block which stores all relevant data for each task (thread or process). This is
     the primary data structured used by the scheduler.
@@ -59,6 +107,7 @@ struct task {
 
     atomic_uint_t     ref_count;  // To ensure that the task isn't killed when the object is in use
     struct list_entry task_list_entry;  // Global list of all tasks
+    struct rcu_head   rcu;              // Defers the freeing until lookups are done with the task
 
     // kernel stack allocation information
     uintptr_t kstack_bottom;
@@ -70,6 +119,21 @@ struct task {
     uint64_t       time_used;     // Allows us to have time statistics
     uint8_t        status;        // Task status flags
 
+    // Scheduling parameters
+    uint8_t        sched_class;  // See sched_class_t
+    uint8_t        priority;     // Priority level of priority tasks, 0 to SCHED_PRIORITY_LEVELS - 1
+    int8_t         nice;         // Nice value of fair tasks, NICE_MIN to NICE_MAX
+    uint32_t       weight;       // Weight of fair tasks, derived from the nice value
+    uint64_t       vruntime;     // Time used scaled by the inverse of the weight, in ns
+    struct rb_node run_node;     // Entry within the fair or deadline runqueue
+    struct sched_deadline dl;    // Parameters of deadline tasks
+    unsigned int   cpu;          // The cpu whose runqueue the task is placed in
+    struct sched_stats stats;
+
+    struct fiber* fiber;  // The fiber being run by the task, NULL outside of fibers
+
+    void* fpu_state;  // Saved fpu registers, allocated on first use, see tasks/fpu.h
+
     // File system related data
     struct task_fs_data fs_data;
 };
@@ -93,9 +157,18 @@ assert_offset(struct task, regs, 0);
 #define IS_TERMINATED(task) \
     (task->state == BLOCKED && task->block_reason == BLOCK_REASON_TERMINATED)
 
-/* Creates a new task executing the code at the address ip */
+/* The number of terminated tasks, together with their stacks, kept around for re-use */
+#define TASK_CACHE_SIZE 16
+
+/* The number of task creations served by the task cache */
+uint32_t task_cache_hits();
+
+/* Creates a new fair task executing the code at the address ip */
 tid_t create_task(void* ip);
 
+/* Creates a new priority task with the supplied priority level, returns 0 on failure */
+tid_t create_task_with_priority(void* ip, unsigned int priority);
+
 /* Gives task control block associated to the supplied tid. Needs to call put_task() when do to
  * allow it to be properly cleaned up on termination */
 task_t* get_task(tid_t tid);
@@ -22,6 +22,13 @@ typedef struct task_queue {
 /* Initialise an empty task queue */
 #define EMPTY_QUEUE(name) task_queue_t name = QUEUE_INIT(name)
 
+/* Initialise an empty task queue at runtime */
+static inline void task_queue_init(task_queue_t* queue)
+{
+    spinlock_init(&queue->lock);
+    list_init(&queue->list);
+}
+
 /* Check if the task queue is empty */
 #define TASK_QUEUE_EMPTY(queue_ptr) LIST_EMPTY(&(queue_ptr)->list)
 
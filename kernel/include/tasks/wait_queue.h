@@ -0,0 +1,114 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifndef TASKS_WAIT_QUEUE_H
+#define TASKS_WAIT_QUEUE_H
+
+#include <devices/timer.h>
+#include <list.h>
+#include <stdbool.h>
+#include <tasks/fiber.h>
+#include <tasks/scheduler.h>
+#include <tasks/spinlock.h>
+
+/*
+    Wait queues - lets tasks block until an arbitrary condition is fulfilled
+
+    A waiting task adds itself to the queue and is marked as blocked before checking the condition,
+    so a wakeup racing with the check makes it return right away rather than being lost. Waiters
+    are woken in FIFO order, and the waker removes them from the queue, e.g.
+
+    Waiter:                                 Waker:
+    wait_event(&wq, data_available);        data_available = true;
+                                            wake_up(&wq);
+
+    The wait entries live on the waiters stacks, so they don't need to be allocated. Called by a
+    fiber, the wait_event() macros block just the fiber, see tasks/fiber.h.
+*/
+struct wait_queue {
+    struct spinlock lock;
+    struct list     waiters;
+    block_reason_t  reason;  // The block reason reported for the waiting tasks
+};
+
+struct wait_queue_entry {
+    task_t           *task;
+    struct fiber     *fiber;      // Set if the waiter is a fiber of the task
+    struct list_entry entry;
+    bool              woken;      // Set when removed from the queue by a waker
+    bool              exclusive;  // Lets locks tell writers apart from readers
+};
+
+#define WAIT_QUEUE_INIT(name, _reason) \
+    {.lock = SPINLOCK_INIT(), .waiters = LIST_INIT((name).waiters), .reason = (_reason)}
+
+/* Initialise a statically allocated wait queue */
+#define DEFINE_WAIT_QUEUE(name, reason) struct wait_queue name = WAIT_QUEUE_INIT(name, reason)
+
+#define WAIT_QUEUE_ENTRY_INIT(name) \
+    {.task = NULL, .fiber = NULL, .entry = LIST_ENTRY_INIT((name).entry)}
+
+/* Initialise an allocated wait queue, a macro so the lockstat class is named after the caller */
+#define wait_queue_init(wq, reason) \
+    (*(wq) = (struct wait_queue)WAIT_QUEUE_INIT(*(wq), reason))
+
+/*
+    Adds the current task to the queue, unless it's already in it, and marks it as blocked. If
+    deadline is non-zero, the task is woken up at that timestamp. The _locked variant requires the
+    queue lock to be held.
+*/
+void prepare_to_wait(struct wait_queue *wq, struct wait_queue_entry *wait, uint64_t deadline);
+void prepare_to_wait_locked(struct wait_queue *wq, struct wait_queue_entry *wait,
+                            uint64_t deadline);
+
+/* Removes the current task from the queue, if still in it, and makes sure it is runnable again */
+void finish_wait(struct wait_queue *wq, struct wait_queue_entry *wait);
+
+/*
+    Wakes up the first waiting task, returns true if there was one. The _locked variant requires the
+    queue lock to be held.
+*/
+bool wake_up(struct wait_queue *wq);
+bool wake_up_locked(struct wait_queue *wq);
+
+/* Wakes up all waiting tasks */
+void wake_up_all(struct wait_queue *wq);
+
+/*
+    Blocks until cond is true or the deadline, in ns since boot, has passed. A deadline of 0 means
+    no deadline. Evaluates to the final value of cond. Must be called in a sleepable context.
+*/
+#define wait_event_deadline(wq, cond, deadline)                                             \
+    ({                                                                                      \
+        struct wait_queue_entry __wait     = WAIT_QUEUE_ENTRY_INIT(__wait);                 \
+        uint64_t                __deadline = (deadline);                                    \
+        bool                    __done;                                                     \
+                                                                                            \
+        __wait.fiber = fiber_current();                                                     \
+        while (true) {                                                                      \
+            prepare_to_wait((wq), &__wait, __deadline);                                     \
+            if ((__done = (cond)) ||                                                        \
+                (__deadline && timer_get_time_since_boot() >= __deadline)) {                \
+                break;                                                                      \
+            }                                                                               \
+            if (__wait.fiber) {                                                             \
+                fiber_schedule();                                                           \
+            } else {                                                                        \
+                scheduler_yield();                                                          \
+            }                                                                               \
+        }                                                                                   \
+        finish_wait((wq), &__wait);                                                         \
+        __done;                                                                             \
+    })
+
+/* Blocks until cond is true */
+#define wait_event(wq, cond) ((void)wait_event_deadline(wq, cond, 0))
+
+/* Blocks until cond is true or timeout_ns has passed, evaluates to false on timeout */
+#define wait_event_timeout(wq, cond, timeout_ns) \
+    wait_event_deadline(wq, cond, timer_get_time_since_boot() + (timeout_ns))
+
+#endif /* TASKS_WAIT_QUEUE_H */
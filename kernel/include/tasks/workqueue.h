@@ -0,0 +1,125 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifndef TASKS_WORKQUEUE_H
+#define TASKS_WORKQUEUE_H
+#include <list.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <tasks/wait_queue.h>
+
+/*
+    Workqueues - runs functions later in task context
+
+    Work items are queued on a workqueue and executed by a pool of worker threads shared by all
+    workqueues. The pool grows while work is waiting and no worker is idle, up to
+    WORKQUEUE_MAX_WORKERS, and workers idle for WORKQUEUE_IDLE_TIMEOUT_NS exit again. Each
+    workqueue bounds how many of its items may execute concurrently, the rest are held back until
+    one of them completes.
+
+    A work item is only queued once, queueing an already pending item is a no-op. It may be queued
+    again once it starts executing. Queueing and cancelling are safe in any context, the work
+    functions run in task context and may sleep.
+*/
+
+/* Upper limit of the number of worker threads */
+#define WORKQUEUE_MAX_WORKERS 8
+
+/* How long a worker stays idle before exiting, the last worker never exits */
+#define WORKQUEUE_IDLE_TIMEOUT_NS 5000000000ull /* 5 s */
+
+struct work_struct;
+
+typedef void (*work_func_t)(struct work_struct *work);
+
+struct work_struct {
+    struct list_entry  entry;
+    work_func_t        func;
+    struct workqueue  *wq;       // The workqueue the item was last queued on
+    bool               pending;  // Queued but not yet started
+};
+
+/* Work item executed once the delay has passed */
+struct delayed_work {
+    struct work_struct work;
+    struct list_entry  timer_entry;
+    uint64_t           expires;  // Timestamp at which the item is queued
+};
+
+struct workqueue {
+    const char       *name;
+    unsigned int      max_active;  // How many items may execute concurrently
+    unsigned int      nr_active;   // Items queued for or under execution
+    struct list       inactive;    // Items held back by max_active
+    struct list_entry entry;       // Entry in the list of all workqueues
+    struct wait_queue flush_wait;  // Woken once nr_active drops to zero
+    uint32_t          nr_executed;
+};
+
+#define WORK_INIT(name, _func) \
+    {.entry = LIST_ENTRY_INIT((name).entry), .func = (_func), .wq = NULL, .pending = false}
+
+#define DELAYED_WORK_INIT(name, _func) \
+    {.work = WORK_INIT((name).work, _func), .timer_entry = LIST_ENTRY_INIT((name).timer_entry)}
+
+/* Initialise a statically allocated work item */
+#define DEFINE_WORK(name, func) struct work_struct name = WORK_INIT(name, func)
+
+/* Initialise a statically allocated delayed work item */
+#define DEFINE_DELAYED_WORK(name, func) struct delayed_work name = DELAYED_WORK_INIT(name, func)
+
+/* Initialise an allocated work item */
+static inline void work_init(struct work_struct *work, work_func_t func)
+{
+    *work = (struct work_struct)WORK_INIT(*work, func);
+}
+
+/* Initialise an allocated delayed work item */
+static inline void delayed_work_init(struct delayed_work *dwork, work_func_t func)
+{
+    *dwork = (struct delayed_work)DELAYED_WORK_INIT(*dwork, func);
+}
+
+/* Gives the delayed work item embedding the work item */
+#define TO_DELAYED_WORK(work_ptr) GET_STRUCT(struct delayed_work, work, work_ptr)
+
+/* The workqueue used by schedule_work() and schedule_delayed_work() */
+extern struct workqueue *system_wq;
+
+/* Creates a workqueue running at most max_active items concurrently, returns NULL on failure */
+struct workqueue *workqueue_create(const char *name, unsigned int max_active);
+
+/* Cancels the delayed items still waiting for their delay, then flushes and frees the workqueue.
+ * The caller must ensure no more work is queued on it. */
+void workqueue_destroy(struct workqueue *wq);
+
+/* Queues the work item, returns false if it was already pending */
+bool queue_work(struct workqueue *wq, struct work_struct *work);
+
+/* Queues the work item once delay_ns has passed, returns false if it was already pending */
+bool queue_delayed_work(struct workqueue *wq, struct delayed_work *dwork, uint64_t delay_ns);
+
+/* Queues the work item on the system workqueue */
+bool schedule_work(struct work_struct *work);
+
+/* Queues the work item on the system workqueue once delay_ns has passed */
+bool schedule_delayed_work(struct delayed_work *dwork, uint64_t delay_ns);
+
+/* Removes the pending work item, and stops the delay timer of delayed items. Returns false if it
+ * wasn't pending. Doesn't wait for it to complete if it's already executing. */
+bool cancel_work(struct work_struct *work);
+
+/* cancel_work() for delayed work items */
+bool cancel_delayed_work(struct delayed_work *dwork);
+
+/* Blocks until all items queued on the workqueue have completed, must be called in task context.
+ * Delayed items still waiting for their delay are not waited for. */
+void flush_workqueue(struct workqueue *wq);
+
+/* Creates the system workqueue and starts the worker pool */
+void workqueue_init();
+
+#endif /* TASKS_WORKQUEUE_H */
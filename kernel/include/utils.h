@@ -102,10 +102,21 @@ int log(const char *restrict format, ...);
 
 /* kernel heap functions */
 
+/*
+    Heap allocation context flags, tells the heap what the caller is allowed to wait for. kalloc()
+    and krealloc() implies KALLOC_SLEEP.
+*/
+#define KALLOC_SLEEP  (0)       // Task context, the heap may grow to satisfy the request
+#define KALLOC_ATOMIC (1 << 0)  // Irq or atomic context, only served from memory within the heap
+
 /* Does always clear the memory before returning the pointer */
 void *kalloc(size_t size);
+void *kalloc_flags(size_t size, unsigned int flags);
 void  kfree(void *ptr);
+
+/* On failure NULL is returned and the original pointer is left untouched */
 void *krealloc(void *ptr, size_t new_size);
+void *krealloc_flags(void *ptr, size_t new_size, unsigned int flags);
 
 /* sleep functions */
 void sleep(uint64_t seconds);
@@ -9,9 +9,14 @@
 #include <arch/serial.h>
 #include <devices/bus.h>
 #include <devices/device.h>
+#include <devices/timer.h>
 #include <fs.h>
+#include <memory/memblock.h>
 #include <memory/page_frame_manager.h>
+#include <memory/shrinker.h>
+#include <tasks/fpu.h>
 #include <tasks/scheduler.h>
+#include <tasks/workqueue.h>
 #include <utils.h>
 
 #include "kshell.h"
@@ -20,11 +25,19 @@
 void kernel_main(struct boot_data* boot_data)
 {
     kprintf("Starting boot sequence...\n");
+
+    // Must come first, everything needing memory before the page frame manager depends on it
+    memblock_init(boot_data);
     page_frame_manager_init(boot_data);
 
     init_gdt();
+    timer_init();
     init_interrupts();
     scheduler_init();
+    fpu_init();
+    start_interrupt_threads();
+    shrinker_init();
+    workqueue_init();
     init_buses();
     if (arch_initialise_static_devices() < 0) {
         kpanic("Failed to initialise static devices");
@@ -5,14 +5,30 @@
    Copyright (C) 2024 Isak Evaldsson
 */
 #include <arch/paging.h>
+#include <memory/shrinker.h>
 #include <memory/vmem_manager.h>
 #include <stdalign.h>
 #include <stdbool.h>
 #include <tasks/locking.h>
 #include <utils.h>
 
+#if HEAP_TRACE
+#include <devices/timer.h>
+#include <tasks/spinlock.h>
+#endif
+
 /* Enables logging and extra extra validations of the heap data structure to simplify debugging */
+#ifndef DEBUG_HEAP_ALLOCATOR
 #define DEBUG_HEAP_ALLOCATOR 1
+#endif
+
+/*
+    Records every kalloc/kfree/krealloc and streams them over serial, allowing the trace to be
+    replayed on the host by tools/heap-replay.
+*/
+#ifndef HEAP_TRACE
+#define HEAP_TRACE 0
+#endif
 
 /*
     Disable/enable ptr input validation to get better error messages with the cost of slightly
@@ -29,6 +45,16 @@
 #define NPAGES_PER_SEGMENT (16)
 #define SEGMENT_SIZE       (size_t)(NPAGES_PER_SEGMENT * PAGE_SIZE)
 
+/* The space within each segment used by the segment header and boundary tags */
+#define SEGMENT_HEADER_SIZE (2 * sizeof(boundary_tag_t) + sizeof(heap_segment_t))
+
+/*
+    Emergency reserve, the amount of free heap memory that sleepable allocations are not allowed to
+    consume. Instead of dipping into it they grow the heap, leaving the reserve to atomic callers
+    that can't afford to wait for a new heap segment.
+*/
+#define ATOMIC_RESERVE_SIZE (SEGMENT_SIZE / 4)
+
 /*
     Magic number flags
 */
@@ -103,7 +129,17 @@
     * Implement a system of bucketing to speed the process of finding a best fit
     * Try to expand block if possible in realloc
     * Can we improve the fragmentation/locality looking over the free list insertions
-    * If there exits multiple free segments, free some of them
+
+    Allocation context:
+    Callers tell the heap if they are allowed to sleep (KALLOC_SLEEP) or not (KALLOC_ATOMIC). Atomic
+    allocations are only served from memory already within the heap, while sleepable allocations
+    are allowed to grow it. Growing the heap is done without holding the heap lock, so the
+    mapping and clearing of new segments never runs with interrupts disabled.
+
+    Reclaim:
+    The heap registers a shrinker, allowing completely free segments to be given back to the page
+    frame allocator when memory runs low. Segments are only released as long as the emergency
+    reserve is kept intact.
 */
 
 /*
@@ -151,6 +187,9 @@ free_list_t* free_list = NULL;
 /* The linked list of heap segments */
 heap_segment_t* segments = NULL;
 
+/* The number of bytes within free blocks, tags included */
+static size_t free_bytes = 0;
+
 /* Global heat allocator lock */
 static SPINLOCK_DEFINE(global_heap_lock);
 
@@ -241,6 +280,107 @@ static void verify_free_list(const char* file, const char* function, unsigned in
 #define VERIFY_FREE_LIST()
 #endif /* DEBUG_HEAP_ALLOCATOR */
 
+#if HEAP_TRACE
+/*
+    Allocation trace recorder
+
+    Records are placed in a ring buffer and written to serial, one line per record, once enough
+    have been collected:
+
+    HEAPTRACE <op> <timestamp_ns high> <timestamp_ns low> <size> <ptr> <old ptr>
+
+    Where op is a (kalloc), f (kfree) or r (krealloc), all numbers are printed in hex. Pointers
+    are only used as ids, identifying which allocation a free or realloc refers to. If the ring
+    overflows, a "HEAPTRACE d <n>" line reports the number of dropped records.
+
+    The ring decouples recording from the slow serial output, allocations made from irq context
+    while flushing are simply queued behind the records being written.
+*/
+#define HEAP_TRACE_RING_SIZE   256
+#define HEAP_TRACE_FLUSH_LIMIT 32
+
+struct heap_trace_record {
+    uint64_t  timestamp_ns;
+    uintptr_t ptr;
+    uintptr_t old_ptr;
+    size_t    size;
+    char      op;
+};
+
+static struct heap_trace_record trace_ring[HEAP_TRACE_RING_SIZE];
+static size_t                   trace_head     = 0;  // Next slot to write
+static size_t                   trace_tail     = 0;  // Next slot to flush
+static size_t                   trace_dropped  = 0;
+static bool                     trace_flushing = false;
+
+/* Protects the trace ring, separate from the heap lock so flushing never blocks allocations */
+static SPINLOCK_DEFINE(trace_lock);
+
+static void heap_trace_flush()
+{
+    uint32_t                 irqflags;
+    size_t                   dropped;
+    struct heap_trace_record rec;
+
+    spinlock_lock(&trace_lock, &irqflags);
+    if (trace_flushing) {
+        spinlock_unlock(&trace_lock, irqflags);
+        return;
+    }
+    trace_flushing = true;
+
+    while (trace_tail != trace_head) {
+        rec = trace_ring[trace_tail % HEAP_TRACE_RING_SIZE];
+        trace_tail++;
+        dropped       = trace_dropped;
+        trace_dropped = 0;
+
+        // Serial output is slow, don't hold the lock while writing
+        spinlock_unlock(&trace_lock, irqflags);
+        if (dropped) {
+            log("HEAPTRACE d %x", dropped);
+        }
+        log("HEAPTRACE %c %x %x %x %x %x", rec.op, (uint32_t)(rec.timestamp_ns >> 32),
+            (uint32_t)rec.timestamp_ns, rec.size, rec.ptr, rec.old_ptr);
+        spinlock_lock(&trace_lock, &irqflags);
+    }
+
+    trace_flushing = false;
+    spinlock_unlock(&trace_lock, irqflags);
+}
+
+static void heap_trace(char op, size_t size, void* ptr, void* old_ptr)
+{
+    uint32_t irqflags;
+    size_t   pending;
+
+    spinlock_lock(&trace_lock, &irqflags);
+    if (trace_head - trace_tail == HEAP_TRACE_RING_SIZE) {
+        trace_dropped++;
+        spinlock_unlock(&trace_lock, irqflags);
+        return;
+    }
+
+    trace_ring[trace_head % HEAP_TRACE_RING_SIZE] = (struct heap_trace_record){
+        .timestamp_ns = timer_get_time_since_boot(),
+        .ptr          = (uintptr_t)ptr,
+        .old_ptr      = (uintptr_t)old_ptr,
+        .size         = size,
+        .op           = op,
+    };
+    trace_head++;
+    pending = trace_head - trace_tail;
+    spinlock_unlock(&trace_lock, irqflags);
+
+    if (pending >= HEAP_TRACE_FLUSH_LIMIT) {
+        heap_trace_flush();
+    }
+}
+
+#else
+#define heap_trace(op, size, ptr, old_ptr)
+#endif /* HEAP_TRACE */
+
 /*
     Free list helper functions
 */
@@ -282,11 +422,16 @@ static void replace_entry(free_list_t* old, free_list_t* new)
 
 static void append_heap_segment(heap_segment_t* segment)
 {
-    // We should never append to empty list
-    kassert(segments != NULL);
-
     heap_segment_t* seg;
 
+    // The first segment initialises the heap
+    if (segments == NULL) {
+        segment->prev = NULL;
+        segment->next = NULL;
+        segments      = segment;
+        return;
+    }
+
     // Find last segment in list
     for (seg = segments; seg->next != NULL; seg = seg->next) {
         // NOOP
@@ -298,11 +443,39 @@ static void append_heap_segment(heap_segment_t* segment)
     segment->next = NULL;
 }
 
+static void unlink_heap_segment(heap_segment_t* segment)
+{
+    if (segment == segments) {
+        segments = segment->next;
+    }
+
+    if (segment->next != NULL) {
+        segment->next->prev = segment->prev;
+    }
+
+    if (segment->prev != NULL) {
+        segment->prev->next = segment->next;
+    }
+}
+
+/* Gets the start tag of the first block within the segment */
+static start_tag_t* segment_first_block(heap_segment_t* segment)
+{
+    boundary_tag_t* heap_area = (boundary_tag_t*)(segment + 1);
+    return (start_tag_t*)(heap_area + 1);
+}
+
+/* A segment is free when it's made up of a single unallocated block */
+static bool segment_is_free(heap_segment_t* segment)
+{
+    start_tag_t* first = segment_first_block(segment);
+    return (first->size & 0x01) == 0 && first->size == segment->size - SEGMENT_HEADER_SIZE;
+}
+
 static free_list_t* create_entry_for_segment(heap_segment_t* segment)
 {
-    boundary_tag_t* heap_area  = (boundary_tag_t*)(segment + 1);
-    start_tag_t*    list_entry = (start_tag_t*)(heap_area + 1);
-    free_list_t*    head       = (free_list_t*)(list_entry + 1);
+    start_tag_t* list_entry = segment_first_block(segment);
+    free_list_t* head       = (free_list_t*)(list_entry + 1);
     head->next                 = NULL;
     head->prev                 = NULL;
     head->size                 = GET_SIZE(list_entry);
@@ -313,7 +486,7 @@ static free_list_t* create_entry_for_segment(heap_segment_t* segment)
 static heap_segment_t* alloc_heap_segment(size_t size)
 {
     // Adjust the size to fit the boundary tags and segment header
-    size_t header_size = 2 * sizeof(boundary_tag_t) + sizeof(heap_segment_t);
+    size_t header_size = SEGMENT_HEADER_SIZE;
     size_t alloc_size  = ALIGN_BY_MULTIPLE(MAX(size + header_size, SEGMENT_SIZE), (8 * PAGE_SIZE));
     size_t n_8pages    = alloc_size / (8 * PAGE_SIZE);
 
@@ -350,34 +523,26 @@ static heap_segment_t* alloc_heap_segment(size_t size)
     return heap_seg;
 }
 
-static void* internal_alloc(size_t size)
+static void* internal_alloc(size_t size, unsigned int flags)
 {
     uint32_t irqflags;
     if (size == 0) {
         return NULL;
     }
 
-    spinlock_lock(&global_heap_lock, &irqflags);
-
     // The total size need to have space for tags and be able to fit a freelist entry between them.
     // It also need to be mutiple of alignment so the object after it starts at an aligned address.
     size_t total = ALIGN_BY_MULTIPLE(MAX(size, sizeof(free_list_t)) + TAGS_SIZE, ALIGNMENT);
 
-    // Init heap
-    if (segments == NULL) {
-        segments = alloc_heap_segment(total);
-        if (segments == NULL) {
-            spinlock_unlock(&global_heap_lock, irqflags);
-            return NULL;  // out of memory
-        }
-
-        // Place free list data after the start tag of the free block
-        free_list_t* head = create_entry_for_segment(segments);
-        free_list         = head;
-    }
+    spinlock_lock(&global_heap_lock, &irqflags);
 
 search_free_list:
 
+    // Sleepable callers are not allowed to eat into the emergency reserve, grow the heap instead
+    if (!(flags & KALLOC_ATOMIC) && free_bytes < total + ATOMIC_RESERVE_SIZE) {
+        goto grow_heap;
+    }
+
     // Iterate over the free list
     for (free_list_t* entry = free_list; entry != NULL; entry = entry->next) {
         // Found our candidate
@@ -424,6 +589,8 @@ search_free_list:
                 unlink_entry(entry);
             }
 
+            free_bytes -= GET_SIZE(start);
+
             // Mark tags
             start->size |= 0x01;
             end->size |= 0x01;
@@ -441,13 +608,24 @@ search_free_list:
         }
     }
 
-    // No free block of suitable since available, lets request a new one
-    heap_segment_t* new_seg = alloc_heap_segment(total);
-    if (new_seg == NULL) {
+grow_heap:
+
+    // Atomic callers can't wait for the heap to grow
+    if (flags & KALLOC_ATOMIC) {
         spinlock_unlock(&global_heap_lock, irqflags);
-        LOG("Failed to allocate %u (requested %u): failed to alloc heap segment", size, total);
+        LOG("Failed to allocate %u (requested %u): no free block for atomic request", total, size);
+        return NULL;
+    }
+
+    // No free block of suitable since available, lets request a new one. Mapping and clearing the
+    // segment is slow, so it's done without holding the lock.
+    spinlock_unlock(&global_heap_lock, irqflags);
+    heap_segment_t* new_seg = alloc_heap_segment(total + ATOMIC_RESERVE_SIZE);
+    if (new_seg == NULL) {
+        LOG("Failed to allocate %u (requested %u): failed to alloc heap segment", total, size);
         return NULL;  // failed to request more memory
     }
+    spinlock_lock(&global_heap_lock, &irqflags);
 
     append_heap_segment(new_seg);
 
@@ -461,17 +639,13 @@ search_free_list:
     if (prev_head != NULL) {
         prev_head->prev = new_entry;
     }
+    free_bytes += new_entry->size;
 
     // Re-do search with our new block
     goto search_free_list;
-
-    // should not be reached
-    LOG("Failed to allocate %u (requested %u): no free blocks after segment alloc", size, total);
-    kassert(false);
-    return NULL;
 }
 
-void kfree(void* ptr)
+static void internal_free(void* ptr)
 {
     uint32_t irqflags;
     LOG("freeing %x", ptr);
@@ -500,6 +674,7 @@ void kfree(void* ptr)
     // Clear allocation bit
     start->size ^= 0x01;
     end->size ^= 0x01;
+    free_bytes += GET_SIZE(start);
 
     // Get the sounding blocks
     start_tag_t* next_block_start = (start_tag_t*)(end + 1);
@@ -581,27 +756,39 @@ void kfree(void* ptr)
     spinlock_unlock(&global_heap_lock, irqflags);
 }
 
-void* kalloc(size_t size)
+void kfree(void* ptr)
+{
+    heap_trace('f', 0, ptr, NULL);
+    internal_free(ptr);
+}
+
+void* kalloc_flags(size_t size, unsigned int flags)
 {
     void* ret;
 
-    ret = internal_alloc(size);
+    ret = internal_alloc(size, flags);
     if (ret != NULL) {
         memset(ret, 0, size);
     }
+    heap_trace('a', size, ret, NULL);
     return ret;
 }
 
-void* krealloc(void* ptr, size_t new_size)
+void* kalloc(size_t size)
 {
-    LOG("krealloc(%x, %u)", ptr, new_size);
+    return kalloc_flags(size, KALLOC_SLEEP);
+}
+
+static void* internal_realloc(void* ptr, size_t new_size, unsigned int flags)
+{
+    LOG("krealloc(%x, %u, %x)", ptr, new_size, flags);
 
     if (ptr == NULL) {
-        return internal_alloc(new_size);
+        return internal_alloc(new_size, flags);
     }
 
     if (new_size == 0) {
-        kfree(ptr);
+        internal_free(ptr);
         return NULL;
     }
 
@@ -628,12 +815,93 @@ void* krealloc(void* ptr, size_t new_size)
         // TODO: check if the next block is free and of sufficient size before allocating a new
         // pointer
 
-        ret_ptr = internal_alloc(new_size);
-        if (ret_ptr != NULL) {
-            memcpy(ret_ptr, ptr, size);
+        ret_ptr = internal_alloc(new_size, flags);
+        if (ret_ptr == NULL) {
+            // Like libc realloc, the original pointer is left untouched on failure
+            return NULL;
         }
-        kfree(ptr);
+        memcpy(ret_ptr, ptr, size);
+        internal_free(ptr);
     }
 
     return ret_ptr;
 }
+
+void* krealloc_flags(void* ptr, size_t new_size, unsigned int flags)
+{
+    void* ret;
+
+    ret = internal_realloc(ptr, new_size, flags);
+    heap_trace('r', new_size, ret, ptr);
+    return ret;
+}
+
+void* krealloc(void* ptr, size_t new_size)
+{
+    return krealloc_flags(ptr, new_size, KALLOC_SLEEP);
+}
+
+/* The number of pages the heap could give back without touching the emergency reserve */
+static size_t heap_shrinker_count(struct shrinker* shrinker)
+{
+    (void)shrinker;
+    uint32_t        irqflags;
+    size_t          count = 0;
+    size_t          avail = 0;
+    heap_segment_t* seg;
+
+    spinlock_lock(&global_heap_lock, &irqflags);
+    if (free_bytes > ATOMIC_RESERVE_SIZE) {
+        avail = free_bytes - ATOMIC_RESERVE_SIZE;
+    }
+
+    for (seg = segments; seg != NULL; seg = seg->next) {
+        if (segment_is_free(seg) && seg->size - SEGMENT_HEADER_SIZE <= avail) {
+            avail -= seg->size - SEGMENT_HEADER_SIZE;
+            count += seg->size / PAGE_SIZE;
+        }
+    }
+    spinlock_unlock(&global_heap_lock, irqflags);
+
+    return count;
+}
+
+/* Releases free segments until nr_pages are freed or no more segments can be released */
+static size_t heap_shrinker_scan(struct shrinker* shrinker, size_t nr_pages)
+{
+    (void)shrinker;
+    uint32_t        irqflags;
+    size_t          freed = 0;
+    heap_segment_t* seg;
+    heap_segment_t* next;
+
+    while (freed < nr_pages) {
+        spinlock_lock(&global_heap_lock, &irqflags);
+        for (seg = segments; seg != NULL; seg = next) {
+            next        = seg->next;
+            size_t size = seg->size - SEGMENT_HEADER_SIZE;
+
+            if (segment_is_free(seg) && free_bytes >= size + ATOMIC_RESERVE_SIZE) {
+                unlink_entry((free_list_t*)(segment_first_block(seg) + 1));
+                unlink_heap_segment(seg);
+                free_bytes -= size;
+                break;
+            }
+        }
+        VERIFY_FREE_LIST();
+        spinlock_unlock(&global_heap_lock, irqflags);
+
+        if (seg == NULL) {
+            break;
+        }
+
+        // The segment is no longer reachable, unmapping it can be done without the lock
+        LOG("Releasing segment %x of size %u", seg, seg->size);
+        freed += seg->size / PAGE_SIZE;
+        vmem_free_pages((virtaddr_t)seg, (unsigned int)(seg->size / (8 * PAGE_SIZE)));
+    }
+
+    return freed;
+}
+
+DEFINE_SHRINKER(heap, heap_shrinker_count, heap_shrinker_scan);
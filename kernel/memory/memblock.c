@@ -0,0 +1,170 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#include <arch/paging.h>
+#include <memory/memblock.h>
+#include <uapi/errno.h>
+#include <utils.h>
+
+#define LOG_MEMBLOCK 0
+
+#define LOG(fmt, ...) __LOG(LOG_MEMBLOCK, "[MEMBLOCK]", fmt, ##__VA_ARGS__)
+
+/* The maximum number of reserved ranges, only a handful of early allocations are expected */
+#define MEMBLOCK_RESERVED_MAX 16
+
+/*
+    Early allocations are mapped into the higher half, where only the boot page table exists, see
+    boot.S. They must therefore be served from the first 4 MiB of physical memory.
+*/
+#define MEMBLOCK_ALLOC_LIMIT (4 * 1024 * 1024)
+
+/* Only low memory, which can be mapped into the higher half, is handed over to the kernel */
+#define LOWMEM_END ((uint64_t)UINT32_MAX + 1 - HIGHER_HALF_ADDR)
+
+#define PAGE_ROUND_DOWN(addr) ((addr) & ~((typeof(addr))PAGE_SIZE - 1))
+#define PAGE_ROUND_UP(addr)   PAGE_ROUND_DOWN((addr) + PAGE_SIZE - 1)
+
+static memory_segment_t memory_segments[MEMMAP_SEGMENT_MAX];
+static size_t           n_memory_segments = 0;
+
+static memory_segment_t reserved_segments[MEMBLOCK_RESERVED_MAX];
+static size_t           n_reserved_segments = 0;
+
+static bool retired = false;
+
+/* Returns the reserved segment overlapping the range, or NULL if none does */
+static memory_segment_t *find_overlap(physaddr_t addr, size_t length)
+{
+    memory_segment_t *res;
+
+    for (res = reserved_segments; res < reserved_segments + n_reserved_segments; res++) {
+        if (addr < res->addr + res->length && res->addr < addr + length) {
+            return res;
+        }
+    }
+    return NULL;
+}
+
+/*
+    Initialises memblock from the boot data, reserving the kernel image and initrd. Must be called
+    first thing during boot, before anything doing early allocations.
+*/
+void memblock_init(struct boot_data *boot_data)
+{
+    uint64_t start, end;
+
+    // Only whole pages within the available segments can be used
+    for (size_t i = 0; i < boot_data->mmap_size; i++) {
+        memory_segment_t *seg = boot_data->mmap_segments + i;
+
+        start = PAGE_ROUND_UP((uint64_t)seg->addr);
+        end   = PAGE_ROUND_DOWN(MIN((uint64_t)seg->addr + seg->length, LOWMEM_END));
+        if (end <= start) {
+            continue;
+        }
+
+        memory_segments[n_memory_segments++] = (memory_segment_t){
+            .addr   = (physaddr_t)start,
+            .length = (size_t)(end - start),
+        };
+    }
+
+    // The init section is released at boot, see boot/init.c
+    kassert(!memblock_reserve(KERNEL_START, INIT_SECTION_START - HIGHER_HALF_ADDR - KERNEL_START));
+    if (boot_data->initrd_size) {
+        kassert(!memblock_reserve(boot_data->initrd_start, boot_data->initrd_size));
+    }
+}
+
+/* Marks the physical range as reserved, returns 0 on success, otherwise -ERRNO */
+int memblock_reserve(physaddr_t addr, size_t length)
+{
+    if (n_reserved_segments >= MEMBLOCK_RESERVED_MAX) {
+        LOG("No space left to reserve %x-%x", addr, addr + length);
+        return -ENOMEM;
+    }
+
+    reserved_segments[n_reserved_segments++] = (memory_segment_t){
+        .addr   = PAGE_ROUND_DOWN(addr),
+        .length = PAGE_ROUND_UP(addr + length) - PAGE_ROUND_DOWN(addr),
+    };
+    return 0;
+}
+
+/*
+    Allocates size bytes (rounded up to whole pages) of cleared and mapped low memory, returns the
+    virtual address or NULL on failure.
+*/
+void *memblock_alloc(size_t size)
+{
+    physaddr_t        addr;
+    memory_segment_t *seg, *res;
+
+    if (retired) {
+        kpanic("memblock_alloc() called after the page frame manager took over");
+    }
+
+    size = PAGE_ROUND_UP(size);
+    if (size == 0) {
+        return NULL;
+    }
+
+    // First fit, skipping past any reserved ranges within the segment
+    for (seg = memory_segments; seg < memory_segments + n_memory_segments; seg++) {
+        addr = seg->addr;
+
+        while (addr + size <= seg->addr + seg->length && addr + size <= MEMBLOCK_ALLOC_LIMIT) {
+            res = find_overlap(addr, size);
+            if (res == NULL) {
+                goto found;
+            }
+            addr = res->addr + res->length;
+        }
+    }
+
+    LOG("Failed to allocate %u bytes", size);
+    return NULL;
+
+found:
+    if (memblock_reserve(addr, size) < 0) {
+        return NULL;
+    }
+
+    for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        map_page(addr + offset, P2L(addr + offset), PAGE_OPTION_WRITABLE);
+    }
+    memset((void *)P2L(addr), 0, size);
+
+    LOG("Allocated %u bytes at %x", size, addr);
+    return (void *)P2L(addr);
+}
+
+memory_segment_t *memblock_memory_segments()
+{
+    return memory_segments;
+}
+
+memory_segment_t *memblock_memory_end()
+{
+    return memory_segments + n_memory_segments;
+}
+
+memory_segment_t *memblock_reserved_segments()
+{
+    return reserved_segments;
+}
+
+memory_segment_t *memblock_reserved_end()
+{
+    return reserved_segments + n_reserved_segments;
+}
+
+/* Called once the page frame manager has taken over the memory, further allocations will panic */
+void memblock_retire()
+{
+    retired = true;
+}
@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#include <memory/mempool.h>
+#include <uapi/errno.h>
+#include <utils.h>
+
+#define LOG_MEMPOOL 0
+
+#define LOG(fmt, ...) __LOG(LOG_MEMPOOL, "[MEMPOOL]", fmt, ##__VA_ARGS__)
+
+/* Reserved objects are linked through their first word */
+struct reserved_obj {
+    struct reserved_obj *next;
+};
+
+static void push_reserve(struct mempool *pool, void *obj)
+{
+    struct reserved_obj *r = obj;
+
+    r->next       = pool->reserve;
+    pool->reserve = r;
+    pool->curr_nr++;
+}
+
+static void *pop_reserve(struct mempool *pool)
+{
+    struct reserved_obj *r = pool->reserve;
+
+    if (r) {
+        pool->reserve = r->next;
+        pool->curr_nr--;
+    }
+    return r;
+}
+
+/*
+    Initialises a mempool reserving min_nr objects of size obj_size. Must be called from a sleepable
+    context. Returns 0 on success, otherwise -ERRNO.
+*/
+int mempool_init(struct mempool *pool, unsigned int min_nr, size_t obj_size)
+{
+    void *obj;
+
+    if (obj_size < sizeof(struct reserved_obj)) {
+        obj_size = sizeof(struct reserved_obj);
+    }
+
+    spinlock_init(&pool->lock);
+    pool->obj_size = obj_size;
+    pool->min_nr   = min_nr;
+    pool->curr_nr  = 0;
+    pool->reserve  = NULL;
+
+    // No need to lock, the pool is not yet visible to anyone else
+    while (pool->curr_nr < min_nr) {
+        obj = kalloc_flags(obj_size, KALLOC_SLEEP);
+        if (!obj) {
+            mempool_destroy(pool);
+            return -ENOMEM;
+        }
+        push_reserve(pool, obj);
+    }
+
+    return 0;
+}
+
+/* Frees all reserved objects, all objects allocated from the pool must be returned beforehand */
+void mempool_destroy(struct mempool *pool)
+{
+    void *obj;
+
+    while ((obj = pop_reserve(pool))) {
+        kfree(obj);
+    }
+}
+
+/*
+    Allocates a cleared object from the pool, flags is passed to the heap (see KALLOC_*). Returns
+    NULL if both the heap and the reserve are exhausted.
+*/
+void *mempool_alloc(struct mempool *pool, unsigned int flags)
+{
+    uint32_t irqflags;
+    void    *obj;
+
+    obj = kalloc_flags(pool->obj_size, flags);
+    if (obj) {
+        return obj;
+    }
+
+    spinlock_lock(&pool->lock, &irqflags);
+    obj = pop_reserve(pool);
+    spinlock_unlock(&pool->lock, irqflags);
+
+    if (!obj) {
+        LOG("pool %x exhausted", pool);
+        return NULL;
+    }
+
+    LOG("served %x from reserve of %x, %u left", obj, pool, pool->curr_nr);
+    memset(obj, 0, pool->obj_size);
+    return obj;
+}
+
+/* Returns an object to the pool, refilling the reserve if necessary */
+void mempool_free(struct mempool *pool, void *obj)
+{
+    uint32_t irqflags;
+
+    if (!obj) {
+        return;
+    }
+
+    spinlock_lock(&pool->lock, &irqflags);
+    if (pool->curr_nr < pool->min_nr) {
+        push_reserve(pool, obj);
+        spinlock_unlock(&pool->lock, irqflags);
+        return;
+    }
+    spinlock_unlock(&pool->lock, irqflags);
+    kfree(obj);
+}
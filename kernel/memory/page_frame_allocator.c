@@ -5,7 +5,9 @@
    Copyright (C) 2024 Isak Evaldsson
 */
 #include <arch/paging.h>
+#include <memory/memblock.h>
 #include <memory/page_frame_manager.h>
+#include <memory/shrinker.h>
 #include <stdbool.h>
 #include <tasks/locking.h>
 #include <utils.h>
@@ -18,10 +20,16 @@
 #define BITMAP_INDX(fnum)  ((fnum) >> 3)  // Division by 8
 #define BITMAP_BIT(fnum)   ((fnum) % 8)
 
+#define BITMAP_WORD_BITS 32
+#define BITMAP_ROUND_UP(fnum) \
+    (((fnum) + BITMAP_WORD_BITS - 1) & ~((typeof(fnum))BITMAP_WORD_BITS - 1))
+
 // Bitmap marking available page frames with a 1, not that fast (O(N) allocation) or space efficient
-// but simple to implement. Currently only stores the first 512 MiB of memory, i.e. low memory
-// exclusive for the kernel
-static unsigned char memory_bitmap[65536];
+// but simple to implement. Allocated through memblock at boot and sized by the amount of low memory,
+// i.e. memory exclusive for the kernel. The size is a multiple of 4 bytes, allowing the bitmap to
+// be accessed one word at the time.
+static unsigned char *memory_bitmap = NULL;
+static size_t         bitmap_size   = 0;
 
 // Speeds up the bitmap search procedure by not always beginning at index 0
 static uint32_t first_available_frame_idx = 0;
@@ -34,6 +42,14 @@ static size_t n_available_frames = 0;
 static size_t amount_of_memory   = 0;
 static size_t n_frames           = 0;
 
+// Reclaim watermarks, the background reclaim is woken when the number of available frames drops
+// below the low watermark and runs until it reaches the high watermark
+#define LOW_WATERMARK_DIVISOR  32
+#define HIGH_WATERMARK_DIVISOR 16
+
+static size_t low_watermark  = 0;
+static size_t high_watermark = 0;
+
 /*
     Internal data structure dependent functions
 */
@@ -41,7 +57,7 @@ static size_t n_frames           = 0;
 // Gets the availability of a specific page
 static bool check_page_available(uint32_t page_num)
 {
-    unsigned char idx = BITMAP_INDX(page_num);
+    uint32_t      idx = BITMAP_INDX(page_num);
     unsigned char bit = BITMAP_BIT(page_num);
     return MASK_BIT(memory_bitmap[idx], bit);
 }
@@ -49,7 +65,7 @@ static bool check_page_available(uint32_t page_num)
 // Marks page at page_num available/unavailable
 static void mark_page(uint32_t page_num, bool available)
 {
-    unsigned char idx = BITMAP_INDX(page_num);
+    uint32_t      idx = BITMAP_INDX(page_num);
     unsigned char bit = BITMAP_BIT(page_num);
 
     if (available) {
@@ -68,7 +84,7 @@ static void mark_page(uint32_t page_num, bool available)
 
 static void mark_8n_pages(uint32_t page_num, unsigned int n, bool available)
 {
-    unsigned char idx = BITMAP_INDX(page_num);
+    uint32_t      idx = BITMAP_INDX(page_num);
 
     for (size_t i = 0; i < n; i++) {
         if (available) {
@@ -93,7 +109,7 @@ static uint32_t find_available_page()
     size_t i = first_available_frame_idx & ~(0b11);  // round down to multiple of 4
 
     // Increase speed by searching 4 bytes at the time
-    for (; i < sizeof(memory_bitmap); i += 4) {
+    for (; i < bitmap_size; i += 4) {
         uint32_t bytes = *(uint32_t *)(memory_bitmap + i);
         if (bytes > 0) {
             // save the index to speed up future searches
@@ -118,7 +134,7 @@ static uint32_t find_available_8n_pages(unsigned int n)
     size_t i = first_available_frame_idx & ~(0b11);  // round down to multiple of 4
 
     // Increase speed by searching 4 bytes at the time
-    for (; i < sizeof(memory_bitmap); i += 4) {
+    for (; i < bitmap_size; i += 4) {
         uint32_t bytes = *(uint32_t *)(memory_bitmap + i);
 
         // Are there any free bits?
@@ -130,7 +146,7 @@ static uint32_t find_available_8n_pages(unsigned int n)
                 first_available_frame_idx = i;
             }
 
-            char offset = 0;
+            size_t offset = 0;
 
             // Are there any free bytes? Assumes little-endianness
             if ((bytes & 0x000000ff) == 0xff) {
@@ -146,9 +162,9 @@ static uint32_t find_available_8n_pages(unsigned int n)
             }
 
             // Can we find enough continuous bytes?
-            bool found = true;
+            bool found = i + offset + n <= bitmap_size;
 
-            for (size_t j = 0; j < n; j++) {
+            for (size_t j = 0; found && j < n; j++) {
                 if (memory_bitmap[i + offset + j] != 0xff) {
                     found = false;
                 }
@@ -163,67 +179,40 @@ static uint32_t find_available_8n_pages(unsigned int n)
     return 0;  // Marks unsuccess
 }
 
-// Allows the init function to mark bigger memory segments
+// Allows the init function to mark bigger memory segments, a word at the time when possible
 static void init_mark_segment(size_t addr, size_t length, bool available)
 {
     // Verify that addr and length is a multiple of PAGE_SIZE
     kassert(addr % PAGE_SIZE == 0);
     kassert(length % PAGE_SIZE == 0);
 
+    uint32_t *words      = (uint32_t *)memory_bitmap;
+    uint32_t  frame      = FRAME_NUMBER(addr);
+    uint32_t  end_frame  = MIN(FRAME_NUMBER(addr + length), bitmap_size * 8);
+    uint32_t  old, mask, count;
+
     // reset first available idx
     first_available_frame_idx = 0;
 
-    uint32_t page_count  = length / PAGE_SIZE;
-    uint32_t start_frame = FRAME_NUMBER(addr);
-    uint32_t start_idx   = BITMAP_INDX(start_frame);
-    uint8_t  start_bit   = BITMAP_BIT(start_frame);
-
-    // Handle first byte if segment start in the middle of a byte
-    if (start_bit != 0) {
-        // Fill the bits for the relevant byte
-        for (uint8_t i = start_bit; i < 8 && page_count; i++) {
-            if (available) {
-                SET_BIT(memory_bitmap[start_idx], i);
-                n_available_frames++;
-            } else {
-                CLR_BIT(memory_bitmap[start_idx], i);
-                n_available_frames--;
-            }
-            page_count--;
-        }
-
-        // Increment idx to point to first full bit
-        start_idx++;
-    }
+    while (frame < end_frame) {
+        uint32_t idx = frame / BITMAP_WORD_BITS;
+        uint32_t bit = frame % BITMAP_WORD_BITS;
 
-    uint32_t end_frame = FRAME_NUMBER(addr + length);
-    uint32_t end_idx   = BITMAP_INDX(end_frame);
-    uint8_t  end_bit   = BITMAP_BIT(end_frame);
+        // Build a mask of the bits within this word, full words are handled in one go
+        count = MIN(end_frame - frame, BITMAP_WORD_BITS - bit);
+        mask  = (count == BITMAP_WORD_BITS) ? UINT32_MAX : ((1u << count) - 1) << bit;
 
-    // Fill all the bytes from start until end index
-    for (uint32_t i = start_idx; i < end_idx; i++) {
+        // Only count the frames that actually change state
+        old = words[idx];
         if (available) {
-            memory_bitmap[i] = 0xff;
-            n_available_frames += 8;
+            words[idx] = old | mask;
+            n_available_frames += (size_t)__builtin_popcount(~old & mask);
         } else {
-            memory_bitmap[i] = 0x00;
-            n_available_frames -= 8;
+            words[idx] = old & ~mask;
+            n_available_frames -= (size_t)__builtin_popcount(old & mask);
         }
-        page_count -= 8;
-    }
 
-    // Handle if the segment ends in the middle of a byte, fill all bits less than it
-    if (end_bit != 0) {
-        for (uint8_t i = 0; i < end_bit && page_count; i++) {
-            if (available) {
-                SET_BIT(memory_bitmap[end_idx], i);
-                n_available_frames++;
-            } else {
-                CLR_BIT(memory_bitmap[end_idx], i);
-                n_available_frames--;
-            }
-            page_count--;
-        }
+        frame += count;
     }
 }
 
@@ -234,22 +223,38 @@ static void init_mark_segment(size_t addr, size_t length, bool available)
 // Initialise the page frame manager based on the supplied memory map
 void page_frame_manager_init(struct boot_data *boot_data)
 {
-    // 1: Initialise bitmap by setting all bytes to zero (i.e. unavailable)
-    memset(memory_bitmap, 0, sizeof(memory_bitmap));
+    memory_segment_t *seg;
+    physaddr_t        mem_end = 0;
 
-    // 2: Parse the supplied memory map, marking segments as available
-    amount_of_memory = boot_data->mem_size;
-    for (size_t i = 0; i < boot_data->mmap_size; i++) {
-        memory_segment_t *segment = boot_data->mmap_segments + i;
-        init_mark_segment(segment->addr, segment->length, true);
+    // 1: Size the bitmap to the available low memory, memblock has already parsed the memory map
+    MEMBLOCK_FOR_EACH(seg, memory)
+    {
+        mem_end = MAX(mem_end, seg->addr + seg->length);
     }
-    n_frames = n_available_frames;
 
-    // 3: Mark kernel segments as unavailable
-    size_t addr   = KERNEL_START;
-    size_t length = KERNEL_END - HIGHER_HALF_ADDR - KERNEL_START;
-    init_mark_segment(addr, ALIGN_BY_PAGE_SIZE(length), false);
-    init_mark_segment(boot_data->initrd_start, ALIGN_BY_PAGE_SIZE(boot_data->initrd_size), false);
+    bitmap_size   = BITMAP_ROUND_UP(FRAME_NUMBER(mem_end)) / 8;
+    memory_bitmap = memblock_alloc(bitmap_size);
+    if (memory_bitmap == NULL) {
+        kpanic("Failed to allocate page frame bitmap of %u bytes", bitmap_size);
+    }
+
+    // 2: Mark the available segments, memblock hands out cleared memory so everything else is
+    // already unavailable
+    amount_of_memory = boot_data->mem_size;
+    MEMBLOCK_FOR_EACH(seg, memory)
+    {
+        init_mark_segment(seg->addr, seg->length, true);
+    }
+    n_frames       = n_available_frames;
+    low_watermark  = n_frames / LOW_WATERMARK_DIVISOR;
+    high_watermark = n_frames / HIGH_WATERMARK_DIVISOR;
+
+    // 3: Mark the kernel, initrd and everything allocated through memblock as unavailable
+    MEMBLOCK_FOR_EACH(seg, reserved)
+    {
+        init_mark_segment(seg->addr, seg->length, false);
+    }
+    memblock_retire();
 }
 
 // Returns memory statistics from the page frame manager
@@ -260,24 +265,51 @@ void page_frame_manger_memory_stats(memory_stats_t *stats)
     stats->n_frames           = n_frames;
 }
 
+// Returns the number of frames that needs to be reclaimed to get back above the high watermark
+size_t page_frame_reclaim_target()
+{
+    size_t available = READ_ONCE(n_available_frames);
+    return available < high_watermark ? high_watermark - available : 0;
+}
+
+/*
+    Called after every allocation attempt, kicks the background reclaim when running low on memory.
+    Returns true if a failed allocation should be retried after the caches were shrunk.
+*/
+static bool check_memory_pressure(uint8_t options, uint32_t page_num, size_t npages)
+{
+    if (READ_ONCE(n_available_frames) < low_watermark) {
+        reclaim_wakeup();
+    }
+
+    if (page_num != 0 || (options & PF_OPT_ATOMIC)) {
+        return false;
+    }
+
+    // Direct reclaim, only worth a retry if something was freed
+    return shrink_caches(npages) > 0;
+}
+
 // Returns physical address to the page that was allocated, 0 marks failure
 physaddr_t page_frame_alloc_page(uint8_t options)
 {
     uint32_t irqflags;
+    uint32_t page_num;
 
     // parse options
     if (MASK_BIT(options, 0)) {
         kpanic("High memory not yet implemented");
     }
 
-    spinlock_lock(&page_alloc_lock, &irqflags);
-    uint32_t page_num = find_available_page();
-    if (page_num == 0) {
-        return 0;
-    }
+    do {
+        spinlock_lock(&page_alloc_lock, &irqflags);
+        page_num = find_available_page();
+        if (page_num != 0) {
+            mark_page(page_num, false);
+        }
+        spinlock_unlock(&page_alloc_lock, irqflags);
+    } while (check_memory_pressure(options, page_num, 1));
 
-    mark_page(page_num, false);
-    spinlock_unlock(&page_alloc_lock, irqflags);
     return page_num * PAGE_SIZE;
 }
 
@@ -286,6 +318,7 @@ physaddr_t page_frame_alloc_page(uint8_t options)
 physaddr_t page_frame_alloc_pages(uint8_t options, unsigned int n)
 {
     uint32_t irqflags;
+    uint32_t page_num;
 
     // parse options
     if (MASK_BIT(options, 0)) {
@@ -295,14 +328,15 @@ physaddr_t page_frame_alloc_pages(uint8_t options, unsigned int n)
     if (n == 0)
         return 0;
 
-    spinlock_lock(&page_alloc_lock, &irqflags);
-    uint32_t page_num = find_available_8n_pages(n);
-    if (page_num == 0) {
-        return 0;
-    }
+    do {
+        spinlock_lock(&page_alloc_lock, &irqflags);
+        page_num = find_available_8n_pages(n);
+        if (page_num != 0) {
+            mark_8n_pages(page_num, n, false);
+        }
+        spinlock_unlock(&page_alloc_lock, irqflags);
+    } while (check_memory_pressure(options, page_num, 8 * n));
 
-    mark_8n_pages(page_num, n, false);
-    spinlock_unlock(&page_alloc_lock, irqflags);
     return page_num * PAGE_SIZE;
 }
 
@@ -0,0 +1,123 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#include <arch/boot.h>
+#include <memory/page_frame_manager.h>
+#include <memory/shrinker.h>
+#include <tasks/scheduler.h>
+#include <tasks/spinlock.h>
+#include <uapi/errno.h>
+#include <utils.h>
+
+#define LOG_SHRINKER 0
+
+#define LOG(fmt, ...) __LOG(LOG_SHRINKER, "[SHRINKER]", fmt, ##__VA_ARGS__)
+
+/* All registered shrinkers */
+static DEFINE_LIST(shrinker_list);
+
+/* Protects the shrinker list */
+static SPINLOCK_DEFINE(shrinker_lock);
+
+/* Background thread reclaiming memory once the page frame allocator reaches the low watermark */
+static task_t *reclaim_task = NULL;
+
+/* Registers the shrinker, returns 0 on success, otherwise -ERRNO */
+int register_shrinker(struct shrinker *shrinker)
+{
+    uint32_t flags;
+
+    if (!shrinker->count || !shrinker->scan) {
+        return -EINVAL;
+    }
+
+    spinlock_lock(&shrinker_lock, &flags);
+    list_add_last(&shrinker_list, &shrinker->entry);
+    spinlock_unlock(&shrinker_lock, flags);
+
+    LOG("Registered %s", shrinker->name);
+    return 0;
+}
+
+/* Removes a registered shrinker */
+void unregister_shrinker(struct shrinker *shrinker)
+{
+    uint32_t flags;
+
+    spinlock_lock(&shrinker_lock, &flags);
+    list_entry_remove(&shrinker->entry);
+    spinlock_unlock(&shrinker_lock, flags);
+}
+
+/* Asks the registered shrinkers to free nr_pages, returns the number of pages actually freed */
+size_t shrink_caches(size_t nr_pages)
+{
+    uint32_t         flags;
+    size_t           count, freed = 0;
+    struct shrinker *shrinker;
+
+    spinlock_lock(&shrinker_lock, &flags);
+    LIST_ITER_STRUCT(&shrinker_list, shrinker, struct shrinker, entry)
+    {
+        if (freed >= nr_pages) {
+            break;
+        }
+
+        count = shrinker->count(shrinker);
+        if (count == 0) {
+            continue;
+        }
+
+        freed += shrinker->scan(shrinker, MIN(count, nr_pages - freed));
+    }
+    spinlock_unlock(&shrinker_lock, flags);
+
+    LOG("Reclaimed %u of %u requested pages", freed, nr_pages);
+    return freed;
+}
+
+/* Wakes the background reclaim thread, safe to call from any context */
+void reclaim_wakeup()
+{
+    task_t *task = READ_ONCE(reclaim_task);
+
+    // A wakeup racing with the thread going to sleep is lost, but the next allocation below the
+    // low watermark will try again
+    if (task && task->state == BLOCKED) {
+        scheduler_unblock_task(task);
+    }
+}
+
+static void reclaim_thread()
+{
+    size_t target;
+
+    while (true) {
+        target = page_frame_reclaim_target();
+
+        // Keep going as long as the shrinkers are making progress
+        if (target == 0 || shrink_caches(target) == 0) {
+            scheduler_block_task(BLOCK_REASON_PAUSED);
+        }
+    }
+}
+
+static int _register_shrinker(void *arg)
+{
+    return register_shrinker(arg);
+}
+
+/* Registers the statically defined shrinkers and starts the background reclaim thread */
+void shrinker_init()
+{
+    kassert(!call_init_objects(INITOBJ_TYPE_SHRINKER, _register_shrinker));
+
+    // Reclaiming memory is latency sensitive since allocations may be waiting on it
+    reclaim_task = get_task(create_task_with_priority(reclaim_thread, 1));
+    if (!reclaim_task) {
+        kpanic("Failed to start reclaim thread");
+    }
+}
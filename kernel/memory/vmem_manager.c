@@ -17,7 +17,7 @@ virtaddr_t vmem_request_free_page(unsigned int fpo)
         kpanic("Highmem not yet implemented");
     }
 
-    physaddr_t physaddr = page_frame_alloc_page(0);
+    physaddr_t physaddr = page_frame_alloc_page((fpo & FPO_ATOMIC) ? PF_OPT_ATOMIC : 0);
     if (physaddr == 0) {
         return 0;  // could not allocate page
     }
@@ -44,7 +44,7 @@ virtaddr_t vmem_request_free_pages(unsigned int fpo, unsigned int n)
         kpanic("Highmem not yet implemented");
     }
 
-    physaddr_t physaddr = page_frame_alloc_pages(0, n);
+    physaddr_t physaddr = page_frame_alloc_pages((fpo & FPO_ATOMIC) ? PF_OPT_ATOMIC : 0, n);
     if (physaddr == 0) {
         return 0;  // could not allocate page
     }
@@ -0,0 +1,353 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#include <devices/timer.h>
+#include <kinfo.h>
+#include <tasks/fiber.h>
+#include <uapi/errno.h>
+#include <utils.h>
+
+#include "internal.h"
+
+#define LOG_FIBER 0
+
+#define LOG(fmt, ...) __LOG(LOG_FIBER, "[FIBER]", fmt, ##__VA_ARGS__)
+
+/* Written below the stack, detects fibers overflowing their stacks */
+#define FIBER_STACK_MAGIC 0xf1be5a5a
+
+typedef enum {
+    FIBER_READY,
+    FIBER_RUNNING,
+    FIBER_BLOCKED,
+    FIBER_EXITED,
+} fiber_state_t;
+
+/* Placed at the bottom of its stack allocation */
+struct fiber {
+    struct thread_regs      regs;
+    struct fiber_scheduler *scheduler;
+    struct list_entry       entry;  // Entry in the ready list, the sleeping list or the cache
+    fiber_state_t           state;
+    uint64_t                wake_at;  // Wakeup time while in the sleeping list
+
+    void (*fn)(void *);
+    void *arg;
+
+    uint32_t magic;  // Directly below the stack
+};
+
+static_assert(sizeof(struct fiber) < FIBER_STACK_SIZE / 4);
+
+/* Cache of exited fibers together with their stacks, linked through the fiber entry */
+static struct {
+    struct spinlock lock;
+    struct list     fibers;
+    unsigned int    nr_cached;
+    uint32_t        hits;
+    uint32_t        misses;
+} fiber_cache = {
+    .lock   = SPINLOCK_INIT(),
+    .fibers = LIST_INIT(fiber_cache.fibers),
+};
+
+static struct fiber *alloc_fiber()
+{
+    uint32_t           flags;
+    struct list_entry *entry;
+
+    spinlock_lock(&fiber_cache.lock, &flags);
+    entry = list_remove_first(&fiber_cache.fibers);
+    if (entry) {
+        fiber_cache.nr_cached--;
+        fiber_cache.hits++;
+    } else {
+        fiber_cache.misses++;
+    }
+    spinlock_unlock(&fiber_cache.lock, flags);
+
+    if (entry) {
+        return GET_STRUCT(struct fiber, entry, entry);
+    }
+    return kalloc(FIBER_STACK_SIZE);
+}
+
+static void free_fiber(struct fiber *fiber)
+{
+    uint32_t flags;
+
+    spinlock_lock(&fiber_cache.lock, &flags);
+    if (fiber_cache.nr_cached < FIBER_CACHE_SIZE) {
+        list_add_last(&fiber_cache.fibers, &fiber->entry);
+        fiber_cache.nr_cached++;
+        fiber = NULL;
+    }
+    spinlock_unlock(&fiber_cache.lock, flags);
+
+    if (fiber) {
+        kfree(fiber);
+    }
+}
+
+/* Runs on the fiber stack, hands the fiber back to the host for freeing once done */
+static void fiber_entry(void *arg)
+{
+    uint32_t                flags;
+    struct fiber           *fiber = arg;
+    struct fiber_scheduler *fs    = fiber->scheduler;
+
+    fiber->fn(fiber->arg);
+
+    spinlock_lock(&fs->lock, &flags);
+    fiber->state = FIBER_EXITED;
+    spinlock_unlock(&fs->lock, flags);
+
+    fiber_schedule();
+    kassert(false);  // unreachable
+}
+
+/* Makes the fiber ready to run, requires the scheduler lock */
+static void make_ready_locked(struct fiber_scheduler *fs, struct fiber *fiber)
+{
+    fiber->state = FIBER_READY;
+    list_add_last(&fs->ready, &fiber->entry);
+
+    if (fs->host_waiting) {
+        fs->host_waiting = false;
+        scheduler_unblock_task(fs->host);
+    }
+}
+
+/* Creates a fiber calling fn(arg), run once the scheduler gets to it. Returns 0 or -ERRNO. */
+int fiber_create(struct fiber_scheduler *fs, void (*fn)(void *), void *arg)
+{
+    uint32_t      flags;
+    struct fiber *fiber = alloc_fiber();
+
+    if (!fiber) {
+        return -ENOMEM;
+    }
+
+    fiber->scheduler = fs;
+    fiber->fn        = fn;
+    fiber->arg       = arg;
+    fiber->magic     = FIBER_STACK_MAGIC;
+    init_thread_regs_with_stack(&fiber->regs, (uint8_t *)fiber + FIBER_STACK_SIZE, fiber_entry,
+                                fiber);
+
+    // The host may be waiting for fibers to become ready, when created by another task
+    spinlock_lock(&fs->lock, &flags);
+    fs->nr_fibers++;
+    make_ready_locked(fs, fiber);
+    spinlock_unlock(&fs->lock, flags);
+    return 0;
+}
+
+/* Moves the sleeping fibers whose wakeup time has passed to the ready list */
+static void wake_sleepers_locked(struct fiber_scheduler *fs, uint64_t now)
+{
+    struct fiber *fiber;
+
+    while (!LIST_EMPTY(&fs->sleeping)) {
+        fiber = GET_STRUCT(struct fiber, entry, fs->sleeping.head.next);
+        if (fiber->wake_at > now) {
+            break;
+        }
+
+        list_entry_remove(&fiber->entry);
+        make_ready_locked(fs, fiber);
+    }
+}
+
+/* Runs the fibers of the scheduler until all of them have exited, must not be called by a fiber */
+void fiber_run(struct fiber_scheduler *fs)
+{
+    uint32_t           flags;
+    uint64_t           wakeup;
+    struct fiber      *fiber;
+    struct list_entry *entry;
+
+    kassert(!current_task->fiber);
+
+    spinlock_lock(&fs->lock, &flags);
+    fs->host = current_task;
+
+    while (fs->nr_fibers) {
+        wake_sleepers_locked(fs, timer_get_time_since_boot());
+
+        entry = list_remove_first(&fs->ready);
+        if (!entry) {
+            // Sleep until a fiber is woken, or the first sleeping one is due
+            wakeup = LIST_EMPTY(&fs->sleeping)
+                         ? 0
+                         : GET_STRUCT(struct fiber, entry, fs->sleeping.head.next)->wake_at;
+
+            fs->host_waiting = true;
+            scheduler_prepare_block(BLOCK_REASON_PAUSED, wakeup);
+            spinlock_unlock(&fs->lock, flags);
+
+            scheduler_yield();
+
+            spinlock_lock(&fs->lock, &flags);
+            fs->host_waiting = false;
+            scheduler_unblock_task(current_task);
+            continue;
+        }
+
+        fiber        = GET_STRUCT(struct fiber, entry, entry);
+        fiber->state = FIBER_RUNNING;
+        spinlock_unlock(&fs->lock, flags);
+
+        current_task->fiber = fiber;
+        arch_thread_switch(&fs->regs, &fiber->regs);
+        current_task->fiber = NULL;
+
+        if (fiber->magic != FIBER_STACK_MAGIC) {
+            kpanic("Fiber %x overflowed its stack", fiber);
+        }
+
+        spinlock_lock(&fs->lock, &flags);
+        if (fiber->state == FIBER_EXITED) {
+            fs->nr_fibers--;
+            spinlock_unlock(&fs->lock, flags);
+            free_fiber(fiber);
+            spinlock_lock(&fs->lock, &flags);
+        }
+    }
+
+    fs->host = NULL;
+    spinlock_unlock(&fs->lock, flags);
+}
+
+/* The executing fiber, NULL if not called by a fiber */
+struct fiber *fiber_current()
+{
+    return current_task->fiber;
+}
+
+/* Switches back to the host, which picks the next fiber to run */
+void fiber_schedule()
+{
+    struct fiber *fiber = current_task->fiber;
+
+    kassert(fiber);
+    if (fiber->magic != FIBER_STACK_MAGIC) {
+        kpanic("Fiber %x overflowed its stack", fiber);
+    }
+    arch_thread_switch(&fiber->regs, &fiber->scheduler->regs);
+}
+
+/* Lets the other ready fibers run before the calling one continues */
+void fiber_yield()
+{
+    uint32_t                flags;
+    struct fiber_scheduler *fs;
+    struct fiber           *fiber = fiber_current();
+
+    kassert(fiber);
+    fs = fiber->scheduler;
+
+    spinlock_lock(&fs->lock, &flags);
+    fiber->state = FIBER_READY;
+    list_add_last(&fs->ready, &fiber->entry);
+    spinlock_unlock(&fs->lock, flags);
+
+    fiber_schedule();
+}
+
+/* Blocks the calling fiber for at least the supplied number of ns */
+void fiber_sleep(uint64_t ns)
+{
+    struct fiber *fiber    = fiber_current();
+    uint64_t      deadline = timer_get_time_since_boot() + ns;
+
+    kassert(fiber);
+    while (timer_get_time_since_boot() < deadline) {
+        fiber_prepare_block(fiber, deadline);
+        fiber_schedule();
+    }
+    fiber_finish_block(fiber);
+}
+
+/* Marks the fiber as blocked until woken or, if deadline is non-zero, until the deadline */
+void fiber_prepare_block(struct fiber *fiber, uint64_t deadline)
+{
+    uint32_t                flags;
+    struct fiber_scheduler *fs = fiber->scheduler;
+    struct list_entry      *pos;
+
+    spinlock_lock(&fs->lock, &flags);
+    if (fiber->state != FIBER_RUNNING) {
+        // Already woken since it was last prepared
+        spinlock_unlock(&fs->lock, flags);
+        return;
+    }
+
+    fiber->state = FIBER_BLOCKED;
+    if (deadline) {
+        // Insert after the fibers waking up no later, keeping the sleeping list sorted
+        fiber->wake_at = deadline;
+        LIST_ITER(&fs->sleeping, pos)
+        {
+            if (GET_STRUCT(struct fiber, entry, pos)->wake_at > deadline) {
+                break;
+            }
+        }
+        list_entry_append_single_element(pos->prev, &fiber->entry);
+    }
+    spinlock_unlock(&fs->lock, flags);
+}
+
+/* Makes the calling fiber runnable again, whether it was woken or not */
+void fiber_finish_block(struct fiber *fiber)
+{
+    uint32_t                flags;
+    struct fiber_scheduler *fs = fiber->scheduler;
+
+    spinlock_lock(&fs->lock, &flags);
+    if (fiber->entry.next != &fiber->entry) {
+        // Still in the ready or sleeping list
+        list_entry_remove(&fiber->entry);
+    }
+    fiber->state = FIBER_RUNNING;
+    spinlock_unlock(&fs->lock, flags);
+}
+
+/* Makes the blocked fiber runnable, safe in any context */
+void fiber_wake(struct fiber *fiber)
+{
+    uint32_t                flags;
+    struct fiber_scheduler *fs = fiber->scheduler;
+
+    spinlock_lock(&fs->lock, &flags);
+    if (fiber->state == FIBER_BLOCKED) {
+        if (fiber->entry.next != &fiber->entry) {
+            list_entry_remove(&fiber->entry);  // Woken before its deadline
+        }
+        make_ready_locked(fs, fiber);
+    }
+    spinlock_unlock(&fs->lock, flags);
+}
+
+/* Dumps the fiber cache usage to kinfo */
+static void kinfo_fiber_cache(struct kinfo_buffer *buff)
+{
+    uint32_t     flags, hits, misses;
+    unsigned int nr_cached;
+
+    spinlock_lock(&fiber_cache.lock, &flags);
+    nr_cached = fiber_cache.nr_cached;
+    hits      = fiber_cache.hits;
+    misses    = fiber_cache.misses;
+    spinlock_unlock(&fiber_cache.lock, flags);
+
+    kinfo_write(buff, "cached: %u\n", nr_cached);
+    kinfo_write(buff, "size: %u\n", FIBER_CACHE_SIZE);
+    kinfo_write(buff, "stack size: %u\n", FIBER_STACK_SIZE);
+    kinfo_write(buff, "hits: %u\n", hits);
+    kinfo_write(buff, "misses: %u\n", misses);
+}
+DEFINE_KINFO_FILE(sched, fiber_cache, kinfo_fiber_cache);
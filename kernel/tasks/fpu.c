@@ -0,0 +1,224 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#include <arch/cpu.h>
+#include <arch/fpu.h>
+#include <arch/interrupts.h>
+#include <arch/percpu.h>
+#include <kinfo.h>
+#include <memory/mempool.h>
+#include <tasks/fpu.h>
+#include <utils.h>
+
+#include "internal.h"
+
+#define LOG_FPU 0
+
+#define LOG(fmt, ...) __LOG(LOG_FPU, "[FPU]", fmt, ##__VA_ARGS__)
+
+// The number of fpu states kept in reserve for the first use trap, which can't grow the heap
+#define STATE_POOL_RESERVE 4
+
+/* The task whose state is loaded in the fpu registers of the cpu, if any */
+static DEFINE_PER_CPU(task_t *, fpu_owner);
+
+/* Non-zero within kernel_fpu_begin() and kernel_fpu_end() */
+static DEFINE_PER_CPU(unsigned int, in_kernel_fpu);
+
+/* Size of the saved state, 0 if there's no fpu */
+static size_t state_size = 0;
+
+/* Backs the saved states */
+static struct mempool state_pool;
+
+/* Save the state of the previous task on every switch, and restore the one of the next */
+static bool save_on_switch    = false;
+static bool restore_on_switch = false;
+
+/* Only touched by its own cpu with interrupts disabled */
+static struct {
+    uint32_t traps;
+    uint32_t saves;
+    uint32_t restores;
+} fpu_stats[MAX_CPUS];
+
+static void *state_of(task_t *task)
+{
+    return (void *)ALIGN_BY_MULTIPLE((uintptr_t)task->fpu_state, ARCH_FPU_STATE_ALIGN);
+}
+
+static void save_state(task_t *task)
+{
+    arch_fpu_save(state_of(task));
+    fpu_stats[arch_cpu_id()].saves++;
+}
+
+static void restore_state(task_t *task)
+{
+    arch_fpu_restore(state_of(task));
+    fpu_stats[arch_cpu_id()].restores++;
+}
+
+/* Detects and enables the fpu */
+void fpu_init()
+{
+    state_size = arch_fpu_init();
+    if (!state_size) {
+        log("[FPU] No fpu found");
+        return;
+    }
+
+    if (mempool_init(&state_pool, STATE_POOL_RESERVE, state_size + ARCH_FPU_STATE_ALIGN - 1) < 0) {
+        kpanic("Failed to reserve fpu states");
+    }
+
+#ifdef SMP
+    save_on_switch = true;
+#else
+    save_on_switch = arch_fpu_eager_save();
+#endif
+    restore_on_switch = arch_fpu_eager_save();
+
+    // No task owns the fpu yet, so the first one using it traps
+    arch_fpu_trap_enable();
+    log("[FPU] Using %s, state size %u", arch_fpu_save_method(), state_size);
+}
+
+/* Called when a task uses the fpu while trapping is enabled, loads the state of the current task */
+void fpu_trap()
+{
+    task_t *owner = this_cpu_read(fpu_owner);
+
+    if (!state_size) {
+        kpanic("Fpu instruction executed without fpu at %x", current_task);
+    }
+
+    // Interrupt handlers must not use the fpu, the loaded state belongs to the interrupted task
+    kassert(!(current_task->status & TASK_STATUS_INTERRUPT));
+
+    arch_fpu_trap_disable();
+    fpu_stats[arch_cpu_id()].traps++;
+    if (owner == current_task) {
+        return;
+    }
+
+    if (owner) {
+        save_state(owner);
+    }
+
+    if (current_task->fpu_state) {
+        restore_state(current_task);
+    } else {
+        // First use, there's no state to restore. The trap runs in exception context
+        current_task->fpu_state = mempool_alloc(&state_pool, KALLOC_ATOMIC);
+        if (!current_task->fpu_state) {
+            kpanic("Failed to allocate fpu state for %x", current_task);
+        }
+        arch_fpu_reset();
+    }
+    this_cpu_write(fpu_owner, current_task);
+}
+
+/* Switches the fpu state from prev to next, called by the scheduler with interrupts disabled */
+void fpu_switch(task_t *prev, task_t *next)
+{
+    if (!state_size) {
+        return;
+    }
+
+    if (save_on_switch && this_cpu_read(fpu_owner) == prev) {
+        arch_fpu_trap_disable();
+        save_state(prev);
+        this_cpu_write(fpu_owner, NULL);
+    }
+
+    if (restore_on_switch && next->fpu_state) {
+        arch_fpu_trap_disable();
+        restore_state(next);
+        this_cpu_write(fpu_owner, next);
+        return;
+    }
+
+    // Let the next task trap on its first fpu use, unless its state is still loaded
+    if (this_cpu_read(fpu_owner) == next) {
+        arch_fpu_trap_disable();
+    } else {
+        arch_fpu_trap_enable();
+    }
+}
+
+/* Releases the fpu state of the terminated task */
+void fpu_release_task(task_t *task)
+{
+    uint32_t flags = get_register_and_disable_interrupts();
+
+    // Only the lazy mode leaves the state of switched out tasks loaded, which implies a single cpu
+    if (this_cpu_read(fpu_owner) == task) {
+        this_cpu_write(fpu_owner, NULL);
+    }
+    restore_interrupt_register(flags);
+
+    if (state_size) {
+        mempool_free(&state_pool, task->fpu_state);
+    }
+    task->fpu_state = NULL;
+}
+
+/* Marks the start of a region using the fpu within the kernel */
+void kernel_fpu_begin()
+{
+    uint32_t flags;
+    task_t  *owner;
+
+    kassert(state_size);
+    kassert(!(current_task->status & TASK_STATUS_INTERRUPT));
+
+    scheduler_disable_preemption();
+    kassert(!this_cpu_read(in_kernel_fpu));
+    this_cpu_write(in_kernel_fpu, 1);
+
+    // The registers are about to be clobbered, so the state of their owner is saved first
+    flags = get_register_and_disable_interrupts();
+    owner = this_cpu_read(fpu_owner);
+    arch_fpu_trap_disable();
+    if (owner) {
+        save_state(owner);
+        this_cpu_write(fpu_owner, NULL);
+    }
+    arch_fpu_reset();
+    restore_interrupt_register(flags);
+}
+
+/* Marks the end of a region using the fpu within the kernel */
+void kernel_fpu_end()
+{
+    kassert(this_cpu_read(in_kernel_fpu));
+    this_cpu_write(in_kernel_fpu, 0);
+
+    // The next fpu use reloads the state of its task
+    arch_fpu_trap_enable();
+    scheduler_enable_preemption();
+}
+
+static void kinfo_fpu(struct kinfo_buffer *buff)
+{
+    if (!state_size) {
+        kinfo_write(buff, "no fpu\n");
+        return;
+    }
+
+    kinfo_write(buff, "method: %s\n", arch_fpu_save_method());
+    kinfo_write(buff, "state size: %u\n", state_size);
+    kinfo_write(buff, "mode: %s\n", restore_on_switch ? "eager"
+                                    : save_on_switch  ? "lazy restore"
+                                                      : "lazy");
+    kinfo_write(buff, "cpu  traps  saves  restores\n");
+    for (unsigned int cpu = 0; cpu < arch_cpus_online(); cpu++) {
+        kinfo_write(buff, "%u  %u  %u  %u\n", cpu, fpu_stats[cpu].traps, fpu_stats[cpu].saves,
+                    fpu_stats[cpu].restores);
+    }
+}
+DEFINE_KINFO_FILE(sched, fpu, kinfo_fpu);
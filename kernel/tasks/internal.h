@@ -6,11 +6,15 @@
 */
 #ifndef TASKS_INTERNAL_H
 #define TASKS_INTERNAL_H
+#include <arch/percpu.h>
 #include <stdbool.h>
 #include <tasks/scheduler.h>
 
-/* Pointer to the currently running task */
-extern task_t *current_task;
+/* Pointer to the task running on the executing cpu, use current_task to access it */
+DECLARE_PER_CPU(task_t *, __current_task);
+
+/* The task running on the executing cpu */
+#define current_task this_cpu_read(__current_task)
 
 /* Flag indicating if the scheduler has been initialised. While false the kernel can assume to run
  * on single threaded */
@@ -31,6 +35,17 @@ void scheduler_disable_preemption();
 /* Enabled preemption within the scheduler */
 void scheduler_enable_preemption();
 
+/*
+    Marks the current task as blocked without yielding, if when is non-zero the task is woken up at
+    that timestamp. Allows the task to put itself on a wait queue, and check its wait condition,
+    before calling scheduler_yield(). If it's woken up in between the yield returns right away, and
+    if the condition is already fulfilled it can unblock itself with scheduler_unblock_task().
+*/
+void scheduler_prepare_block(block_reason_t reason, uint64_t when);
+
+/* Reports that the executing cpu passed through a rcu quiescent state */
+void rcu_note_quiescent_state();
+
 /* Called by the interrupt handler allowing notifying the scheduler that an interrupt has been
  * called */
 void scheduler_start_of_interrupt();
@@ -5,7 +5,12 @@
    Copyright (C) 2024 Isak Evaldsson
 */
 #include <arch/interrupts.h>
+#include <arch/percpu.h>
 #include <atomics.h>
+#include <kinfo.h>
+#include <tasks/latency_tracer.h>
+#include <tasks/locking.h>
+#include <tasks/wait_queue.h>
 #include <uapi/errno.h>
 #include <utils.h>
 
@@ -22,8 +27,9 @@
 
 /* State and configuration flags for the interrupt entries */
 typedef enum {
-    INTERRUPT_ENABLED = 0,  // Is this entry enabled?
-    INTERRUPT_QUEUED,       // Are the bottom half already queued
+    INTERRUPT_ENABLED = 0,     // Is this entry enabled?
+    INTERRUPT_THREADED,        // Is the bottom half run by a dedicated thread
+    INTERRUPT_THREAD_PENDING,  // Has the thread been woken, but not yet started the bottom half
 } interrupt_entry_flags_t;
 
 /* Per interrupt configuration data */
@@ -35,28 +41,38 @@ struct interrupt_entry {
     // sleep or interrupted (including by itself).
     bottom_half_handler_t bottom_half;
 
-    atomic_uint_t           flags;
-    struct interrupt_entry *next;
+    atomic_uint_t flags;
+    unsigned int  priority;  // Bottom half priority class, or the scheduling priority of the thread
+
+    // Handler thread of threaded interrupts, 0 until started
+    tid_t             thread;
+    struct wait_queue thread_wait;
+
+    // Statistics, only for kinfo
+    uint32_t nr_fired;
+    uint32_t nr_bottom_halves;
 };
 
 static_assert(ARCH_N_INTERRUPTS > 0);
 static struct interrupt_entry interrupt_table[ARCH_N_INTERRUPTS];
 
-/* The level of interrupt nesting */
-static unsigned int interrupt_level;
+/* The level of interrupt nesting of the executing cpu */
+static DEFINE_PER_CPU(unsigned int, interrupt_level);
 
 /*
-    Linked list for serializing second halfs
+    Per vector pending bits for each bottom half priority class, only modified with interrupts
+    disabled. Within a class, the bottom halves run in vector order.
 */
-static struct interrupt_entry *bottom_half_queue_head = NULL;
-static struct interrupt_entry *bottom_half_queue_tail = NULL;
+#define PENDING_WORDS ((ARCH_N_INTERRUPTS + 31) / 32)
+static uint32_t bottom_half_pending[N_BOTTOM_HALF_PRIORITIES][PENDING_WORDS];
 
-/*
-    Registers an interrupt at the specified interrupt number. The caller needs to provide at least a
-    top or a bottom half handler.
-*/
-int register_interrupt_handler(uint32_t interrupt_number, top_half_handler_t top_half,
-                               bottom_half_handler_t bottom_half)
+/* Serialises the start of handler threads, lets a started thread find its entry */
+static MUTEX_DEFINE(interrupt_threads_lock);
+static bool interrupt_threads_started = false;
+
+static int register_entry(uint32_t interrupt_number, top_half_handler_t top_half,
+                          bottom_half_handler_t bottom_half, unsigned int priority,
+                          interrupt_entry_flags_t flags)
 {
     struct interrupt_entry *entry;
 
@@ -81,17 +97,168 @@ int register_interrupt_handler(uint32_t interrupt_number, top_half_handler_t top
         return -EALREADY;
     }
 
-    interrupt_entry_flags_t flags = 1 << INTERRUPT_ENABLED;
-
     entry->bottom_half = bottom_half;
     entry->top_half    = top_half;
-    entry->next        = NULL;
+    entry->priority    = priority;
+    entry->thread      = 0;
+    wait_queue_init(&entry->thread_wait, BLOCK_REASON_IO_WAIT);
 
     // Could probably be relaxed to a release operation
-    atomic_store(&entry->flags, flags);
+    atomic_store(&entry->flags, flags | (1 << INTERRUPT_ENABLED));
+    return 0;
+}
+
+/*
+    Registers an interrupt at the specified interrupt number. The caller needs to provide at least a
+    top or a bottom half handler.
+*/
+int register_interrupt_handler(uint32_t interrupt_number, top_half_handler_t top_half,
+                               bottom_half_handler_t bottom_half)
+{
+    return register_interrupt_handler_with_priority(interrupt_number, top_half, bottom_half,
+                                                    BOTTOM_HALF_PRIORITY_NORMAL);
+}
+
+/* Like register_interrupt_handler(), but runs the bottom half in the supplied priority class */
+int register_interrupt_handler_with_priority(uint32_t interrupt_number, top_half_handler_t top_half,
+                                             bottom_half_handler_t bottom_half,
+                                             bottom_half_priority_t priority)
+{
+    if (priority >= N_BOTTOM_HALF_PRIORITIES) {
+        return -EINVAL;
+    }
+
+    return register_entry(interrupt_number, top_half, bottom_half, priority, 0);
+}
+
+/* Runs the bottom half of a threaded interrupt whenever the top half has fired */
+static void interrupt_thread()
+{
+    tid_t                   tid   = current_task->tid;
+    struct interrupt_entry *entry = NULL;
+    uint32_t                interrupt_number;
+
+    // The starting task stores the tid before releasing the lock
+    mutex_lock(&interrupt_threads_lock);
+    for (interrupt_number = 0; interrupt_number < ARCH_N_INTERRUPTS; interrupt_number++) {
+        if (interrupt_table[interrupt_number].thread == tid) {
+            entry = &interrupt_table[interrupt_number];
+            break;
+        }
+    }
+    mutex_unlock(&interrupt_threads_lock);
+    kassert(entry);
+
+    while (true) {
+        wait_event(&entry->thread_wait,
+                   atomic_load(&entry->flags) & (1 << INTERRUPT_THREAD_PENDING));
+
+        // Cleared before running, so an interrupt firing meanwhile runs the bottom half again
+        atomic_and_fetch(&entry->flags, ~(1u << INTERRUPT_THREAD_PENDING));
+        entry->nr_bottom_halves++;
+        entry->bottom_half(interrupt_number);
+    }
+}
+
+/* Requires the interrupt_threads_lock */
+static int start_interrupt_thread(struct interrupt_entry *entry)
+{
+    tid_t tid = create_task_with_priority(interrupt_thread, entry->priority);
+
+    if (!tid) {
+        return -ENOMEM;
+    }
+
+    entry->thread = tid;
     return 0;
 }
 
+/*
+    Registers an interrupt whose bottom half runs in a dedicated thread with the supplied
+    scheduling priority, rather than inline at the end of the interrupt. During boot, the thread is
+    started by start_interrupt_threads() once the scheduler is up.
+*/
+int register_threaded_interrupt_handler(uint32_t interrupt_number, top_half_handler_t top_half,
+                                        bottom_half_handler_t thread_fn, unsigned int priority)
+{
+    int ret;
+
+    if (!thread_fn || priority >= SCHED_PRIORITY_LEVELS) {
+        return -EINVAL;
+    }
+
+    // Boot is single threaded, and the lock can't be taken before the scheduler is up
+    if (!READ_ONCE(interrupt_threads_started)) {
+        return register_entry(interrupt_number, top_half, thread_fn, priority,
+                              1 << INTERRUPT_THREADED);
+    }
+
+    mutex_lock(&interrupt_threads_lock);
+    ret = register_entry(interrupt_number, top_half, thread_fn, priority,
+                         1 << INTERRUPT_THREADED);
+    if (ret >= 0) {
+        ret = start_interrupt_thread(&interrupt_table[interrupt_number]);
+        if (ret < 0) {
+            atomic_store(&interrupt_table[interrupt_number].flags, 0);
+        }
+    }
+    mutex_unlock(&interrupt_threads_lock);
+    return ret;
+}
+
+/* Starts the threads of the threaded interrupts registered before the scheduler was up */
+void start_interrupt_threads()
+{
+    mutex_lock(&interrupt_threads_lock);
+    for (uint32_t i = 0; i < ARCH_N_INTERRUPTS; i++) {
+        struct interrupt_entry *entry = &interrupt_table[i];
+
+        if ((atomic_load(&entry->flags) & (1 << INTERRUPT_THREADED)) &&
+            start_interrupt_thread(entry) < 0) {
+            kpanic("Failed to start thread for interrupt %u", i);
+        }
+    }
+    WRITE_ONCE(interrupt_threads_started, true);
+    mutex_unlock(&interrupt_threads_lock);
+}
+
+/* Defers the work of the interrupt, runs with interrupts disabled */
+static void raise_bottom_half(uint32_t interrupt_number, struct interrupt_entry *entry)
+{
+    if (atomic_load(&entry->flags) & (1 << INTERRUPT_THREADED)) {
+        atomic_or_fetch(&entry->flags, 1 << INTERRUPT_THREAD_PENDING);
+        if (entry->thread) {
+            wake_up(&entry->thread_wait);
+        }
+        return;
+    }
+
+    bottom_half_pending[entry->priority][interrupt_number / 32] |= 1u << (interrupt_number % 32);
+}
+
+/*
+    Takes the next pending bottom half, most important class first, requires interrupts disabled.
+    The pending bit is cleared before the bottom half runs, so an interrupt firing meanwhile runs
+    it again.
+*/
+static bool take_pending_bottom_half(uint32_t *interrupt_number)
+{
+    for (unsigned int prio = 0; prio < N_BOTTOM_HALF_PRIORITIES; prio++) {
+        for (unsigned int word = 0; word < PENDING_WORDS; word++) {
+            uint32_t pending = bottom_half_pending[prio][word];
+
+            if (pending) {
+                unsigned int bit = (unsigned int)__builtin_ctz(pending);
+
+                bottom_half_pending[prio][word] = pending & ~(1u << bit);
+                *interrupt_number               = word * 32 + bit;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
 /*
     Provides an architecture independet interrupt mechanism proving a atomic top half and a
     reentrant bottom half. Is supposed to be called by the arch specific low level interrupt code.
@@ -104,6 +271,7 @@ void generic_interrupt_handler()
     struct interrupt_stack_state *state            = ARCH_GET_INTERRUPT_STACK_STATE();
     unsigned int                  interrupt_number = ARCH_GET_INTERRUPT_NUMBER(state);
     struct interrupt_entry       *entry            = &interrupt_table[interrupt_number];
+    unsigned int                  level;
 
     /*
         Three levels of interrupts are allowed:
@@ -112,8 +280,10 @@ void generic_interrupt_handler()
         2:  A interrupt fires while another interrupt runs a bottom half, only allowed to execute a
             top half.
     */
-    interrupt_level++;
-    kassert(interrupt_level <= 2);
+    this_cpu_inc(interrupt_level);
+    level = this_cpu_read(interrupt_level);
+    kassert(level <= 2);
+    trace_irqs_off(ARCH_GET_INTERRUPTED_IP(state));
 
     kassert(interrupt_number <= ARCH_N_INTERRUPTS);
     scheduler_start_of_interrupt();  // Replace, with some kind atomic section macro
@@ -123,70 +293,43 @@ void generic_interrupt_handler()
         goto end;
     }
 
-    LOG("N: %u, L: %u", interrupt_number, interrupt_level);
+    LOG("N: %u, L: %u", interrupt_number, level);
 
     if (entry->top_half) {
         entry->top_half(state, interrupt_number);
     }
 
-    if (interrupt_level == 2) {
-        if (entry->bottom_half && !(atomic_load(&entry->flags) & (1 << INTERRUPT_QUEUED))) {
-            /*
-                Bottom half interrupts are not allowed to run on top of each others, instead they
-               are queued and executed on level 1.
-            */
-            if (bottom_half_queue_head == NULL) {
-                bottom_half_queue_head = entry;
-            } else {
-                bottom_half_queue_tail->next = entry;
-            }
-
-            bottom_half_queue_tail = entry;
-            entry->next            = NULL;
-
-            atomic_or_fetch(&entry->flags, 1 << INTERRUPT_QUEUED);
-        }
-        goto level2_end;
+    entry->nr_fired++;
+    if (entry->bottom_half) {
+        raise_bottom_half(interrupt_number, entry);
     }
 
-    if (entry->bottom_half) {
-        enable_interrupts();
-        entry->bottom_half(interrupt_number);
+    if (level == 2) {
+        // Bottom halves are not allowed to run on top of each other, they are run on level 1
+        goto level2_end;
     }
 
     while (true) {
         /*
             This disabling and re-enabling of interrupts is needed to avoid race conditions with
-            parallel level 2 upper halfs. However, it's not very efficient. A lock free queue would
-            be a better approach. Also, this loop could theoretically spin forever, some kind of
+            parallel level 2 upper halfs. This loop could theoretically spin forever, some kind of
             limit to the number of halfs could potentially be needed.
         */
         disable_interrupts();
-        entry = bottom_half_queue_head;
-        if (entry == NULL) {
+        if (!take_pending_bottom_half(&interrupt_number)) {
             break;  // Will always exit the loop with interrupts disabled
         }
 
-        bottom_half_queue_head = entry->next;
-        if (bottom_half_queue_head == NULL) {
-            bottom_half_queue_tail = NULL;
-        }
-        entry->next = NULL;
-
-        // The bottom half may not be executed by its original interrupt, so it's interrupt number
-        // needs to be computed.
-        uint32_t bottom_half_number =
-            ((uintptr_t)entry - (uintptr_t)interrupt_table) / sizeof(struct interrupt_entry);
+        // The bottom half may not be executed by its original interrupt
+        entry = &interrupt_table[interrupt_number];
+        entry->nr_bottom_halves++;
 
         enable_interrupts();
-        entry->bottom_half(bottom_half_number);
-
-        // Clear queued flag
-        atomic_and_fetch(&entry->flags, ~(1u << INTERRUPT_QUEUED));
+        entry->bottom_half(interrupt_number);
     }
 
 end:
-    if (interrupt_level == 2) {
+    if (level == 2) {
         /*
             Since level 2 interrupts runs on top of level 1 interrupts, some checks can skipped
             since they will be done at the end of the level 1 interrupt anyways
@@ -199,5 +342,39 @@ end:
     scheduler_end_of_interrupt();
 
 level2_end:
-    interrupt_level--;
+    this_cpu_dec(interrupt_level);
+
+    // Interrupts are re-enabled on return, unless they were disabled by the interrupted code
+    if (ARCH_INTERRUPTED_WITH_IRQS_ENABLED(state)) {
+        trace_irqs_on((uintptr_t)generic_interrupt_handler);
+    }
+}
+
+static const char *const bottom_half_priority_names[N_BOTTOM_HALF_PRIORITIES] = {
+    [BOTTOM_HALF_PRIORITY_HIGH]   = "high",
+    [BOTTOM_HALF_PRIORITY_NORMAL] = "normal",
+    [BOTTOM_HALF_PRIORITY_LOW]    = "low",
+};
+
+/* Dumps the registered interrupts with a bottom half to kinfo */
+static void kinfo_interrupt_handlers(struct kinfo_buffer *buff)
+{
+    kinfo_write(buff, "vector  fired  bottom_halves  mode\n");
+    for (uint32_t i = 0; i < ARCH_N_INTERRUPTS; i++) {
+        struct interrupt_entry *entry = &interrupt_table[i];
+        unsigned int            flags = atomic_load(&entry->flags);
+
+        if (!(flags & (1 << INTERRUPT_ENABLED)) || !entry->bottom_half) {
+            continue;
+        }
+
+        if (flags & (1 << INTERRUPT_THREADED)) {
+            kinfo_write(buff, "%u  %u  %u  thread %u prio %u\n", i, entry->nr_fired,
+                        entry->nr_bottom_halves, entry->thread, entry->priority);
+        } else {
+            kinfo_write(buff, "%u  %u  %u  %s\n", i, entry->nr_fired, entry->nr_bottom_halves,
+                        bottom_half_priority_names[entry->priority]);
+        }
+    }
 }
+DEFINE_KINFO_FILE(interrupts, handlers, kinfo_interrupt_handlers);
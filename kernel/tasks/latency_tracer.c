@@ -0,0 +1,143 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifdef LATENCY_TRACER
+#include <arch/cpu.h>
+#include <devices/timer.h>
+#include <kinfo.h>
+#include <libc.h>
+#include <stdbool.h>
+#include <tasks/latency_tracer.h>
+#include <utils.h>
+
+/* A window with interrupts or preemption disabled */
+struct latency_window {
+    bool      open;
+    uint64_t  start_ns;
+    uintptr_t start_ip;
+
+    // The longest window seen
+    uint64_t  max_ns;
+    uint64_t  max_at_ns;
+    uintptr_t max_start_ip;
+    uintptr_t max_end_ip;
+    uint32_t  nr_windows;
+};
+
+/* Only touched by its own cpu with interrupts, respectively preemption, disabled */
+static struct latency_window irqsoff[MAX_CPUS];
+static struct latency_window preemptoff[MAX_CPUS];
+
+static void open_window(struct latency_window *window, uintptr_t ip)
+{
+    if (window->open) {
+        return;
+    }
+
+    // Marked as open before reading the clock, in case the clock driver itself disables interrupts
+    window->open     = true;
+    window->start_ip = ip;
+    window->start_ns = timer_get_time_since_boot();
+}
+
+static void close_window(struct latency_window *window, uintptr_t ip)
+{
+    uint64_t now, duration;
+
+    if (!window->open) {
+        return;
+    }
+
+    now          = timer_get_time_since_boot();
+    duration     = now - window->start_ns;
+    window->open = false;
+    window->nr_windows++;
+
+    if (duration > window->max_ns) {
+        window->max_ns       = duration;
+        window->max_at_ns    = now;
+        window->max_start_ip = window->start_ip;
+        window->max_end_ip   = ip;
+    }
+}
+
+/* Called right after interrupts have been disabled */
+void trace_irqs_off(uintptr_t ip)
+{
+    open_window(&irqsoff[arch_cpu_id()], ip);
+}
+
+/* Called right before interrupts are re-enabled */
+void trace_irqs_on(uintptr_t ip)
+{
+    close_window(&irqsoff[arch_cpu_id()], ip);
+}
+
+/* Called once the preemption counter has left zero */
+void trace_preempt_off(uintptr_t ip)
+{
+    open_window(&preemptoff[arch_cpu_id()], ip);
+}
+
+/* Called before the preemption counter returns to zero */
+void trace_preempt_on(uintptr_t ip)
+{
+    close_window(&preemptoff[arch_cpu_id()], ip);
+}
+
+static void reset_window(struct latency_window *window)
+{
+    // An open window is kept, it's recorded once closed
+    window->max_ns       = 0;
+    window->max_at_ns    = 0;
+    window->max_start_ip = 0;
+    window->max_end_ip   = 0;
+    window->nr_windows   = 0;
+}
+
+/* Forgets the longest windows of the executing cpu, must be called with interrupts disabled */
+void latency_tracer_reset()
+{
+    reset_window(&irqsoff[arch_cpu_id()]);
+    reset_window(&preemptoff[arch_cpu_id()]);
+}
+
+/* Returns the longest irqs off window of the executing cpu in ns, together with its call sites */
+uint64_t latency_tracer_irqsoff_max(uintptr_t *entry_ip, uintptr_t *exit_ip)
+{
+    struct latency_window *window = &irqsoff[arch_cpu_id()];
+
+    *entry_ip = window->max_start_ip;
+    *exit_ip  = window->max_end_ip;
+    return window->max_ns;
+}
+
+static void kinfo_write_windows(struct kinfo_buffer *buff, struct latency_window *windows)
+{
+    struct latency_window window;
+
+    kinfo_write(buff, "cpu  max_us  at_ms  entry  exit  windows\n");
+    for (unsigned int cpu = 0; cpu < arch_cpus_online(); cpu++) {
+        memcpy(&window, &windows[cpu], sizeof(window));
+        kinfo_write(buff, "%u  %u  %u  %x  %x  %u\n", cpu, (uint32_t)(window.max_ns / 1000),
+                    (uint32_t)(window.max_at_ns / 1000000), window.max_start_ip,
+                    window.max_end_ip, window.nr_windows);
+    }
+}
+
+static void kinfo_irqsoff(struct kinfo_buffer *buff)
+{
+    kinfo_write_windows(buff, irqsoff);
+}
+DEFINE_KINFO_FILE(latency, irqsoff, kinfo_irqsoff);
+
+static void kinfo_preemptoff(struct kinfo_buffer *buff)
+{
+    kinfo_write_windows(buff, preemptoff);
+}
+DEFINE_KINFO_FILE(latency, preemptoff, kinfo_preemptoff);
+
+#endif /* LATENCY_TRACER */
@@ -4,6 +4,7 @@
 
    Copyright (C) 2024 Isak Evaldsson
 */
+#include <arch/cpu.h>
 #include <arch/interrupts.h>
 #include <tasks/locking.h>
 #include <tasks/scheduler.h>
@@ -12,7 +13,7 @@
 
 #include "internal.h"
 
-#define LOG_LOCKING 1
+#define LOG_LOCKING 0
 
 #define LOG(fmt, ...) __LOG(LOG_LOCKING, "[LOCKING]", fmt, ##__VA_ARGS__)
 
@@ -34,49 +35,50 @@ static void check_non_interrupt(void *ptr, const char *name)
     }
 }
 
-static void __semaphore_signal(semaphore_t *semaphore)
-{
-    task_t *task;
-    atomic_add_fetch(&semaphore->count, 1);
-
-    // pick the first waiting task if available
-    scheduler_disable_preemption();
-    task = task_queue_dequeue(&semaphore->waiting_tasks);
-    if (task) {
-        scheduler_unblock_task(task);
-    }
-    scheduler_enable_preemption();
-}
-
-static void __semaphore_wait(semaphore_t *semaphore)
-{
-    int current;
-
-    current = atomic_load(&semaphore->count);
-    do {
-        while (!current) {
-            LOG("%x failed to acquire semaphore/mutex %x", current_task, semaphore);
-            scheduler_disable_preemption();
-            task_queue_enqueue(&semaphore->waiting_tasks, current_task);
-            scheduler_block_task(BLOCK_REASON_LOCK_WAIT);  // Implicitly enables preemption
-            current = atomic_load(&semaphore->count);
-        }
-    } while (!atomic_compare_exchange(&semaphore->count, &current, current - 1));
-    LOG("%x successfully acquired semaphore/mutex %x", current_task, semaphore);
-}
-
 /* Increments the semaphore and wakes up potential waiters */
 void semaphore_signal(semaphore_t *semaphore)
 {
+    uint32_t flags;
+
     check_non_interrupt(semaphore, "semaphore");
-    __semaphore_signal(semaphore);
+
+    // Hand the unit over to the first waiter, if any
+    spinlock_lock(&semaphore->wait.lock, &flags);
+    if (!wake_up_locked(&semaphore->wait)) {
+        semaphore->count++;
+    }
+    spinlock_unlock(&semaphore->wait.lock, flags);
 }
 
 /* Decrements the semaphore if possible, otherwise wait */
 void semaphore_wait(semaphore_t *semaphore)
 {
+    uint32_t                flags;
+    uint64_t                wait_start;
+    struct wait_queue_entry wait = WAIT_QUEUE_ENTRY_INIT(wait);
+
     check_non_interrupt(semaphore, "semaphore");
-    __semaphore_wait(semaphore);
+
+    spinlock_lock(&semaphore->wait.lock, &flags);
+    if (semaphore->count > 0) {
+        semaphore->count--;
+        spinlock_unlock(&semaphore->wait.lock, flags);
+        lockstat_acquired(semaphore, LOCK_TYPE_SEMAPHORE, LOCKSTAT_UNCONTENDED);
+        return;
+    }
+
+    LOG("%x failed to acquire semaphore %x", current_task, semaphore);
+    wait_start = lockstat_now();
+    while (!wait.woken) {
+        prepare_to_wait_locked(&semaphore->wait, &wait, 0);
+        spinlock_unlock(&semaphore->wait.lock, flags);
+        scheduler_yield();
+        spinlock_lock(&semaphore->wait.lock, &flags);
+    }
+    spinlock_unlock(&semaphore->wait.lock, flags);
+    finish_wait(&semaphore->wait, &wait);
+    lockstat_acquired(semaphore, LOCK_TYPE_SEMAPHORE, wait_start);
+    LOG("%x successfully acquired semaphore %x", current_task, semaphore);
 }
 
 /* Allocate and initialise a mutex */
@@ -93,24 +95,326 @@ mutex_t *mutex_create()
 /* Lock mutex */
 void mutex_lock(mutex_t *mutex)
 {
+    uint32_t                flags;
+    uint64_t                wait_start;
+    struct wait_queue_entry wait = WAIT_QUEUE_ENTRY_INIT(wait);
+
     kassert(scheduler_initialised);
     check_non_interrupt(mutex, "mutex");
-    __semaphore_wait(&mutex->sem);
+
+    spinlock_lock(&mutex->wait.lock, &flags);
+    if (mutex->owner == current_task) {
+        kpanic("Thread %x is trying to re-acquire mutex %x", current_task, mutex);
+    }
+
+    // The mutex is only free if there's no one waiting for it, otherwise it's handed over on unlock
+    if (!mutex->owner) {
+        mutex->owner = current_task;
+        spinlock_unlock(&mutex->wait.lock, flags);
+        lockstat_acquired(mutex, LOCK_TYPE_MUTEX, LOCKSTAT_UNCONTENDED);
+        return;
+    }
+
+    LOG("%x failed to acquire mutex %x held by %x", current_task, mutex, mutex->owner);
+    wait_start = lockstat_now();
+    while (mutex->owner != current_task) {
+        prepare_to_wait_locked(&mutex->wait, &wait, 0);
+        spinlock_unlock(&mutex->wait.lock, flags);
+        scheduler_yield();
+        spinlock_lock(&mutex->wait.lock, &flags);
+    }
+    spinlock_unlock(&mutex->wait.lock, flags);
+    finish_wait(&mutex->wait, &wait);
+    lockstat_acquired(mutex, LOCK_TYPE_MUTEX, wait_start);
+    LOG("%x successfully acquired mutex %x", current_task, mutex);
 }
 
 /* Unlock mutex */
 void mutex_unlock(mutex_t *mutex)
 {
+    uint32_t           flags;
+    struct list_entry *first;
+
     kassert(scheduler_initialised);
     check_non_interrupt(mutex, "mutex");
-    __semaphore_signal(&mutex->sem);
+
+    spinlock_lock(&mutex->wait.lock, &flags);
+    if (mutex->owner != current_task) {
+        kpanic("Thread %x is trying to release mutex %x held by %x", current_task, mutex,
+               mutex->owner);
+    }
+    lockstat_released(mutex);
+
+    // Hand the ownership over to the first waiter before waking it
+    first        = mutex->wait.waiters.head.next;
+    mutex->owner = LIST_EMPTY(&mutex->wait.waiters)
+                       ? NULL
+                       : GET_STRUCT(struct wait_queue_entry, entry, first)->task;
+    wake_up_locked(&mutex->wait);
+    spinlock_unlock(&mutex->wait.lock, flags);
+}
+
+/* Checks if the mutex is held by the current task */
+bool mutex_is_held(mutex_t *mutex)
+{
+    return READ_ONCE(mutex->owner) == current_task;
+}
+
+/* Waits for the condition variable, gives up at the deadline unless it's 0 */
+static bool condvar_wait_deadline(condvar_t *cond, mutex_t *mutex, uint64_t deadline)
+{
+    struct wait_queue_entry wait = WAIT_QUEUE_ENTRY_INIT(wait);
+
+    kassert(mutex_is_held(mutex));
+
+    // Being on the queue before releasing the mutex ensures a signal can't be missed
+    prepare_to_wait(&cond->wait, &wait, deadline);
+    mutex_unlock(mutex);
+    if (!deadline || timer_get_time_since_boot() < deadline) {
+        scheduler_yield();
+    }
+    finish_wait(&cond->wait, &wait);
+
+    mutex_lock(mutex);
+    return wait.woken;
+}
+
+/* Atomically unlocks the mutex and waits for the condition variable to be signaled */
+void condvar_wait(condvar_t *cond, mutex_t *mutex)
+{
+    condvar_wait_deadline(cond, mutex, 0);
+}
+
+/* Like condvar_wait() but gives up after timeout_ns, returns false on timeout */
+bool condvar_wait_timeout(condvar_t *cond, mutex_t *mutex, uint64_t timeout_ns)
+{
+    return condvar_wait_deadline(cond, mutex, timer_get_time_since_boot() + timeout_ns);
+}
+
+/* Wakes up one task waiting on the condition variable */
+void condvar_signal(condvar_t *cond)
+{
+    wake_up(&cond->wait);
+}
+
+/* Wakes up all tasks waiting on the condition variable */
+void condvar_broadcast(condvar_t *cond)
+{
+    wake_up_all(&cond->wait);
+}
+
+/* Allocate and initialise a reader-writer lock */
+rwlock_t *rwlock_create()
+{
+    rwlock_t *rwlock = kalloc(sizeof(rwlock_t));
+    if (rwlock != NULL) {
+        *rwlock = (rwlock_t)RWLOCK_INIT(*rwlock);
+    }
+
+    return rwlock;
+}
+
+/* Hands the lock over to the first waiting writer, or to the readers at the front of the queue */
+static void rwlock_grant_locked(rwlock_t *rwlock)
+{
+    struct wait_queue_entry *first;
+
+    while (!LIST_EMPTY(&rwlock->wait.waiters)) {
+        first = GET_STRUCT(struct wait_queue_entry, entry, rwlock->wait.waiters.head.next);
+        if (first->exclusive) {
+            if (rwlock->readers == 0) {
+                rwlock->writer = first->task;
+                wake_up_locked(&rwlock->wait);
+            }
+            return;
+        }
+
+        rwlock->readers++;
+        wake_up_locked(&rwlock->wait);
+    }
+}
+
+/* Blocks until the lock has been handed over, requires the queue lock */
+static void rwlock_wait_locked(rwlock_t *rwlock, bool exclusive, uint32_t *flags)
+{
+    struct wait_queue_entry wait = WAIT_QUEUE_ENTRY_INIT(wait);
+
+    wait.exclusive = exclusive;
+    while (!wait.woken) {
+        prepare_to_wait_locked(&rwlock->wait, &wait, 0);
+        spinlock_unlock(&rwlock->wait.lock, *flags);
+        scheduler_yield();
+        spinlock_lock(&rwlock->wait.lock, flags);
+    }
+    spinlock_unlock(&rwlock->wait.lock, *flags);
+    finish_wait(&rwlock->wait, &wait);
+}
+
+/* Lock for reading */
+void rwlock_read_lock(rwlock_t *rwlock)
+{
+    uint32_t flags;
+
+    kassert(scheduler_initialised);
+    check_non_interrupt(rwlock, "rwlock");
+
+    // Queue up behind any waiting writer, rather than starving it
+    spinlock_lock(&rwlock->wait.lock, &flags);
+    if (!rwlock->writer && LIST_EMPTY(&rwlock->wait.waiters)) {
+        rwlock->readers++;
+        spinlock_unlock(&rwlock->wait.lock, flags);
+        return;
+    }
+    rwlock_wait_locked(rwlock, false, &flags);
+}
+
+/* Unlock after reading */
+void rwlock_read_unlock(rwlock_t *rwlock)
+{
+    uint32_t flags;
+
+    check_non_interrupt(rwlock, "rwlock");
+
+    spinlock_lock(&rwlock->wait.lock, &flags);
+    kassert(rwlock->readers > 0);
+    if (--rwlock->readers == 0) {
+        rwlock_grant_locked(rwlock);
+    }
+    spinlock_unlock(&rwlock->wait.lock, flags);
+}
+
+/* Lock for writing */
+void rwlock_write_lock(rwlock_t *rwlock)
+{
+    uint32_t flags;
+
+    kassert(scheduler_initialised);
+    check_non_interrupt(rwlock, "rwlock");
+
+    spinlock_lock(&rwlock->wait.lock, &flags);
+    if (rwlock->writer == current_task) {
+        kpanic("Thread %x is trying to re-acquire rwlock %x", current_task, rwlock);
+    }
+
+    if (!rwlock->writer && rwlock->readers == 0) {
+        rwlock->writer = current_task;
+        spinlock_unlock(&rwlock->wait.lock, flags);
+        return;
+    }
+    rwlock_wait_locked(rwlock, true, &flags);
+}
+
+/* Unlock after writing */
+void rwlock_write_unlock(rwlock_t *rwlock)
+{
+    uint32_t flags;
+
+    check_non_interrupt(rwlock, "rwlock");
+
+    spinlock_lock(&rwlock->wait.lock, &flags);
+    if (rwlock->writer != current_task) {
+        kpanic("Thread %x is trying to release rwlock %x held by %x", current_task, rwlock,
+               rwlock->writer);
+    }
+    rwlock->writer = NULL;
+    rwlock_grant_locked(rwlock);
+    spinlock_unlock(&rwlock->wait.lock, flags);
+}
+
+#define RW_SPINLOCK_WRITER         (1u << 31)  // Held by a writer
+#define RW_SPINLOCK_WRITER_WAITING (1u << 30)  // A writer is waiting, new readers must wait
+#define RW_SPINLOCK_READERS_MASK   (RW_SPINLOCK_WRITER_WAITING - 1)
+
+/* Lock for reading */
+void rw_spinlock_read_lock(struct rw_spinlock *lock, uint32_t *irqflags)
+{
+    unsigned int state;
+
+    *irqflags = get_register_and_disable_interrupts();
+    scheduler_disable_preemption();
+
+    state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    while (true) {
+        if (state & (RW_SPINLOCK_WRITER | RW_SPINLOCK_WRITER_WAITING)) {
+#ifndef SMP
+            // Nothing can release the lock, while holding it in the same context
+            kpanic("rw_spinlock %x deadlocked", lock);
+#endif
+            arch_cpu_relax();
+            state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        } else if (__atomic_compare_exchange_n(&lock->state, &state, state + 1, true,
+                                               __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+}
+
+/* Unlock after reading */
+void rw_spinlock_read_unlock(struct rw_spinlock *lock, uint32_t irqflags)
+{
+    kassert(__atomic_load_n(&lock->state, __ATOMIC_RELAXED) & RW_SPINLOCK_READERS_MASK);
+    __atomic_sub_fetch(&lock->state, 1, __ATOMIC_RELEASE);
+    scheduler_enable_preemption();
+    restore_interrupt_register(irqflags);
+}
+
+/* Lock for writing */
+void rw_spinlock_write_lock(struct rw_spinlock *lock, uint32_t *irqflags)
+{
+    unsigned int state;
+
+    *irqflags = get_register_and_disable_interrupts();
+    scheduler_disable_preemption();
+
+    state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    while (true) {
+        if (!(state & ~RW_SPINLOCK_WRITER_WAITING)) {
+            // Free, possibly with other writers waiting, which then have to re-announce themselves
+            if (__atomic_compare_exchange_n(&lock->state, &state, RW_SPINLOCK_WRITER, true,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                break;
+            }
+            continue;
+        }
+
+#ifndef SMP
+        kpanic("rw_spinlock %x deadlocked", lock);
+#endif
+        if (!(state & RW_SPINLOCK_WRITER_WAITING)) {
+            __atomic_or_fetch(&lock->state, RW_SPINLOCK_WRITER_WAITING, __ATOMIC_RELAXED);
+        }
+        arch_cpu_relax();
+        state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    }
+}
+
+/* Unlock after writing */
+void rw_spinlock_write_unlock(struct rw_spinlock *lock, uint32_t irqflags)
+{
+    kassert(__atomic_load_n(&lock->state, __ATOMIC_RELAXED) & RW_SPINLOCK_WRITER);
+    __atomic_store_n(&lock->state, 0, __ATOMIC_RELEASE);
+    scheduler_enable_preemption();
+    restore_interrupt_register(irqflags);
+}
+
+/* Takes the sequence lock for writing */
+void write_seqlock(seqlock_t *sl, uint32_t *irqflags)
+{
+    spinlock_lock(&sl->lock, irqflags);
+    write_seqcount_begin(&sl->seq);
+}
+
+/* Releases the sequence lock */
+void write_sequnlock(seqlock_t *sl, uint32_t irqflags)
+{
+    write_seqcount_end(&sl->seq);
+    spinlock_unlock(&sl->lock, irqflags);
 }
 
 /* Lock spinlock */
 void spinlock_lock(struct spinlock *spinlock, uint32_t *irqflags)
 {
 #ifndef SMP
-    LOG("lock %x", spinlock);
     *irqflags = get_register_and_disable_interrupts();
     scheduler_disable_preemption();
 
@@ -121,19 +425,40 @@ void spinlock_lock(struct spinlock *spinlock, uint32_t *irqflags)
     */
     kassert(!spinlock->flag);
     spinlock->flag++;
+    lockstat_acquired(spinlock, LOCK_TYPE_SPINLOCK, LOCKSTAT_UNCONTENDED);
 #else
-#error Spinlock not defined for SMP
+    uint64_t wait_start = LOCKSTAT_UNCONTENDED;
+
+    *irqflags = get_register_and_disable_interrupts();
+    scheduler_disable_preemption();
+
+    /*
+        Test-and-test-and-set, while the lock is held the waiters only read the flag so the cache
+        line isn't bounced between the cpus until the lock is released.
+    */
+    while (__atomic_exchange_n(&spinlock->flag, 1, __ATOMIC_ACQUIRE)) {
+        if (wait_start == LOCKSTAT_UNCONTENDED) {
+            wait_start = lockstat_now();
+        }
+
+        while (__atomic_load_n(&spinlock->flag, __ATOMIC_RELAXED)) {
+            arch_cpu_relax();
+        }
+    }
+    lockstat_acquired(spinlock, LOCK_TYPE_SPINLOCK, wait_start);
 #endif
 }
 /* Unlock spinlock */
 void spinlock_unlock(struct spinlock *spinlock, uint32_t irqflags)
 {
+    lockstat_released(spinlock);
 #ifndef SMP
-    LOG("unlock %x", spinlock);
     spinlock->flag--;
     scheduler_enable_preemption();
     restore_interrupt_register(irqflags);
 #else
-#error Spinlock not defined for SMP
+    __atomic_store_n(&spinlock->flag, 0, __ATOMIC_RELEASE);
+    scheduler_enable_preemption();
+    restore_interrupt_register(irqflags);
 #endif
 }
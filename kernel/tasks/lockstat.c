@@ -0,0 +1,266 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifdef LOCKSTAT
+#include <arch/cpu.h>
+#include <arch/interrupts.h>
+#include <atomics.h>
+#include <devices/timer.h>
+#include <kinfo.h>
+#include <libc.h>
+#include <tasks/lockstat.h>
+#include <utils.h>
+
+#define LOCKSTAT_MAX_CLASSES 128
+
+/* Number of classes listed by /kinfo/lockstat/classes, the rest don't fit within a kinfo read */
+#define LOCKSTAT_LISTED_CLASSES 40u
+
+/* Number of classes listed in detail by /kinfo/lockstat/contention */
+#define LOCKSTAT_TOP_CLASSES 6u
+
+static const char *const lock_type_names[N_LOCK_TYPES] = {
+    [LOCK_TYPE_SPINLOCK]  = "spinlock",
+    [LOCK_TYPE_MUTEX]     = "mutex",
+    [LOCK_TYPE_SEMAPHORE] = "semaphore",
+};
+
+static const char *const hist_bucket_names[LOCKSTAT_HIST_BUCKETS] = {
+    "<1us", "<4us", "<16us", "<64us", "<256us", "<1ms", "<4ms", ">=4ms",
+};
+
+static struct lock_class lock_classes[LOCKSTAT_MAX_CLASSES];
+static unsigned int      nr_classes = 0;
+
+/* Protects the registration of classes, can't be a spinlock since those are tracked themselves */
+static unsigned int class_lock = 0;
+
+/* Used for locks whose class could not be registered */
+static struct lock_class overflow_class = {.name = "<overflow>"};
+
+static uint32_t raw_lock(unsigned int *lock)
+{
+    uint32_t flags = get_register_and_disable_interrupts();
+
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        arch_cpu_relax();
+    }
+    return flags;
+}
+
+static void raw_unlock(unsigned int *lock, uint32_t flags)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+    restore_interrupt_register(flags);
+}
+
+/* Finds the class of the key, registering it if it's the first of its kind */
+static struct lock_class *get_class(struct lockstat_key *key, enum lock_type type)
+{
+    uint32_t           flags;
+    const char        *name  = key->name ? key->name : "<uninitialised>";
+    struct lock_class *class = READ_ONCE(key->class);
+
+    if (class) {
+        return class;
+    }
+
+    flags = raw_lock(&class_lock);
+    for (unsigned int i = 0; i < nr_classes; i++) {
+        if (lock_classes[i].type == type && strcmp(lock_classes[i].name, name) == 0) {
+            class = &lock_classes[i];
+            break;
+        }
+    }
+
+    if (!class && nr_classes < LOCKSTAT_MAX_CLASSES) {
+        class       = &lock_classes[nr_classes++];
+        class->name = name;
+        class->type = type;
+    }
+    raw_unlock(&class_lock, flags);
+
+    class = class ? class : &overflow_class;
+    WRITE_ONCE(key->class, class);
+    return class;
+}
+
+static unsigned int hist_bucket(uint64_t ns)
+{
+    unsigned int bucket = 0;
+
+    for (uint64_t limit = 1000; bucket < LOCKSTAT_HIST_BUCKETS - 1 && ns >= limit; limit *= 4) {
+        bucket++;
+    }
+    return bucket;
+}
+
+/* Space-saving top-k, an unknown call site replaces the least frequent one */
+static void record_call_site(struct lock_class *class, uintptr_t ip)
+{
+    struct lock_call_site *min = &class->call_sites[0];
+
+    for (int i = 0; i < LOCKSTAT_CALL_SITES; i++) {
+        struct lock_call_site *site = &class->call_sites[i];
+
+        if (site->ip == ip) {
+            site->count++;
+            return;
+        }
+
+        if (site->count < min->count) {
+            min = site;
+        }
+    }
+
+    min->ip = ip;
+    min->count++;
+}
+
+/* Timestamp used for the wait start */
+uint64_t lockstat_now()
+{
+    return timer_get_time_since_boot();
+}
+
+/* Records an acquisition, contended unless wait_start is LOCKSTAT_UNCONTENDED */
+void __lockstat_acquired(struct lockstat_key *key, enum lock_type type, uint64_t wait_start,
+                         uintptr_t ip)
+{
+    uint32_t           flags;
+    uint64_t           now   = timer_get_time_since_boot();
+    struct lock_class *class = get_class(key, type);
+
+    // A semaphore may be held by several tasks at once, so there's no single hold time
+    if (type != LOCK_TYPE_SEMAPHORE) {
+        key->acquired_at = now;
+    }
+
+    flags = raw_lock(&class->busy);
+    class->acquisitions++;
+    if (wait_start != LOCKSTAT_UNCONTENDED) {
+        uint64_t wait = now - wait_start;
+
+        class->contentions++;
+        class->wait_total_ns += wait;
+        class->wait_max_ns = MAX(class->wait_max_ns, wait);
+        class->wait_hist[hist_bucket(wait)]++;
+        record_call_site(class, ip);
+    }
+    raw_unlock(&class->busy, flags);
+}
+
+/* Records the release of a lock held since its last acquisition */
+void __lockstat_released(struct lockstat_key *key)
+{
+    uint32_t           flags;
+    struct lock_class *class = READ_ONCE(key->class);
+    uint64_t           hold  = timer_get_time_since_boot() - key->acquired_at;
+
+    if (!class) {
+        return;
+    }
+    kassert(class->type != LOCK_TYPE_SEMAPHORE);
+
+    flags = raw_lock(&class->busy);
+    class->hold_total_ns += hold;
+    class->hold_max_ns = MAX(class->hold_max_ns, hold);
+    class->hold_hist[hist_bucket(hold)]++;
+    raw_unlock(&class->busy, flags);
+}
+
+static uint32_t ns_to_us(uint64_t ns)
+{
+    return (uint32_t)(ns / 1000);
+}
+
+/* Sorts the registered classes by total wait time, returns the number of classes */
+static unsigned int sort_classes(struct lock_class **sorted)
+{
+    unsigned int n = READ_ONCE(nr_classes);
+
+    for (unsigned int i = 0; i < n; i++) {
+        unsigned int j = i;
+
+        for (; j > 0 && sorted[j - 1]->wait_total_ns < lock_classes[i].wait_total_ns; j--) {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = &lock_classes[i];
+    }
+    return n;
+}
+
+/* kinfo reads are serialised by the shared read buffer */
+static struct lock_class *sorted_classes[LOCKSTAT_MAX_CLASSES];
+
+static void kinfo_lockstat_classes(struct kinfo_buffer *buff)
+{
+    unsigned int n       = sort_classes(sorted_classes);
+    unsigned int listed  = MIN(n, LOCKSTAT_LISTED_CLASSES);
+    uint32_t     omitted = 0;
+
+    kinfo_write(buff, "class type acquired contended wait_us wait_max_us hold_us hold_max_us\n");
+
+    for (unsigned int i = 0; i < listed; i++) {
+        struct lock_class *class = sorted_classes[i];
+
+        kinfo_write(buff, "%s %s %u %u %u %u ", class->name, lock_type_names[class->type],
+                    class->acquisitions, class->contentions, ns_to_us(class->wait_total_ns),
+                    ns_to_us(class->wait_max_ns));
+        if (class->type == LOCK_TYPE_SEMAPHORE) {
+            kinfo_write(buff, "- -\n");
+        } else {
+            kinfo_write(buff, "%u %u\n", ns_to_us(class->hold_total_ns),
+                        ns_to_us(class->hold_max_ns));
+        }
+    }
+
+    // The classes are sorted by wait time, so the omitted ones are the least interesting
+    for (unsigned int i = listed; i < n; i++) {
+        omitted += sorted_classes[i]->acquisitions;
+    }
+    if (listed < n) {
+        kinfo_write(buff, "%u more classes with %u acquisitions\n", n - listed, omitted);
+    }
+
+    if (overflow_class.acquisitions) {
+        kinfo_write(buff, "%u acquisitions of unregistered classes\n", overflow_class.acquisitions);
+    }
+}
+
+DEFINE_KINFO_FILE(lockstat, classes, kinfo_lockstat_classes);
+
+static void kinfo_lockstat_contention(struct kinfo_buffer *buff)
+{
+    unsigned int n = MIN(sort_classes(sorted_classes), LOCKSTAT_TOP_CLASSES);
+
+    for (unsigned int i = 0; i < n && sorted_classes[i]->contentions; i++) {
+        struct lock_class *class = sorted_classes[i];
+
+        kinfo_write(buff, "%s (%s)\n", class->name, lock_type_names[class->type]);
+        kinfo_write(buff, "  bucket wait hold\n");
+        for (int b = 0; b < LOCKSTAT_HIST_BUCKETS; b++) {
+            if (class->type == LOCK_TYPE_SEMAPHORE) {
+                kinfo_write(buff, "  %s %u -\n", hist_bucket_names[b], class->wait_hist[b]);
+            } else {
+                kinfo_write(buff, "  %s %u %u\n", hist_bucket_names[b], class->wait_hist[b],
+                            class->hold_hist[b]);
+            }
+        }
+
+        kinfo_write(buff, "  call sites:");
+        for (int s = 0; s < LOCKSTAT_CALL_SITES; s++) {
+            if (class->call_sites[s].count) {
+                kinfo_write(buff, " %x (%u)", class->call_sites[s].ip, class->call_sites[s].count);
+            }
+        }
+        kinfo_write(buff, "\n");
+    }
+}
+
+DEFINE_KINFO_FILE(lockstat, contention, kinfo_lockstat_contention);
+
+#endif /* LOCKSTAT */
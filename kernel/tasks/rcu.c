@@ -0,0 +1,161 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#include <arch/cpu.h>
+#include <arch/percpu.h>
+#include <devices/timer.h>
+#include <tasks/locking.h>
+#include <tasks/rcu.h>
+#include <tasks/spinlock.h>
+#include <utils.h>
+
+#include "internal.h"
+
+#define LOG_RCU 0
+
+#define LOG(fmt, ...) __LOG(LOG_RCU, "[RCU]", fmt, ##__VA_ARGS__)
+
+/* How often the rcu thread checks if the other cpus have passed through the scheduler */
+#define RCU_POLL_INTERVAL_NS 1000000u /* 1 ms */
+
+/* Callbacks queued by call_rcu(), waiting for the rcu thread to start the next grace period */
+static struct rcu_head  *pending_head = NULL;
+static struct rcu_head **pending_tail = &pending_head;
+
+/* Protects the pending callbacks */
+static SPINLOCK_DEFINE(rcu_lock);
+
+/* Bitmap of the cpus that has yet to pass through a quiescent state in the current grace period */
+static atomic_uint_t qs_pending = ATOMIC_INIT();
+
+/* Signaled once the pending callbacks goes from empty to non-empty */
+static SEMAPHORE_DEFINE(rcu_work, 0);
+
+/* Thread running the grace periods and invoking the callbacks */
+static task_t *rcu_task = NULL;
+
+/* Nesting depth of the read-side critical sections of the executing cpu */
+static DEFINE_PER_CPU(unsigned int, read_depth);
+
+/* Marks the start of a read-side critical section, may be nested */
+void rcu_read_lock()
+{
+    scheduler_disable_preemption();
+    this_cpu_inc(read_depth);
+}
+
+/* Marks the end of a read-side critical section */
+void rcu_read_unlock()
+{
+    kassert(this_cpu_read(read_depth));
+    this_cpu_dec(read_depth);
+    scheduler_enable_preemption();
+}
+
+/* Returns true if the executing cpu is within a read-side critical section */
+bool rcu_read_lock_held()
+{
+    return this_cpu_read(read_depth) != 0;
+}
+
+/* Called by the scheduler each time the executing cpu passes through it */
+void rcu_note_quiescent_state()
+{
+    unsigned int cpu_bit = 1u << arch_cpu_id();
+
+    if (atomic_load(&qs_pending) & cpu_bit) {
+        atomic_and_fetch(&qs_pending, ~cpu_bit);
+    }
+}
+
+/* Invokes func once a grace period has elapsed */
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+    uint32_t flags;
+    bool     was_empty;
+
+    kassert(!(current_task->status & TASK_STATUS_INTERRUPT));
+
+    head->func = func;
+    head->next = NULL;
+
+    spinlock_lock(&rcu_lock, &flags);
+    was_empty     = pending_head == NULL;
+    *pending_tail = head;
+    pending_tail  = &head->next;
+    spinlock_unlock(&rcu_lock, flags);
+
+    if (was_empty) {
+        semaphore_signal(&rcu_work);
+    }
+}
+
+struct rcu_sync {
+    struct rcu_head head;
+    semaphore_t     done;
+};
+
+static void wakeup_synchronize(struct rcu_head *head)
+{
+    semaphore_signal(&GET_STRUCT(struct rcu_sync, head, head)->done);
+}
+
+/* Blocks until a grace period has elapsed */
+void synchronize_rcu()
+{
+    struct rcu_sync sync = {.done = SEMAPHORE_INIT(sync.done, 0)};
+
+    call_rcu(&sync.head, wakeup_synchronize);
+    semaphore_wait(&sync.done);
+}
+
+static void wait_for_grace_period()
+{
+    atomic_store(&qs_pending, (1u << arch_cpus_online()) - 1);
+
+    // Re-scheduling reports the quiescent state of this cpu, the others report theirs as they pass
+    // through the scheduler
+    scheduler_yield();
+    while (atomic_load(&qs_pending)) {
+        scheduler_nano_sleep_until(timer_get_time_since_boot() + RCU_POLL_INTERVAL_NS);
+    }
+}
+
+static void rcu_thread()
+{
+    uint32_t         flags;
+    struct rcu_head *head, *next;
+
+    while (true) {
+        semaphore_wait(&rcu_work);
+
+        spinlock_lock(&rcu_lock, &flags);
+        head         = pending_head;
+        pending_head = NULL;
+        pending_tail = &pending_head;
+        spinlock_unlock(&rcu_lock, flags);
+
+        if (!head) {
+            continue;
+        }
+
+        wait_for_grace_period();
+        for (; head; head = next) {
+            next = head->next;
+            head->func(head);
+        }
+    }
+}
+
+/* Starts the rcu thread */
+void rcu_init()
+{
+    rcu_task = get_task(create_task(rcu_thread));
+    if (!rcu_task) {
+        kpanic("Failed to start rcu thread");
+    }
+    LOG("Initialised rcu (thread: %x)", rcu_task);
+}
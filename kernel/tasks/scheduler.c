@@ -4,15 +4,22 @@
 
    Copyright (C) 2024 Isak Evaldsson
 */
+#include <arch/cpu.h>
 #include <arch/interrupts.h>
 #include <arch/paging.h>
+#include <arch/percpu.h>
 #include <arch/thread.h>
 #include <devices/timer.h>
+#include <kinfo.h>
 #include <memory/vmem_manager.h>
+#include <tasks/fpu.h>
+#include <tasks/latency_tracer.h>
 #include <tasks/locking.h>
+#include <tasks/rcu.h>
 #include <tasks/scheduler.h>
 #include <tasks/spinlock.h>
 #include <tasks/task_queue.h>
+#include <uapi/errno.h>
 #include <utils.h>
 
 #include "internal.h"
@@ -25,8 +32,117 @@
     Scheduler state
 */
 
-// The ready-to-run task queue
-static EMPTY_QUEUE(ready_queue);
+/*
+ * The ready-to-run priority tasks, one queue per priority level together with a bitmap of the
+ * levels that may have queued tasks, allowing the next task to be picked in constant time. A set
+ * bit doesn't guarantee a non-empty queue since tasks can be removed from their queue behind the
+ * scheduler's back, so it's cleared lazily when the queue is found empty.
+ */
+struct prio_runqueue {
+    uint32_t     bitmap;
+    task_queue_t queues[SCHED_PRIORITY_LEVELS];
+};
+
+static_assert(SCHED_PRIORITY_LEVELS <= 32, "runqueue bitmap too small");
+
+/*
+ * The ready-to-run fair tasks ordered by their virtual runtime, the task that has received the
+ * least cpu time in relation to its weight runs next. Fair tasks only run when there's no ready
+ * priority task.
+ */
+struct fair_runqueue {
+    struct rb_root tasks;
+    uint64_t       min_vruntime;  // Monotonically increasing lower bound of the ready vruntimes
+    uint32_t       total_weight;  // The sum of the weights of the queued tasks
+    unsigned int   nr_queued;
+};
+
+/*
+ * The ready-to-run deadline tasks ordered by the absolute deadline of their current instance.
+ * Deadline tasks that have used up their runtime wait for their next period in the dl_wait queue.
+ */
+struct dl_runqueue {
+    struct rb_root tasks;
+    unsigned int   nr_queued;
+};
+
+/*
+ * Soft lockup watchdog, run from the timer interrupt. A cpu is locked up once it has gone
+ * SCHED_WATCHDOG_THRESHOLD_NS without passing through the scheduler while other tasks are waiting
+ * for it, e.g. a task looping with preemption disabled. Since it relies on the timer interrupt it
+ * can't detect cpus spinning with interrupts disabled, the irqsoff latency tracer covers those.
+ */
+struct watchdog_cpu {
+    uint64_t touched;   // When the cpu last passed through the scheduler, or got waiting tasks
+    bool     reported;  // Each lockup is only reported once
+};
+
+/*
+ * Histogram of the time tasks spend ready to run in the runqueue before being picked, bucket i
+ * counts the waits shorter than 2^i us, except the last one which counts the remaining
+ */
+#define RUNQUEUE_LATENCY_BUCKETS 16
+
+/*
+ * Each cpu picks the tasks to run from its own runqueue. Tasks are placed in the runqueue of the
+ * cpu they were created on and stay there, there's no load balancing since only the boot cpu is
+ * brought online.
+ *
+ * The runqueue lock protects the queued tasks, the state of the tasks placed in the runqueue and
+ * the time keeping of its cpu. It nests within scheduler_lock, and at most one runqueue is locked
+ * at a time.
+ */
+struct runqueue {
+    struct spinlock      lock;
+    unsigned int         cpu;
+    task_t              *curr;  // The task running on the cpu
+    struct dl_runqueue   dl;
+    struct prio_runqueue prio;
+    struct fair_runqueue fair;
+
+    // Deadline tasks that have used up their runtime, waiting for their next period
+    task_queue_t dl_wait;
+    uint64_t     dl_earliest_replenish;  // The earliest start of a period among them
+
+    // Counter variables keeping track of the time consumption of each task
+    uint64_t last_count;
+    uint64_t current_count;
+
+    uint64_t idle_time_ns;      // How many ns the cpu has been idle
+    uint64_t irq_time_ns;       // Time spent in interrupts, which isn't charged to the task
+    uint64_t irq_time_charged;  // The part of irq_time_ns deducted from the task time
+    uint64_t irq_start_ns;      // When the current interrupt started
+
+    // When the running task shall be preempted, zero to never preempt it
+    uint64_t preemption_timestamp_ns;
+    uint64_t preemption_event_ns;  // Timestamp of the registered preemption callback, or zero
+    uint64_t slice_start_ns;       // When the running task was scheduled
+
+    struct watchdog_cpu watchdog;
+    uint32_t            latency[RUNQUEUE_LATENCY_BUCKETS];
+};
+
+static struct runqueue runqueues[MAX_CPUS];
+
+/* The utilisation reserved by all deadline tasks, see DL_BW() */
+static uint64_t dl_total_bw = 0;
+
+/* Utilisation is stored as fixed point numbers with DL_BW_SHIFT fractional bits */
+#define DL_BW_SHIFT            20
+#define DL_BW(runtime, period) (((runtime) << DL_BW_SHIFT) / (period))
+#define DL_MAX_BW              (((uint64_t)SCHED_DEADLINE_MAX_UTIL << DL_BW_SHIFT) / 100)
+
+/* Maps nice values to weights, each step changes the share of the cpu by roughly 10% */
+static const uint32_t nice_to_weight[NICE_MAX - NICE_MIN + 1] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */ 9548,  7620,  6100,  4904,  3906,
+    /*  -5 */ 3121,  2501,  1991,  1586,  1277,
+    /*   0 */ 1024,  820,   655,   526,   423,
+    /*   5 */ 335,   272,   215,   172,   137,
+    /*  10 */ 110,   87,    70,    56,    45,
+    /*  15 */ 36,    29,    23,    18,    15,
+};
 
 // Sleep queue
 static EMPTY_QUEUE(sleep_queue);
@@ -39,26 +155,40 @@ static EMPTY_QUEUE(sleep_queue);
  */
 static DEFINE_LIST(termination_queue);
 
-/* Protects the whole scheduler */
+/*
+ * Protects the state shared by all cpus: the sleep and termination queues, the deadline admission
+ * control, the load averages and the watchdog reports. The per-cpu state is protected by the lock
+ * of its runqueue.
+ */
 static SPINLOCK_DEFINE(scheduler_lock);
 
-// Counter variables keeping track of the time consumption of each task
-static uint64_t last_count    = 0;
-static uint64_t current_count = 0;
+/*
+ * Exponentially decaying averages of the number of running and ready tasks over 1, 5 and 15
+ * minutes, sampled every LOAD_FREQ_NS, stored as fixed point numbers with LOAD_SHIFT fractional
+ * bits.
+ */
+#define LOAD_FREQ_NS SECONDS_TO_NS(5)
+#define LOAD_SHIFT   11
+#define LOAD_FIXED_1 (1u << LOAD_SHIFT)
+
+static const uint32_t load_decay[3] = {1884, 2014, 2037};  // LOAD_FIXED_1 / e^(5s / avg period)
+static uint32_t       load_avg[3];
 
-// Counts how many ns the CPU has been idle
-static uint64_t idle_time_ns = 0;
+// The number of detected lockups together with the last one
+static uint32_t     watchdog_lockups    = 0;
+static unsigned int watchdog_last_cpu   = 0;
+static tid_t        watchdog_last_tid   = 0;
+static uint64_t     watchdog_last_stall = 0;
 
-// Pointer to the currently running task
-task_t *current_task;
+// Pointer to the currently running task, accessed through current_task
+DEFINE_PER_CPU(task_t *, __current_task);
 
 // The next task to run, set by the scheduler, but the context switch itself is
 // handled by interrupt logic and is architecture dependent
-task_t *next_task;
+DEFINE_PER_CPU(task_t *, next_task);
 
-/* Stores at which timestamp the currently running task shall be preempted, if set to zero indicate
- * to never preempt */
-static uint64_t preemption_timestamp_ns = 0;
+/* The shortest time slice given to fair tasks, and how long they run before wakeup preemption */
+static uint32_t sched_min_granularity_ns = SCHED_MIN_GRANULARITY_NS;
 
 // Variables handling if the scheduler needs to postpone task switches. Necessary if you want to
 // unblock multiple tasks within without running the risk of the first unblocked task preempting the
@@ -68,7 +198,7 @@ static uint64_t preemption_timestamp_ns = 0;
  * Disables preemption if non-zero. Note, the process can still re-schedule itself;
  * so, the next time the process runs, the counter will be reset.
  */
-unsigned int preemption_counter;
+static DEFINE_PER_CPU(unsigned int, preemption_counter);
 
 /* Variable storing the earliest wakeup time (in ns since boot) for any sleeping task. Allows
  * clock drivers check if it's necessary to call the 'scheduler_check_sleep_queue' */
@@ -80,6 +210,27 @@ static task_t *cleanup_task = NULL;
 /* Flag indicating if the scheduler has been initialised */
 bool scheduler_initialised = false;
 
+/* The runqueue of the executing cpu */
+static inline struct runqueue *this_rq()
+{
+    return &runqueues[arch_cpu_id()];
+}
+
+/* The runqueue the task is placed in */
+static inline struct runqueue *task_rq(task_t *task)
+{
+    return &runqueues[task->cpu];
+}
+
+/* Locks the runqueue the task is placed in, tasks stay on the cpu they were created on */
+static struct runqueue *task_rq_lock(task_t *task, uint32_t *flags)
+{
+    struct runqueue *rq = task_rq(task);
+
+    spinlock_lock(&rq->lock, flags);
+    return rq;
+}
+
 void scheduler_disable_preemption()
 {
     unsigned int old;
@@ -87,8 +238,14 @@ void scheduler_disable_preemption()
     if (!scheduler_initialised) {
         return;
     }
-    old = preemption_counter++;
-    kassert(preemption_counter > old);
+    old = this_cpu_read(preemption_counter);
+    this_cpu_inc(preemption_counter);
+    kassert(this_cpu_read(preemption_counter) > old);
+
+    // Traced with the counter raised, so interrupts disabling preemption don't nest the tracing
+    if (old == 0) {
+        trace_preempt_off(TRACE_CALLER());
+    }
 }
 
 void scheduler_enable_preemption()
@@ -98,10 +255,348 @@ void scheduler_enable_preemption()
     if (!scheduler_initialised) {
         return;
     }
-    old = preemption_counter--;
-    kassert(preemption_counter < old);
+    old = this_cpu_read(preemption_counter);
+    if (old == 1) {
+        trace_preempt_on(TRACE_CALLER());
+    }
+    this_cpu_dec(preemption_counter);
+    kassert(this_cpu_read(preemption_counter) < old);
+}
+
+static void prio_enqueue(struct runqueue *rq, task_t *task)
+{
+    kassert(task->priority < SCHED_PRIORITY_LEVELS);
+    task_queue_enqueue(&rq->prio.queues[task->priority], task);
+    rq->prio.bitmap |= (1u << task->priority);
+}
+
+/* Removes the first task of the highest non-empty priority level, NULL if there's none */
+static task_t *prio_dequeue(struct runqueue *rq)
+{
+    unsigned int  prio;
+    task_t       *task;
+    task_queue_t *queue;
+
+    while (rq->prio.bitmap) {
+        prio  = (unsigned int)__builtin_ctz(rq->prio.bitmap);
+        queue = &rq->prio.queues[prio];
+        task  = task_queue_dequeue(queue);
+
+        if (TASK_QUEUE_EMPTY(queue)) {
+            rq->prio.bitmap &= ~(1u << prio);
+        }
+        if (task) {
+            return task;
+        }
+    }
+    return NULL;
 }
 
+static bool prio_runqueue_empty(struct runqueue *rq)
+{
+    for (uint32_t bitmap = rq->prio.bitmap; bitmap; bitmap &= bitmap - 1) {
+        if (!TASK_QUEUE_EMPTY(&rq->prio.queues[__builtin_ctz(bitmap)])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool vruntime_less(const struct rb_node *a, const struct rb_node *b)
+{
+    return GET_STRUCT(const task_t, run_node, a)->vruntime <
+           GET_STRUCT(const task_t, run_node, b)->vruntime;
+}
+
+static void fair_enqueue(struct runqueue *rq, task_t *task)
+{
+    kassert(!IS_TERMINATED(task) && task->current_task_queue == NULL);
+
+    // Just like the task queues, prevent the task from being free'd while queued
+    atomic_add_fetch(&task->ref_count, 1);
+    rb_add(&rq->fair.tasks, &task->run_node, vruntime_less);
+    rq->fair.total_weight += task->weight;
+    rq->fair.nr_queued++;
+}
+
+/* Removes the task with the smallest vruntime, NULL if there's none */
+static task_t *fair_dequeue(struct runqueue *rq)
+{
+    task_t         *task;
+    struct rb_node *node = rb_first(&rq->fair.tasks);
+
+    if (!node) {
+        return NULL;
+    }
+
+    task = GET_STRUCT(task_t, run_node, node);
+    rb_erase(&rq->fair.tasks, node);
+    rq->fair.total_weight -= task->weight;
+    rq->fair.nr_queued--;
+    put_task(task);
+    return task;
+}
+
+/* Scales the time by the inverse of the weight of the fair task */
+static uint64_t weighted_time(task_t *task, uint64_t time)
+{
+    if (task->weight == SCHED_NICE_0_WEIGHT) {
+        return time;
+    }
+    return time * SCHED_NICE_0_WEIGHT / task->weight;
+}
+
+/* Advances min_vruntime, curr is the running fair task or NULL */
+static void update_min_vruntime(struct runqueue *rq, task_t *curr)
+{
+    uint64_t        vruntime;
+    struct rb_node *leftmost = rb_first(&rq->fair.tasks);
+
+    if (curr) {
+        vruntime = curr->vruntime;
+        if (leftmost) {
+            vruntime = MIN(vruntime, GET_STRUCT(task_t, run_node, leftmost)->vruntime);
+        }
+    } else if (leftmost) {
+        vruntime = GET_STRUCT(task_t, run_node, leftmost)->vruntime;
+    } else {
+        return;
+    }
+
+    rq->fair.min_vruntime = MAX(rq->fair.min_vruntime, vruntime);
+}
+
+/*
+ * Places a waking fair task relative to the tasks that have kept running. Since it didn't use the
+ * cpu while blocked its vruntime could be far behind, letting it monopolise the cpu until it has
+ * caught up. Instead, only allow it to lag half a scheduling period behind.
+ */
+static void place_task(struct runqueue *rq, task_t *task)
+{
+    uint64_t min_vruntime = rq->fair.min_vruntime;
+
+    if (min_vruntime > SCHED_LATENCY_NS / 2) {
+        task->vruntime = MAX(task->vruntime, min_vruntime - SCHED_LATENCY_NS / 2);
+    }
+}
+
+static bool deadline_less(const struct rb_node *a, const struct rb_node *b)
+{
+    return GET_STRUCT(const task_t, run_node, a)->dl.abs_deadline <
+           GET_STRUCT(const task_t, run_node, b)->dl.abs_deadline;
+}
+
+static void dl_enqueue(struct runqueue *rq, task_t *task)
+{
+    kassert(!IS_TERMINATED(task) && task->current_task_queue == NULL);
+
+    atomic_add_fetch(&task->ref_count, 1);
+    rb_add(&rq->dl.tasks, &task->run_node, deadline_less);
+    rq->dl.nr_queued++;
+}
+
+/* Removes the task with the earliest deadline, NULL if there's none */
+static task_t *dl_dequeue(struct runqueue *rq)
+{
+    task_t         *task;
+    struct rb_node *node = rb_first(&rq->dl.tasks);
+
+    if (!node) {
+        return NULL;
+    }
+
+    task = GET_STRUCT(task_t, run_node, node);
+    rb_erase(&rq->dl.tasks, node);
+    rq->dl.nr_queued--;
+    put_task(task);
+    return task;
+}
+
+/*
+ * Starts a new instance of the deadline task if the current one has ended. Instances are kept
+ * periodic, unless the task has been blocked for longer than a period, then the new instance
+ * starts right away rather than trying to catch up.
+ */
+static void dl_update_instance(task_t *task, uint64_t now)
+{
+    uint64_t start = task->dl.next_period;
+
+    if (now < start) {
+        return;
+    }
+    if (now - start >= task->dl.period) {
+        start = now;
+    }
+
+    task->dl.abs_deadline = start + task->dl.deadline;
+    task->dl.next_period  = start + task->dl.period;
+    task->dl.remaining    = task->dl.runtime;
+}
+
+/*
+ * Gives back the utilisation reserved by a deadline task, turning it into a fair task. Requires
+ * both the scheduler lock and the lock of the task's runqueue.
+ */
+static void dl_release_locked(task_t *task)
+{
+    dl_total_bw -= DL_BW(task->dl.runtime, task->dl.period);
+    task->sched_class = SCHED_CLASS_FAIR;
+    place_task(task_rq(task), task);
+}
+
+static bool runqueue_empty(struct runqueue *rq)
+{
+    return RB_EMPTY(&rq->dl.tasks) && prio_runqueue_empty(rq) && RB_EMPTY(&rq->fair.tasks);
+}
+
+static void runqueue_enqueue(task_t *task)
+{
+    struct runqueue *rq = task_rq(task);
+
+    // The cpu can't be hogged by its task before others are waiting for it
+    if (runqueue_empty(rq)) {
+        rq->watchdog.touched = timer_get_time_since_boot();
+    }
+
+    if (task->sched_class == SCHED_CLASS_DEADLINE) {
+        dl_enqueue(rq, task);
+    } else if (task->sched_class == SCHED_CLASS_PRIORITY) {
+        prio_enqueue(rq, task);
+    } else {
+        fair_enqueue(rq, task);
+    }
+}
+
+/* Picks the next task to run, deadline tasks goes first, then priority and lastly fair tasks */
+static task_t *runqueue_dequeue(struct runqueue *rq)
+{
+    task_t *task = dl_dequeue(rq);
+    if (!task) {
+        task = prio_dequeue(rq);
+    }
+    return task ? task : fair_dequeue(rq);
+}
+
+/*
+ * Gives how long the task may run before being preempted. Fair tasks gets their share of the
+ * scheduling period, which is stretched when the minimum granularity can't be guaranteed.
+ */
+static uint64_t task_time_slice(task_t *task)
+{
+    uint64_t         period, slice;
+    uint32_t         total_weight;
+    unsigned int     nr_running;
+    struct runqueue *rq = task_rq(task);
+
+    if (task->sched_class == SCHED_CLASS_PRIORITY) {
+        return TIME_SLICE_NS(task->priority);
+    }
+
+    // Deadline tasks runs until their runtime is used up
+    if (task->sched_class == SCHED_CLASS_DEADLINE) {
+        return task->dl.remaining;
+    }
+
+    // Task is running, so it's not accounted for in the runqueue
+    nr_running   = rq->fair.nr_queued + 1;
+    total_weight = rq->fair.total_weight + task->weight;
+
+    period = SCHED_LATENCY_NS;
+    if (nr_running > SCHED_LATENCY_NS / sched_min_granularity_ns) {
+        period = (uint64_t)nr_running * sched_min_granularity_ns;
+    }
+
+    slice = period * task->weight / total_weight;
+    return MAX(slice, sched_min_granularity_ns);
+}
+
+/* Orders the scheduling classes, a task of a higher class always preempts the lower ones */
+static int class_rank(task_t *task)
+{
+    switch (task->sched_class) {
+        case SCHED_CLASS_DEADLINE:
+            return 2;
+        case SCHED_CLASS_PRIORITY:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Gives when the running task should be preempted by the woken task, or 0 if it shouldn't. Tasks
+ * of the same fair class only preempts if the woken task lags behind by more than the minimum
+ * granularity, and not before the current task has run for at least the minimum granularity,
+ * preventing tasks frequently waking up from thrashing the cpu.
+ */
+static uint64_t wakeup_preemption_time(struct runqueue *rq, task_t *task, uint64_t now)
+{
+    uint64_t vruntime;
+    task_t  *curr = rq->curr;
+
+    if (class_rank(task) != class_rank(curr)) {
+        return class_rank(task) > class_rank(curr) ? now : 0;
+    }
+
+    switch (task->sched_class) {
+        case SCHED_CLASS_DEADLINE:
+            return task->dl.abs_deadline < curr->dl.abs_deadline ? now : 0;
+
+        case SCHED_CLASS_PRIORITY:
+            return task->priority < curr->priority ? now : 0;
+
+        default:
+            // Account for the time the current task has run since its vruntime was last updated
+            vruntime = curr->vruntime + weighted_time(curr, now - rq->last_count);
+            if (vruntime <= task->vruntime + sched_min_granularity_ns) {
+                return 0;
+            }
+            return MAX(now, rq->slice_start_ns + sched_min_granularity_ns);
+    }
+}
+
+/* Charges the time since the task's last state change to its current state */
+static void account_state_change(task_t *task, uint64_t now)
+{
+    uint64_t delta = now - task->stats.last_change;
+
+    if (task->state == READY_TO_RUN) {
+        task->stats.wait_time += delta;
+    } else if (task->state == BLOCKED || task->state == BLOCKED_IDLING) {
+        task->stats.blocked_time[task->block_reason] += delta;
+    }
+    task->stats.last_change = now;
+}
+
+/* Adds a sample to the runqueue latency histogram */
+static void record_runqueue_latency(struct runqueue *rq, uint64_t latency_ns)
+{
+    unsigned int bucket = 0;
+
+    for (uint64_t us = latency_ns / 1000; us && bucket < RUNQUEUE_LATENCY_BUCKETS - 1; us >>= 1) {
+        bucket++;
+    }
+    rq->latency[bucket]++;
+}
+
+static void update_time_used(struct runqueue *rq);
+
+static void preemption_callback(uint64_t time_since_boot_ns, uint64_t timestamp_ns);
+
+/*
+ * Makes sure the preemption callback fires at the preemption timestamp. The callback is only
+ * registered while there's a timestamp, so a cpu without other tasks to run isn't woken up.
+ */
+static void arm_preemption_event(struct runqueue *rq)
+{
+    if (rq->preemption_timestamp_ns &&
+        (!rq->preemption_event_ns || rq->preemption_timestamp_ns < rq->preemption_event_ns)) {
+        rq->preemption_event_ns = rq->preemption_timestamp_ns;
+        timer_register_timed_event(rq->preemption_event_ns, preemption_callback);
+    }
+}
+
+/* Requires the lock of the current task's runqueue */
 static void mark_task_blocked_locked(block_reason_t reason)
 {
     LOG("Block task %x, reason %u", current_task, reason);
@@ -111,39 +606,96 @@ static void mark_task_blocked_locked(block_reason_t reason)
 
 void scheduler_block_task(block_reason_t reason)
 {
-    uint32_t flags;
+    uint32_t         flags;
+    struct runqueue *rq = task_rq_lock(current_task, &flags);
 
-    spinlock_lock(&scheduler_lock, &flags);
     mark_task_blocked_locked(reason);
-    spinlock_unlock(&scheduler_lock, flags);
+    spinlock_unlock(&rq->lock, flags);
     scheduler_yield();
 }
 
-void scheduler_unblock_task_locked(task_t *task)
+/*
+ * Makes the blocked task ready to run, requires the lock of its runqueue. The task running on
+ * another cpu is preempted at the end of that cpu's next interrupt, there are no inter-processor
+ * interrupts to notify it sooner.
+ */
+static void wake_task_locked(struct runqueue *rq, task_t *task)
 {
+    uint64_t now, preempt_at;
+    task_t  *curr = rq->curr;
+
     LOG("Unblock task %x", task);
 
-    if (task->state == BLOCKED || task->state == BLOCKED_IDLING) {
-        if (task == current_task) {
-            LOG("Unblock current, rescheduling it");
-            kassert(MARK_FOR_RESCHEDULE(task));
-            task->state = RUNNING;
-        } else {
-            LOG("put %x in ready_queue", task);
-            task->state = READY_TO_RUN;
-            task_queue_enqueue(&ready_queue, task);
+    if (task->state != BLOCKED && task->state != BLOCKED_IDLING) {
+        return;
+    }
 
-            // Remove current from idle state so do_schedule() can run on next irq
-            if (current_task->state == BLOCKED_IDLING) {
-                current_task->state = BLOCKED;
-            }
+    now = timer_get_time_since_boot();
+    if (task->sched_class == SCHED_CLASS_DEADLINE) {
+        dl_update_instance(task, now);
+    }
 
-            // Make sure the current_task gets preempted
-            if (!preemption_timestamp_ns) {
-                preemption_timestamp_ns = timer_get_time_since_boot() + TIME_SLICE_NS;
-            }
+    // Charge the time spent idling to the idle time rather than the task
+    if (curr->state == BLOCKED_IDLING) {
+        update_time_used(rq);
+    }
+
+    // The running task is still running until it has been switched out, unless it's idling
+    if (task != curr || task->state == BLOCKED_IDLING) {
+        account_state_change(task, now);
+    }
+
+    if (task == curr) {
+        LOG("Unblock current, rescheduling it");
+        kassert(MARK_FOR_RESCHEDULE(task));
+        task->state = RUNNING;
+        return;
+    }
+
+    LOG("put %x in runqueue", task);
+    task->state = READY_TO_RUN;
+    if (task->sched_class == SCHED_CLASS_FAIR) {
+        place_task(rq, task);
+    }
+    runqueue_enqueue(task);
+
+    // Remove the running task from idle state so do_schedule() can run on next irq
+    if (curr->state == BLOCKED_IDLING) {
+        curr->state = BLOCKED;
+    }
+
+    // Let the woken task preempt the running task early if it's more important, the preemption
+    // is carried out at the end of the interrupt or by the preemption callback
+    if (curr->state == RUNNING) {
+        preempt_at = wakeup_preemption_time(rq, task, now);
+        if (preempt_at &&
+            (!rq->preemption_timestamp_ns || preempt_at < rq->preemption_timestamp_ns)) {
+            LOG("%x preempts %x at %u", task, curr, preempt_at);
+            rq->preemption_timestamp_ns = preempt_at;
         }
     }
+
+    // Make sure the running task gets preempted
+    if (!rq->preemption_timestamp_ns) {
+        rq->preemption_timestamp_ns = now + task_time_slice(curr);
+    }
+    arm_preemption_event(rq);
+}
+
+/* Makes the blocked task ready to run, requires the scheduler lock */
+static void scheduler_unblock_task_locked(task_t *task)
+{
+    uint32_t         flags;
+    struct runqueue *rq;
+
+    // Woken before the timeout of a timed block expired
+    if (task->current_task_queue == &sleep_queue) {
+        task_remove_from_current_task_queue(task);
+    }
+
+    rq = task_rq_lock(task, &flags);
+    wake_task_locked(rq, task);
+    spinlock_unlock(&rq->lock, flags);
 }
 
 void scheduler_unblock_task(task_t *task)
@@ -155,16 +707,79 @@ void scheduler_unblock_task(task_t *task)
     spinlock_unlock(&scheduler_lock, flags);
 }
 
-static void update_time_used()
+/*
+    Called within the timer interrupt using the timed event mechanism, letting deadline tasks
+    waiting for their next period run again.
+*/
+static void dl_replenish_callback(uint64_t time_since_boot_ns, uint64_t timestamp_ns)
 {
-    current_count    = timer_get_time_since_boot();
-    uint64_t elapsed = current_count - last_count;
-    last_count       = current_count;
+    uint32_t         flags;
+    task_t          *task;
+    struct runqueue *rq;
 
-    if (current_task->status == BLOCKED_IDLING) {
-        idle_time_ns += elapsed;
-    } else {
-        current_task->time_used += elapsed;
+    (void)timestamp_ns;  // silence unused warning
+
+    // Tasks are never migrated, so each cpu keeps its own throttled tasks
+    for (unsigned int cpu = 0; cpu < arch_cpus_online(); cpu++) {
+        rq = &runqueues[cpu];
+        spinlock_lock(&rq->lock, &flags);
+        rq->dl_earliest_replenish = UINT64_MAX;
+
+        LIST_ITER_STRUCT_SAFE_REMOVAL(&rq->dl_wait.list, task, task_t, task_queue_entry)
+        {
+            if (task->dl.next_period <= time_since_boot_ns) {
+                LOG("Replenish deadline task %x at %u", task, time_since_boot_ns);
+                task_remove_from_current_task_queue(task);
+                wake_task_locked(rq, task);
+            } else if (task->dl.next_period < rq->dl_earliest_replenish) {
+                rq->dl_earliest_replenish = task->dl.next_period;
+            }
+        }
+
+        if (rq->dl_earliest_replenish < UINT64_MAX) {
+            timer_register_timed_event(rq->dl_earliest_replenish, dl_replenish_callback);
+        }
+        spinlock_unlock(&rq->lock, flags);
+    }
+}
+
+/* Blocks the current deadline task until its next period, requires the lock of its runqueue */
+static void dl_throttle_locked(struct runqueue *rq)
+{
+    task_t *task = current_task;
+
+    task_queue_enqueue(&rq->dl_wait, task);
+    if (task->dl.next_period < rq->dl_earliest_replenish) {
+        rq->dl_earliest_replenish = task->dl.next_period;
+        timer_register_timed_event(rq->dl_earliest_replenish, dl_replenish_callback);
+    }
+    mark_task_blocked_locked(BLOCK_REASON_DEADLINE_WAIT);
+}
+
+/* Charges the time since the last update to the task running on the cpu of the runqueue */
+static void update_time_used(struct runqueue *rq)
+{
+    task_t  *curr    = rq->curr;
+    uint64_t elapsed;
+
+    rq->current_count = timer_get_time_since_boot();
+    elapsed           = rq->current_count - rq->last_count;
+    rq->last_count    = rq->current_count;
+
+    // Time spent in interrupts is accounted separately
+    elapsed -= MIN(elapsed, rq->irq_time_ns - rq->irq_time_charged);
+    rq->irq_time_charged = rq->irq_time_ns;
+
+    if (curr->state == BLOCKED_IDLING) {
+        rq->idle_time_ns += elapsed;
+        return;
+    }
+    curr->time_used += elapsed;
+
+    if (curr->sched_class == SCHED_CLASS_FAIR) {
+        curr->vruntime += weighted_time(curr, elapsed);
+    } else if (curr->sched_class == SCHED_CLASS_DEADLINE) {
+        curr->dl.remaining -= MIN(elapsed, curr->dl.remaining);
     }
 }
 
@@ -175,74 +790,124 @@ void scheduler_yield()
     // Should never try reschedule while in atomic context
     kassert(interrupts_enabled() && !(task->status & TASK_STATUS_INTERRUPT));
 
-    if (preemption_counter) {
+    if (this_cpu_read(preemption_counter)) {
         LOG("%x voluntarily re-schedules while preemption is disabled %x", task);
     }
 
     /*
-     * Since context switches occurs within interrupts we simply set the
-     * rescheduling status flags and waits for the next interrupt to do the work.
-     * Since there might not be any other task to schedule, this thread might
-     * need to act as the idle thread, hence the loop.
+     * Context switches occurs on the way out of interrupts, so set the rescheduling status flag
+     * and raise the reschedule interrupt to switch task right away. If there's no other task to
+     * schedule, this thread needs to act as the idle thread until it's woken up, hence the loop.
      */
     MARK_FOR_RESCHEDULE(task);
-    do {
-        wait_for_interrupt();
-    } while (WAITING_FOR_RESCHEDULE(task));
+    raise_reschedule_interrupt();
+
+    disable_interrupts();
+    while (WAITING_FOR_RESCHEDULE(task)) {
+        enable_interrupts_and_wait();
+        disable_interrupts();
+    }
+    enable_interrupts();
 }
 
 /*
  * The core of the scheduler, set the next_task to be executed at the next
  * context switch.
  *
- * Note, is up to the caller to ensure that function is called in thread safe manner
+ * Note, must be called with interrupts disabled on the way out of an interrupt
  */
-void do_schedule()
+static void do_schedule()
 {
-    struct task *task;
+    uint32_t         flags;
+    struct task     *task;
+    struct runqueue *rq = this_rq();
 
-    update_time_used();
-    kassert(WAITING_FOR_RESCHEDULE(current_task));
+    // Blocking or yielding within a rcu read-side critical section is forbidden, so passing through
+    // the scheduler is a quiescent state. Preemption is disabled within the sections.
+    kassert(!rcu_read_lock_held());
+    rcu_note_quiescent_state();
 
     // If a process voluntary re-schedules itself, it implicitly tells the system
-    // that it's no longer needs to be run in a non-preemption context
-    if (preemption_counter) {
+    // that it's no longer needs to be run in a non-preemption context. Done before taking the
+    // runqueue lock, since the lock itself disables preemption.
+    if (this_cpu_read(preemption_counter)) {
         LOG("Reseting preemption counter");
-        preemption_counter = 0;
+        trace_preempt_on((uintptr_t)do_schedule);
+        this_cpu_write(preemption_counter, 0);
+    }
+
+    spinlock_lock(&rq->lock, &flags);
+    update_time_used(rq);
+    kassert(WAITING_FOR_RESCHEDULE(current_task));
+
+    rq->watchdog.touched  = rq->current_count;
+    rq->watchdog.reported = false;
+
+    // Throttle deadline tasks that have used up their runtime, unless no one else wants the cpu
+    if (current_task->sched_class == SCHED_CLASS_DEADLINE && current_task->state == RUNNING) {
+        dl_update_instance(current_task, rq->current_count);
+        if (current_task->dl.remaining == 0 && !runqueue_empty(rq)) {
+            LOG("Throttle %x until %u", current_task, current_task->dl.next_period);
+            dl_throttle_locked(rq);
+        }
+    }
+
+    // Requeue current_task if possible, letting it compete with the other ready tasks
+    if (current_task->state == RUNNING) {
+        current_task->state = READY_TO_RUN;
+        runqueue_enqueue(current_task);
     }
 
-    task = task_queue_dequeue(&ready_queue);
+    // The time the current task ran isn't charged to its state, that's done by update_time_used()
+    current_task->stats.last_change = rq->current_count;
+
+    task = runqueue_dequeue(rq);
     if (!task) {
         // No need to preempt when there's no other tasks asking for cpu time
-        preemption_timestamp_ns = 0;
+        rq->preemption_timestamp_ns = 0;
 
-        if (current_task->state == RUNNING) {
-            LOG("No new task in queue, let the task continue");
-            current_task->status &= ~TASK_STATUS_RESCHEDULE;
-        } else if (current_task->state == BLOCKED) {
+        if (current_task->state == BLOCKED) {
             LOG("No new task in queue, but current is blocked, idle");
             current_task->state = BLOCKED_IDLING;
+            current_task->stats.nr_voluntary_switches++;
         } else {
             kassert(false);
         }
+        spinlock_unlock(&rq->lock, flags);
         return;
     }
-    // current_task cannot be queued to run while running, there must be a scheduler bug
-    kassert(task != current_task);
 
-    LOG("Re-schedule to %x", task);
-    next_task        = task;
-    next_task->state = RUNNING;
-    current_task->status &= ~TASK_STATUS_RESCHEDULE;
+    if (task == current_task) {
+        LOG("No task of higher priority in queue, let the task continue");
+    } else {
+        LOG("Re-schedule to %x", task);
+        if (current_task->status & TASK_STATUS_PREEMPTED) {
+            current_task->stats.nr_involuntary_switches++;
+        } else {
+            current_task->stats.nr_voluntary_switches++;
+        }
+        record_runqueue_latency(rq, rq->current_count - task->stats.last_change);
+    }
+    account_state_change(task, rq->current_count);
 
-    // Requeue current_task if possible
-    if (current_task->state == RUNNING) {
-        current_task->state = READY_TO_RUN;
-        task_queue_enqueue(&ready_queue, current_task);
+    this_cpu_write(next_task, task);
+    if (task != current_task) {
+        fpu_switch(current_task, task);
     }
+    rq->curr    = task;
+    task->state = RUNNING;
+    current_task->status &= (uint8_t) ~(TASK_STATUS_RESCHEDULE | TASK_STATUS_PREEMPTED);
 
-    preemption_timestamp_ns =
-        !TASK_QUEUE_EMPTY(&ready_queue) ? timer_get_time_since_boot() + TIME_SLICE_NS : 0;
+    if (task->sched_class == SCHED_CLASS_FAIR) {
+        update_min_vruntime(rq, task);
+    }
+
+    // No need to preempt when there's no other tasks asking for cpu time
+    rq->slice_start_ns = rq->current_count;
+    rq->preemption_timestamp_ns =
+        !runqueue_empty(rq) ? rq->current_count + task_time_slice(task) : 0;
+    arm_preemption_event(rq);
+    spinlock_unlock(&rq->lock, flags);
 }
 
 /*
@@ -285,75 +950,181 @@ static void sleep_expiry_callback(uint64_t time_since_boot_ns, uint64_t timestam
 
 /*
     Called within the timer interrupt using the timed event mechanism check if it's time to preempt
-    the currently running task
+    the currently running task. Only the executing cpu is handled, the other cpus preempt their
+    tasks at the end of their next interrupt once the preemption timestamp has passed.
 */
 static void preemption_callback(uint64_t time_since_boot_ns, uint64_t timestamp_ns)
 {
-    // NOTE: No need to lock scheduler since function will be called within the timer ISR
-    uint64_t next_preemption_timestamp = time_since_boot_ns + TIME_SLICE_NS;
+    uint32_t         flags;
+    struct runqueue *rq          = this_rq();
+    bool             preemptible = !this_cpu_read(preemption_counter);
 
-    (void)timestamp_ns;  // silence unused warning
+    spinlock_lock(&rq->lock, &flags);
 
-    if (preemption_timestamp_ns != 0) {
-        /* if preemption_timestamp is less than our time since boot than he callback has fired to
-         * late, indicating something is wrong with the scheduler */
-        kassert(preemption_timestamp_ns >= time_since_boot_ns);
-
-        /* Should currently running task be preempted?  */
-        if (preemption_timestamp_ns == time_since_boot_ns) {
-            /*
-               Mark the currently running task ready for rescheduling, allowing the interrupt
-               system to reschedule when it is safe to do so.
-            */
-            if (!preemption_counter) {
-                MARK_FOR_RESCHEDULE(current_task);
-
-                // Preemption should de disabled while idling
-                kassert(current_task->state != BLOCKED_IDLING);
-            } else {
-                LOG("Preemption disabled, skip rescheduling");
+    // Superseded by an earlier callback, which has already taken care of the preemption
+    if (timestamp_ns != rq->preemption_event_ns) {
+        goto out;
+    }
+    rq->preemption_event_ns = 0;
+
+    // Nothing else is asking for cpu time, the callback is registered again once there is
+    if (rq->preemption_timestamp_ns == 0) {
+        goto out;
+    }
+
+    if (rq->preemption_timestamp_ns > time_since_boot_ns) {
+        // The preemption has been postponed since the callback was registered
+        LOG("No need to preempt %x at %u", current_task, time_since_boot_ns);
+        arm_preemption_event(rq);
+        goto out;
+    }
+
+    /*
+       Mark the currently running task ready for rescheduling, allowing the interrupt system to
+       reschedule when it is safe to do so. Rescheduling re-arms the callback.
+    */
+    if (preemptible) {
+        MARK_FOR_RESCHEDULE(current_task);
+        current_task->status |= TASK_STATUS_PREEMPTED;
+
+        // Preemption should de disabled while idling
+        kassert(current_task->state != BLOCKED_IDLING);
+    } else {
+        LOG("Preemption disabled, skip rescheduling");
+        rq->preemption_event_ns = time_since_boot_ns + sched_min_granularity_ns;
+        timer_register_timed_event(rq->preemption_event_ns, preemption_callback);
+    }
+
+out:
+    spinlock_unlock(&rq->lock, flags);
+}
+
+/* Counts the running and ready tasks of all cpus */
+static unsigned int nr_active()
+{
+    uint32_t         flags;
+    unsigned int     nr = 0;
+    task_t          *task;
+    struct runqueue *rq;
+
+    for (unsigned int cpu = 0; cpu < arch_cpus_online(); cpu++) {
+        rq = &runqueues[cpu];
+        spinlock_lock(&rq->lock, &flags);
+        nr += rq->dl.nr_queued + rq->fair.nr_queued;
+        for (int i = 0; i < SCHED_PRIORITY_LEVELS; i++) {
+            LIST_ITER_STRUCT(&rq->prio.queues[i].list, task, task_t, task_queue_entry)
+            {
+                nr++;
             }
-        } else {
-            /* No, adjust next_preemption timestamp so that the next callback fire when it's time */
-            LOG("No need to preempt %x at %u", current_task, time_since_boot_ns);
-            next_preemption_timestamp = preemption_timestamp_ns;
         }
+        if (rq->curr && rq->curr->state == RUNNING) {
+            nr++;
+        }
+        spinlock_unlock(&rq->lock, flags);
     }
-
-    /* Register a new callback at the appropriate time */
-    timer_register_timed_event(next_preemption_timestamp, preemption_callback);
+    return nr;
 }
 
-/* Tells the scheduler to but current task to sleep until the timestamp when */
-void scheduler_nano_sleep_until(uint64_t when)
+/*
+    Called within the timer interrupt using the timed event mechanism, sampling the number of active
+    tasks into the load averages
+*/
+static void load_avg_callback(uint64_t time_since_boot_ns, uint64_t timestamp_ns)
 {
     uint32_t flags;
-    LOG("Put task %x to sleep until %u", current_task, when);
+    uint64_t active;
 
-    // No need to sleep if when has already occurred
-    if (when <= timer_get_time_since_boot()) {
-        return;
+    (void)timestamp_ns;  // silence unused warning
+
+    active = (uint64_t)nr_active() * LOAD_FIXED_1;
+    spinlock_lock(&scheduler_lock, &flags);
+    for (int i = 0; i < 3; i++) {
+        load_avg[i] = (uint32_t)(((uint64_t)load_avg[i] * load_decay[i] +
+                                  active * (LOAD_FIXED_1 - load_decay[i])) >>
+                                 LOAD_SHIFT);
     }
+    spinlock_unlock(&scheduler_lock, flags);
+
+    timer_register_timed_event(time_since_boot_ns + LOAD_FREQ_NS, load_avg_callback);
+}
+
+/* Reports the cpus which hasn't passed through the scheduler while tasks have been waiting */
+static void watchdog_callback(uint64_t time_since_boot_ns, uint64_t timestamp_ns)
+{
+    uint32_t         flags, rq_flags;
+    bool             locked_up;
+    struct runqueue *rq;
+
+    (void)timestamp_ns;  // silence unused warning
 
     spinlock_lock(&scheduler_lock, &flags);
-    current_task->sleep_expiry = when;
+    for (unsigned int cpu = 0; cpu < arch_cpus_online(); cpu++) {
+        rq = &runqueues[cpu];
+        spinlock_lock(&rq->lock, &rq_flags);
+        locked_up = !rq->watchdog.reported && !runqueue_empty(rq) &&
+                    time_since_boot_ns >= rq->watchdog.touched + SCHED_WATCHDOG_THRESHOLD_NS;
+        if (locked_up) {
+            rq->watchdog.reported = true;
+            watchdog_last_cpu     = cpu;
+            watchdog_last_tid     = rq->curr->tid;
+            watchdog_last_stall   = time_since_boot_ns - rq->watchdog.touched;
+            watchdog_lockups++;
+        }
+        spinlock_unlock(&rq->lock, rq_flags);
 
-    // Add task to sleep queue
-    task_queue_enqueue(&sleep_queue, current_task);
+        if (!locked_up) {
+            continue;
+        }
 
-    // Adjust first wakeup if necessary
-    if (when < scheduler_earliest_wakeup) {
-        scheduler_earliest_wakeup = when;
+        log("[WATCHDOG] soft lockup on cpu %u, task %u stuck for %u ms", cpu, watchdog_last_tid,
+            (uint32_t)(watchdog_last_stall / 1000000));
+    }
+    spinlock_unlock(&scheduler_lock, flags);
 
-        // Only register time event if this task needs to wakeup before the previous ones
-        timer_register_timed_event(when, sleep_expiry_callback);
+    timer_register_timed_event(time_since_boot_ns + SCHED_WATCHDOG_INTERVAL_NS, watchdog_callback);
+}
+
+/* Marks the current task as blocked without yielding, see internal.h */
+void scheduler_prepare_block(block_reason_t reason, uint64_t when)
+{
+    uint32_t         flags, rq_flags;
+    struct runqueue *rq;
+
+    spinlock_lock(&scheduler_lock, &flags);
+    if (when) {
+        LOG("Put task %x to sleep until %u", current_task, when);
+        current_task->sleep_expiry = when;
+
+        // Add task to sleep queue
+        task_queue_enqueue(&sleep_queue, current_task);
+
+        // Adjust first wakeup if necessary
+        if (when < scheduler_earliest_wakeup) {
+            scheduler_earliest_wakeup = when;
+
+            // Only register time event if this task needs to wakeup before the previous ones
+            timer_register_timed_event(when, sleep_expiry_callback);
+        }
     }
 
     // Must be within a non-irq context to prevent the sleep expiry callback
     // from firing, potential trying to unblock the task before blocking it,
     // if we block afterwards, it will never wake up
-    mark_task_blocked_locked(BLOCK_REASON_SLEEP);
+    rq = task_rq_lock(current_task, &rq_flags);
+    mark_task_blocked_locked(reason);
+    spinlock_unlock(&rq->lock, rq_flags);
     spinlock_unlock(&scheduler_lock, flags);
+}
+
+/* Tells the scheduler to but current task to sleep until the timestamp when */
+void scheduler_nano_sleep_until(uint64_t when)
+{
+    // No need to sleep if when has already occurred
+    if (when <= timer_get_time_since_boot()) {
+        return;
+    }
+
+    scheduler_prepare_block(BLOCK_REASON_SLEEP, when);
     scheduler_yield();
 }
 
@@ -361,8 +1132,34 @@ void scheduler_nano_sleep_until(uint64_t when)
  * done executing allowing the scheduler to perform save preemption */
 void scheduler_end_of_interrupt()
 {
+    uint32_t         flags;
+    uint64_t         now;
+    bool             preemptible, reschedule;
+    struct runqueue *rq = this_rq();
+
     if (current_task != NULL) {
-        if (WAITING_FOR_RESCHEDULE(current_task) && current_task->state != BLOCKED_IDLING) {
+        preemptible = !this_cpu_read(preemption_counter);
+
+        spinlock_lock(&rq->lock, &flags);
+        now = timer_get_time_since_boot();
+        rq->irq_time_ns += now - rq->irq_start_ns;
+
+        /*
+         * Preempt right away once the preemption timestamp has passed rather than waiting for the
+         * preemption callback, it's what allows woken tasks, and deadline tasks running out of
+         * runtime, to be switched to at the end of the waking interrupt or the next timer tick.
+         */
+        if (preemptible && rq->preemption_timestamp_ns && rq->preemption_timestamp_ns <= now &&
+            current_task->state == RUNNING) {
+            MARK_FOR_RESCHEDULE(current_task);
+            current_task->status |= TASK_STATUS_PREEMPTED;
+        }
+
+        reschedule =
+            WAITING_FOR_RESCHEDULE(current_task) && current_task->state != BLOCKED_IDLING;
+        spinlock_unlock(&rq->lock, flags);
+
+        if (reschedule) {
             do_schedule();
         }
         current_task->status &= ~TASK_STATUS_INTERRUPT;
@@ -373,7 +1170,9 @@ void scheduler_end_of_interrupt()
  * called */
 void scheduler_start_of_interrupt()
 {
-    if (current_task != NULL) {
+    // Nested interrupts are accounted to the outermost one
+    if (current_task != NULL && !(current_task->status & TASK_STATUS_INTERRUPT)) {
+        this_rq()->irq_start_ns = timer_get_time_since_boot();
         current_task->status |= TASK_STATUS_INTERRUPT;
     }
 }
@@ -383,7 +1182,8 @@ void scheduler_terminate_task()
 {
     // Note: Can do any harmless stuff here (close files, free memory in user-space, ...) but
     // there's none of that yet
-    uint32_t flags;
+    uint32_t         flags, rq_flags;
+    struct runqueue *rq;
 
     spinlock_lock(&scheduler_lock, &flags);
     if (current_task->current_task_queue) {
@@ -396,7 +1196,12 @@ void scheduler_terminate_task()
     send_task_termination_event(current_task);
 
     LOG("Adding %x to termination queue", current_task);
+    rq = task_rq_lock(current_task, &rq_flags);
+    if (current_task->sched_class == SCHED_CLASS_DEADLINE) {
+        dl_release_locked(current_task);
+    }
     mark_task_blocked_locked(BLOCK_REASON_TERMINATED);
+    spinlock_unlock(&rq->lock, rq_flags);
     spinlock_unlock(&scheduler_lock, flags);
     scheduler_yield();
 }
@@ -406,11 +1211,13 @@ static void cleanup_thread()
     uint32_t           flags;
     task_t            *task;
     bool               empty;
+    struct list        dead;
 
     // TODO: Re-write to handle refcount...
 
     while (true) {
         LOG("wakeup");
+        list_init(&dead);
         spinlock_lock(&scheduler_lock, &flags);
         LIST_ITER_STRUCT_SAFE_REMOVAL(&termination_queue, task, task_t, task_queue_entry)
         {
@@ -419,7 +1226,7 @@ static void cleanup_thread()
                 LOG("Cleanup terminated task %x", task);
 
                 list_entry_remove(&task->task_queue_entry);
-                free_task(task);
+                list_add_last(&dead, &task->task_queue_entry);
             } else {
                 LOG("Terminated thread still in use %x", task);
             }
@@ -427,6 +1234,13 @@ static void cleanup_thread()
         empty = LIST_EMPTY(&termination_queue);
         spinlock_unlock(&scheduler_lock, flags);
 
+        // Freeing defers to rcu, which can't be done with the scheduler lock held
+        LIST_ITER_STRUCT_SAFE_REMOVAL(&dead, task, task_t, task_queue_entry)
+        {
+            list_entry_remove(&task->task_queue_entry);
+            free_task(task);
+        }
+
         if (!empty) {
             // There tasks left to kill, hopefully they can be free'd the next time this thread
             // runs
@@ -447,23 +1261,44 @@ void scheduler_init()
      */
     uint32_t flags = get_register_and_disable_interrupts();
 
-    current_task = create_root_task();
+    for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct runqueue *rq = &runqueues[cpu];
+
+        spinlock_init(&rq->lock);
+        rq->cpu = cpu;
+        rb_init(&rq->dl.tasks);
+        rb_init(&rq->fair.tasks);
+        for (int i = 0; i < SCHED_PRIORITY_LEVELS; i++) {
+            task_queue_init(&rq->prio.queues[i]);
+        }
+        task_queue_init(&rq->dl_wait);
+        rq->dl_earliest_replenish = UINT64_MAX;
+    }
+
+    this_cpu_write(__current_task, create_root_task());
     if (current_task == NULL) {
         kpanic("Failed to allocate memory for initial task");
     }
 
-    next_task               = current_task;
-    last_count              = timer_get_time_since_boot();
-    preemption_timestamp_ns = timer_get_time_since_boot() + TIME_SLICE_NS;
+    this_cpu_write(next_task, current_task);
+    this_rq()->curr                    = current_task;
+    this_rq()->last_count              = timer_get_time_since_boot();
+    this_rq()->preemption_timestamp_ns = timer_get_time_since_boot() +
+                                         task_time_slice(current_task);
 
     // Mark the scheduler as initialised
     scheduler_initialised = true;
-    timer_register_timed_event(preemption_timestamp_ns, preemption_callback);
+    arm_preemption_event(this_rq());
+
+    timer_register_timed_event(timer_get_time_since_boot() + LOAD_FREQ_NS, load_avg_callback);
+    timer_register_timed_event(timer_get_time_since_boot() + SCHED_WATCHDOG_INTERVAL_NS,
+                               watchdog_callback);
 
     LOG("Initialise scheduler (root proc: %x)", current_task);
 
     // Start task cleaning up terminated task
     cleanup_task = get_task(create_task(cleanup_thread));
+    rcu_init();
 
     restore_interrupt_register(flags);
 }
@@ -473,3 +1308,248 @@ task_t *scheduler_get_current_task()
 {
     return current_task;
 }
+
+/* Sets the minimum granularity knob, returns 0 on success, otherwise -ERRNO */
+int scheduler_set_min_granularity(uint64_t granularity_ns)
+{
+    if (granularity_ns < SCHED_MIN_GRANULARITY_LOWER_NS || granularity_ns > SCHED_LATENCY_NS) {
+        return -EINVAL;
+    }
+
+    WRITE_ONCE(sched_min_granularity_ns, (uint32_t)granularity_ns);
+    return 0;
+}
+
+/* Sets the nice value of a fair task, returns 0 on success, otherwise -ERRNO */
+int scheduler_set_nice(task_t *task, int nice)
+{
+    uint32_t         flags;
+    uint32_t         weight;
+    struct runqueue *rq;
+
+    if (nice < NICE_MIN || nice > NICE_MAX || task->sched_class != SCHED_CLASS_FAIR) {
+        return -EINVAL;
+    }
+
+    rq     = task_rq_lock(task, &flags);
+    weight = nice_to_weight[nice - NICE_MIN];
+
+    // The vruntime is unaffected, so a queued task keeps its place in the runqueue
+    if (task->state == READY_TO_RUN) {
+        rq->fair.total_weight = rq->fair.total_weight - task->weight + weight;
+    }
+    task->nice   = (int8_t)nice;
+    task->weight = weight;
+    spinlock_unlock(&rq->lock, flags);
+    return 0;
+}
+
+/*
+    Turns the current task into a deadline task, guaranteed runtime_ns of cpu time within
+    deadline_ns of the start of each period. Requires runtime <= deadline <= period. Returns 0 on
+    success, -EBUSY if admitting the task would exceed SCHED_DEADLINE_MAX_UTIL, otherwise -ERRNO.
+*/
+int scheduler_set_deadline(uint64_t runtime_ns, uint64_t deadline_ns, uint64_t period_ns)
+{
+    uint32_t         flags, rq_flags;
+    uint64_t         bw, old_bw = 0, now;
+    task_t          *task = current_task;
+    struct runqueue *rq;
+
+    if (runtime_ns == 0 || runtime_ns > deadline_ns || deadline_ns > period_ns ||
+        period_ns > (UINT64_MAX >> DL_BW_SHIFT)) {
+        return -EINVAL;
+    }
+    bw = DL_BW(runtime_ns, period_ns);
+
+    // Admission control, only accept the task if the deadlines can be met for all tasks
+    spinlock_lock(&scheduler_lock, &flags);
+    if (task->sched_class == SCHED_CLASS_DEADLINE) {
+        old_bw = DL_BW(task->dl.runtime, task->dl.period);
+    }
+    if (dl_total_bw - old_bw + bw > DL_MAX_BW) {
+        spinlock_unlock(&scheduler_lock, flags);
+        return -EBUSY;
+    }
+    dl_total_bw = dl_total_bw - old_bw + bw;
+
+    rq                    = task_rq_lock(task, &rq_flags);
+    now                   = timer_get_time_since_boot();
+    task->sched_class     = SCHED_CLASS_DEADLINE;
+    task->dl.runtime      = runtime_ns;
+    task->dl.deadline     = deadline_ns;
+    task->dl.period       = period_ns;
+    task->dl.abs_deadline = now + deadline_ns;
+    task->dl.next_period  = now + period_ns;
+    task->dl.remaining    = runtime_ns;
+    spinlock_unlock(&rq->lock, rq_flags);
+    spinlock_unlock(&scheduler_lock, flags);
+
+    LOG("%x is now a deadline task (%u/%u/%u us)", task, (uint32_t)(runtime_ns / 1000),
+        (uint32_t)(deadline_ns / 1000), (uint32_t)(period_ns / 1000));
+    return 0;
+}
+
+/* Turns the current deadline task back into a fair task, releasing its reserved utilisation */
+void scheduler_clear_deadline()
+{
+    uint32_t         flags, rq_flags;
+    struct runqueue *rq;
+
+    spinlock_lock(&scheduler_lock, &flags);
+    rq = task_rq_lock(current_task, &rq_flags);
+    if (current_task->sched_class == SCHED_CLASS_DEADLINE) {
+        dl_release_locked(current_task);
+    }
+    spinlock_unlock(&rq->lock, rq_flags);
+    spinlock_unlock(&scheduler_lock, flags);
+}
+
+/* Lets the current deadline task give up the rest of its runtime, blocking until the next period */
+void scheduler_wait_next_period()
+{
+    uint32_t         flags;
+    struct runqueue *rq;
+
+    kassert(current_task->sched_class == SCHED_CLASS_DEADLINE);
+
+    rq = task_rq_lock(current_task, &flags);
+    if (current_task->dl.next_period <= timer_get_time_since_boot()) {
+        // Already overran into the next period, no need to wait
+        dl_update_instance(current_task, timer_get_time_since_boot());
+        spinlock_unlock(&rq->lock, flags);
+        return;
+    }
+    dl_throttle_locked(rq);
+    spinlock_unlock(&rq->lock, flags);
+    scheduler_yield();
+}
+
+/* Dumps the state of the runqueues to kinfo */
+static void kinfo_runqueues(struct kinfo_buffer *buff)
+{
+    uint32_t         flags;
+    unsigned int     depth;
+    uint64_t         dl_bw;
+    task_t          *task;
+    struct runqueue *rq;
+
+    for (unsigned int cpu = 0; cpu < arch_cpus_online(); cpu++) {
+        rq = &runqueues[cpu];
+        spinlock_lock(&rq->lock, &flags);
+        kinfo_write(buff, "cpu %u current tid %u\n", cpu, rq->curr ? rq->curr->tid : 0);
+        kinfo_write(buff, "dl    %u\n", rq->dl.nr_queued);
+        kinfo_write(buff, "prio  depth  slice_ms\n");
+        for (unsigned int i = 0; i < SCHED_PRIORITY_LEVELS; i++) {
+            depth = 0;
+            LIST_ITER_STRUCT(&rq->prio.queues[i].list, task, task_t, task_queue_entry)
+            {
+                depth++;
+            }
+            kinfo_write(buff, "%u     %u      %u\n", i, depth, TIME_SLICE_NS(i) / 1000000);
+        }
+        kinfo_write(buff, "fair  %u      weight %u min_vruntime_ms %u\n", rq->fair.nr_queued,
+                    rq->fair.total_weight, (uint32_t)(rq->fair.min_vruntime / 1000000));
+        spinlock_unlock(&rq->lock, flags);
+    }
+
+    spinlock_lock(&scheduler_lock, &flags);
+    dl_bw = dl_total_bw;
+    spinlock_unlock(&scheduler_lock, flags);
+
+    kinfo_write(buff, "dl_util: %u%%\n", (uint32_t)((dl_bw * 100) >> DL_BW_SHIFT));
+    kinfo_write(buff, "min_granularity_us: %u\n", sched_min_granularity_ns / 1000);
+}
+DEFINE_KINFO_FILE(sched, runqueues, kinfo_runqueues);
+
+/* Writes a load average as a decimal number with two decimals */
+static void kinfo_write_load(struct kinfo_buffer *buff, uint32_t load)
+{
+    uint32_t hundredths = ((load & (LOAD_FIXED_1 - 1)) * 100) >> LOAD_SHIFT;
+
+    kinfo_write(buff, " %u.%u%u", load >> LOAD_SHIFT, hundredths / 10, hundredths % 10);
+}
+
+/* Dumps the system wide cpu usage and load to kinfo */
+static void kinfo_stat(struct kinfo_buffer *buff)
+{
+    uint32_t         flags;
+    uint64_t         uptime, idle = 0, irq = 0, cpu_time;
+    uint32_t         load[3];
+    unsigned int     nr_cpus = arch_cpus_online();
+    struct runqueue *rq;
+
+    for (unsigned int cpu = 0; cpu < nr_cpus; cpu++) {
+        rq = &runqueues[cpu];
+        spinlock_lock(&rq->lock, &flags);
+        idle += rq->idle_time_ns;
+        irq += rq->irq_time_ns;
+        spinlock_unlock(&rq->lock, flags);
+    }
+
+    spinlock_lock(&scheduler_lock, &flags);
+    uptime = timer_get_time_since_boot();
+    memcpy(load, load_avg, sizeof(load));
+    spinlock_unlock(&scheduler_lock, flags);
+
+    // The idle and irq time are summed over the cpus, so is the available cpu time
+    cpu_time = uptime * nr_cpus;
+
+    kinfo_write(buff, "uptime_ms: %u\n", (uint32_t)(uptime / 1000000));
+    kinfo_write(buff, "idle_ms: %u\n", (uint32_t)(idle / 1000000));
+    kinfo_write(buff, "irq_ms: %u\n", (uint32_t)(irq / 1000000));
+    kinfo_write(buff, "cpu_util: %u%%\n",
+                cpu_time ? (uint32_t)(100 - idle * 100 / cpu_time) : 0);
+    kinfo_write(buff, "loadavg:");
+    for (int i = 0; i < 3; i++) {
+        kinfo_write_load(buff, load[i]);
+    }
+    kinfo_write(buff, "\n");
+}
+DEFINE_KINFO_FILE(sched, stat, kinfo_stat);
+
+/* Dumps the runqueue latency histogram to kinfo */
+static void kinfo_latency(struct kinfo_buffer *buff)
+{
+    uint32_t         flags;
+    uint32_t         latency[RUNQUEUE_LATENCY_BUCKETS] = {0};
+    struct runqueue *rq;
+
+    for (unsigned int cpu = 0; cpu < arch_cpus_online(); cpu++) {
+        rq = &runqueues[cpu];
+        spinlock_lock(&rq->lock, &flags);
+        for (unsigned int i = 0; i < RUNQUEUE_LATENCY_BUCKETS; i++) {
+            latency[i] += rq->latency[i];
+        }
+        spinlock_unlock(&rq->lock, flags);
+    }
+
+    kinfo_write(buff, "below_us  count\n");
+    for (unsigned int i = 0; i < RUNQUEUE_LATENCY_BUCKETS - 1; i++) {
+        kinfo_write(buff, "%u  %u\n", 1u << i, latency[i]);
+    }
+    kinfo_write(buff, "inf  %u\n", latency[RUNQUEUE_LATENCY_BUCKETS - 1]);
+}
+DEFINE_KINFO_FILE(sched, latency, kinfo_latency);
+
+/* Dumps the soft lockups detected by the watchdog to kinfo */
+static void kinfo_watchdog(struct kinfo_buffer *buff)
+{
+    uint32_t     flags, lockups, stall;
+    unsigned int cpu;
+    tid_t        tid;
+
+    spinlock_lock(&scheduler_lock, &flags);
+    lockups = watchdog_lockups;
+    cpu     = watchdog_last_cpu;
+    tid     = watchdog_last_tid;
+    stall   = (uint32_t)(watchdog_last_stall / 1000000);
+    spinlock_unlock(&scheduler_lock, flags);
+
+    kinfo_write(buff, "threshold_ms: %u\n", SCHED_WATCHDOG_THRESHOLD_NS / 1000000);
+    kinfo_write(buff, "lockups: %u\n", lockups);
+    if (lockups) {
+        kinfo_write(buff, "last: cpu %u tid %u stall_ms %u\n", cpu, tid, stall);
+    }
+}
+DEFINE_KINFO_FILE(sched, watchdog, kinfo_watchdog);
@@ -4,8 +4,14 @@
 
    Copyright (C) 2025 Isak Evaldsson
 */
+#include <arch/cpu.h>
 #include <arch/paging.h>
+#include <devices/timer.h>
+#include <idr.h>
+#include <kinfo.h>
+#include <memory/shrinker.h>
 #include <memory/vmem_manager.h>
+#include <tasks/fpu.h>
 #include <tasks/spinlock.h>
 #include <tasks/scheduler.h>
 #include <uapi/errno.h>
@@ -18,28 +24,32 @@ struct task_handler {
 /* Global list of all tasks */
 static DEFINE_LIST(task_list);
 
+/* Maps tids to tasks, 0 is never used as a tid */
+static struct idr tid_table = IDR_INIT(1);
+
+/* Protects the task list and the tid table */
 static SPINLOCK_DEFINE(task_lock);
 
+/*
+    Cache of free'd tasks together with their stacks, linked through the task list entry. Allows
+    new tasks to be created without going through the heap and the page frame allocator.
+*/
+static struct {
+    struct spinlock lock;
+    struct list     tasks;
+    unsigned int    nr_cached;
+    uint32_t        hits;
+    uint32_t        misses;
+} task_cache = {
+    .lock  = SPINLOCK_INIT(),
+    .tasks = LIST_INIT(task_cache.tasks),
+};
+
 /* The number of handlers will be rather limited, so a static array will be good enough */
 #define HANDLER_COUNT 1 /*FS*/ 
 
 static struct task_handler task_handlers[HANDLER_COUNT];
 
-static tid_t alloc_tid()
-{
-    static tid_t last_tid = 0;
-
-    tid_t prev = last_tid;
-    tid_t new  = ++last_tid;
-
-    if (new < prev) {
-        kpanic("Can't create new task, out of tids");
-    }
-
-    kassert(new > 0);
-    return new;
-}
-
 /* Wrapper functions for new tasks handling proper setup/cleanup */
 static void new_task_wrapper(void* ip)
 {
@@ -65,44 +75,209 @@ static void send_task_event(int event, struct task *task)
     }
 }
 
-/* Creates a new task executing the code at the address ip */
-tid_t create_task(void* ip)
+/* Assigns the task a tid and adds it to the task list, returns 0 on success, otherwise -ERRNO */
+static int register_task_locked(task_t* task)
 {
-    uint32_t flags;
-    task_t *task = kalloc(sizeof(task_t));
+    int tid = idr_alloc(&tid_table, task);
+    if (tid < 0) {
+        return tid;
+    }
+
+    task->tid = (tid_t)tid;
+    list_add_last(&task_list, &task->task_list_entry);
+    send_task_event(TASK_EVENT_CREATED, task);
+    return 0;
+}
+
+/* Allocates a cleared task with a stack, prefers re-using a cached task */
+static task_t* alloc_task()
+{
+    uint32_t           flags;
+    uintptr_t          stack;
+    struct list_entry* entry;
+    task_t*            task;
+
+    spinlock_lock(&task_cache.lock, &flags);
+    entry = list_remove_first(&task_cache.tasks);
+    if (entry) {
+        task_cache.nr_cached--;
+        task_cache.hits++;
+    } else {
+        task_cache.misses++;
+    }
+    spinlock_unlock(&task_cache.lock, flags);
+
+    if (entry) {
+        task  = GET_STRUCT(task_t, task_list_entry, entry);
+        stack = task->kstack_bottom;
+        memset(task, 0, sizeof(task_t));
+        task->kstack_bottom = stack;
+        task->kstack_size   = PAGE_SIZE;
+        return task;
+    }
+
+    task = kalloc(sizeof(task_t));
     if (task == NULL) {
-        return 0;
+        return NULL;
     }
 
-    // Allocate stack
     task->kstack_bottom = vmem_request_free_page(0);
     if ((void*)task->kstack_bottom == NULL) {
+        kfree(task);
+        return NULL;
+    }
+    task->kstack_size = PAGE_SIZE;
+    return task;
+}
+
+static void release_task(task_t* task)
+{
+    vmem_free_page(task->kstack_bottom);
+    kfree(task);
+}
+
+/* Returns the task to the cache, or frees it if the cache is full */
+static void cache_task(task_t* task)
+{
+    uint32_t flags;
+    bool     cached = false;
+
+    spinlock_lock(&task_cache.lock, &flags);
+    if (task_cache.nr_cached < TASK_CACHE_SIZE) {
+        list_add_first(&task_cache.tasks, &task->task_list_entry);
+        task_cache.nr_cached++;
+        cached = true;
+    }
+    spinlock_unlock(&task_cache.lock, flags);
+
+    if (!cached) {
+        release_task(task);
+    }
+}
+
+/* The number of task creations served by the task cache */
+uint32_t task_cache_hits()
+{
+    uint32_t flags, hits;
+
+    spinlock_lock(&task_cache.lock, &flags);
+    hits = task_cache.hits;
+    spinlock_unlock(&task_cache.lock, flags);
+    return hits;
+}
+
+static void cache_task_rcu(struct rcu_head* head)
+{
+    task_t* task = GET_STRUCT(task_t, rcu, head);
+
+    // Lookups racing with free_task() drop their references before the grace period ends
+    kassert(atomic_load(&task->ref_count) == 0);
+    cache_task(task);
+}
+
+/* Each cached task holds on to its stack page, the task itself lives on the heap */
+static size_t task_cache_count(struct shrinker* shrinker)
+{
+    (void)shrinker;
+    return READ_ONCE(task_cache.nr_cached);
+}
+
+static size_t task_cache_scan(struct shrinker* shrinker, size_t nr_pages)
+{
+    (void)shrinker;
+    uint32_t           flags;
+    size_t             freed = 0;
+    struct list_entry* entry;
+
+    while (freed < nr_pages) {
+        spinlock_lock(&task_cache.lock, &flags);
+        entry = list_remove_first(&task_cache.tasks);
+        if (entry) {
+            task_cache.nr_cached--;
+        }
+        spinlock_unlock(&task_cache.lock, flags);
+
+        if (!entry) {
+            break;
+        }
+
+        release_task(GET_STRUCT(task_t, task_list_entry, entry));
+        freed++;
+    }
+    return freed;
+}
+
+DEFINE_SHRINKER(task_cache, task_cache_count, task_cache_scan);
+
+/* Initialises the scheduling parameters, fair tasks starts out with the nice value 0 */
+static void init_sched_params(task_t* task, sched_class_t sched_class, unsigned int priority)
+{
+    task->sched_class = (uint8_t)sched_class;
+    task->priority    = (uint8_t)priority;
+    task->nice        = 0;
+    task->weight      = SCHED_NICE_0_WEIGHT;
+    task->vruntime    = 0;
+    task->cpu         = arch_cpu_id();
+    task->stats       = (struct sched_stats){.last_change = timer_get_time_since_boot()};
+}
+
+static tid_t _create_task(void* ip, sched_class_t sched_class, unsigned int priority)
+{
+    uint32_t flags;
+    task_t  *task;
+
+    task = alloc_task();
+    if (task == NULL) {
         return 0;
     }
 
-    task->kstack_size   = PAGE_SIZE;
     uintptr_t stack_top = task->kstack_bottom + task->kstack_size;
 
     // Setup thread registers
     init_thread_regs_with_stack(&task->regs, (void*)stack_top, new_task_wrapper, ip);
-    spinlock_lock(&task_lock, &flags);
 
     // Initialise fields
-    task->tid       = alloc_tid();
     task->time_used = 0;
     task->state     = BLOCKED;  // initially blocked, since the scheduler doesn't know about it yet
     task->status    = 0;
+    init_sched_params(task, sched_class, priority);
     atomic_store(&task->ref_count, 0);
 
-    // Add to global task list
-    list_add_last(&task_list, &task->task_list_entry);
-    send_task_event(TASK_EVENT_CREATED, task);
+    // The tid table can't grow while holding the lock
+    if (idr_preload(&tid_table) < 0) {
+        goto err_free;
+    }
+
+    spinlock_lock(&task_lock, &flags);
+    if (register_task_locked(task) < 0) {
+        spinlock_unlock(&task_lock, flags);
+        goto err_free;
+    }
     spinlock_unlock(&task_lock, flags);
 
     // Make the scheduler aware of the new task
     scheduler_unblock_task(task);
 
     return task->tid;
+
+err_free:
+    cache_task(task);
+    return 0;
+}
+
+/* Creates a new fair task executing the code at the address ip */
+tid_t create_task(void* ip)
+{
+    return _create_task(ip, SCHED_CLASS_FAIR, 0);
+}
+
+/* Creates a new priority task with the supplied priority level, returns 0 on failure */
+tid_t create_task_with_priority(void* ip, unsigned int priority)
+{
+    if (priority >= SCHED_PRIORITY_LEVELS) {
+        return 0;
+    }
+    return _create_task(ip, SCHED_CLASS_PRIORITY, priority);
 }
 
 /* Function handling creation of the root task */
@@ -118,18 +293,25 @@ task_t* create_root_task()
 
     // Setup thread registers
     init_initial_thread_regs(&task->regs);
-    spinlock_lock(&task_lock, &flags);
 
     // Initialise fields
-    task->tid       = alloc_tid();
     task->time_used = 0;
     task->state     = RUNNING;
     task->status    = 0;
+    init_sched_params(task, SCHED_CLASS_FAIR, 0);
     atomic_store(&task->ref_count, 0);
 
-    // Add to global task list
-    list_add_last(&task_list, &task->task_list_entry);
-    send_task_event(TASK_EVENT_CREATED, task);
+    if (idr_preload(&tid_table) < 0) {
+        kfree(task);
+        return NULL;
+    }
+
+    spinlock_lock(&task_lock, &flags);
+    if (register_task_locked(task) < 0) {
+        spinlock_unlock(&task_lock, flags);
+        kfree(task);
+        return NULL;
+    }
     spinlock_unlock(&task_lock, flags);
     return task;
 }
@@ -138,29 +320,30 @@ task_t* create_root_task()
  * allow it to be properly cleaned up on termination */
 task_t* get_task(tid_t tid)
 {
-    task_t*            task;
-    uint32_t flags;
+    task_t* task;
 
     if (tid == 0) {
         return NULL;
     }
 
-    spinlock_lock(&task_lock, &flags);
-    LIST_ITER_STRUCT(&task_list, task, task_t, task_list_entry)
-    {
-        if (task->tid == tid) {
-            // Only return non-killed tasks
-            if (!IS_TERMINATED(task)) {
-                atomic_add_fetch(&task->ref_count, 1);
-                goto unlock;
-            }
+    // Freeing is deferred by rcu, so the task can't be free'd before the reference is taken
+    rcu_read_lock();
+    task = idr_find(&tid_table, (int)tid);
+
+    /*
+        Take the reference before checking if the task is terminated. A task that isn't terminated
+        once the reference is held can't be free'd by the cleanup thread, which skips tasks with
+        references. A terminated task only sees the reference briefly, and it's dropped within the
+        read-side section, so it's gone before the task is cached.
+    */
+    if (task) {
+        atomic_add_fetch(&task->ref_count, 1);
+        if (IS_TERMINATED(task)) {
+            atomic_sub_fetch(&task->ref_count, 1);
             task = NULL;
-            goto unlock;
         }
     }
-    task = NULL;
-unlock:
-    spinlock_unlock(&task_lock, flags);
+    rcu_read_unlock();
     return task;
 }
 
@@ -188,17 +371,16 @@ void free_task(task_t* task)
     // Can't free the root task since it's created differently compared to other tasks
     kassert(task->tid != 0);
 
-    // Free'ing up a process still in used, might put the kernel in a dangerous inconsistent state
-    kassert(atomic_load(&task->ref_count) == 0);
-
     // Free'ing a task in a non-terminated state could be very dangerous
     kassert(IS_TERMINATED(task));
 
     spinlock_lock(&task_lock, &flags);
     list_entry_remove(&task->task_list_entry);
+    idr_remove(&tid_table, (int)task->tid);
     spinlock_unlock(&task_lock, flags);
-    vmem_free_page(task->kstack_bottom);
-    kfree(task);
+
+    fpu_release_task(task);
+    call_rcu(&task->rcu, cache_task_rcu);
 }
 
 int register_task_event_handler(task_event_handler handler, int mask)
@@ -249,3 +431,66 @@ unlock:
     spinlock_unlock(&task_lock, flags);
     return ret;
 }
+
+static const char* state_names[] = {
+    [READY_TO_RUN] = "ready", [RUNNING] = "run", [BLOCKED] = "block", [BLOCKED_IDLING] = "idle"};
+
+static const char* class_names[] = {
+    [SCHED_CLASS_FAIR] = "fair", [SCHED_CLASS_PRIORITY] = "prio", [SCHED_CLASS_DEADLINE] = "dl"};
+
+/* Dumps the scheduling statistics of every task to kinfo */
+static void kinfo_tasks(struct kinfo_buffer* buff)
+{
+    uint32_t           flags;
+    uint64_t           now;
+    task_t*            task;
+    struct sched_stats stats;
+
+    kinfo_write(buff, "tid  state  class  cpu_ms  wait_ms  vol  invol  blocked_ms: sleep paused "
+                      "lock io dl_wait\n");
+
+    spinlock_lock(&task_lock, &flags);
+    now = timer_get_time_since_boot();
+    LIST_ITER_STRUCT(&task_list, task, task_t, task_list_entry)
+    {
+        // Include the time spent in the current state
+        stats = task->stats;
+        if (task->state == READY_TO_RUN) {
+            stats.wait_time += now - task->stats.last_change;
+        } else if (task->state == BLOCKED || task->state == BLOCKED_IDLING) {
+            stats.blocked_time[task->block_reason] += now - task->stats.last_change;
+        }
+
+        kinfo_write(buff, "%u  %s  %s  %u  %u  %u  %u ", task->tid, state_names[task->state],
+                    class_names[task->sched_class], (uint32_t)(task->time_used / 1000000),
+                    (uint32_t)(stats.wait_time / 1000000), stats.nr_voluntary_switches,
+                    stats.nr_involuntary_switches);
+        for (int reason = 0; reason < BLOCK_REASON_MAX; reason++) {
+            if (reason != BLOCK_REASON_TERMINATED) {
+                kinfo_write(buff, " %u", (uint32_t)(stats.blocked_time[reason] / 1000000));
+            }
+        }
+        kinfo_write(buff, "\n");
+    }
+    spinlock_unlock(&task_lock, flags);
+}
+DEFINE_KINFO_FILE(sched, tasks, kinfo_tasks);
+
+/* Dumps the task cache usage to kinfo */
+static void kinfo_task_cache(struct kinfo_buffer* buff)
+{
+    uint32_t     flags, hits, misses;
+    unsigned int nr_cached;
+
+    spinlock_lock(&task_cache.lock, &flags);
+    nr_cached = task_cache.nr_cached;
+    hits      = task_cache.hits;
+    misses    = task_cache.misses;
+    spinlock_unlock(&task_cache.lock, flags);
+
+    kinfo_write(buff, "cached: %u\n", nr_cached);
+    kinfo_write(buff, "size: %u\n", TASK_CACHE_SIZE);
+    kinfo_write(buff, "hits: %u\n", hits);
+    kinfo_write(buff, "misses: %u\n", misses);
+}
+DEFINE_KINFO_FILE(sched, task_cache, kinfo_task_cache);
@@ -0,0 +1,115 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#include <tasks/wait_queue.h>
+#include <utils.h>
+
+#include "internal.h"
+
+#define LOG_WAIT_QUEUE 0
+
+#define LOG(fmt, ...) __LOG(LOG_WAIT_QUEUE, "[WAIT_QUEUE]", fmt, ##__VA_ARGS__)
+
+static inline bool entry_queued(struct wait_queue_entry *wait)
+{
+    return wait->entry.next != &wait->entry;
+}
+
+/* Adds the current task to the queue and marks it as blocked, requires the queue lock */
+void prepare_to_wait_locked(struct wait_queue *wq, struct wait_queue_entry *wait,
+                            uint64_t deadline)
+{
+    kassert(!(current_task->status & TASK_STATUS_INTERRUPT));
+
+    if (!entry_queued(wait)) {
+        wait->task  = current_task;
+        wait->woken = false;
+        list_add_last(&wq->waiters, &wait->entry);
+    }
+
+    if (wait->fiber) {
+        fiber_prepare_block(wait->fiber, deadline);
+        return;
+    }
+
+    // Marking the task as blocked with the queue lock held ensures the wakeup can't slip in between
+    scheduler_prepare_block(wq->reason, deadline);
+}
+
+/* Adds the current task to the queue and marks it as blocked */
+void prepare_to_wait(struct wait_queue *wq, struct wait_queue_entry *wait, uint64_t deadline)
+{
+    uint32_t flags;
+
+    spinlock_lock(&wq->lock, &flags);
+    prepare_to_wait_locked(wq, wait, deadline);
+    spinlock_unlock(&wq->lock, flags);
+}
+
+/* Removes the current task from the queue and makes sure it is runnable again */
+void finish_wait(struct wait_queue *wq, struct wait_queue_entry *wait)
+{
+    uint32_t flags;
+
+    spinlock_lock(&wq->lock, &flags);
+    if (entry_queued(wait)) {
+        list_entry_remove(&wait->entry);
+    }
+    spinlock_unlock(&wq->lock, flags);
+
+    // The condition may have been fulfilled, or the deadline passed, before the task yielded
+    if (wait->fiber) {
+        fiber_finish_block(wait->fiber);
+    } else {
+        scheduler_unblock_task(current_task);
+    }
+}
+
+/* Wakes up the first waiting task, requires the queue lock */
+bool wake_up_locked(struct wait_queue *wq)
+{
+    struct list_entry       *entry = list_remove_first(&wq->waiters);
+    struct wait_queue_entry *wait;
+
+    if (!entry) {
+        return false;
+    }
+
+    // Unblocking with the lock held prevents the waiter from moving on before it's woken, which
+    // could otherwise cause a stray wakeup of whatever it's blocked on next
+    wait        = GET_STRUCT(struct wait_queue_entry, entry, entry);
+    wait->woken = true;
+    LOG("Wake up %x", wait->task);
+    if (wait->fiber) {
+        fiber_wake(wait->fiber);
+    } else {
+        scheduler_unblock_task(wait->task);
+    }
+    return true;
+}
+
+/* Wakes up the first waiting task */
+bool wake_up(struct wait_queue *wq)
+{
+    uint32_t flags;
+    bool     woken;
+
+    spinlock_lock(&wq->lock, &flags);
+    woken = wake_up_locked(wq);
+    spinlock_unlock(&wq->lock, flags);
+    return woken;
+}
+
+/* Wakes up all waiting tasks */
+void wake_up_all(struct wait_queue *wq)
+{
+    uint32_t flags;
+
+    spinlock_lock(&wq->lock, &flags);
+    while (wake_up_locked(wq)) {
+    }
+    spinlock_unlock(&wq->lock, flags);
+}
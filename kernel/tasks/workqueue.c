@@ -0,0 +1,418 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#include <devices/timer.h>
+#include <kinfo.h>
+#include <tasks/spinlock.h>
+#include <tasks/workqueue.h>
+#include <utils.h>
+
+#include "internal.h"
+
+#define LOG_WORKQUEUE 0
+
+#define LOG(fmt, ...) __LOG(LOG_WORKQUEUE, "[WORKQUEUE]", fmt, ##__VA_ARGS__)
+
+/* Idle workers waiting for work, its lock protects the pool, the workqueues and their items */
+static DEFINE_WAIT_QUEUE(idle_workers, BLOCK_REASON_PAUSED);
+
+/* Items ready to be executed, in the order they were queued */
+static DEFINE_LIST(worklist);
+
+/* Delayed items waiting for their timer, sorted by expiry */
+static DEFINE_LIST(delayed_list);
+
+/* Timestamp of the registered timed event for the delayed items, zero if there's none */
+static uint64_t delayed_event_ns = 0;
+
+/* All workqueues, for kinfo */
+static DEFINE_LIST(workqueues);
+
+static unsigned int nr_workers  = 0;  // Including the ones yet to be started
+static unsigned int nr_idle     = 0;
+static unsigned int nr_to_start = 0;  // Workers requested from the manager
+
+/* Woken once workers are requested, since they can't be created in interrupt context */
+static DEFINE_WAIT_QUEUE(manager_wait, BLOCK_REASON_PAUSED);
+
+struct workqueue *system_wq = NULL;
+
+static void delayed_work_callback(uint64_t time_since_boot_ns, uint64_t timestamp_ns);
+
+/* Wakes an idle worker, or requests a new one if there's none, requires the pool lock */
+static void kick_worker_locked()
+{
+    if (wake_up_locked(&idle_workers) || nr_workers >= WORKQUEUE_MAX_WORKERS) {
+        return;
+    }
+
+    nr_workers++;
+    nr_to_start++;
+    wake_up(&manager_wait);
+}
+
+/* Hands the item over to the pool, unless its workqueue has reached max_active */
+static void insert_work_locked(struct workqueue *wq, struct work_struct *work)
+{
+    work->wq      = wq;
+    work->pending = true;
+
+    if (wq->nr_active >= wq->max_active) {
+        list_add_last(&wq->inactive, &work->entry);
+        return;
+    }
+
+    wq->nr_active++;
+    list_add_last(&worklist, &work->entry);
+    kick_worker_locked();
+}
+
+/* Accounts a completed item, activating the next held back one */
+static void complete_work_locked(struct workqueue *wq)
+{
+    struct list_entry *next = list_remove_first(&wq->inactive);
+
+    wq->nr_executed++;
+    if (next) {
+        list_add_last(&worklist, next);  // Picked up by the completing worker
+        return;
+    }
+
+    if (--wq->nr_active == 0) {
+        wake_up_all(&wq->flush_wait);
+    }
+}
+
+/* Makes sure the timed event fires for the first delayed item, requires the pool lock */
+static void arm_delayed_event_locked()
+{
+    struct delayed_work *first;
+
+    if (LIST_EMPTY(&delayed_list)) {
+        return;
+    }
+
+    first = GET_STRUCT(struct delayed_work, timer_entry, delayed_list.head.next);
+    if (!delayed_event_ns || first->expires < delayed_event_ns) {
+        delayed_event_ns = first->expires;
+        timer_register_timed_event(delayed_event_ns, delayed_work_callback);
+    }
+}
+
+/* Queues the delayed items whose delay has passed, runs within the timer interrupt */
+static void delayed_work_callback(uint64_t time_since_boot_ns, uint64_t timestamp_ns)
+{
+    uint32_t             flags;
+    struct delayed_work *dwork;
+
+    spinlock_lock(&idle_workers.lock, &flags);
+    if (timestamp_ns == delayed_event_ns) {
+        delayed_event_ns = 0;
+    }
+
+    while (!LIST_EMPTY(&delayed_list)) {
+        dwork = GET_STRUCT(struct delayed_work, timer_entry, delayed_list.head.next);
+        if (dwork->expires > time_since_boot_ns) {
+            break;
+        }
+
+        list_entry_remove(&dwork->timer_entry);
+        insert_work_locked(dwork->work.wq, &dwork->work);
+    }
+    arm_delayed_event_locked();
+    spinlock_unlock(&idle_workers.lock, flags);
+}
+
+/* Queues the work item, returns false if it was already pending */
+bool queue_work(struct workqueue *wq, struct work_struct *work)
+{
+    uint32_t flags;
+    bool     queued = false;
+
+    spinlock_lock(&idle_workers.lock, &flags);
+    if (!work->pending) {
+        insert_work_locked(wq, work);
+        queued = true;
+    }
+    spinlock_unlock(&idle_workers.lock, flags);
+    return queued;
+}
+
+/* Queues the work item once delay_ns has passed, returns false if it was already pending */
+bool queue_delayed_work(struct workqueue *wq, struct delayed_work *dwork, uint64_t delay_ns)
+{
+    uint32_t           flags;
+    struct list_entry *pos;
+
+    if (delay_ns == 0) {
+        return queue_work(wq, &dwork->work);
+    }
+
+    spinlock_lock(&idle_workers.lock, &flags);
+    if (dwork->work.pending) {
+        spinlock_unlock(&idle_workers.lock, flags);
+        return false;
+    }
+
+    dwork->work.wq      = wq;
+    dwork->work.pending = true;
+    dwork->expires      = timer_get_time_since_boot() + delay_ns;
+
+    // Insert after the items expiring no later, keeping the items with the same expiry in order
+    LIST_ITER(&delayed_list, pos)
+    {
+        if (GET_STRUCT(struct delayed_work, timer_entry, pos)->expires > dwork->expires) {
+            break;
+        }
+    }
+    list_entry_append_single_element(pos->prev, &dwork->timer_entry);
+
+    arm_delayed_event_locked();
+    spinlock_unlock(&idle_workers.lock, flags);
+    return true;
+}
+
+/* Queues the work item on the system workqueue */
+bool schedule_work(struct work_struct *work)
+{
+    return queue_work(system_wq, work);
+}
+
+/* Queues the work item on the system workqueue once delay_ns has passed */
+bool schedule_delayed_work(struct delayed_work *dwork, uint64_t delay_ns)
+{
+    return queue_delayed_work(system_wq, dwork, delay_ns);
+}
+
+/*
+    Removes the pending item from the delayed list, the worklist or its workqueue's inactive list.
+    Only delayed items waiting for their timer are pending without being in either list.
+*/
+static bool cancel_work_locked(struct work_struct *work)
+{
+    struct workqueue  *wq = work->wq;
+    struct list_entry *pos;
+
+    if (!work->pending) {
+        return false;
+    }
+
+    if (work->entry.next == &work->entry) {
+        // Not counted as active until queued, the timed event is left as is and finds nothing
+        list_entry_remove(&TO_DELAYED_WORK(work)->timer_entry);
+        work->pending = false;
+        return true;
+    }
+
+    // Items held back by max_active are not counted as active
+    LIST_ITER(&wq->inactive, pos)
+    {
+        if (pos == &work->entry) {
+            break;
+        }
+    }
+
+    list_entry_remove(&work->entry);
+    work->pending = false;
+
+    if (pos != &work->entry && --wq->nr_active == 0) {
+        wake_up_all(&wq->flush_wait);
+    }
+    return true;
+}
+
+/* Removes the pending work item, returns false if it wasn't pending */
+bool cancel_work(struct work_struct *work)
+{
+    uint32_t flags;
+    bool     cancelled;
+
+    spinlock_lock(&idle_workers.lock, &flags);
+    cancelled = cancel_work_locked(work);
+    spinlock_unlock(&idle_workers.lock, flags);
+    return cancelled;
+}
+
+/* Like cancel_work(), but also stops the delay timer */
+bool cancel_delayed_work(struct delayed_work *dwork)
+{
+    return cancel_work(&dwork->work);
+}
+
+/* Blocks until all items queued on the workqueue have completed, delayed items still waiting for
+ * their timer are not waited for */
+void flush_workqueue(struct workqueue *wq)
+{
+    wait_event(&wq->flush_wait, READ_ONCE(wq->nr_active) == 0);
+}
+
+/* Creates a workqueue running at most max_active items concurrently, returns NULL on failure */
+struct workqueue *workqueue_create(const char *name, unsigned int max_active)
+{
+    uint32_t          flags;
+    struct workqueue *wq;
+
+    if (max_active == 0) {
+        return NULL;
+    }
+
+    wq = kalloc(sizeof(struct workqueue));
+    if (!wq) {
+        return NULL;
+    }
+
+    wq->name        = name;
+    wq->max_active  = max_active;
+    wq->nr_active   = 0;
+    wq->nr_executed = 0;
+    list_init(&wq->inactive);
+    wait_queue_init(&wq->flush_wait, BLOCK_REASON_PAUSED);
+
+    spinlock_lock(&idle_workers.lock, &flags);
+    list_add_last(&workqueues, &wq->entry);
+    spinlock_unlock(&idle_workers.lock, flags);
+    return wq;
+}
+
+/* Cancels the delayed items still waiting for their timer, then flushes and frees the workqueue */
+void workqueue_destroy(struct workqueue *wq)
+{
+    uint32_t             flags;
+    struct delayed_work *dwork;
+
+    // Otherwise the timer would queue them on the free'd workqueue
+    spinlock_lock(&idle_workers.lock, &flags);
+    LIST_ITER_STRUCT_SAFE_REMOVAL(&delayed_list, dwork, struct delayed_work, timer_entry)
+    {
+        if (dwork->work.wq == wq) {
+            cancel_work_locked(&dwork->work);
+        }
+    }
+    spinlock_unlock(&idle_workers.lock, flags);
+
+    flush_workqueue(wq);
+
+    spinlock_lock(&idle_workers.lock, &flags);
+    list_entry_remove(&wq->entry);
+    spinlock_unlock(&idle_workers.lock, flags);
+    kfree(wq);
+}
+
+/* Waits for work until the deadline, requires the pool lock which is held again on return */
+static void worker_wait_locked(uint64_t deadline, uint32_t *flags)
+{
+    struct wait_queue_entry wait = WAIT_QUEUE_ENTRY_INIT(wait);
+
+    while (LIST_EMPTY(&worklist) && !wait.woken && timer_get_time_since_boot() < deadline) {
+        prepare_to_wait_locked(&idle_workers, &wait, deadline);
+        spinlock_unlock(&idle_workers.lock, *flags);
+        scheduler_yield();
+        spinlock_lock(&idle_workers.lock, flags);
+    }
+    spinlock_unlock(&idle_workers.lock, *flags);
+    finish_wait(&idle_workers, &wait);
+    spinlock_lock(&idle_workers.lock, flags);
+}
+
+static void worker_thread()
+{
+    uint32_t            flags;
+    uint64_t            deadline;
+    struct workqueue   *wq;
+    struct work_struct *work;
+
+    spinlock_lock(&idle_workers.lock, &flags);
+    while (true) {
+        if (LIST_EMPTY(&worklist)) {
+            deadline = timer_get_time_since_boot() + WORKQUEUE_IDLE_TIMEOUT_NS;
+
+            nr_idle++;
+            worker_wait_locked(deadline, &flags);
+            nr_idle--;
+
+            // Shrink the pool once the backlog is gone, but keep one worker around
+            if (LIST_EMPTY(&worklist) && timer_get_time_since_boot() >= deadline &&
+                nr_workers > 1) {
+                break;
+            }
+            continue;
+        }
+
+        work          = GET_STRUCT(struct work_struct, entry, list_remove_first(&worklist));
+        wq            = work->wq;
+        work->pending = false;
+        spinlock_unlock(&idle_workers.lock, flags);
+
+        // The item may be re-queued, or even free'd, by its function
+        work->func(work);
+
+        spinlock_lock(&idle_workers.lock, &flags);
+        complete_work_locked(wq);
+    }
+
+    nr_workers--;
+    spinlock_unlock(&idle_workers.lock, flags);
+    LOG("Worker %x exits", current_task);
+}
+
+/* Creates the workers requested by the pool, which can't be done in interrupt context */
+static void manager_thread()
+{
+    uint32_t flags;
+    bool     failed;
+
+    while (true) {
+        wait_event(&manager_wait, READ_ONCE(nr_to_start) > 0);
+
+        failed = !create_task(worker_thread);
+
+        spinlock_lock(&idle_workers.lock, &flags);
+        nr_to_start--;
+        if (failed) {
+            // Queued items are still served by the existing workers
+            nr_workers--;
+        }
+        spinlock_unlock(&idle_workers.lock, flags);
+
+        if (failed) {
+            LOG("Failed to start worker");
+        }
+    }
+}
+
+/* Creates the system workqueue and starts the worker pool */
+void workqueue_init()
+{
+    system_wq = workqueue_create("system", WORKQUEUE_MAX_WORKERS);
+    if (!system_wq) {
+        kpanic("Failed to create system workqueue");
+    }
+
+    nr_workers = 1;
+    if (!create_task(manager_thread) || !create_task(worker_thread)) {
+        kpanic("Failed to start worker pool");
+    }
+}
+
+/* Dumps the worker pool and the workqueues to kinfo */
+static void kinfo_workqueues(struct kinfo_buffer *buff)
+{
+    uint32_t          flags;
+    struct workqueue *wq;
+
+    // Only the counters are read under the lock, the names are static
+    spinlock_lock(&idle_workers.lock, &flags);
+    kinfo_write(buff, "workers: %u idle: %u max: %u\n", nr_workers, nr_idle,
+                WORKQUEUE_MAX_WORKERS);
+    kinfo_write(buff, "name  active  max_active  executed\n");
+    LIST_ITER_STRUCT(&workqueues, wq, struct workqueue, entry)
+    {
+        kinfo_write(buff, "%s  %u  %u  %u\n", wq->name, wq->nr_active, wq->max_active,
+                    wq->nr_executed);
+    }
+    spinlock_unlock(&idle_workers.lock, flags);
+}
+DEFINE_KINFO_FILE(sched, workqueues, kinfo_workqueues);
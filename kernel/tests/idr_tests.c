@@ -0,0 +1,91 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#include <idr.h>
+#include <uapi/errno.h>
+
+#include "test.h"
+
+#define N_IDS ((int)IDR_LEAF_SIZE + 16)
+
+static int values[N_IDS];
+
+static int test_alloc_find_remove()
+{
+    int        id;
+    struct idr idr = IDR_INIT(1);
+
+    // Spans more than one leaf
+    for (int i = 0; i < N_IDS; i++) {
+        TEST_ERRNO_FUNC(idr_preload(&idr));
+        id = idr_alloc(&idr, &values[i]);
+        TEST_RETURN_IF_FALSE(id == i + 1);
+    }
+
+    TEST_RETURN_IF_FALSE(idr_find(&idr, 0) == NULL);
+    TEST_RETURN_IF_FALSE(idr_find(&idr, N_IDS + 1) == NULL);
+    TEST_RETURN_IF_FALSE(idr_find(&idr, -1) == NULL);
+    TEST_RETURN_IF_FALSE(idr_find(&idr, IDR_MAX_ID + 1) == NULL);
+    for (int i = 0; i < N_IDS; i++) {
+        TEST_RETURN_IF_FALSE(idr_find(&idr, i + 1) == &values[i]);
+    }
+
+    for (int i = 0; i < N_IDS; i += 2) {
+        TEST_RETURN_IF_FALSE(idr_remove(&idr, i + 1) == &values[i]);
+    }
+    TEST_RETURN_IF_FALSE(idr_remove(&idr, 1) == NULL);
+
+    for (int i = 0; i < N_IDS; i++) {
+        TEST_RETURN_IF_FALSE(idr_find(&idr, i + 1) == (i % 2 ? &values[i] : NULL));
+    }
+
+    idr_destroy(&idr);
+    return 0;
+}
+
+static int test_cyclic_alloc()
+{
+    int        id, prev;
+    struct idr idr = IDR_INIT(1);
+
+    // A freed id shall not be re-used straight away
+    TEST_ERRNO_FUNC(idr_preload(&idr));
+    prev = idr_alloc(&idr, &values[0]);
+    TEST_RETURN_IF_FALSE(idr_remove(&idr, prev) == &values[0]);
+    id = idr_alloc(&idr, &values[0]);
+    TEST_RETURN_IF_FALSE(id == prev + 1);
+    idr_remove(&idr, id);
+
+    // But once the id space is exhausted, allocations wraps around to the freed ids
+    for (int i = id + 1; i <= IDR_MAX_ID; i++) {
+        TEST_ERRNO_FUNC(idr_preload(&idr));
+        TEST_RETURN_IF_FALSE(idr_alloc(&idr, &values[0]) == i);
+    }
+    TEST_RETURN_IF_FALSE(idr_alloc(&idr, &values[1]) == 1);
+    TEST_RETURN_IF_FALSE(idr_alloc(&idr, &values[1]) == 2);
+    TEST_RETURN_IF_FALSE(idr_alloc(&idr, &values[1]) == -ENOSPC);
+
+    // Frees in the middle of a full leaf shall be found again
+    TEST_RETURN_IF_FALSE(idr_remove(&idr, 1000) == &values[0]);
+    TEST_RETURN_IF_FALSE(idr_alloc(&idr, &values[2]) == 1000);
+    TEST_RETURN_IF_FALSE(idr_find(&idr, 1000) == &values[2]);
+
+    idr_destroy(&idr);
+    return 0;
+}
+
+static struct test_func idr_tests[] = {
+    CREATE_TEST_FUNC(test_alloc_find_remove),
+    CREATE_TEST_FUNC(test_cyclic_alloc),
+};
+
+struct test_suite idr_test_suite = {
+    .name     = "idr_tests",
+    .setup    = NULL,
+    .teardown = NULL,
+    .tests    = idr_tests,
+    .n_tests  = COUNT_ARRAY_ELEMS(idr_tests),
+};
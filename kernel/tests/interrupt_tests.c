@@ -6,6 +6,7 @@
 */
 #include <arch/interrupts.h>
 #include <atomics.h>
+#include <devices/timer.h>
 
 #include "test.h"
 
@@ -14,6 +15,11 @@
 #define TEST_INTERRUPT3 (ARCH_N_INTERRUPTS - 2)
 #define TEST_INTERRUPT4 (ARCH_N_INTERRUPTS - 1)
 
+/* Below the reschedule interrupt */
+#define TEST_INTERRUPT_LOW      (ARCH_N_INTERRUPTS - 7)
+#define TEST_INTERRUPT_HIGH     (ARCH_N_INTERRUPTS - 6)
+#define TEST_INTERRUPT_THREADED (ARCH_N_INTERRUPTS - 8)
+
 #if ARCH(i686)
 #define INT(i) asm volatile("int %0\n\t" ::"i"(i))
 #else
@@ -29,6 +35,12 @@ static atomic_uint_t isr1_bottom_done = ATOMIC_INIT();
 /* state variables for test_successive_bottom_halfs */
 static atomic_uint_t bottom_half_count = ATOMIC_INIT();
 
+/* state variables for test_bottom_half_priorities and test_threaded_interrupt */
+static atomic_uint_t high_bottom_done = ATOMIC_INIT();
+static atomic_uint_t priority_fail    = ATOMIC_INIT();
+static atomic_uint_t threaded_count   = ATOMIC_INIT();
+static atomic_uint_t threaded_in_irq  = ATOMIC_INIT();
+
 static void test_isr_ordering_top(struct interrupt_stack_state *state, uint32_t interrupt_number)
 {
     (void)(state);
@@ -86,6 +98,41 @@ static void test_isr_successive_bottom(uint32_t interrupt_number)
     atomic_add_fetch(&bottom_half_count, 1);
 }
 
+static void test_isr_low_top(struct interrupt_stack_state *state, uint32_t interrupt_number)
+{
+    (void)(state);
+    (void)(interrupt_number);
+
+    INT(TEST_INTERRUPT_HIGH);
+}
+
+static void test_isr_low_bottom(uint32_t interrupt_number)
+{
+    (void)(interrupt_number);
+
+    // Despite its lower vector, the bottom half of the high priority class must have run first
+    if (!atomic_load(&high_bottom_done)) {
+        atomic_store(&priority_fail, 1);
+        TEST_LOG("low priority bottom half ran before the high priority one");
+    }
+}
+
+static void test_isr_high_bottom(uint32_t interrupt_number)
+{
+    (void)(interrupt_number);
+    atomic_store(&high_bottom_done, 1);
+}
+
+static void test_isr_threaded(uint32_t interrupt_number)
+{
+    (void)(interrupt_number);
+
+    if (!interrupts_enabled()) {
+        atomic_store(&threaded_in_irq, 1);
+    }
+    atomic_add_fetch(&threaded_count, 1);
+}
+
 static int interrupt_tests_setup()
 {
     TEST_ERRNO_FUNC(register_interrupt_handler(TEST_INTERRUPT1, test_isr_ordering_top,
@@ -94,6 +141,13 @@ static int interrupt_tests_setup()
                                                test_isr_ordering_bottom));
     TEST_ERRNO_FUNC(register_interrupt_handler(TEST_INTERRUPT3, test_isr_successive_top, NULL));
     TEST_ERRNO_FUNC(register_interrupt_handler(TEST_INTERRUPT4, NULL, test_isr_successive_bottom));
+    TEST_ERRNO_FUNC(register_interrupt_handler_with_priority(
+        TEST_INTERRUPT_LOW, test_isr_low_top, test_isr_low_bottom, BOTTOM_HALF_PRIORITY_LOW));
+    TEST_ERRNO_FUNC(register_interrupt_handler_with_priority(
+        TEST_INTERRUPT_HIGH, NULL, test_isr_high_bottom, BOTTOM_HALF_PRIORITY_HIGH));
+    TEST_ERRNO_FUNC(register_threaded_interrupt_handler(TEST_INTERRUPT_THREADED, NULL,
+                                                        test_isr_threaded,
+                                                        INTERRUPT_THREAD_PRIORITY));
     return 0;
 }
 
@@ -143,9 +197,48 @@ static int test_successive_bottom_halfs()
     return 0;
 }
 
+/*
+    Test that pending bottom halves of a more important class run first
+*/
+static int test_bottom_half_priorities()
+{
+    INT(TEST_INTERRUPT_LOW);
+
+    if (!atomic_load(&high_bottom_done) || atomic_load(&priority_fail)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+    Test that the bottom half of a threaded interrupt runs in its thread, with interrupts enabled
+*/
+static int test_threaded_interrupt()
+{
+    uint64_t start_time;
+
+    INT(TEST_INTERRUPT_THREADED);
+
+    start_time = timer_get_time_since_boot();
+    while (!atomic_load(&threaded_count) &&
+           timer_get_time_since_boot() < start_time + MS_TO_NS(100)) {
+        nano_sleep(MS_TO_NS(1));
+    }
+
+    if (atomic_load(&threaded_count) != 1 || atomic_load(&threaded_in_irq)) {
+        TEST_LOG("threaded_count is %u", atomic_load(&threaded_count));
+        return -1;
+    }
+
+    return 0;
+}
+
 struct test_func interrupt_tests[] = {
     CREATE_TEST_FUNC(test_interrupt_ordering),
     CREATE_TEST_FUNC(test_successive_bottom_halfs),
+    CREATE_TEST_FUNC(test_bottom_half_priorities),
+    CREATE_TEST_FUNC(test_threaded_interrupt),
 };
 
 struct test_suite interrupt_test_suite = {
@@ -0,0 +1,140 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#include <memory/mempool.h>
+#include <memory/shrinker.h>
+#include <utils.h>
+
+#include "test.h"
+
+/* Atomic allocations should be served by the emergency reserve left by sleepable allocations */
+static int test_atomic_alloc()
+{
+    void *sleepable = kalloc(128);
+    void *atomic    = kalloc_flags(128, KALLOC_ATOMIC);
+
+    TEST_RETURN_IF_FALSE(sleepable);
+    TEST_RETURN_IF_FALSE(atomic);
+
+    kfree(atomic);
+    kfree(sleepable);
+    return 0;
+}
+
+/* A failed krealloc must leave the original allocation intact */
+static int test_krealloc_keeps_ptr()
+{
+    char *ptr = kalloc(16);
+    char *new;
+
+    TEST_RETURN_IF_FALSE(ptr);
+    strcpy(ptr, "islay");
+
+    // Far bigger than anything within the heap, can't be served atomically
+    new = krealloc_flags(ptr, 1 << 24, KALLOC_ATOMIC);
+    TEST_RETURN_IF_FALSE(!new);
+    TEST_RETURN_IF_FALSE(strcmp(ptr, "islay") == 0);
+
+    kfree(ptr);
+    return 0;
+}
+
+static int test_mempool()
+{
+    struct mempool pool;
+    void          *objs[8];
+
+    TEST_ERRNO_FUNC(mempool_init(&pool, 4, 32));
+    TEST_RETURN_IF_FALSE(pool.curr_nr == 4);
+
+    for (size_t i = 0; i < COUNT_ARRAY_ELEMS(objs); i++) {
+        objs[i] = mempool_alloc(&pool, KALLOC_ATOMIC);
+        TEST_RETURN_IF_FALSE(objs[i]);
+    }
+
+    // Returned objects should refill the reserve before going back to the heap
+    for (size_t i = 0; i < COUNT_ARRAY_ELEMS(objs); i++) {
+        mempool_free(&pool, objs[i]);
+    }
+    TEST_RETURN_IF_FALSE(pool.curr_nr == 4);
+
+    mempool_destroy(&pool);
+    TEST_RETURN_IF_FALSE(pool.curr_nr == 0);
+    return 0;
+}
+
+static int test_mempool_reserve()
+{
+    struct mempool pool;
+    void          *reserved;
+    void          *obj;
+
+    // Hand back the free segments, so the heap can't serve the objects atomically
+    shrink_caches(SIZE_MAX);
+    TEST_ERRNO_FUNC(mempool_init(&pool, 1, 1 << 18));
+    reserved = pool.reserve;
+
+    obj = mempool_alloc(&pool, KALLOC_ATOMIC);
+    TEST_RETURN_IF_FALSE(obj == reserved);
+    TEST_RETURN_IF_FALSE(pool.curr_nr == 0);
+
+    // The pool is exhausted
+    TEST_RETURN_IF_FALSE(!mempool_alloc(&pool, KALLOC_ATOMIC));
+
+    mempool_free(&pool, obj);
+    TEST_RETURN_IF_FALSE(pool.curr_nr == 1);
+    TEST_RETURN_IF_FALSE(pool.reserve == reserved);
+
+    mempool_destroy(&pool);
+    return 0;
+}
+
+static size_t dummy_scanned = 0;
+
+static size_t dummy_count(struct shrinker *shrinker)
+{
+    (void)shrinker;
+    return 4;
+}
+
+static size_t dummy_scan(struct shrinker *shrinker, size_t nr_pages)
+{
+    (void)shrinker;
+    dummy_scanned += nr_pages;
+    return nr_pages;
+}
+
+/* A registered shrinker should be asked to give back memory, never more than it reported */
+static int test_shrinker()
+{
+    struct shrinker dummy = {.name = "dummy", .count = dummy_count, .scan = dummy_scan};
+
+    TEST_ERRNO_FUNC(register_shrinker(&dummy));
+
+    // The other shrinkers may or may not have something to free, so only check the dummy
+    dummy_scanned = 0;
+    shrink_caches(SIZE_MAX);
+    unregister_shrinker(&dummy);
+
+    TEST_RETURN_IF_FALSE(dummy_scanned == 4);
+    return 0;
+}
+
+struct test_func memory_tests[] = {
+    CREATE_TEST_FUNC(test_atomic_alloc),
+    CREATE_TEST_FUNC(test_krealloc_keeps_ptr),
+    CREATE_TEST_FUNC(test_mempool),
+    CREATE_TEST_FUNC(test_mempool_reserve),
+    CREATE_TEST_FUNC(test_shrinker),
+};
+
+struct test_suite memory_test_suite = {
+    .name     = "memory_tests",
+    .setup    = NULL,
+    .teardown = NULL,
+    .tests    = memory_tests,
+    .n_tests  = COUNT_ARRAY_ELEMS(memory_tests),
+};
@@ -10,12 +10,18 @@ extern struct test_suite interrupt_test_suite;
 extern struct test_suite fs_test_suite;
 extern struct test_suite scheduler_test_suite;
 extern struct test_suite list_test_suite;
+extern struct test_suite rbtree_test_suite;
+extern struct test_suite idr_test_suite;
+extern struct test_suite memory_test_suite;
 
 static struct test_suite* post_boot_tests[] = {
     &interrupt_test_suite,
     &fs_test_suite,
     &scheduler_test_suite,
     &list_test_suite,
+    &rbtree_test_suite,
+    &idr_test_suite,
+    &memory_test_suite,
 };
 
 struct test_suite* current_suite;
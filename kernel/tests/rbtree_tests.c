@@ -0,0 +1,135 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#include <rbtree.h>
+
+#include "test.h"
+
+#define N_ELEMS 64
+
+struct elem {
+    unsigned int   key;
+    struct rb_node node;
+};
+
+static struct elem elems[N_ELEMS];
+
+static bool elem_less(const struct rb_node* a, const struct rb_node* b)
+{
+    return GET_STRUCT(const struct elem, node, a)->key <
+           GET_STRUCT(const struct elem, node, b)->key;
+}
+
+/* Ensure the tree to be ordered, correctly linked and balanced, returns the black height */
+static int verify_subtree(struct rb_node* node, struct rb_node* parent)
+{
+    int left, right;
+
+    if (!node) {
+        return 1;
+    }
+
+    if (node->parent != parent) {
+        TEST_LOG("Tree illformated: node %x has parent %x, not %x", node, node->parent, parent);
+        return -1;
+    }
+
+    if ((node->left && elem_less(node, node->left)) ||
+        (node->right && elem_less(node->right, node))) {
+        TEST_LOG("Tree unordered at %x", node);
+        return -1;
+    }
+
+    left  = verify_subtree(node->left, node);
+    right = verify_subtree(node->right, node);
+    if (left < 0 || right < 0 || left != right) {
+        TEST_LOG("Tree unbalanced at %x (%i, %i)", node, left, right);
+        return -1;
+    }
+    return left + (node->color != 0);
+}
+
+static int verify_tree(struct rb_root* root, unsigned int expected_count)
+{
+    unsigned int    count = 0, prev = 0;
+    struct rb_node* node;
+
+    if (verify_subtree(root->node, NULL) < 0) {
+        return -1;
+    }
+
+    RB_ITER(root, node)
+    {
+        struct elem* e = GET_STRUCT(struct elem, node, node);
+        if (count > 0 && e->key < prev) {
+            TEST_LOG("Iteration out of order, %u after %u", e->key, prev);
+            return -1;
+        }
+        prev = e->key;
+        count++;
+    }
+    return count == expected_count ? 0 : -1;
+}
+
+static int test_add_and_erase()
+{
+    struct rb_root tree = RB_ROOT_INIT;
+
+    // Insert the keys in a scrambled order
+    for (unsigned int i = 0; i < N_ELEMS; i++) {
+        elems[i].key = (i * 37) % N_ELEMS;
+        rb_add(&tree, &elems[i].node, elem_less);
+    }
+    TEST_ERRNO_FUNC(verify_tree(&tree, N_ELEMS));
+    TEST_RETURN_IF_FALSE(GET_STRUCT(struct elem, node, rb_first(&tree))->key == 0);
+
+    // Remove every other element, including the leftmost
+    for (unsigned int i = 0; i < N_ELEMS; i += 2) {
+        rb_erase(&tree, &elems[i].node);
+    }
+    TEST_ERRNO_FUNC(verify_tree(&tree, N_ELEMS / 2));
+    TEST_RETURN_IF_FALSE(GET_STRUCT(struct elem, node, rb_first(&tree))->key == 1);
+
+    for (unsigned int i = 1; i < N_ELEMS; i += 2) {
+        rb_erase(&tree, &elems[i].node);
+    }
+    TEST_RETURN_IF_FALSE(RB_EMPTY(&tree) && rb_first(&tree) == NULL);
+    return 0;
+}
+
+static int test_equal_keys()
+{
+    struct rb_root  tree = RB_ROOT_INIT;
+    struct rb_node* node;
+    unsigned int    i = 0;
+
+    for (i = 0; i < N_ELEMS; i++) {
+        elems[i].key = 1;
+        rb_add(&tree, &elems[i].node, elem_less);
+    }
+    TEST_ERRNO_FUNC(verify_tree(&tree, N_ELEMS));
+
+    // Equal keys shall be kept in insertion order
+    i = 0;
+    RB_ITER(&tree, node)
+    {
+        TEST_RETURN_IF_FALSE(node == &elems[i++].node);
+    }
+    return 0;
+}
+
+static struct test_func rbtree_tests[] = {
+    CREATE_TEST_FUNC(test_add_and_erase),
+    CREATE_TEST_FUNC(test_equal_keys),
+};
+
+struct test_suite rbtree_test_suite = {
+    .name     = "rbtree_tests",
+    .setup    = NULL,
+    .teardown = NULL,
+    .tests    = rbtree_tests,
+    .n_tests  = COUNT_ARRAY_ELEMS(rbtree_tests),
+};
@@ -4,10 +4,18 @@
 
    Copyright (C) 2024 Isak Evaldsson
 */
+#include <arch/interrupts.h>
 #include <atomics.h>
 #include <devices/timer.h>
+#include <tasks/fiber.h>
+#include <tasks/fpu.h>
+#include <tasks/latency_tracer.h>
 #include <tasks/locking.h>
+#include <tasks/rcu.h>
+#include <tasks/wait_queue.h>
 #include <tasks/scheduler.h>
+#include <tasks/workqueue.h>
+#include <uapi/errno.h>
 #include <utils.h>
 
 #include "test.h"
@@ -120,6 +128,165 @@ static int mutex_test()
     return 0;
 }
 
+/* Mutex handoff test */
+static unsigned int lock_order[3];
+static unsigned int lock_order_idx = 0;
+
+static void lock_order_thread()
+{
+    mutex_lock(&test_mutex);
+    lock_order[lock_order_idx++] = scheduler_get_current_task()->tid;
+    mutex_unlock(&test_mutex);
+}
+
+static int mutex_handoff_test()
+{
+    tid_t tids[3];
+
+    mutex_lock(&test_mutex);
+    TEST_RETURN_IF_FALSE(mutex_is_held(&test_mutex));
+
+    // Queue up the tasks one at a time, so their order on the wait queue is known
+    for (int i = 0; i < 3; i++) {
+        tids[i] = create_task(&lock_order_thread);
+        scheduler_yield();
+        TEST_RETURN_IF_FALSE(get_block_reason(tids[i]) == BLOCK_REASON_LOCK_WAIT);
+    }
+
+    // The ownership is handed over, so the main task can't barge in ahead of the waiters
+    mutex_unlock(&test_mutex);
+    mutex_lock(&test_mutex);
+    TEST_RETURN_IF_FALSE(lock_order_idx == 3);
+    mutex_unlock(&test_mutex);
+
+    for (int i = 0; i < 3; i++) {
+        TEST_RETURN_IF_FALSE(lock_order[i] == tids[i]);
+    }
+    return 0;
+}
+
+#ifdef LOCKSTAT
+/* Lock statistics test */
+static MUTEX_DEFINE(lockstat_mutex);
+
+static void lockstat_thread()
+{
+    mutex_lock(&lockstat_mutex);
+    mutex_unlock(&lockstat_mutex);
+}
+
+static int lockstat_test()
+{
+    tid_t    tid;
+    uint32_t contentions;
+
+    mutex_lock(&lockstat_mutex);
+    contentions = lockstat_mutex.lockstat.class->contentions;
+
+    tid = create_task(&lockstat_thread);
+    scheduler_yield();
+    TEST_RETURN_IF_FALSE(get_block_reason(tid) == BLOCK_REASON_LOCK_WAIT);
+    mutex_unlock(&lockstat_mutex);
+
+    // Once the thread has been handed the lock and released it, the main task can take it again
+    mutex_lock(&lockstat_mutex);
+    mutex_unlock(&lockstat_mutex);
+
+    TEST_RETURN_IF_FALSE(lockstat_mutex.lockstat.class->contentions == contentions + 1);
+    TEST_RETURN_IF_FALSE(lockstat_mutex.lockstat.class->hold_total_ns > 0);
+    return 0;
+}
+#endif
+
+/* Reader-writer lock and sequence counter test */
+static RWLOCK_DEFINE(test_rwlock);
+static SEQCOUNT_DEFINE(test_seq);
+static tid_t        rw_order[2];
+static atomic_int_t rw_order_idx = ATOMIC_INIT();
+
+static void rw_writer_thread()
+{
+    rwlock_write_lock(&test_rwlock);
+    rw_order[atomic_add_fetch(&rw_order_idx, 1) - 1] = scheduler_get_current_task()->tid;
+    rwlock_write_unlock(&test_rwlock);
+}
+
+static void rw_reader_thread()
+{
+    rwlock_read_lock(&test_rwlock);
+    rw_order[atomic_add_fetch(&rw_order_idx, 1) - 1] = scheduler_get_current_task()->tid;
+    rwlock_read_unlock(&test_rwlock);
+}
+
+static int rwlock_test()
+{
+    tid_t        writer, reader;
+    unsigned int seq;
+
+    // Readers share the lock
+    rwlock_read_lock(&test_rwlock);
+    rwlock_read_lock(&test_rwlock);
+    rwlock_read_unlock(&test_rwlock);
+
+    writer = create_task(&rw_writer_thread);
+    scheduler_yield();
+    TEST_RETURN_IF_FALSE(get_block_reason(writer) == BLOCK_REASON_LOCK_WAIT);
+
+    // With a writer waiting new readers must queue up, even though the lock is held for reading
+    reader = create_task(&rw_reader_thread);
+    scheduler_yield();
+    TEST_RETURN_IF_FALSE(get_block_reason(reader) == BLOCK_REASON_LOCK_WAIT);
+
+    rwlock_read_unlock(&test_rwlock);
+    while (atomic_load(&rw_order_idx) < 2) {
+        scheduler_yield();
+    }
+    TEST_RETURN_IF_FALSE(rw_order[0] == writer && rw_order[1] == reader);
+
+    seq = read_seqcount_begin(&test_seq);
+    TEST_RETURN_IF_FALSE(!read_seqcount_retry(&test_seq, seq));
+    write_seqcount_begin(&test_seq);
+    write_seqcount_end(&test_seq);
+    TEST_RETURN_IF_FALSE(read_seqcount_retry(&test_seq, seq));
+    return 0;
+}
+
+/* Wait queue and condition variable test */
+static DEFINE_WAIT_QUEUE(test_wait_queue, BLOCK_REASON_IO_WAIT);
+static CONDVAR_DEFINE(test_cond);
+static bool test_event = false;
+
+static void event_thread()
+{
+    test_event = true;
+    wake_up(&test_wait_queue);
+
+    mutex_lock(&test_mutex);
+    condvar_signal(&test_cond);
+    mutex_unlock(&test_mutex);
+}
+
+static int wait_queue_test()
+{
+    uint64_t start_time = timer_get_time_since_boot();
+
+    // Nothing wakes the queue, so the wait shall time out
+    TEST_RETURN_IF_FALSE(!wait_event_timeout(&test_wait_queue, test_event, MS_TO_NS(5)));
+    TEST_RETURN_IF_FALSE(timer_get_time_since_boot() - start_time >= MS_TO_NS(5));
+
+    mutex_lock(&test_mutex);
+    TEST_RETURN_IF_FALSE(!condvar_wait_timeout(&test_cond, &test_mutex, MS_TO_NS(5)));
+    TEST_RETURN_IF_FALSE(mutex_is_held(&test_mutex));
+
+    // Signaling requires the mutex, so the signal can't be sent before the main task waits
+    TEST_RETURN_IF_FALSE(create_task(&event_thread));
+    TEST_RETURN_IF_FALSE(condvar_wait_timeout(&test_cond, &test_mutex, SECONDS_TO_NS(1)));
+    mutex_unlock(&test_mutex);
+
+    TEST_RETURN_IF_FALSE(wait_event_timeout(&test_wait_queue, test_event, SECONDS_TO_NS(1)));
+    return 0;
+}
+
 /* Cleanup test */
 static void void_thread()
 {
@@ -151,10 +318,517 @@ static int cleanup_test()
     return ret;
 }
 
+/* Task cache test */
+static void sleeping_thread()
+{
+    scheduler_nano_sleep_until(timer_get_time_since_boot() + MS_TO_NS(1));
+}
+
+static int task_cache_test()
+{
+    uint32_t hits;
+    tid_t    tid;
+    task_t  *t, *reused;
+
+    tid = create_task(&sleeping_thread);
+    t   = get_task(tid);
+    TEST_RETURN_IF_FALSE(t);
+
+    while (!IS_TERMINATED(t)) {
+        scheduler_nano_sleep_until(timer_get_time_since_boot() + MS_TO_NS(1));
+    }
+    TEST_RETURN_IF_FALSE(t->sleep_expiry);
+
+    // Let the cleanup thread free the task, the rcu callbacks then run in order
+    put_task(t);
+    scheduler_nano_sleep_until(timer_get_time_since_boot() + MS_TO_NS(10));
+    synchronize_rcu();
+
+    // The cache is LIFO, so the terminated task is the first to be re-used
+    hits   = task_cache_hits();
+    tid    = create_task(&void_thread);
+    reused = get_task(tid);
+    TEST_RETURN_IF_FALSE(reused);
+
+    TEST_LOG("task %x re-used as %x, hits %u", t, reused, task_cache_hits() - hits);
+    TEST_RETURN_IF_FALSE(task_cache_hits() == hits + 1);
+    TEST_RETURN_IF_FALSE(reused == t);
+    TEST_RETURN_IF_FALSE(reused->sleep_expiry == 0);
+    TEST_RETURN_IF_FALSE(!reused->fpu_state && !reused->fiber);
+
+    put_task(reused);
+    return 0;
+}
+
+/* Priority test */
+static atomic_uint_t run_order     = ATOMIC_INIT();
+static unsigned int  low_prio_run  = 0;
+static unsigned int  high_prio_run = 0;
+
+static void low_prio_thread()
+{
+    low_prio_run = atomic_add_fetch(&run_order, 1);
+}
+
+static void high_prio_thread()
+{
+    high_prio_run = atomic_add_fetch(&run_order, 1);
+}
+
+static int priority_test()
+{
+    TEST_RETURN_IF_FALSE(create_task_with_priority(&void_thread, SCHED_PRIORITY_LEVELS) == 0);
+
+    // Created in reverse order, so a plain FIFO would run the low priority task first
+    TEST_RETURN_IF_FALSE(create_task_with_priority(&low_prio_thread, SCHED_PRIORITY_LEVELS - 1));
+    TEST_RETURN_IF_FALSE(create_task_with_priority(&high_prio_thread, 0));
+
+    // Priority tasks are scheduled before this fair task, the most important one first
+    scheduler_yield();
+    TEST_RETURN_IF_FALSE(high_prio_run == 1 && low_prio_run == 2);
+    return 0;
+}
+
+/* Nice test */
+static atomic_uint_t spinners_stop = ATOMIC_INIT();
+
+static void spinner()
+{
+    while (!atomic_load(&spinners_stop))
+        ;
+}
+
+static int nice_test()
+{
+    int      ret = 0;
+    task_t  *t0  = get_task(create_task(&spinner));
+    task_t  *t5  = get_task(create_task(&spinner));
+    uint64_t used0, used5;
+
+    TEST_RETURN_IF_FALSE(t0 && t5);
+    TEST_RETURN_IF_FALSE(scheduler_set_nice(t5, NICE_MAX + 1) == -EINVAL);
+    TEST_RETURN_IF_FALSE(scheduler_set_nice(t5, 5) == 0);
+
+    // Let the spinners compete for the cpu, nice 5 has roughly a third of the weight of nice 0
+    sleep(1);
+    used0 = t0->time_used;
+    used5 = t5->time_used;
+    atomic_store(&spinners_stop, 1);
+
+    TEST_LOG("nice 0 used %u ms, nice 5 used %u ms", (uint32_t)(used0 / 1000000),
+             (uint32_t)(used5 / 1000000));
+    if (used0 < 2 * used5 || used5 == 0) {
+        ret = -1;
+    }
+
+    put_task(t0);
+    put_task(t5);
+    return ret;
+}
+
+/* Deadline test */
+#define DL_TEST_PERIODS 20
+
+static atomic_uint_t dl_periods = ATOMIC_INIT();
+static int           dl_ret     = 0;
+
+static void dl_thread()
+{
+    // 2 ms every 10 ms
+    dl_ret = scheduler_set_deadline(MS_TO_NS(2), MS_TO_NS(10), MS_TO_NS(10));
+    if (dl_ret < 0) {
+        return;
+    }
+
+    for (int i = 0; i < DL_TEST_PERIODS; i++) {
+        atomic_add_fetch(&dl_periods, 1);
+        scheduler_wait_next_period();
+    }
+    scheduler_clear_deadline();
+}
+
+static int deadline_test()
+{
+    uint64_t start_time;
+
+    TEST_RETURN_IF_FALSE(scheduler_set_deadline(MS_TO_NS(3), MS_TO_NS(2), MS_TO_NS(10)) ==
+                         -EINVAL);
+    TEST_RETURN_IF_FALSE(scheduler_set_deadline(MS_TO_NS(10), MS_TO_NS(10), MS_TO_NS(10)) ==
+                         -EBUSY);
+
+    TEST_RETURN_IF_FALSE(create_task(&dl_thread));
+
+    // Hog the cpu without blocking, the deadline task should still get to run each period
+    start_time = timer_get_time_since_boot();
+    while (timer_get_time_since_boot() < start_time + MS_TO_NS(10 * DL_TEST_PERIODS + 50))
+        ;
+
+    TEST_ERRNO_FUNC(dl_ret);
+    TEST_LOG("deadline task ran %u periods", atomic_load(&dl_periods));
+    TEST_RETURN_IF_FALSE(atomic_load(&dl_periods) == DL_TEST_PERIODS);
+    return 0;
+}
+
+/* Wakeup preemption test */
+static uint64_t wakeup_latency = UINT64_MAX;
+
+static void wakeup_thread()
+{
+    uint64_t when = timer_get_time_since_boot() + MS_TO_NS(20);
+
+    scheduler_nano_sleep_until(when);
+    wakeup_latency = timer_get_time_since_boot() - when;
+}
+
+static int wakeup_test()
+{
+    uint64_t start_time;
+
+    TEST_RETURN_IF_FALSE(scheduler_set_min_granularity(0) == -EINVAL);
+    TEST_RETURN_IF_FALSE(create_task(&wakeup_thread));
+
+    // Hog the cpu, the woken task should preempt this task rather than waiting out its time slice
+    start_time = timer_get_time_since_boot();
+    while (timer_get_time_since_boot() < start_time + MS_TO_NS(100))
+        ;
+
+    // Without wakeup preemption the task would wait out the 10 ms time slice, the woken task may
+    // have to wait for the min granularity though
+    TEST_LOG("wakeup latency %u us", (uint32_t)(wakeup_latency / 1000));
+    TEST_RETURN_IF_FALSE(wakeup_latency < MS_TO_NS(8));
+    return 0;
+}
+
+/* One-shot timer test */
+static int oneshot_test()
+{
+    uint64_t when, oversleep;
+    uint32_t ticks;
+
+    // While idling the device is only programmed for the wakeup, a 1 kHz tick would fire 100 times
+    ticks = timer_get_nr_interrupts();
+    scheduler_nano_sleep_until(timer_get_time_since_boot() + MS_TO_NS(100));
+    ticks = timer_get_nr_interrupts() - ticks;
+
+    TEST_LOG("%u timer interrupts while idling 100 ms", ticks);
+    TEST_RETURN_IF_FALSE(ticks < 25);
+
+    // Off the ms boundaries of a periodic tick. The bound only catches lost wakeups, since slow
+    // emulators can delay the interrupt, so the precise value is logged
+    when = timer_get_time_since_boot() + MS_TO_NS(3) + 300000;
+    scheduler_nano_sleep_until(when);
+    oversleep = timer_get_time_since_boot() - when;
+
+    TEST_LOG("overslept %u us", (uint32_t)(oversleep / 1000));
+    TEST_RETURN_IF_FALSE(oversleep < MS_TO_NS(5));
+    return 0;
+}
+
+/* Scheduling statistics test */
+static int stats_test()
+{
+    task_t  *task = scheduler_get_current_task();
+    uint64_t slept, before = task->stats.blocked_time[BLOCK_REASON_SLEEP];
+    uint32_t switches      = task->stats.nr_voluntary_switches;
+
+    scheduler_nano_sleep_until(timer_get_time_since_boot() + MS_TO_NS(5));
+    slept = task->stats.blocked_time[BLOCK_REASON_SLEEP] - before;
+
+    TEST_LOG("slept %u us", (uint32_t)(slept / 1000));
+    TEST_RETURN_IF_FALSE(slept >= MS_TO_NS(5) && slept < MS_TO_NS(25));
+    TEST_RETURN_IF_FALSE(task->stats.nr_voluntary_switches > switches);
+    return 0;
+}
+
+/* RCU test */
+static struct rcu_head rcu_test_head;
+static bool            rcu_callback_called = false;
+
+static void rcu_test_callback(struct rcu_head *head)
+{
+    (void)head;
+    rcu_callback_called = true;
+}
+
+static int rcu_test()
+{
+    uint64_t start_time;
+
+    // The callback must not run while a read-side critical section is ongoing
+    rcu_read_lock();
+    call_rcu(&rcu_test_head, rcu_test_callback);
+    start_time = timer_get_time_since_boot();
+    while (timer_get_time_since_boot() < start_time + MS_TO_NS(20))
+        ;
+    TEST_RETURN_IF_FALSE(!rcu_callback_called);
+    rcu_read_unlock();
+
+    // Callbacks are invoked in order, so it has been called once synchronize_rcu() returns
+    synchronize_rcu();
+    TEST_RETURN_IF_FALSE(rcu_callback_called);
+    return 0;
+}
+
+/* Workqueue test */
+static atomic_uint_t wq_running  = ATOMIC_INIT();
+static unsigned int  wq_max_seen = 0;
+static unsigned int  wq_executed = 0;
+
+static void wq_test_func(struct work_struct *work)
+{
+    unsigned int running = atomic_add_fetch(&wq_running, 1);
+
+    (void)work;
+    wq_max_seen = MAX(wq_max_seen, running);
+    nano_sleep(MS_TO_NS(5));
+    wq_executed++;
+    atomic_sub_fetch(&wq_running, 1);
+}
+
+static DEFINE_WORK(wq_work1, wq_test_func);
+static DEFINE_WORK(wq_work2, wq_test_func);
+static DEFINE_WORK(wq_work3, wq_test_func);
+static DEFINE_DELAYED_WORK(wq_delayed, wq_test_func);
+static DEFINE_DELAYED_WORK(wq_cancelled, wq_test_func);
+
+static int workqueue_test()
+{
+    struct workqueue *wq = workqueue_create("test", 1);
+
+    TEST_RETURN_IF_FALSE(wq);
+
+    // An ordered workqueue runs its items one at a time, and pending items are only queued once
+    TEST_RETURN_IF_FALSE(queue_work(wq, &wq_work1));
+    TEST_RETURN_IF_FALSE(queue_work(wq, &wq_work2));
+    TEST_RETURN_IF_FALSE(queue_work(wq, &wq_work3));
+    TEST_RETURN_IF_FALSE(!queue_work(wq, &wq_work3));
+    flush_workqueue(wq);
+    TEST_RETURN_IF_FALSE(wq_executed == 3);
+    TEST_RETURN_IF_FALSE(wq_max_seen == 1);
+
+    // Delayed items are queued once their delay has passed, unless cancelled
+    TEST_RETURN_IF_FALSE(queue_delayed_work(wq, &wq_delayed, MS_TO_NS(10)));
+    TEST_RETURN_IF_FALSE(queue_delayed_work(wq, &wq_cancelled, MS_TO_NS(10)));
+    TEST_RETURN_IF_FALSE(cancel_delayed_work(&wq_cancelled));
+    TEST_RETURN_IF_FALSE(wq_executed == 3);
+    nano_sleep(MS_TO_NS(50));
+    flush_workqueue(wq);
+    TEST_RETURN_IF_FALSE(wq_executed == 4);
+
+    // Cancelling a delayed item as a regular one also stops its timer, and leaves nr_active as is
+    TEST_RETURN_IF_FALSE(queue_delayed_work(wq, &wq_cancelled, MS_TO_NS(10)));
+    TEST_RETURN_IF_FALSE(cancel_work(&wq_cancelled.work));
+    TEST_RETURN_IF_FALSE(!cancel_work(&wq_cancelled.work));
+    TEST_RETURN_IF_FALSE(wq->nr_active == 0);
+    nano_sleep(MS_TO_NS(50));
+    flush_workqueue(wq);
+    TEST_RETURN_IF_FALSE(wq_executed == 4);
+
+    // Destroying the workqueue cancels the delayed items still waiting for their timer
+    TEST_RETURN_IF_FALSE(queue_delayed_work(wq, &wq_delayed, MS_TO_NS(10)));
+    workqueue_destroy(wq);
+    TEST_RETURN_IF_FALSE(!wq_delayed.work.pending);
+    nano_sleep(MS_TO_NS(50));
+    TEST_RETURN_IF_FALSE(wq_executed == 4);
+    return 0;
+}
+
+/* Fiber test */
+#define FIBER_TEST_FIBERS 100
+
+static DEFINE_WAIT_QUEUE(fiber_wait_queue, BLOCK_REASON_IO_WAIT);
+static unsigned int fiber_order[4];
+static unsigned int fiber_order_idx = 0;
+static unsigned int fibers_done     = 0;
+static bool         fiber_event     = false;
+
+static void fiber_waiter(void *arg)
+{
+    (void)arg;
+    wait_event(&fiber_wait_queue, READ_ONCE(fiber_event));
+    fiber_order[fiber_order_idx++] = 3;
+}
+
+static void fiber_sleeper(void *arg)
+{
+    (void)arg;
+    fiber_order[fiber_order_idx++] = 1;
+    fiber_sleep(MS_TO_NS(10));
+
+    WRITE_ONCE(fiber_event, true);
+    wake_up(&fiber_wait_queue);
+    fiber_order[fiber_order_idx++] = 2;
+}
+
+static void fiber_yielder(void *arg)
+{
+    (void)arg;
+    fiber_yield();
+    fibers_done++;
+}
+
+static int fiber_test()
+{
+    DEFINE_FIBER_SCHEDULER(fs);
+
+    // The waiter blocks on the wait queue, without blocking the other fibers, until the sleeper
+    // wakes it up
+    TEST_RETURN_IF_FALSE(fiber_create(&fs, fiber_waiter, NULL) == 0);
+    TEST_RETURN_IF_FALSE(fiber_create(&fs, fiber_sleeper, NULL) == 0);
+    for (int i = 0; i < FIBER_TEST_FIBERS; i++) {
+        TEST_RETURN_IF_FALSE(fiber_create(&fs, fiber_yielder, NULL) == 0);
+    }
+
+    fiber_run(&fs);
+    TEST_RETURN_IF_FALSE(fibers_done == FIBER_TEST_FIBERS);
+    TEST_RETURN_IF_FALSE(fiber_order_idx == 3);
+    TEST_RETURN_IF_FALSE(fiber_order[0] == 1 && fiber_order[1] == 2 && fiber_order[2] == 3);
+    TEST_RETURN_IF_FALSE(!fiber_current());
+    return 0;
+}
+
+/* FPU test */
+#define FPU_CW_DEFAULT  0x037f
+#define FPU_CW_ROUND_DN (FPU_CW_DEFAULT | 0x0400)
+#define FPU_CW_ROUND_UP (FPU_CW_DEFAULT | 0x0800)
+#define FPU_CW_TRUNCATE (FPU_CW_DEFAULT | 0x0c00)
+
+static atomic_uint_t fpu_threads_done = ATOMIC_INIT();
+static atomic_uint_t fpu_fail         = ATOMIC_INIT();
+
+static uint16_t fpu_get_cw()
+{
+    uint16_t cw;
+    asm volatile("fnstcw %0" : "=m"(cw));
+    return cw;
+}
+
+static void fpu_set_cw(uint16_t cw)
+{
+    asm volatile("fldcw %0" ::"m"(cw));
+}
+
+/* Each task keeps its own control word, despite the other ones changing theirs */
+static void fpu_check_cw(uint16_t cw)
+{
+    fpu_set_cw(cw);
+    for (int i = 0; i < 10; i++) {
+        scheduler_yield();
+        if (fpu_get_cw() != cw) {
+            atomic_store(&fpu_fail, 1);
+        }
+    }
+    atomic_add_fetch(&fpu_threads_done, 1);
+}
+
+static void fpu_thread1()
+{
+    fpu_check_cw(FPU_CW_ROUND_DN);
+}
+
+static void fpu_thread2()
+{
+    fpu_check_cw(FPU_CW_ROUND_UP);
+}
+
+static int fpu_test()
+{
+    uint16_t kernel_cw;
+
+    fpu_set_cw(FPU_CW_TRUNCATE);
+
+    create_task(fpu_thread1);
+    create_task(fpu_thread2);
+    while (atomic_load(&fpu_threads_done) < 2) {
+        nano_sleep(MS_TO_NS(1));
+    }
+    TEST_RETURN_IF_FALSE(!atomic_load(&fpu_fail));
+    TEST_RETURN_IF_FALSE(fpu_get_cw() == FPU_CW_TRUNCATE);
+
+    // Kernel fpu regions start out from the initial state, and leave the task state untouched
+    // The region must be ended before returning, so only check the result afterwards
+    kernel_fpu_begin();
+    kernel_cw = fpu_get_cw();
+    fpu_set_cw(FPU_CW_ROUND_UP);
+    kernel_fpu_end();
+    TEST_RETURN_IF_FALSE(kernel_cw == FPU_CW_DEFAULT);
+    TEST_RETURN_IF_FALSE(fpu_get_cw() == FPU_CW_TRUNCATE);
+
+    fpu_set_cw(FPU_CW_DEFAULT);
+    return 0;
+}
+
+#ifdef LATENCY_TRACER
+/* Latency tracer test */
+#define IRQS_OFF_NS MS_TO_NS(2)
+
+/* Keeps interrupts disabled for IRQS_OFF_NS, returns the time measured within the window */
+static __attribute__((noinline)) uint64_t hold_irqs_off()
+{
+    uint32_t flags = get_register_and_disable_interrupts();
+    uint64_t start = timer_get_time_since_boot();
+    uint64_t now   = start;
+
+    while (now < start + IRQS_OFF_NS) {
+        now = timer_get_time_since_boot();
+    }
+    restore_interrupt_register(flags);
+    return now - start;
+}
+
+static int latency_tracer_test()
+{
+    uint32_t  flags;
+    uint64_t  held, max_ns;
+    uintptr_t entry, exit;
+
+    flags = get_register_and_disable_interrupts();
+    latency_tracer_reset();
+    restore_interrupt_register(flags);
+
+    held = hold_irqs_off();
+
+    // Read with interrupts disabled, so no interrupt can record a window in-between
+    flags  = get_register_and_disable_interrupts();
+    max_ns = latency_tracer_irqsoff_max(&entry, &exit);
+    restore_interrupt_register(flags);
+
+    TEST_LOG("held %u us, max %u us, entry %x exit %x", (uint32_t)(held / 1000),
+             (uint32_t)(max_ns / 1000), entry, exit);
+    TEST_RETURN_IF_FALSE(held >= IRQS_OFF_NS);
+    TEST_RETURN_IF_FALSE(max_ns >= held && max_ns < held + MS_TO_NS(1));
+
+    // Both call sites are within hold_irqs_off(), which is far smaller than 256 bytes
+    TEST_RETURN_IF_FALSE(entry > (uintptr_t)hold_irqs_off && entry < exit);
+    TEST_RETURN_IF_FALSE(exit < (uintptr_t)hold_irqs_off + 256);
+    return 0;
+}
+#endif
+
 struct test_func scheduling_tests[] = {
     CREATE_TEST_FUNC(sleep_test),
     CREATE_TEST_FUNC(mutex_test),
+    CREATE_TEST_FUNC(mutex_handoff_test),
+#ifdef LOCKSTAT
+    CREATE_TEST_FUNC(lockstat_test),
+#endif
+    CREATE_TEST_FUNC(rwlock_test),
+    CREATE_TEST_FUNC(wait_queue_test),
     CREATE_TEST_FUNC(cleanup_test),
+    CREATE_TEST_FUNC(task_cache_test),
+    CREATE_TEST_FUNC(priority_test),
+    CREATE_TEST_FUNC(nice_test),
+    CREATE_TEST_FUNC(deadline_test),
+    CREATE_TEST_FUNC(wakeup_test),
+    CREATE_TEST_FUNC(oneshot_test),
+    CREATE_TEST_FUNC(stats_test),
+    CREATE_TEST_FUNC(rcu_test),
+    CREATE_TEST_FUNC(workqueue_test),
+    CREATE_TEST_FUNC(fiber_test),
+    CREATE_TEST_FUNC(fpu_test),
+#ifdef LATENCY_TRACER
+    CREATE_TEST_FUNC(latency_tracer_test),
+#endif
 };
 
 struct test_suite scheduler_test_suite = {
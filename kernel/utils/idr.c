@@ -0,0 +1,163 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#include <idr.h>
+#include <uapi/errno.h>
+
+#define BITMAP_TEST(bitmap, n)  ((bitmap)[(n) / 32] & (1u << ((n) % 32)))
+#define BITMAP_SET(bitmap, n)   ((bitmap)[(n) / 32] |= (1u << ((n) % 32)))
+#define BITMAP_CLEAR(bitmap, n) ((bitmap)[(n) / 32] &= ~(1u << ((n) % 32)))
+
+/* Allocates the memory a following idr_alloc() may need */
+int idr_preload(struct idr *idr)
+{
+    uintptr_t        expected = 0;
+    struct idr_leaf *leaf;
+
+    if (atomic_load(&idr->spare)) {
+        return 0;
+    }
+
+    leaf = kalloc(sizeof(struct idr_leaf));
+    if (!leaf) {
+        return -ENOMEM;
+    }
+
+    // Someone else may have preloaded in the meantime
+    if (!atomic_compare_exchange(&idr->spare, &expected, (uintptr_t)leaf)) {
+        kfree(leaf);
+    }
+    return 0;
+}
+
+/* Frees the memory held by the idr */
+void idr_destroy(struct idr *idr)
+{
+    for (unsigned int i = 0; i < IDR_LEAVES; i++) {
+        kfree(idr->leaves[i]);
+    }
+    kfree((void *)atomic_exchange(&idr->spare, 0));
+    idr_init(idr, idr->min_id);
+}
+
+static struct idr_leaf *new_leaf(struct idr *idr)
+{
+    struct idr_leaf *leaf = (struct idr_leaf *)atomic_exchange(&idr->spare, 0);
+
+    if (!leaf) {
+        leaf = kalloc_flags(sizeof(struct idr_leaf), KALLOC_ATOMIC);
+        if (!leaf) {
+            return NULL;
+        }
+    }
+
+    memset(leaf, 0, sizeof(struct idr_leaf));
+    return leaf;
+}
+
+/* Finds the first free id within [from, to], -1 if there's none */
+static int find_free(const struct idr *idr, unsigned int from, unsigned int to)
+{
+    unsigned int     id = from, leaf_idx, slot, word, used;
+    struct idr_leaf *leaf;
+
+    while (id <= to) {
+        leaf_idx = id >> IDR_LEAF_BITS;
+        leaf     = idr->leaves[leaf_idx];
+
+        // The slots of a missing leaf are all free
+        if (!leaf) {
+            return (int)id;
+        }
+
+        if (BITMAP_TEST(idr->full, leaf_idx)) {
+            id = (leaf_idx + 1) << IDR_LEAF_BITS;
+            continue;
+        }
+
+        // Check the bitmap a word at a time, treating the slots below id as used
+        slot = id & (IDR_LEAF_SIZE - 1);
+        for (word = slot / 32; word < IDR_LEAF_SIZE / 32; word++) {
+            used = leaf->used[word];
+            if (word == slot / 32) {
+                used |= (1u << (slot % 32)) - 1;
+            }
+
+            if (used != UINT32_MAX) {
+                id = (leaf_idx << IDR_LEAF_BITS) + word * 32 + (unsigned int)__builtin_ctz(~used);
+                return id <= to ? (int)id : -1;
+            }
+        }
+        id = (leaf_idx + 1) << IDR_LEAF_BITS;
+    }
+    return -1;
+}
+
+/* Associates ptr with a free id */
+int idr_alloc(struct idr *idr, void *ptr)
+{
+    int              id;
+    unsigned int     leaf_idx, slot;
+    struct idr_leaf *leaf;
+
+    kassert(ptr);
+
+    // Search from the next id to the end, then wrap around
+    id = find_free(idr, (unsigned int)idr->next_id, IDR_MAX_ID);
+    if (id < 0) {
+        id = find_free(idr, (unsigned int)idr->min_id, (unsigned int)idr->next_id);
+        if (id < 0) {
+            return -ENOSPC;
+        }
+    }
+
+    leaf_idx = (unsigned int)id >> IDR_LEAF_BITS;
+    slot     = (unsigned int)id & (IDR_LEAF_SIZE - 1);
+
+    leaf = idr->leaves[leaf_idx];
+    if (!leaf) {
+        leaf = new_leaf(idr);
+        if (!leaf) {
+            return -ENOMEM;
+        }
+        WRITE_ONCE(idr->leaves[leaf_idx], leaf);
+    }
+
+    BITMAP_SET(leaf->used, slot);
+    if (++leaf->nr_used == IDR_LEAF_SIZE) {
+        BITMAP_SET(idr->full, leaf_idx);
+    }
+    WRITE_ONCE(leaf->slots[slot], ptr);
+
+    idr->next_id = id == IDR_MAX_ID ? idr->min_id : id + 1;
+    return id;
+}
+
+/* Frees the id, returns the pointer it was associated with */
+void *idr_remove(struct idr *idr, int id)
+{
+    void            *ptr;
+    unsigned int     leaf_idx, slot;
+    struct idr_leaf *leaf;
+
+    if (id < idr->min_id || id > IDR_MAX_ID) {
+        return NULL;
+    }
+
+    leaf_idx = (unsigned int)id >> IDR_LEAF_BITS;
+    slot     = (unsigned int)id & (IDR_LEAF_SIZE - 1);
+    leaf     = idr->leaves[leaf_idx];
+    if (!leaf || !BITMAP_TEST(leaf->used, slot)) {
+        return NULL;
+    }
+
+    ptr = leaf->slots[slot];
+    WRITE_ONCE(leaf->slots[slot], NULL);
+    BITMAP_CLEAR(leaf->used, slot);
+    BITMAP_CLEAR(idr->full, leaf_idx);
+    leaf->nr_used--;
+    return ptr;
+}
@@ -0,0 +1,279 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#include <rbtree.h>
+
+/*
+    Implementation based on the algorithms described in Introduction to Algorithms (CLRS) but using
+    NULL pointers rather than a sentinel node as leaves, which is why the erase fix-up needs to
+    keep track of the parent separately.
+*/
+
+#define RB_RED   0
+#define RB_BLACK 1
+
+#define IS_BLACK(node) (!(node) || (node)->color == RB_BLACK)
+
+/* Let new take the place of old as child of parent */
+static void replace_child(struct rb_root* root, struct rb_node* parent, struct rb_node* old,
+                          struct rb_node* new)
+{
+    if (!parent) {
+        root->node = new;
+    } else if (parent->left == old) {
+        parent->left = new;
+    } else {
+        parent->right = new;
+    }
+}
+
+static void rotate_left(struct rb_root* root, struct rb_node* x)
+{
+    struct rb_node* y = x->right;
+
+    x->right = y->left;
+    if (y->left) {
+        y->left->parent = x;
+    }
+    y->parent = x->parent;
+    replace_child(root, x->parent, x, y);
+    y->left   = x;
+    x->parent = y;
+}
+
+static void rotate_right(struct rb_root* root, struct rb_node* x)
+{
+    struct rb_node* y = x->left;
+
+    x->left = y->right;
+    if (y->right) {
+        y->right->parent = x;
+    }
+    y->parent = x->parent;
+    replace_child(root, x->parent, x, y);
+    y->right  = x;
+    x->parent = y;
+}
+
+/* Restores the red-black properties after inserting the red node z */
+static void insert_fixup(struct rb_root* root, struct rb_node* z)
+{
+    struct rb_node *parent, *grandparent, *uncle;
+
+    while ((parent = z->parent) && parent->color == RB_RED) {
+        // The parent is red, so it can't be the root, hence the grandparent exists
+        grandparent = parent->parent;
+
+        if (parent == grandparent->left) {
+            uncle = grandparent->right;
+            if (!IS_BLACK(uncle)) {
+                parent->color      = RB_BLACK;
+                uncle->color       = RB_BLACK;
+                grandparent->color = RB_RED;
+                z                  = grandparent;
+                continue;
+            }
+
+            if (z == parent->right) {
+                rotate_left(root, parent);
+                z      = parent;
+                parent = z->parent;
+            }
+            parent->color      = RB_BLACK;
+            grandparent->color = RB_RED;
+            rotate_right(root, grandparent);
+        } else {
+            uncle = grandparent->left;
+            if (!IS_BLACK(uncle)) {
+                parent->color      = RB_BLACK;
+                uncle->color       = RB_BLACK;
+                grandparent->color = RB_RED;
+                z                  = grandparent;
+                continue;
+            }
+
+            if (z == parent->left) {
+                rotate_right(root, parent);
+                z      = parent;
+                parent = z->parent;
+            }
+            parent->color      = RB_BLACK;
+            grandparent->color = RB_RED;
+            rotate_left(root, grandparent);
+        }
+    }
+    root->node->color = RB_BLACK;
+}
+
+/* Restores the red-black properties after removing a black node, x may be NULL */
+static void erase_fixup(struct rb_root* root, struct rb_node* x, struct rb_node* parent)
+{
+    struct rb_node* sibling;
+
+    while (x != root->node && IS_BLACK(x)) {
+        // Since x is "double black", its sibling can't be a NULL leaf
+        if (x == parent->left) {
+            sibling = parent->right;
+            if (sibling->color == RB_RED) {
+                sibling->color = RB_BLACK;
+                parent->color  = RB_RED;
+                rotate_left(root, parent);
+                sibling = parent->right;
+            }
+
+            if (IS_BLACK(sibling->left) && IS_BLACK(sibling->right)) {
+                sibling->color = RB_RED;
+                x              = parent;
+                parent         = x->parent;
+                continue;
+            }
+
+            if (IS_BLACK(sibling->right)) {
+                sibling->left->color = RB_BLACK;
+                sibling->color       = RB_RED;
+                rotate_right(root, sibling);
+                sibling = parent->right;
+            }
+            sibling->color        = parent->color;
+            parent->color         = RB_BLACK;
+            sibling->right->color = RB_BLACK;
+            rotate_left(root, parent);
+        } else {
+            sibling = parent->left;
+            if (sibling->color == RB_RED) {
+                sibling->color = RB_BLACK;
+                parent->color  = RB_RED;
+                rotate_right(root, parent);
+                sibling = parent->left;
+            }
+
+            if (IS_BLACK(sibling->left) && IS_BLACK(sibling->right)) {
+                sibling->color = RB_RED;
+                x              = parent;
+                parent         = x->parent;
+                continue;
+            }
+
+            if (IS_BLACK(sibling->left)) {
+                sibling->right->color = RB_BLACK;
+                sibling->color        = RB_RED;
+                rotate_left(root, sibling);
+                sibling = parent->left;
+            }
+            sibling->color       = parent->color;
+            parent->color        = RB_BLACK;
+            sibling->left->color = RB_BLACK;
+            rotate_right(root, parent);
+        }
+        x = root->node;
+    }
+
+    if (x) {
+        x->color = RB_BLACK;
+    }
+}
+
+/* Inserts node into the tree */
+void rb_add(struct rb_root* root, struct rb_node* node, rb_less_t less)
+{
+    struct rb_node** link     = &root->node;
+    struct rb_node*  parent   = NULL;
+    bool             leftmost = true;
+
+    // Equal nodes are placed to the right, preserving insertion order
+    while (*link) {
+        parent = *link;
+        if (less(node, parent)) {
+            link = &parent->left;
+        } else {
+            link     = &parent->right;
+            leftmost = false;
+        }
+    }
+
+    node->parent = parent;
+    node->left = node->right = NULL;
+    node->color              = RB_RED;
+    *link                    = node;
+
+    if (leftmost) {
+        root->leftmost = node;
+    }
+    insert_fixup(root, node);
+}
+
+/* Removes node from the tree */
+void rb_erase(struct rb_root* root, struct rb_node* node)
+{
+    int             color;
+    struct rb_node *child, *parent, *successor;
+
+    if (root->leftmost == node) {
+        root->leftmost = rb_next(node);
+    }
+
+    if (!node->left || !node->right) {
+        // At most one child, simply let it take the place of node
+        child  = node->left ? node->left : node->right;
+        parent = node->parent;
+        color  = node->color;
+
+        if (child) {
+            child->parent = parent;
+        }
+        replace_child(root, parent, node, child);
+    } else {
+        // Two children, let the in order successor take the place of node
+        successor = node->right;
+        while (successor->left) {
+            successor = successor->left;
+        }
+
+        color = successor->color;
+        child = successor->right;
+
+        if (successor->parent == node) {
+            parent = successor;
+        } else {
+            parent       = successor->parent;
+            parent->left = child;
+            if (child) {
+                child->parent = parent;
+            }
+            successor->right     = node->right;
+            node->right->parent  = successor;
+        }
+
+        successor->left     = node->left;
+        node->left->parent  = successor;
+        successor->parent   = node->parent;
+        successor->color    = node->color;
+        replace_child(root, node->parent, node, successor);
+    }
+
+    if (color == RB_BLACK) {
+        erase_fixup(root, child, parent);
+    }
+}
+
+/* Gives the node following node in order, NULL if it is the last one */
+struct rb_node* rb_next(const struct rb_node* node)
+{
+    struct rb_node* parent;
+
+    if (node->right) {
+        node = node->right;
+        while (node->left) {
+            node = node->left;
+        }
+        return (struct rb_node*)node;
+    }
+
+    while ((parent = node->parent) && node == parent->right) {
+        node = parent;
+    }
+    return parent;
+}
@@ -22,6 +22,8 @@ SYSTEM_HEADER_PROJECTS="kernel"
 USE_GDB=false
 ARCH=i686
 RUN_TESTS=false
+LOCKSTAT=false
+LATENCY_TRACER=false
 QEMU_VARIANT=i386
 
 # Display script help text
@@ -40,6 +42,8 @@ function help() {
     echo "  --arch <arch>:  Target architecutre, uses $ARCH as default"
     echo "  --gdb|-g:       Attch qemu to gdb"
     echo "  --run_tests|-t: Run unit tests at the end of boot"
+    echo "  --lockstat|-l:  Collect lock statistics, published in /kinfo/lockstat"
+    echo "  --trace_latency: Trace irqs-off and preempt-off windows, published in /kinfo/latency"
 }
 
 # clean(): clean everything to force a full re-build
@@ -81,6 +85,14 @@ function config() {
         export CPPFLAGS+=" -DRUN_TESTS"
     fi
 
+    if [ $LOCKSTAT = true ]; then
+        export CPPFLAGS+=" -DLOCKSTAT"
+    fi
+
+    if [ $LATENCY_TRACER = true ]; then
+        export CPPFLAGS+=" -DLATENCY_TRACER"
+    fi
+
     # Define tool-chain
     export AR=${TARGET}-ar
     export AS=${TARGET}-as
@@ -199,6 +211,16 @@ while [[ $# -gt 0 ]]; do
             shift
             ;;    
 
+        -l|--lockstat)
+            LOCKSTAT=true
+            shift
+            ;;
+
+        --trace_latency)
+            LATENCY_TRACER=true
+            shift
+            ;;
+
         *)
             echo "error: unkown option '$1'"
             echo ""
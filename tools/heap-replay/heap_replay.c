@@ -0,0 +1,472 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#define _POSIX_C_SOURCE 200809L
+#include <memory/shrinker.h>
+#include <memory/vmem_manager.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <utils.h>
+
+/*
+    heap-replay - replays an allocation trace recorded by the kernel heap (HEAP_TRACE) against
+    the very same heap allocator compiled for the host.
+
+    The trace is read from the kernel's serial log, all lines not containing a HEAPTRACE record
+    are ignored. Each operation is timed individually and the tool reports latency percentiles,
+    peak page footprint and the heap overhead at the peak, i.e. how much of the footprint was not
+    used by live allocations.
+*/
+
+#define TRACE_TAG "HEAPTRACE "
+
+/* The heap's shrinker, exposed by the shim instead of being registered */
+extern struct shrinker replay_shrinker_heap;
+
+struct trace_op {
+    char      op;
+    uint64_t  timestamp_ns;
+    size_t    size;
+    uintptr_t ptr;
+    uintptr_t old_ptr;
+};
+
+struct trace {
+    struct trace_op *ops;
+    size_t           n_ops;
+    size_t           capacity;
+    size_t           dropped;
+};
+
+/* Maps the kernel pointers, used as allocation ids, to host allocations */
+struct live_alloc {
+    uintptr_t id;
+    void     *ptr;
+    size_t    size;
+    bool      used;
+    bool      deleted;
+};
+
+struct alloc_map {
+    struct live_alloc *entries;
+    size_t             capacity;  // Power of 2
+};
+
+struct latencies {
+    const char *name;
+    uint64_t   *samples;
+    size_t      n_samples;
+};
+
+static bool verbose = false;
+
+/* Footprint of the heap, in bytes requested through vmem_request_free_pages */
+static size_t footprint      = 0;
+static size_t peak_footprint = 0;
+
+/* Requested bytes of all live allocations */
+static size_t live_bytes         = 0;
+static size_t live_bytes_at_peak = 0;
+
+/*
+    Kernel interfaces used by heap_allocator.c
+*/
+int log(const char *restrict format, ...)
+{
+    int     ret = 0;
+    va_list args;
+
+    if (verbose) {
+        va_start(args, format);
+        ret = vfprintf(stderr, format, args);
+        va_end(args);
+        fputc('\n', stderr);
+    }
+    return ret;
+}
+
+void kpanic(const char *restrict format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    fprintf(stderr, "kpanic: ");
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputc('\n', stderr);
+    abort();
+}
+
+virtaddr_t vmem_request_free_pages(unsigned int fpo, unsigned int n)
+{
+    (void)fpo;
+    size_t size = (size_t)n * 8 * PAGE_SIZE;
+    void  *mem  = aligned_alloc(PAGE_SIZE, size);
+
+    if (mem == NULL) {
+        return 0;
+    }
+
+    // The kernel hands out cleared pages to the heap
+    memset(mem, 0, size);
+
+    footprint += size;
+    if (footprint > peak_footprint) {
+        peak_footprint     = footprint;
+        live_bytes_at_peak = live_bytes;
+    }
+    return (virtaddr_t)mem;
+}
+
+void vmem_free_pages(virtaddr_t addr, unsigned int n)
+{
+    footprint -= (size_t)n * 8 * PAGE_SIZE;
+    free((void *)addr);
+}
+
+/*
+    Trace parsing
+*/
+static void trace_append(struct trace *trace, struct trace_op *op)
+{
+    if (trace->n_ops == trace->capacity) {
+        trace->capacity = trace->capacity ? 2 * trace->capacity : 1024;
+        trace->ops      = realloc(trace->ops, trace->capacity * sizeof(struct trace_op));
+        if (trace->ops == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    trace->ops[trace->n_ops++] = *op;
+}
+
+static int parse_trace(FILE *file, struct trace *trace)
+{
+    char           *line   = NULL;
+    size_t          len    = 0;
+    size_t          lineno = 0;
+    const char     *rec;
+    unsigned long   ts_high, ts_low, size, ptr, old_ptr, dropped;
+    char            op;
+    struct trace_op trace_op;
+
+    while (getline(&line, &len, file) != -1) {
+        lineno++;
+        rec = strstr(line, TRACE_TAG);
+        if (rec == NULL) {
+            continue;
+        }
+        rec += strlen(TRACE_TAG);
+
+        if (sscanf(rec, "d %lx", &dropped) == 1) {
+            trace->dropped += dropped;
+            continue;
+        }
+
+        if (sscanf(rec, "%c %lx %lx %lx %lx %lx", &op, &ts_high, &ts_low, &size, &ptr, &old_ptr) !=
+                6 ||
+            (op != 'a' && op != 'f' && op != 'r')) {
+            fprintf(stderr, "line %zu: malformed trace record\n", lineno);
+            free(line);
+            return -1;
+        }
+
+        trace_op = (struct trace_op){
+            .op           = op,
+            .timestamp_ns = ((uint64_t)ts_high << 32) | ts_low,
+            .size         = size,
+            .ptr          = ptr,
+            .old_ptr      = old_ptr,
+        };
+        trace_append(trace, &trace_op);
+    }
+
+    free(line);
+    return 0;
+}
+
+/*
+    Allocation id map, open addressing with linear probing
+*/
+static size_t map_slot(struct alloc_map *map, uintptr_t id)
+{
+    return (id * 2654435761u) & (map->capacity - 1);
+}
+
+static struct live_alloc *map_find(struct alloc_map *map, uintptr_t id)
+{
+    for (size_t i = map_slot(map, id);; i = (i + 1) & (map->capacity - 1)) {
+        struct live_alloc *entry = map->entries + i;
+        if (!entry->used) {
+            return NULL;
+        }
+        if (!entry->deleted && entry->id == id) {
+            return entry;
+        }
+    }
+}
+
+static void map_insert(struct alloc_map *map, uintptr_t id, void *ptr, size_t size)
+{
+    for (size_t i = map_slot(map, id);; i = (i + 1) & (map->capacity - 1)) {
+        struct live_alloc *entry = map->entries + i;
+        if (!entry->used || entry->deleted) {
+            *entry = (struct live_alloc){.id = id, .ptr = ptr, .size = size, .used = true};
+            return;
+        }
+    }
+}
+
+static void map_remove(struct live_alloc *entry)
+{
+    entry->deleted = true;
+}
+
+/*
+    Statistics
+*/
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void record_latency(struct latencies *lat, uint64_t ns)
+{
+    lat->samples[lat->n_samples++] = ns;
+}
+
+static void report_latencies(struct latencies *lat)
+{
+    static const double percentiles[] = {50, 90, 99, 99.9};
+
+    if (lat->n_samples == 0) {
+        return;
+    }
+
+    qsort(lat->samples, lat->n_samples, sizeof(uint64_t), compare_u64);
+    printf("%-8s n=%-8zu", lat->name, lat->n_samples);
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+        size_t idx = (size_t)((double)(lat->n_samples - 1) * percentiles[i] / 100.0);
+        printf(" p%-4g %6lu ns", percentiles[i], (unsigned long)lat->samples[idx]);
+    }
+    printf(" max %lu ns\n", (unsigned long)lat->samples[lat->n_samples - 1]);
+}
+
+/*
+    Replay
+*/
+static void track_live(struct alloc_map *map, uintptr_t id, void *ptr, size_t size)
+{
+    map_insert(map, id, ptr, size);
+    live_bytes += size;
+}
+
+static void untrack_live(struct live_alloc *entry)
+{
+    live_bytes -= entry->size;
+    map_remove(entry);
+}
+
+static void replay(struct trace *trace)
+{
+    size_t             unknown = 0;
+    size_t             failed  = 0;
+    uint64_t           start;
+    uint64_t           elapsed;
+    void              *ptr;
+    struct live_alloc *entry;
+    struct alloc_map   map = {0};
+    struct latencies   lat_alloc   = {.name = "kalloc"};
+    struct latencies   lat_free    = {.name = "kfree"};
+    struct latencies   lat_realloc = {.name = "krealloc"};
+
+    map.capacity = 1024;
+    while (map.capacity < 2 * trace->n_ops) {
+        map.capacity *= 2;
+    }
+    map.entries         = calloc(map.capacity, sizeof(struct live_alloc));
+    lat_alloc.samples   = calloc(trace->n_ops, sizeof(uint64_t));
+    lat_free.samples    = calloc(trace->n_ops, sizeof(uint64_t));
+    lat_realloc.samples = calloc(trace->n_ops, sizeof(uint64_t));
+    if (!map.entries || !lat_alloc.samples || !lat_free.samples || !lat_realloc.samples) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < trace->n_ops; i++) {
+        struct trace_op *op = trace->ops + i;
+
+        switch (op->op) {
+            case 'a':
+                // Allocations that failed in the kernel are skipped, they never became live
+                if (op->ptr == 0) {
+                    failed++;
+                    break;
+                }
+
+                start = now_ns();
+                ptr   = kalloc(op->size);
+                record_latency(&lat_alloc, now_ns() - start);
+
+                if (ptr == NULL) {
+                    kpanic("replay: kalloc(%zu) failed", op->size);
+                }
+                track_live(&map, op->ptr, ptr, op->size);
+                break;
+
+            case 'f':
+                ptr   = NULL;
+                entry = NULL;
+                if (op->ptr != 0) {
+                    entry = map_find(&map, op->ptr);
+                    if (entry == NULL) {
+                        unknown++;
+                        break;
+                    }
+                    ptr = entry->ptr;
+                }
+
+                start = now_ns();
+                kfree(ptr);
+                record_latency(&lat_free, now_ns() - start);
+
+                if (entry) {
+                    untrack_live(entry);
+                }
+                break;
+
+            case 'r':
+                // Failed reallocations leave the original allocation untouched
+                if (op->ptr == 0 && op->size != 0) {
+                    failed++;
+                    break;
+                }
+
+                ptr   = NULL;
+                entry = NULL;
+                if (op->old_ptr != 0) {
+                    entry = map_find(&map, op->old_ptr);
+                    if (entry == NULL) {
+                        unknown++;
+                        break;
+                    }
+                    ptr = entry->ptr;
+                }
+
+                start = now_ns();
+                ptr   = krealloc(ptr, op->size);
+                record_latency(&lat_realloc, now_ns() - start);
+
+                if (ptr == NULL && op->size != 0) {
+                    kpanic("replay: krealloc(%zu) failed", op->size);
+                }
+                if (entry) {
+                    untrack_live(entry);
+                }
+                if (ptr) {
+                    track_live(&map, op->ptr, ptr, op->size);
+                }
+                break;
+        }
+
+        if (footprint >= peak_footprint) {
+            peak_footprint     = footprint;
+            live_bytes_at_peak = live_bytes;
+        }
+    }
+
+    elapsed = trace->n_ops ? trace->ops[trace->n_ops - 1].timestamp_ns - trace->ops[0].timestamp_ns
+                           : 0;
+
+    printf("Replayed %zu operations spanning %lu ms of kernel time\n", trace->n_ops,
+           (unsigned long)(elapsed / 1000000));
+    if (trace->dropped || unknown || failed) {
+        printf("Skipped: %zu dropped by the recorder, %zu unknown ids, %zu failed in kernel\n",
+               trace->dropped, unknown, failed);
+    }
+
+    printf("\nLatency:\n");
+    report_latencies(&lat_alloc);
+    report_latencies(&lat_free);
+    report_latencies(&lat_realloc);
+
+    printf("\nFootprint:\n");
+    printf("peak     %zu KiB (%zu KiB live, %.1f%% overhead)\n", peak_footprint / 1024,
+           live_bytes_at_peak / 1024,
+           peak_footprint ? 100.0 * (double)(peak_footprint - live_bytes_at_peak) /
+                                (double)peak_footprint
+                          : 0.0);
+    printf("end      %zu KiB (%zu KiB live)\n", footprint / 1024, live_bytes / 1024);
+
+    // Let the heap give back what it can, shows what's pinned by fragmentation
+    replay_shrinker_heap.scan(&replay_shrinker_heap,
+                              replay_shrinker_heap.count(&replay_shrinker_heap));
+    printf("shrunk   %zu KiB\n", footprint / 1024);
+
+    free(lat_alloc.samples);
+    free(lat_free.samples);
+    free(lat_realloc.samples);
+    free(map.entries);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-v] <serial log>\n", prog);
+    fprintf(stderr, "  -v: print the heap's debug log to stderr\n");
+}
+
+int main(int argc, char **argv)
+{
+    FILE        *file;
+    const char  *path  = NULL;
+    struct trace trace = {0};
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) {
+            verbose = true;
+        } else if (path == NULL) {
+            path = argv[i];
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (path == NULL) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    if (parse_trace(file, &trace) < 0) {
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+    fclose(file);
+
+    replay(&trace);
+    free(trace.ops);
+    return EXIT_SUCCESS;
+}
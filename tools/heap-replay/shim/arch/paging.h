@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifndef HEAP_REPLAY_SHIM_ARCH_PAGING_H
+#define HEAP_REPLAY_SHIM_ARCH_PAGING_H
+#include <stdint.h>
+
+#define PAGE_SIZE (4096)
+
+/* Host pointers are not in the kernel's higher half, disable the free list address check */
+#define HIGHER_HALF_ADDR ((void *)0)
+
+/* Wide enough to hold host pointers */
+typedef uintptr_t virtaddr_t;
+
+#endif /* HEAP_REPLAY_SHIM_ARCH_PAGING_H */
@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifndef HEAP_REPLAY_SHIM_MEMORY_SHRINKER_H
+#define HEAP_REPLAY_SHIM_MEMORY_SHRINKER_H
+#include <stddef.h>
+
+struct shrinker {
+    const char *name;
+    size_t (*count)(struct shrinker *shrinker);
+    size_t (*scan)(struct shrinker *shrinker, size_t nr_pages);
+};
+
+/* Exposes the shrinker to the replay tool instead of registering it */
+#define DEFINE_SHRINKER(_name, _count, _scan)   \
+    struct shrinker replay_shrinker_##_name = { \
+        .name  = #_name,                        \
+        .count = (_count),                      \
+        .scan  = (_scan),                       \
+    }
+
+#endif /* HEAP_REPLAY_SHIM_MEMORY_SHRINKER_H */
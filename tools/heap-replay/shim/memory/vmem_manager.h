@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifndef HEAP_REPLAY_SHIM_MEMORY_VMEM_MANAGER_H
+#define HEAP_REPLAY_SHIM_MEMORY_VMEM_MANAGER_H
+#include <arch/paging.h>
+
+#define FPO_CLEAR  (1 << 1)
+#define FPO_ATOMIC (1 << 2)
+
+/* Implemented by the replay tool, keeps track of the heap's page footprint */
+virtaddr_t vmem_request_free_pages(unsigned int fpo, unsigned int n);
+void       vmem_free_pages(virtaddr_t addr, unsigned int n);
+
+#endif /* HEAP_REPLAY_SHIM_MEMORY_VMEM_MANAGER_H */
@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifndef HEAP_REPLAY_SHIM_TASKS_LOCKING_H
+#define HEAP_REPLAY_SHIM_TASKS_LOCKING_H
+#include <stdint.h>
+
+/* The replay is single threaded, locking is a no-op */
+struct spinlock {
+    unsigned int flag;
+};
+
+#define SPINLOCK_DEFINE(name) struct spinlock name = {.flag = 0}
+
+static inline void spinlock_lock(struct spinlock *spinlock, uint32_t *irqflags)
+{
+    (void)spinlock;
+    *irqflags = 0;
+}
+
+static inline void spinlock_unlock(struct spinlock *spinlock, uint32_t irqflags)
+{
+    (void)spinlock;
+    (void)irqflags;
+}
+
+#endif /* HEAP_REPLAY_SHIM_TASKS_LOCKING_H */
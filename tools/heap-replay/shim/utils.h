@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+
+   See README.md and LICENSE.txt for license details.
+
+   Copyright (C) 2025 Isak Evaldsson
+*/
+#ifndef HEAP_REPLAY_SHIM_UTILS_H
+#define HEAP_REPLAY_SHIM_UTILS_H
+#include <assert.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+    Host replacement for the kernel's utils.h, providing just enough for heap_allocator.c to be
+    compiled as a regular Linux program.
+*/
+
+#define ALIGN_BY_MULTIPLE(num, n)           \
+    ({                                      \
+        static_assert(n % 2 == 0);          \
+        (((num) + ((n) - 1)) & ~((n) - 1)); \
+    })
+
+#define MAX(a, b)           \
+    ({                      \
+        typeof(a) _a = (a); \
+        typeof(b) _b = (b); \
+        _a > _b ? _a : _b;  \
+    })
+
+#define MIN(a, b)           \
+    ({                      \
+        typeof(a) _a = (a); \
+        typeof(b) _b = (b); \
+        _a < _b ? _a : _b;  \
+    })
+
+#define kassert(expr)                                                                 \
+    if (!(expr)) {                                                                    \
+        kpanic("kernel assertion '%s' failed at %s:%u\n", #expr, __FILE__, __LINE__); \
+    }
+
+#define __LOG(var, subsys, fmt, ...)                          \
+    do {                                                      \
+        if (var)                                              \
+            log(subsys " %s: " fmt, __func__, ##__VA_ARGS__); \
+    } while (0)
+
+/* Avoid clashing with the libm builtin */
+#define log replay_log
+
+int log(const char *restrict format, ...);
+
+__attribute__((__noreturn__)) void kpanic(const char *restrict, ...);
+
+#define KALLOC_SLEEP  (0)
+#define KALLOC_ATOMIC (1 << 0)
+
+void *kalloc(size_t size);
+void *kalloc_flags(size_t size, unsigned int flags);
+void  kfree(void *ptr);
+void *krealloc(void *ptr, size_t new_size);
+void *krealloc_flags(void *ptr, size_t new_size, unsigned int flags);
+
+#endif /* HEAP_REPLAY_SHIM_UTILS_H */